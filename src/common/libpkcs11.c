@@ -59,6 +59,20 @@ failed:
 	return NULL;
 }
 
+/*
+ * Look up an extension function exported by a loaded module,
+ * e.g. C_OpenSC_GetStats. Returns NULL when it is not there.
+ */
+void *
+C_GetModuleSymbol(void *module, const char *name)
+{
+	sc_pkcs11_module_t *mod = (sc_pkcs11_module_t *) module;
+
+	if (!mod || mod->_magic != MAGIC || name == NULL)
+		return NULL;
+	return sc_dlsym(mod->handle, name);
+}
+
 /*
  * Unload a pkcs11 module.
  * The calling application is responsible for cleaning up
@@ -375,6 +375,7 @@ static int
 sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 {
 	struct sc_context *ctx  = card->ctx;
+	unsigned long long start;
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
@@ -389,8 +390,11 @@ sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 #endif
 
 	/* send APDU to the reader driver */
+	start = sc_stats_clock();
 	rv = card->reader->ops->transmit(card->reader, apdu);
 	LOG_TEST_RET(ctx, rv, "unable to transmit APDU");
+	sc_stats_transmit(card, apdu->ins, apdu->datalen, apdu->resplen,
+			sc_stats_clock() - start);
 
 	LOG_FUNC_RETURN(ctx, rv);
 }
@@ -421,6 +425,7 @@ sc_set_le_and_transmit(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 		msleep(40);
 
 	/* re-transmit the APDU with new Le length */
+	sc_stats_count(ctx, SC_STATS_RESEND_6C, 0);
 	rv = sc_single_transmit(card, apdu);
 	LOG_TEST_RET(ctx, rv, "cannot re-transmit APDU");
 
@@ -469,6 +474,7 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 		/* call GET RESPONSE to get more date from the card;
 		 * note: GET RESPONSE returns the left amount of data (== SW2) */
 		memset(resp, 0, sizeof(resp));
+		sc_stats_count(ctx, SC_STATS_GET_RESPONSE, 0);
 		rv = card->ops->get_response(card, &resp_len, resp);
 		if (rv < 0)   {
 #ifdef ENABLE_SM
@@ -511,6 +517,37 @@ sc_get_response(struct sc_card *card, struct sc_apdu *apdu, size_t olen)
 }
 
 
+/** Tells whether the APDU may change the currently selected file, i.e.
+ *  selects, creates or deletes a file or accesses an EF by its short
+ *  identifier.
+ */
+static int
+sc_apdu_changes_selection(const sc_apdu_t *apdu)
+{
+	switch (apdu->ins) {
+	case 0xA4:	/* SELECT */
+	case 0xE0:	/* CREATE FILE */
+	case 0xE4:	/* DELETE FILE */
+		return 1;
+	case 0xB0:	/* READ BINARY */
+	case 0xD0:	/* WRITE BINARY */
+	case 0xD6:	/* UPDATE BINARY */
+	case 0x0E:	/* ERASE BINARY */
+		return (apdu->p1 & 0x80) != 0;
+	case 0xB1:
+	case 0xD7:
+		return apdu->p1 != 0 || apdu->p2 != 0;
+	case 0xB2:	/* READ RECORD */
+	case 0xDC:	/* UPDATE RECORD */
+	case 0xD2:	/* WRITE RECORD */
+	case 0xE2:	/* APPEND RECORD */
+		return (apdu->p2 & 0xF8) != 0;
+	default:
+		return 0;
+	}
+}
+
+
 /** Sends a single APDU to the card reader and calls GET RESPONSE to get the return data if necessary.
  *  @param  card  sc_card_t object for the smartcard
  *  @param  apdu  APDU to be sent
@@ -572,6 +609,13 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 		return r;
 	}
 
+	/* the file selection tracked by iso7816_select_file() becomes unknown,
+	 * and with it the security environment, as in sc_select_file() */
+	if (sc_apdu_changes_selection(apdu)) {
+		card->cache.current_valid = 0;
+		card->cache.sec_env_valid = 0;
+	}
+
 	if ((apdu->flags & SC_APDU_FLAGS_CHAINING) != 0) {
 		/* divide et impera: transmit APDU in chunks with Lc <= max_send_size
 		 * bytes using command chaining */
@@ -614,6 +658,7 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 				break;
 			}
 
+			sc_stats_count(card->ctx, SC_STATS_CHAINED, 0);
 			r = sc_transmit(card, &tapdu);
 			if (r != SC_SUCCESS)
 				break;
@@ -379,7 +379,8 @@ const u8 *sc_asn1_skip_tag(sc_context_t *ctx, const u8 ** buf, size_t *buflen,
 	size_t len = *buflen, taglen;
 	unsigned int cla, tag;
 
-	if (sc_asn1_read_tag((const u8 **) &p, len, &cla, &tag, &taglen) != SC_SUCCESS)
+	if (sc_asn1_read_tag((const u8 **) &p, len, &cla, &tag, &taglen) != SC_SUCCESS
+			|| p == NULL)
 		return NULL;
 	switch (cla & 0xC0) {
 	case SC_ASN1_TAG_UNIVERSAL:
@@ -1099,43 +1100,57 @@ static const struct sc_asn1_entry c_asn1_p15_obj[5] = {
 	{ NULL, 0, 0, 0, NULL, NULL }
 };
 
-static int asn1_decode_p15_object(sc_context_t *ctx, const u8 *in,
-				  size_t len, struct sc_asn1_pkcs15_object *obj,
-				  int depth)
+/* The templates of a PKCS#15 object, formatted to decode into obj */
+struct asn1_p15_object_templates {
+	struct sc_asn1_entry c_attr[6], p15_obj[5];
+	struct sc_asn1_entry ac_rules[SC_PKCS15_MAX_ACCESS_RULES + 1], ac_rule[SC_PKCS15_MAX_ACCESS_RULES][3];
+	size_t flags_len, label_len, access_mode_len;
+};
+
+static void asn1_format_p15_object(struct asn1_p15_object_templates *t,
+				   const struct sc_asn1_pkcs15_object *obj)
 {
 	struct sc_pkcs15_object *p15_obj = obj->p15_obj;
-	struct sc_asn1_entry asn1_c_attr[6], asn1_p15_obj[5];
-	struct sc_asn1_entry asn1_ac_rules[SC_PKCS15_MAX_ACCESS_RULES + 1], asn1_ac_rule[SC_PKCS15_MAX_ACCESS_RULES][3];
-	size_t flags_len = sizeof(p15_obj->flags);
-	size_t label_len = sizeof(p15_obj->label);
-	size_t access_mode_len = sizeof(p15_obj->access_rules[0].access_mode);
-	int r, ii;
+	int ii;
+
+	t->flags_len = sizeof(p15_obj->flags);
+	t->label_len = sizeof(p15_obj->label);
+	t->access_mode_len = sizeof(p15_obj->access_rules[0].access_mode);
 
 	for (ii=0; ii<SC_PKCS15_MAX_ACCESS_RULES; ii++)
-		sc_copy_asn1_entry(c_asn1_access_control_rule, asn1_ac_rule[ii]);
-	sc_copy_asn1_entry(c_asn1_access_control_rules, asn1_ac_rules);
+		sc_copy_asn1_entry(c_asn1_access_control_rule, t->ac_rule[ii]);
+	sc_copy_asn1_entry(c_asn1_access_control_rules, t->ac_rules);
 
 
-	sc_copy_asn1_entry(c_asn1_com_obj_attr, asn1_c_attr);
-	sc_copy_asn1_entry(c_asn1_p15_obj, asn1_p15_obj);
-	sc_format_asn1_entry(asn1_c_attr + 0, p15_obj->label, &label_len, 0);
-	sc_format_asn1_entry(asn1_c_attr + 1, &p15_obj->flags, &flags_len, 0);
-	sc_format_asn1_entry(asn1_c_attr + 2, &p15_obj->auth_id, NULL, 0);
-	sc_format_asn1_entry(asn1_c_attr + 3, &p15_obj->user_consent, NULL, 0);
+	sc_copy_asn1_entry(c_asn1_com_obj_attr, t->c_attr);
+	sc_copy_asn1_entry(c_asn1_p15_obj, t->p15_obj);
+	sc_format_asn1_entry(t->c_attr + 0, p15_obj->label, &t->label_len, 0);
+	sc_format_asn1_entry(t->c_attr + 1, &p15_obj->flags, &t->flags_len, 0);
+	sc_format_asn1_entry(t->c_attr + 2, &p15_obj->auth_id, NULL, 0);
+	sc_format_asn1_entry(t->c_attr + 3, &p15_obj->user_consent, NULL, 0);
 
 	for (ii=0; ii<SC_PKCS15_MAX_ACCESS_RULES; ii++)   {
-		sc_format_asn1_entry(asn1_ac_rule[ii] + 0, &p15_obj->access_rules[ii].access_mode, &access_mode_len, 0);
-		sc_format_asn1_entry(asn1_ac_rule[ii] + 1, &p15_obj->access_rules[ii].auth_id, NULL, 0);
-		sc_format_asn1_entry(asn1_ac_rules + ii, asn1_ac_rule[ii], NULL, 0);
+		sc_format_asn1_entry(t->ac_rule[ii] + 0, &p15_obj->access_rules[ii].access_mode, &t->access_mode_len, 0);
+		sc_format_asn1_entry(t->ac_rule[ii] + 1, &p15_obj->access_rules[ii].auth_id, NULL, 0);
+		sc_format_asn1_entry(t->ac_rules + ii, t->ac_rule[ii], NULL, 0);
 	}
-	sc_format_asn1_entry(asn1_c_attr + 4, asn1_ac_rules, NULL, 0);
+	sc_format_asn1_entry(t->c_attr + 4, t->ac_rules, NULL, 0);
+
+	sc_format_asn1_entry(t->p15_obj + 0, t->c_attr, NULL, 0);
+	sc_format_asn1_entry(t->p15_obj + 1, obj->asn1_class_attr, NULL, 0);
+	sc_format_asn1_entry(t->p15_obj + 2, obj->asn1_subclass_attr, NULL, 0);
+	sc_format_asn1_entry(t->p15_obj + 3, obj->asn1_type_attr, NULL, 0);
+}
 
-	sc_format_asn1_entry(asn1_p15_obj + 0, asn1_c_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_p15_obj + 1, obj->asn1_class_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_p15_obj + 2, obj->asn1_subclass_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_p15_obj + 3, obj->asn1_type_attr, NULL, 0);
+static int asn1_decode_p15_object(sc_context_t *ctx, const u8 *in,
+				  size_t len, struct sc_asn1_pkcs15_object *obj,
+				  int depth)
+{
+	struct asn1_p15_object_templates t;
+	int r;
 
-	r = asn1_decode(ctx, asn1_p15_obj, in, len, NULL, NULL, 0, depth + 1);
+	asn1_format_p15_object(&t, obj);
+	r = asn1_decode(ctx, t.p15_obj, in, len, NULL, NULL, 0, depth + 1);
 	return r;
 }
 
@@ -1476,6 +1491,330 @@ int sc_asn1_decode_choice(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 	return asn1_decode(ctx, asn1, in, len, newp, len_left, 1, 0);
 }
 
+/*
+ * Compiled templates
+ *
+ * Copying and formatting the templates of a PKCS#15 directory entry costs
+ * more than decoding it. sc_asn1_compile() walks a formatted template once
+ * and flattens it into an array of operations, in which the parm and arg
+ * pointers became offsets into the structures they pointed to. The program
+ * then decodes straight into any instance of these structures. Nested
+ * templates and PKCS#15 objects are inlined; callbacks are not supported.
+ */
+#define ASN1_OP_NO_BASE	0xFF	/* NULL pointer */
+#define ASN1_OP_LOCAL	0xFE	/* length on the stack, initial value in arg */
+
+struct sc_asn1_op {
+	const char *name;
+	unsigned int type;
+	unsigned int tag;
+	unsigned int flags;
+	int nested;			/* first op of the nested template, or -1 */
+	size_t mark;			/* 1 + index in the present array, or 0 */
+	unsigned char parm_base, arg_base;
+	size_t parm, arg;
+};
+
+struct sc_asn1_program {
+	struct sc_asn1_op *ops;
+	int count, size;
+};
+
+struct asn1_compile_info {
+	void * const *bases;
+	const size_t *sizes;
+	size_t nbases;
+	const struct sc_asn1_entry * const *marks;
+	size_t nmarks;
+};
+
+static int asn1_locate(const struct asn1_compile_info *info, const void *ptr,
+		       unsigned char *base, size_t *offset)
+{
+	size_t i;
+
+	*base = ASN1_OP_NO_BASE;
+	*offset = 0;
+	if (ptr == NULL)
+		return 0;
+	for (i = 0; i < info->nbases; i++) {
+		const u8 *start = info->bases[i];
+
+		if ((const u8 *) ptr >= start && (const u8 *) ptr < start + info->sizes[i]) {
+			*base = (unsigned char) i;
+			*offset = (const u8 *) ptr - start;
+			return 0;
+		}
+	}
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+static int asn1_compile(sc_context_t *ctx, struct sc_asn1_program *prog,
+			const struct asn1_compile_info *info,
+			const struct sc_asn1_entry *asn1, int *start)
+{
+	struct asn1_p15_object_templates *t;
+	int first, n, i, r;
+	size_t j;
+
+	for (n = 0; asn1[n].name != NULL; n++)
+		;
+	if (prog->count + n + 1 > prog->size) {
+		struct sc_asn1_op *ops;
+		int size = prog->size ? prog->size : 64;
+
+		while (size < prog->count + n + 1)
+			size *= 2;
+		ops = realloc(prog->ops, size * sizeof(*ops));
+		if (ops == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		prog->ops = ops;
+		prog->size = size;
+	}
+	first = prog->count;
+	prog->count += n + 1;
+	memset(prog->ops + first, 0, (n + 1) * sizeof(*prog->ops));
+
+	for (i = 0; i < n; i++) {
+		const struct sc_asn1_entry *entry = &asn1[i];
+		struct sc_asn1_op op;
+
+		memset(&op, 0, sizeof(op));
+		op.name = entry->name;
+		op.type = entry->type;
+		op.tag = entry->tag;
+		op.flags = entry->flags & ~SC_ASN1_PRESENT;
+		op.nested = -1;
+		op.parm_base = op.arg_base = ASN1_OP_NO_BASE;
+		for (j = 0; j < info->nmarks; j++)
+			if (info->marks[j] == entry)
+				op.mark = j + 1;
+
+		r = 0;
+		switch (entry->type) {
+		case SC_ASN1_CHOICE:
+			if (entry->parm == NULL) {
+				r = SC_ERROR_INVALID_ARGUMENTS;
+				break;
+			}
+			/* fall through */
+		case SC_ASN1_STRUCT:
+			if (entry->parm != NULL)
+				r = asn1_compile(ctx, prog, info,
+						 (const struct sc_asn1_entry *) entry->parm, &op.nested);
+			break;
+		case SC_ASN1_PKCS15_OBJECT:
+			if (entry->parm == NULL)
+				break;
+			t = malloc(sizeof(*t));
+			if (t == NULL) {
+				r = SC_ERROR_OUT_OF_MEMORY;
+				break;
+			}
+			asn1_format_p15_object(t, (const struct sc_asn1_pkcs15_object *) entry->parm);
+			r = asn1_compile(ctx, prog, info, t->p15_obj, &op.nested);
+			free(t);
+			op.type = SC_ASN1_STRUCT;
+			break;
+		case SC_ASN1_CALLBACK:
+			r = SC_ERROR_NOT_SUPPORTED;
+			break;
+		default:
+			r = asn1_locate(info, entry->parm, &op.parm_base, &op.parm);
+			if (r == 0 && asn1_locate(info, entry->arg, &op.arg_base, &op.arg) != 0) {
+				/* a length kept by the function that formatted the template */
+				op.arg_base = ASN1_OP_LOCAL;
+				op.arg = *(const size_t *) entry->arg;
+			}
+			break;
+		}
+		if (r < 0) {
+			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "cannot compile ASN.1 entry '%s': %s\n",
+				 entry->name, sc_strerror(r));
+			return r;
+		}
+		prog->ops[first + i] = op;
+	}
+	*start = first;
+	return 0;
+}
+
+int sc_asn1_compile(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		    void * const *bases, const size_t *sizes, size_t nbases,
+		    const struct sc_asn1_entry * const *marks, size_t nmarks,
+		    struct sc_asn1_program **prog_out)
+{
+	struct asn1_compile_info info;
+	struct sc_asn1_program *prog;
+	int start, r;
+
+	if (asn1 == NULL || prog_out == NULL || nbases >= ASN1_OP_LOCAL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	prog = calloc(1, sizeof(*prog));
+	if (prog == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	info.bases = bases;
+	info.sizes = sizes;
+	info.nbases = nbases;
+	info.marks = marks;
+	info.nmarks = nmarks;
+	r = asn1_compile(ctx, prog, &info, asn1, &start);
+	if (r < 0) {
+		sc_asn1_free_program(prog);
+		return r;
+	}
+	sc_debug(ctx, SC_LOG_DEBUG_ASN1, "compiled '%s' into %d ASN.1 operations\n",
+		 asn1->name, prog->count);
+	*prog_out = prog;
+	return 0;
+}
+
+void sc_asn1_free_program(struct sc_asn1_program *prog)
+{
+	if (prog == NULL)
+		return;
+	free(prog->ops);
+	free(prog);
+}
+
+static int asn1_run(sc_context_t *ctx, const struct sc_asn1_program *prog, int start,
+		    void * const *bases, const u8 *in, size_t len,
+		    const u8 **newp, size_t *len_left, int choice, int *present, int depth);
+
+/* Decodes one element like asn1_decode_entry() */
+static int asn1_run_entry(sc_context_t *ctx, const struct sc_asn1_program *prog,
+			  const struct sc_asn1_op *op, void * const *bases,
+			  const u8 *obj, size_t objlen, int *present, int depth)
+{
+	struct sc_asn1_entry entry;
+	size_t local_len;
+	int r;
+
+	if (op->nested >= 0) {
+		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "%*.*sdecoding '%s'\n", depth, depth, "", op->name);
+		r = asn1_run(ctx, prog, op->nested, bases, obj, objlen, NULL, NULL, 0, present, depth + 1);
+		if (r) {
+			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "decoding of ASN.1 object '%s' failed: %s\n",
+				 op->name, sc_strerror(r));
+			return r;
+		}
+	}
+	else {
+		entry.name = op->name;
+		entry.type = op->type;
+		entry.tag = op->tag;
+		entry.flags = op->flags;
+		entry.parm = NULL;
+		entry.arg = NULL;
+		if (op->parm_base != ASN1_OP_NO_BASE)
+			entry.parm = (u8 *) bases[op->parm_base] + op->parm;
+		if (op->arg_base == ASN1_OP_LOCAL) {
+			local_len = op->arg;
+			entry.arg = &local_len;
+		}
+		else if (op->arg_base != ASN1_OP_NO_BASE)
+			entry.arg = (u8 *) bases[op->arg_base] + op->arg;
+		r = asn1_decode_entry(ctx, &entry, obj, objlen, depth);
+		if (r)
+			return r;
+	}
+	if (op->mark && present != NULL)
+		present[op->mark - 1] = 1;
+	return 0;
+}
+
+/* Walks the ops of one template like asn1_decode() walks its entries */
+static int asn1_run(sc_context_t *ctx, const struct sc_asn1_program *prog, int start,
+		    void * const *bases, const u8 *in, size_t len,
+		    const u8 **newp, size_t *len_left, int choice, int *present, int depth)
+{
+	const struct sc_asn1_op *ops = prog->ops + start, *op;
+	const u8 *p = in, *obj;
+	size_t left = len, objlen;
+	int r, idx;
+
+	if (left < 2) {
+		while (ops->name && (ops->flags & SC_ASN1_OPTIONAL))
+			ops++;
+		if (ops->name == NULL)
+			return 0;
+		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "End of ASN.1 stream, "
+			      "non-optional field \"%s\" not found\n", ops->name);
+		return SC_ERROR_ASN1_OBJECT_NOT_FOUND;
+	}
+	if (p[0] == 0 || p[0] == 0xFF || len == 0)
+		return SC_ERROR_ASN1_END_OF_CONTENTS;
+
+	for (idx = 0; ops[idx].name != NULL; idx++) {
+		op = &ops[idx];
+
+		if (op->type == SC_ASN1_CHOICE) {
+			r = asn1_run(ctx, prog, op->nested, bases, p, left, &p, &left,
+				     1, present, depth + 1);
+			if (r >= 0)
+				r = 0;
+		}
+		else {
+			obj = sc_asn1_skip_tag(ctx, &p, &left, op->tag, &objlen);
+			if (obj == NULL) {
+				if (choice || (op->flags & SC_ASN1_OPTIONAL))
+					continue;
+				sc_debug(ctx, SC_LOG_DEBUG_ASN1, "mandatory ASN.1 object '%s' not found\n",
+					 op->name);
+				return SC_ERROR_ASN1_OBJECT_NOT_FOUND;
+			}
+			r = asn1_run_entry(ctx, prog, op, bases, obj, objlen, present, depth);
+		}
+		if (r)
+			return r;
+		if (choice)
+			break;
+	}
+	if (choice && ops[idx].name == NULL)
+		return SC_ERROR_ASN1_OBJECT_NOT_FOUND;
+	if (newp != NULL)
+		*newp = p;
+	if (len_left != NULL)
+		*len_left = left;
+	return choice ? idx : 0;
+}
+
+int sc_asn1_run(sc_context_t *ctx, const struct sc_asn1_program *prog,
+		void * const *bases, const u8 *in, size_t len,
+		const u8 **newp, size_t *len_left, int choice, int *present)
+{
+	if (prog == NULL || prog->count == 0)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	return asn1_run(ctx, prog, 0, bases, in, len, newp, len_left, choice, present, 0);
+}
+
+int sc_asn1_get_program(sc_context_t *ctx, unsigned int id,
+			int (*compile)(sc_context_t *, struct sc_asn1_program **),
+			const struct sc_asn1_program **prog)
+{
+	int r = 0;
+
+	if (id >= SC_MAX_ASN1_PROGRAMS || compile == NULL || prog == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	sc_mutex_lock(ctx, ctx->mutex);
+	if (ctx->asn1_programs[id] == NULL)
+		r = compile(ctx, &ctx->asn1_programs[id]);
+	*prog = ctx->asn1_programs[id];
+	sc_mutex_unlock(ctx, ctx->mutex);
+	return r;
+}
+
+void sc_asn1_free_programs(sc_context_t *ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < SC_MAX_ASN1_PROGRAMS; i++) {
+		sc_asn1_free_program(ctx->asn1_programs[i]);
+		ctx->asn1_programs[i] = NULL;
+	}
+}
+
 static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entry,
 			     u8 **obj, size_t *objlen, int depth)
 {
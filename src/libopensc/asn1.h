@@ -72,6 +72,35 @@ int _sc_asn1_decode(struct sc_context *, struct sc_asn1_entry *,
 int _sc_asn1_encode(struct sc_context *, const struct sc_asn1_entry *,
 		   u8 **, size_t *, int);
 
+/* Templates compiled for repeated decoding, see asn1.c */
+struct sc_asn1_program;
+
+/* Programs kept in the context, see sc_asn1_get_program() */
+#define SC_ASN1_PROGRAM_CDF		0
+#define SC_ASN1_PROGRAM_PRKDF		1
+#define SC_ASN1_PROGRAM_PUKDF		2
+
+/**
+ * Compiles a formatted template. Every parm and arg pointer of the template
+ * must point into one of the nbases structures at bases, or be a length
+ * that is only read; the program then decodes into the structures passed
+ * to sc_asn1_run() instead. sc_asn1_run() sets present[i] when the entry
+ * marks[i] was decoded.
+ */
+int sc_asn1_compile(struct sc_context *ctx, const struct sc_asn1_entry *asn1,
+		    void * const *bases, const size_t *sizes, size_t nbases,
+		    const struct sc_asn1_entry * const *marks, size_t nmarks,
+		    struct sc_asn1_program **prog);
+int sc_asn1_run(struct sc_context *ctx, const struct sc_asn1_program *prog,
+		void * const *bases, const u8 *in, size_t len,
+		const u8 **newp, size_t *left, int choice, int *present);
+void sc_asn1_free_program(struct sc_asn1_program *prog);
+/* Returns the program id of the context, compiling it on first use */
+int sc_asn1_get_program(struct sc_context *ctx, unsigned int id,
+			int (*compile)(struct sc_context *, struct sc_asn1_program **),
+			const struct sc_asn1_program **prog);
+void sc_asn1_free_programs(struct sc_context *ctx);
+
 int sc_asn1_read_tag(const u8 ** buf, size_t buflen, unsigned int *cla_out,
 		     unsigned int *tag_out, size_t *taglen);
 const u8 *sc_asn1_find_tag(struct sc_context *ctx, const u8 * buf,
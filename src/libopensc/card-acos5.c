@@ -228,6 +228,7 @@ static struct sc_card_driver *sc_get_driver(void)
 	acos5_ops.card_ctl = acos5_card_ctl;
 	acos5_ops.list_files = acos5_list_files;
 
+	acos5_drv.builtin_atrs = acos5_atrs;
 	return &acos5_drv;
 }
 
@@ -553,6 +553,7 @@ sc_get_driver(void)
 	/* put_data: Not implemented */
 	/* delete_record: Not implemented */
 
+	akis_drv.builtin_atrs = akis_atrs;
 	return &akis_drv;
 }
 
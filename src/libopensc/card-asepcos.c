@@ -1122,6 +1122,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	asepcos_ops.card_ctl          = asepcos_card_ctl;
 	asepcos_ops.pin_cmd           = asepcos_pin_cmd;
 
+	asepcos_drv.builtin_atrs = asepcos_atrs;
 	return &asepcos_drv;
 }
 
@@ -2385,6 +2385,7 @@ sc_get_driver(void)
 	authentic_ops.process_fci = authentic_process_fci;
 	authentic_ops.pin_cmd = authentic_pin_cmd;
 
+	authentic_drv.builtin_atrs = authentic_known_atrs;
 	return &authentic_drv;
 }
 
@@ -1509,6 +1509,7 @@ static struct sc_card_driver *sc_get_driver(void)
 	belpic_ops.get_response = iso_ops->get_response;
 	belpic_ops.check_sw = iso_ops->check_sw;
 
+	belpic_drv.builtin_atrs = belpic_atrs;
 	return &belpic_drv;
 }
 
@@ -1266,6 +1266,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	cardos_ops.logout  = cardos_logout;
 	cardos_ops.get_data = cardos_get_data;
 
+	cardos_drv.builtin_atrs = cardos_atrs;
 	return &cardos_drv;
 }
 
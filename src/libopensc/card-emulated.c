@@ -0,0 +1,82 @@
+/*
+ * card-emulated.c: Support for the cards emulated by the virtual reader
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include "internal.h"
+
+static struct sc_card_operations emulated_ops;
+static struct sc_card_driver emulated_drv = {
+	"Card emulated by the virtual reader",
+	"emulated",
+	&emulated_ops,
+	NULL, 0, NULL
+};
+
+
+static int
+emulated_match_card(struct sc_card *card)
+{
+	return card->reader && (card->reader->capabilities & SC_READER_CAP_EMULATED);
+}
+
+
+static int
+emulated_init(struct sc_card *card)
+{
+	unsigned long flags, ext_flags;
+
+	LOG_FUNC_CALLED(card->ctx);
+
+	card->name = "Emulated card";
+	card->type = SC_CARD_TYPE_EMULATED;
+	card->cla = 0x00;
+	card->drv_data = NULL;
+
+	/* The emulation signs and deciphers with the plain ISO 7816-8
+	 * commands, whatever the size of the key */
+	flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_NONE;
+	_sc_card_add_rsa_alg(card, 1024, flags, 0);
+	_sc_card_add_rsa_alg(card, 2048, flags, 0);
+	_sc_card_add_rsa_alg(card, 3072, flags, 0);
+	_sc_card_add_rsa_alg(card, 4096, flags, 0);
+
+	flags = SC_ALGORITHM_ECDSA_RAW | SC_ALGORITHM_ECDSA_HASH_NONE;
+	ext_flags = SC_ALGORITHM_EXT_EC_F_P | SC_ALGORITHM_EXT_EC_NAMEDCURVE
+		| SC_ALGORITHM_EXT_EC_UNCOMPRESES;
+	_sc_card_add_ec_alg(card, 256, flags, ext_flags);
+	_sc_card_add_ec_alg(card, 384, flags, ext_flags);
+
+	LOG_FUNC_RETURN(card->ctx, SC_SUCCESS);
+}
+
+static struct sc_card_driver * sc_get_driver(void)
+{
+	struct sc_card_driver *iso_drv = sc_get_iso7816_driver();
+
+	emulated_ops = *iso_drv->ops;
+	emulated_ops.match_card = emulated_match_card;
+	emulated_ops.init = emulated_init;
+
+	return &emulated_drv;
+}
+
+struct sc_card_driver * sc_get_emulated_driver(void)
+{
+	return sc_get_driver();
+}
@@ -1579,6 +1579,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	entersafe_ops.pin_cmd = entersafe_pin_cmd;
 	entersafe_ops.card_ctl    = entersafe_card_ctl_2048;
 	entersafe_ops.process_fci = entersafe_process_fci;
+	entersafe_drv.builtin_atrs = entersafe_atrs;
 	return &entersafe_drv;
 }
 
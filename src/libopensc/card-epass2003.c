@@ -64,7 +64,6 @@ static struct sc_card_driver epass2003_drv = {
 
 #define KEY_TYPE_AES	0x01	/* FIPS mode */
 #define KEY_TYPE_DES	0x02	/* Non-FIPS mode */
-static unsigned char g_smtype;	/* sm cryption algorithm type */
 
 #define KEY_LEN_AES	16
 #define KEY_LEN_DES	8
@@ -76,7 +75,6 @@ static unsigned char PIN_ID[2] = { ENTERSAFE_USER_PIN_ID, ENTERSAFE_SO_PIN_ID };
 /*0x00:plain; 0x01:scp01 sm*/
 #define SM_PLAIN				0x00
 #define SM_SCP01				0x01
-static unsigned char g_sm;	/* if perform sm or not */
 
 static unsigned char g_init_key_enc[16] = {
 	0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C,
@@ -92,9 +90,27 @@ static unsigned char g_random[8] = {
 	0xBF, 0xC3, 0x29, 0x11, 0xC7, 0x18, 0xC3, 0x40
 };
 
-static unsigned char g_sk_enc[16] = { 0 };	/* encrypt session key */
-static unsigned char g_sk_mac[16] = { 0 };	/* mac session key */
-static unsigned char g_icv_mac[16] = { 0 };	/* instruction counter vector(for sm) */
+/* Cipher contexts kept for the lifetime of the card: one per cipher and
+ * direction used by the secure messaging */
+#define EPASS2003_MAX_CIPHER_CTX	8
+
+struct epass2003_cipher_ctx {
+	const EVP_CIPHER *cipher;
+	int enc;
+	EVP_CIPHER_CTX *ctx;
+};
+
+/* Secure messaging state, per card so that several tokens can be used at once */
+struct epass2003_exdata {
+	unsigned char sm;		/* if perform sm or not */
+	unsigned char smtype;		/* sm cryption algorithm type */
+	unsigned char sk_enc[16];	/* encrypt session key */
+	unsigned char sk_mac[16];	/* mac session key */
+	unsigned char icv_mac[16];	/* instruction counter vector(for sm) */
+	struct epass2003_cipher_ctx ciphers[EPASS2003_MAX_CIPHER_CTX];
+};
+
+#define EXDATA(card)	((struct epass2003_exdata *)(card)->drv_data)
 
 #define REVERSE_ORDER4(x)	(			  \
 		((unsigned long)x & 0xFF000000)>> 24	| \
@@ -105,92 +121,131 @@ static unsigned char g_icv_mac[16] = { 0 };	/* instruction counter vector(for sm
 static int epass2003_transmit_apdu(struct sc_card *card, struct sc_apdu *apdu);
 static int epass2003_select_file(struct sc_card *card, const sc_path_t * in_path, sc_file_t ** file_out);
 
+/* Returns the cached context of the card for a cipher and direction,
+ * creating it on first use; the key and IV are set for every operation */
+static EVP_CIPHER_CTX *
+get_cipher_ctx(struct sc_card *card, const EVP_CIPHER * cipher, int enc)
+{
+	struct epass2003_exdata *exdata = EXDATA(card);
+	struct epass2003_cipher_ctx *c = NULL;
+	int i;
+
+	for (i = 0; i < EPASS2003_MAX_CIPHER_CTX; i++) {
+		c = &exdata->ciphers[i];
+		if (c->ctx == NULL)
+			break;
+		if (c->cipher == cipher && c->enc == enc)
+			return c->ctx;
+	}
+	if (i == EPASS2003_MAX_CIPHER_CTX)
+		return NULL;
+
+	c->ctx = EVP_CIPHER_CTX_new();
+	if (c->ctx == NULL)
+		return NULL;
+	if (!EVP_CipherInit_ex(c->ctx, cipher, NULL, NULL, NULL, enc)) {
+		EVP_CIPHER_CTX_free(c->ctx);
+		c->ctx = NULL;
+		return NULL;
+	}
+	EVP_CIPHER_CTX_set_padding(c->ctx, 0);
+	c->cipher = cipher;
+	c->enc = enc;
+	return c->ctx;
+}
+
+
+static void
+free_cipher_ctx(struct epass2003_exdata *exdata)
+{
+	int i;
+
+	for (i = 0; i < EPASS2003_MAX_CIPHER_CTX; i++) {
+		if (exdata->ciphers[i].ctx)
+			EVP_CIPHER_CTX_free(exdata->ciphers[i].ctx);
+		exdata->ciphers[i].ctx = NULL;
+	}
+}
+
+
 static int
-openssl_enc(const EVP_CIPHER * cipher, const unsigned char *key, const unsigned char *iv,
-		const unsigned char *input, size_t length, unsigned char *output)
+openssl_enc(struct sc_card *card, const EVP_CIPHER * cipher, const unsigned char *key,
+		const unsigned char *iv, const unsigned char *input, size_t length,
+		unsigned char *output)
 {
-	int r = SC_ERROR_INTERNAL;
-	EVP_CIPHER_CTX ctx;
+	EVP_CIPHER_CTX *ctx;
 	int outl = 0;
 	int outl_tmp = 0;
-	unsigned char iv_tmp[EVP_MAX_IV_LENGTH] = { 0 };
 
-	memcpy(iv_tmp, iv, EVP_MAX_IV_LENGTH);
-	EVP_CIPHER_CTX_init(&ctx);
-	EVP_EncryptInit_ex(&ctx, cipher, NULL, key, iv_tmp);
-	EVP_CIPHER_CTX_set_padding(&ctx, 0);
+	ctx = get_cipher_ctx(card, cipher, 1);
+	if (ctx == NULL)
+		return SC_ERROR_INTERNAL;
 
-	if (!EVP_EncryptUpdate(&ctx, output, &outl, input, length))
-		goto out;
+	if (!EVP_EncryptInit_ex(ctx, NULL, NULL, key, iv))
+		return SC_ERROR_INTERNAL;
 
-	if (!EVP_EncryptFinal_ex(&ctx, output + outl, &outl_tmp))
-		goto out;
+	if (!EVP_EncryptUpdate(ctx, output, &outl, input, length))
+		return SC_ERROR_INTERNAL;
 
-	if (!EVP_CIPHER_CTX_cleanup(&ctx))
-		goto out;
+	if (!EVP_EncryptFinal_ex(ctx, output + outl, &outl_tmp))
+		return SC_ERROR_INTERNAL;
 
-	r = SC_SUCCESS;
-out:
-	return r;
+	return SC_SUCCESS;
 }
 
 static int
-openssl_dec(const EVP_CIPHER * cipher, const unsigned char *key, const unsigned char *iv,
-		const unsigned char *input, size_t length, unsigned char *output)
+openssl_dec(struct sc_card *card, const EVP_CIPHER * cipher, const unsigned char *key,
+		const unsigned char *iv, const unsigned char *input, size_t length,
+		unsigned char *output)
 {
-	int r = SC_ERROR_INTERNAL;
-	EVP_CIPHER_CTX ctx;
+	EVP_CIPHER_CTX *ctx;
 	int outl = 0;
 	int outl_tmp = 0;
-	unsigned char iv_tmp[EVP_MAX_IV_LENGTH] = { 0 };
 
-	memcpy(iv_tmp, iv, EVP_MAX_IV_LENGTH);
-	EVP_CIPHER_CTX_init(&ctx);
-	EVP_DecryptInit_ex(&ctx, cipher, NULL, key, iv_tmp);
-	EVP_CIPHER_CTX_set_padding(&ctx, 0);
+	ctx = get_cipher_ctx(card, cipher, 0);
+	if (ctx == NULL)
+		return SC_ERROR_INTERNAL;
 
-	if (!EVP_DecryptUpdate(&ctx, output, &outl, input, length))
-		goto out;
+	if (!EVP_DecryptInit_ex(ctx, NULL, NULL, key, iv))
+		return SC_ERROR_INTERNAL;
 
-	if (!EVP_DecryptFinal_ex(&ctx, output + outl, &outl_tmp))
-		goto out;
+	if (!EVP_DecryptUpdate(ctx, output, &outl, input, length))
+		return SC_ERROR_INTERNAL;
 
-	if (!EVP_CIPHER_CTX_cleanup(&ctx))
-		goto out;
+	if (!EVP_DecryptFinal_ex(ctx, output + outl, &outl_tmp))
+		return SC_ERROR_INTERNAL;
 
-	r = SC_SUCCESS;
-out:
-	return r;
+	return SC_SUCCESS;
 }
 
 
 static int
-aes128_encrypt_ecb(const unsigned char *key, int keysize,
+aes128_encrypt_ecb(struct sc_card *card, const unsigned char *key, int keysize,
 		const unsigned char *input, size_t length, unsigned char *output)
 {
 	unsigned char iv[EVP_MAX_IV_LENGTH] = { 0 };
-	return openssl_enc(EVP_aes_128_ecb(), key, iv, input, length, output);
+	return openssl_enc(card, EVP_aes_128_ecb(), key, iv, input, length, output);
 }
 
 
 static int
-aes128_encrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[16],
+aes128_encrypt_cbc(struct sc_card *card, const unsigned char *key, int keysize, unsigned char iv[16],
 		const unsigned char *input, size_t length, unsigned char *output)
 {
-	return openssl_enc(EVP_aes_128_cbc(), key, iv, input, length, output);
+	return openssl_enc(card, EVP_aes_128_cbc(), key, iv, input, length, output);
 }
 
 
 static int
-aes128_decrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[16],
+aes128_decrypt_cbc(struct sc_card *card, const unsigned char *key, int keysize, unsigned char iv[16],
 		const unsigned char *input, size_t length, unsigned char *output)
 {
-	return openssl_dec(EVP_aes_128_cbc(), key, iv, input, length, output);
+	return openssl_dec(card, EVP_aes_128_cbc(), key, iv, input, length, output);
 }
 
 
 static int
-des3_encrypt_ecb(const unsigned char *key, int keysize,
+des3_encrypt_ecb(struct sc_card *card, const unsigned char *key, int keysize,
 		const unsigned char *input, int length, unsigned char *output)
 {
 	unsigned char iv[EVP_MAX_IV_LENGTH] = { 0 };
@@ -204,12 +259,12 @@ des3_encrypt_ecb(const unsigned char *key, int keysize,
 		memcpy(&bKey[0], key, 24);
 	}
 
-	return openssl_enc(EVP_des_ede3(), bKey, iv, input, length, output);
+	return openssl_enc(card, EVP_des_ede3(), bKey, iv, input, length, output);
 }
 
 
 static int
-des3_encrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[8],
+des3_encrypt_cbc(struct sc_card *card, const unsigned char *key, int keysize, unsigned char iv[8],
 		const unsigned char *input, size_t length, unsigned char *output)
 {
 	unsigned char bKey[24] = { 0 };
@@ -222,12 +277,12 @@ des3_encrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[8],
 		memcpy(&bKey[0], key, 24);
 	}
 
-	return openssl_enc(EVP_des_ede3_cbc(), bKey, iv, input, length, output);
+	return openssl_enc(card, EVP_des_ede3_cbc(), bKey, iv, input, length, output);
 }
 
 
 static int
-des3_decrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[8],
+des3_decrypt_cbc(struct sc_card *card, const unsigned char *key, int keysize, unsigned char iv[8],
 		const unsigned char *input, size_t length, unsigned char *output)
 {
 	unsigned char bKey[24] = { 0 };
@@ -239,23 +294,23 @@ des3_decrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[8],
 		memcpy(&bKey[0], key, 24);
 	}
 
-	return openssl_dec(EVP_des_ede3_cbc(), bKey, iv, input, length, output);
+	return openssl_dec(card, EVP_des_ede3_cbc(), bKey, iv, input, length, output);
 }
 
 
 static int
-des_encrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[8],
+des_encrypt_cbc(struct sc_card *card, const unsigned char *key, int keysize, unsigned char iv[8],
 		const unsigned char *input, size_t length, unsigned char *output)
 {
-	return openssl_enc(EVP_des_cbc(), key, iv, input, length, output);
+	return openssl_enc(card, EVP_des_cbc(), key, iv, input, length, output);
 }
 
 
 static int
-des_decrypt_cbc(const unsigned char *key, int keysize, unsigned char iv[8],
+des_decrypt_cbc(struct sc_card *card, const unsigned char *key, int keysize, unsigned char iv[8],
 		const unsigned char *input, size_t length, unsigned char *output)
 {
-	return openssl_dec(EVP_des_cbc(), key, iv, input, length, output);
+	return openssl_dec(card, EVP_des_cbc(), key, iv, input, length, output);
 }
 
 
@@ -292,6 +347,7 @@ static int
 gen_init_key(struct sc_card *card, unsigned char *key_enc, unsigned char *key_mac,
 		unsigned char *result, unsigned char key_type)
 {
+	struct epass2003_exdata *exdata = EXDATA(card);
 	int r;
 	struct sc_apdu apdu;
 	unsigned char data[256] = { 0 };
@@ -309,10 +365,10 @@ gen_init_key(struct sc_card *card, unsigned char *key_enc, unsigned char *key_ma
 	apdu.le = apdu.resplen = 28;
 	apdu.resp = result;	/* card random is result[12~19] */
 
-	tmp_sm = g_sm;
-	g_sm = SM_PLAIN;
+	tmp_sm = exdata->sm;
+	exdata->sm = SM_PLAIN;
 	r = epass2003_transmit_apdu(card, &apdu);
-	g_sm = tmp_sm;
+	exdata->sm = tmp_sm;
 	LOG_TEST_RET(card->ctx, r, "APDU gen_init_key failed");
 
 	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
@@ -326,12 +382,12 @@ gen_init_key(struct sc_card *card, unsigned char *key_enc, unsigned char *key_ma
 
 	/* Step 2,3 - Create S-ENC/S-MAC Session Key */
 	if (KEY_TYPE_AES == key_type) {
-		aes128_encrypt_ecb(key_enc, 16, data, 16, g_sk_enc);
-		aes128_encrypt_ecb(key_mac, 16, data, 16, g_sk_mac);
+		aes128_encrypt_ecb(card, key_enc, 16, data, 16, exdata->sk_enc);
+		aes128_encrypt_ecb(card, key_mac, 16, data, 16, exdata->sk_mac);
 	}
 	else {
-		des3_encrypt_ecb(key_enc, 16, data, 16, g_sk_enc);
-		des3_encrypt_ecb(key_mac, 16, data, 16, g_sk_mac);
+		des3_encrypt_ecb(card, key_enc, 16, data, 16, exdata->sk_enc);
+		des3_encrypt_ecb(card, key_mac, 16, data, 16, exdata->sk_mac);
 	}
 
 	memcpy(data, g_random, 8);
@@ -342,9 +398,9 @@ gen_init_key(struct sc_card *card, unsigned char *key_enc, unsigned char *key_ma
 
 	/* calculate host cryptogram */
 	if (KEY_TYPE_AES == key_type)
-		aes128_encrypt_cbc(g_sk_enc, 16, iv, data, 16 + blocksize, cryptogram);
+		aes128_encrypt_cbc(card, exdata->sk_enc, 16, iv, data, 16 + blocksize, cryptogram);
 	else
-		des3_encrypt_cbc(g_sk_enc, 16, iv, data, 16 + blocksize, cryptogram);
+		des3_encrypt_cbc(card, exdata->sk_enc, 16, iv, data, 16 + blocksize, cryptogram);
 
 	/* verify card cryptogram */
 	if (0 != memcmp(&cryptogram[16], &result[20], 8))
@@ -357,6 +413,7 @@ gen_init_key(struct sc_card *card, unsigned char *key_enc, unsigned char *key_ma
 static int
 verify_init_key(struct sc_card *card, unsigned char *ran_key, unsigned char key_type)
 {
+	struct epass2003_exdata *exdata = EXDATA(card);
 	int r;
 	struct sc_apdu apdu;
 	unsigned long blocksize = (key_type == KEY_TYPE_AES ? 16 : 8);
@@ -377,10 +434,10 @@ verify_init_key(struct sc_card *card, unsigned char *ran_key, unsigned char key_
 
 	/* calculate host cryptogram */
 	if (KEY_TYPE_AES == key_type) {
-		aes128_encrypt_cbc(g_sk_enc, 16, iv, data, 16 + blocksize,
+		aes128_encrypt_cbc(card, exdata->sk_enc, 16, iv, data, 16 + blocksize,
 				   cryptogram);
 	} else {
-		des3_encrypt_cbc(g_sk_enc, 16, iv, data, 16 + blocksize,
+		des3_encrypt_cbc(card, exdata->sk_enc, 16, iv, data, 16 + blocksize,
 				 cryptogram);
 	}
 
@@ -392,15 +449,15 @@ verify_init_key(struct sc_card *card, unsigned char *ran_key, unsigned char key_
 	/* calculate mac icv */
 	memset(iv, 0x00, 16);
 	if (KEY_TYPE_AES == key_type) {
-		aes128_encrypt_cbc(g_sk_mac, 16, iv, data, 16, mac);
+		aes128_encrypt_cbc(card, exdata->sk_mac, 16, iv, data, 16, mac);
 		i = 0;
 	} else {
-		des3_encrypt_cbc(g_sk_mac, 16, iv, data, 16, mac);
+		des3_encrypt_cbc(card, exdata->sk_mac, 16, iv, data, 16, mac);
 		i = 8;
 	}
 	/* save mac icv */
-	memset(g_icv_mac, 0x00, 16);
-	memcpy(g_icv_mac, &mac[i], 8);
+	memset(exdata->icv_mac, 0x00, 16);
+	memcpy(exdata->icv_mac, &mac[i], 8);
 
 	/* verify host cryptogram */
 	memcpy(data, &cryptogram[16], 8);
@@ -409,10 +466,10 @@ verify_init_key(struct sc_card *card, unsigned char *ran_key, unsigned char key_
 	apdu.cla = 0x84;
 	apdu.lc = apdu.datalen = 16;
 	apdu.data = data;
-	tmp_sm = g_sm;
-	g_sm = SM_PLAIN;
+	tmp_sm = exdata->sm;
+	exdata->sm = SM_PLAIN;
 	r = epass2003_transmit_apdu(card, &apdu);
-	g_sm = tmp_sm;
+	exdata->sm = tmp_sm;
 	LOG_TEST_RET(card->ctx, r,
 		    "APDU verify_init_key failed");
 	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
@@ -426,6 +483,7 @@ static int
 mutual_auth(struct sc_card *card, unsigned char *key_enc,
 			unsigned char *key_mac)
 {
+	struct epass2003_exdata *exdata = EXDATA(card);
 	struct sc_context *ctx = card->ctx;
 	int r;
 	unsigned char result[256] = { 0 };
@@ -433,11 +491,11 @@ mutual_auth(struct sc_card *card, unsigned char *key_enc,
 
 	LOG_FUNC_CALLED(ctx);
 
-	r = gen_init_key(card, key_enc, key_mac, result, g_smtype);
+	r = gen_init_key(card, key_enc, key_mac, result, exdata->smtype);
 	LOG_TEST_RET(ctx, r, "gen_init_key failed");
 	memcpy(ran_key, &result[12], 8);
 
-	r = verify_init_key(card, ran_key, g_smtype);
+	r = verify_init_key(card, ran_key, exdata->smtype);
 	LOG_TEST_RET(ctx, r, "verify_init_key failed");
 
 	LOG_FUNC_RETURN(ctx, r);
@@ -447,9 +505,10 @@ mutual_auth(struct sc_card *card, unsigned char *key_enc,
 int
 epass2003_refresh(struct sc_card *card)
 {
+	struct epass2003_exdata *exdata = EXDATA(card);
 	int r = SC_SUCCESS;
 
-	if (g_sm) {
+	if (exdata->sm) {
 		r = mutual_auth(card, g_init_key_enc, g_init_key_mac);
 		LOG_TEST_RET(card->ctx, r, "mutual_auth failed");
 	}
@@ -460,9 +519,10 @@ epass2003_refresh(struct sc_card *card)
 
 /* Data(TLV)=0x87|L|0x01+Cipher */
 static int
-construct_data_tlv(struct sc_apdu *apdu, unsigned char *apdu_buf,
+construct_data_tlv(struct sc_card *card, struct sc_apdu *apdu, unsigned char *apdu_buf,
 		unsigned char *data_tlv, size_t * data_tlv_len, const unsigned char key_type)
 {
+	struct epass2003_exdata *exdata = EXDATA(card);
 	size_t block_size = (KEY_TYPE_AES == key_type ? 16 : 8);
 	unsigned char pad[4096] = { 0 };
 	size_t pad_len;
@@ -496,9 +556,9 @@ construct_data_tlv(struct sc_apdu *apdu, unsigned char *apdu_buf,
 
 	/* encrypt Data */
 	if (KEY_TYPE_AES == key_type)
-		aes128_encrypt_cbc(g_sk_enc, 16, iv, pad, pad_len, apdu_buf + block_size + tlv_more);
+		aes128_encrypt_cbc(card, exdata->sk_enc, 16, iv, pad, pad_len, apdu_buf + block_size + tlv_more);
 	else
-		des3_encrypt_cbc(g_sk_enc, 16, iv, pad, pad_len, apdu_buf + block_size + tlv_more);
+		des3_encrypt_cbc(card, exdata->sk_enc, 16, iv, pad, pad_len, apdu_buf + block_size + tlv_more);
 
 	memcpy(data_tlv + tlv_more, apdu_buf + block_size + tlv_more, pad_len);
 	*data_tlv_len = tlv_more + pad_len;
@@ -534,9 +594,10 @@ construct_le_tlv(struct sc_apdu *apdu, unsigned char *apdu_buf, size_t data_tlv_
 
 /* MAC(TLV)=0x8e|0x08|MAC */
 static int
-construct_mac_tlv(unsigned char *apdu_buf, size_t data_tlv_len, size_t le_tlv_len,
+construct_mac_tlv(struct sc_card *card, unsigned char *apdu_buf, size_t data_tlv_len, size_t le_tlv_len,
 		unsigned char *mac_tlv, size_t * mac_tlv_len, const unsigned char key_type)
 {
+	struct epass2003_exdata *exdata = EXDATA(card);
 	size_t block_size = (KEY_TYPE_AES == key_type ? 16 : 8);
 	unsigned char mac[4096] = { 0 };
 	size_t mac_len;
@@ -562,29 +623,29 @@ construct_mac_tlv(unsigned char *apdu_buf, size_t data_tlv_len, size_t le_tlv_le
 
 	/* increase icv */
 	for (; i >= 0; i--) {
-		if (g_icv_mac[i] == 0xff) {
-			g_icv_mac[i] = 0;
+		if (exdata->icv_mac[i] == 0xff) {
+			exdata->icv_mac[i] = 0;
 		}
 		else {
-			g_icv_mac[i]++;
+			exdata->icv_mac[i]++;
 			break;
 		}
 	}
 
 	/* calculate MAC */
 	memset(icv, 0, sizeof(icv));
-	memcpy(icv, g_icv_mac, 16);
+	memcpy(icv, exdata->icv_mac, 16);
 	if (KEY_TYPE_AES == key_type) {
-		aes128_encrypt_cbc(g_sk_mac, 16, icv, apdu_buf, mac_len, mac);
+		aes128_encrypt_cbc(card, exdata->sk_mac, 16, icv, apdu_buf, mac_len, mac);
 		memcpy(mac_tlv + 2, &mac[mac_len - 16], 8);
 	}
 	else {
 		unsigned char iv[8] = { 0 };
 		unsigned char tmp[8] = { 0 };
-		des_encrypt_cbc(g_sk_mac, 8, icv, apdu_buf, mac_len, mac);
-		des_decrypt_cbc(&g_sk_mac[8], 8, iv, &mac[mac_len - 8], 8, tmp);
+		des_encrypt_cbc(card, exdata->sk_mac, 8, icv, apdu_buf, mac_len, mac);
+		des_decrypt_cbc(card, &exdata->sk_mac[8], 8, iv, &mac[mac_len - 8], 8, tmp);
 		memset(iv, 0x00, 8);
-		des_encrypt_cbc(g_sk_mac, 8, iv, tmp, 8, mac_tlv + 2);
+		des_encrypt_cbc(card, exdata->sk_mac, 8, iv, tmp, 8, mac_tlv + 2);
 	}
 
 	*mac_tlv_len = 2 + 8;
@@ -625,10 +686,11 @@ static size_t calc_le(size_t le)
  * where
  * Data'=Data(TLV)+Le(TLV)+MAC(TLV) */
 static int
-encode_apdu(struct sc_apdu *plain, struct sc_apdu *sm,
+encode_apdu(struct sc_card *card, struct sc_apdu *plain, struct sc_apdu *sm,
 		unsigned char *apdu_buf, size_t * apdu_buf_len)
 {
-	size_t block_size = (KEY_TYPE_DES == g_smtype ? 16 : 8);
+	struct epass2003_exdata *exdata = EXDATA(card);
+	size_t block_size = (KEY_TYPE_DES == exdata->smtype ? 16 : 8);
 	unsigned char dataTLV[4096] = { 0 };
 	size_t data_tlv_len = 0;
 	unsigned char le_tlv[256] = { 0 };
@@ -656,15 +718,15 @@ encode_apdu(struct sc_apdu *plain, struct sc_apdu *sm,
 
 	/* Data -> Data' */
 	if (plain->lc != 0)
-		if (0 != construct_data_tlv(plain, apdu_buf, dataTLV, &data_tlv_len, g_smtype))
+		if (0 != construct_data_tlv(card, plain, apdu_buf, dataTLV, &data_tlv_len, exdata->smtype))
 			return -1;
 
 	if (plain->le != 0 || (plain->le == 0 && plain->resplen != 0))
 		if (0 != construct_le_tlv(plain, apdu_buf, data_tlv_len, le_tlv,
-				     &le_tlv_len, g_smtype))
+				     &le_tlv_len, exdata->smtype))
 			return -1;
 
-	if (0 != construct_mac_tlv(apdu_buf, data_tlv_len, le_tlv_len, mac_tlv, &mac_tlv_len, g_smtype))
+	if (0 != construct_mac_tlv(card, apdu_buf, data_tlv_len, le_tlv_len, mac_tlv, &mac_tlv_len, exdata->smtype))
 		return -1;
 
 	memset(apdu_buf + 4, 0, *apdu_buf_len - 4);
@@ -707,12 +769,13 @@ encode_apdu(struct sc_apdu *plain, struct sc_apdu *sm,
 static int
 epass2003_sm_wrap_apdu(struct sc_card *card, struct sc_apdu *plain, struct sc_apdu *sm)
 {
+	struct epass2003_exdata *exdata = EXDATA(card);
 	unsigned char buf[4096] = { 0 };	/* APDU buffer */
 	size_t buf_len = sizeof(buf);
 
 	LOG_FUNC_CALLED(card->ctx);
 
-	if (g_sm)
+	if (exdata->sm)
 		plain->cla |= 0x0C;
 
 	sm->cse = plain->cse;
@@ -735,7 +798,7 @@ epass2003_sm_wrap_apdu(struct sc_card *card, struct sc_apdu *plain, struct sc_ap
 		break;
 	case 0x0C:
 		memset(buf, 0, sizeof(buf));
-		if (0 != encode_apdu(plain, sm, buf, &buf_len))
+		if (0 != encode_apdu(card, plain, sm, buf, &buf_len))
 			return SC_ERROR_CARD_CMD_FAILED;
 		break;
 	default:
@@ -758,8 +821,9 @@ epass2003_sm_wrap_apdu(struct sc_card *card, struct sc_apdu *plain, struct sc_ap
  * SW12(TLV)=0x99|0x02|SW1+SW2
  * MAC(TLV)=0x8e|0x08|MAC */
 static int
-decrypt_response(unsigned char *in, unsigned char *out, size_t * out_len)
+decrypt_response(struct sc_card *card, unsigned char *in, unsigned char *out, size_t * out_len)
 {
+	struct epass2003_exdata *exdata = EXDATA(card);
 	size_t in_len;
 	size_t i;
 	unsigned char iv[16] = { 0 };
@@ -788,10 +852,10 @@ decrypt_response(unsigned char *in, unsigned char *out, size_t * out_len)
 	}
 
 	/* decrypt */
-	if (KEY_TYPE_AES == g_smtype)
-		aes128_decrypt_cbc(g_sk_enc, 16, iv, &in[i], in_len - 1, plaintext);
+	if (KEY_TYPE_AES == exdata->smtype)
+		aes128_decrypt_cbc(card, exdata->sk_enc, 16, iv, &in[i], in_len - 1, plaintext);
 	else
-		des3_decrypt_cbc(g_sk_enc, 16, iv, &in[i], in_len - 1, plaintext);
+		des3_decrypt_cbc(card, exdata->sk_enc, 16, iv, &in[i], in_len - 1, plaintext);
 
 	/* unpadding */
 	while (0x80 != plaintext[in_len - 2] && (in_len - 2 > 0))
@@ -809,6 +873,7 @@ decrypt_response(unsigned char *in, unsigned char *out, size_t * out_len)
 static int
 epass2003_sm_unwrap_apdu(struct sc_card *card, struct sc_apdu *sm, struct sc_apdu *plain)
 {
+	struct epass2003_exdata *exdata = EXDATA(card);
 	int r;
 	size_t len = 0;
 
@@ -816,8 +881,8 @@ epass2003_sm_unwrap_apdu(struct sc_card *card, struct sc_apdu *sm, struct sc_apd
 
 	r = sc_check_sw(card, sm->sw1, sm->sw2);
 	if (r == SC_SUCCESS) {
-		if (g_sm) {
-			if (0 != decrypt_response(sm->resp, plain->resp, &len))
+		if (exdata->sm) {
+			if (0 != decrypt_response(card, sm->resp, plain->resp, &len))
 				return SC_ERROR_CARD_CMD_FAILED;
 		}
 		else {
@@ -916,6 +981,7 @@ epass2003_transmit_apdu(struct sc_card *card, struct sc_apdu *apdu)
 static int
 get_data(struct sc_card *card, unsigned char type, unsigned char *data, size_t datalen)
 {
+	struct epass2003_exdata *exdata = EXDATA(card);
 	int r;
 	struct sc_apdu apdu;
 	unsigned char resp[SC_MAX_APDU_BUFFER_SIZE] = { 0 };
@@ -929,10 +995,10 @@ get_data(struct sc_card *card, unsigned char type, unsigned char *data, size_t d
 	apdu.resplen = resplen;
 	if (0x86 == type) {
 		/* No SM temporarily */
-		unsigned char tmp_sm = g_sm;
-		g_sm = SM_PLAIN;
+		unsigned char tmp_sm = exdata->sm;
+		exdata->sm = SM_PLAIN;
 		r = sc_transmit_apdu(card, &apdu);
-		g_sm = tmp_sm;
+		exdata->sm = tmp_sm;
 	}
 	else {
 		r = sc_transmit_apdu(card, &apdu);
@@ -963,6 +1029,7 @@ static int epass2003_match_card(struct sc_card *card)
 static int
 epass2003_init(struct sc_card *card)
 {
+	struct epass2003_exdata *exdata;
 	unsigned int flags;
 	unsigned char data[SC_MAX_APDU_BUFFER_SIZE] = { 0 };
 	size_t datalen = SC_MAX_APDU_BUFFER_SIZE;
@@ -971,22 +1038,29 @@ epass2003_init(struct sc_card *card)
 
 	card->name = "epass2003";
 	card->cla = 0x00;
-	card->drv_data = NULL;
+	exdata = calloc(1, sizeof(struct epass2003_exdata));
+	if (!exdata)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+	card->drv_data = exdata;
 /* VT
 	card->ctx->use_sm = 1;
 */
 
-	g_sm = SM_SCP01;
-	/* g_sm = SM_PLAIN; */
+	exdata->sm = SM_SCP01;
+	/* exdata->sm = SM_PLAIN; */
 
 	/* decide FIPS/Non-FIPS mode */
-	if (SC_SUCCESS != get_data(card, 0x86, data, datalen))
+	if (SC_SUCCESS != get_data(card, 0x86, data, datalen)) {
+		free_cipher_ctx(exdata);
+		free(exdata);
+		card->drv_data = NULL;
 		return SC_ERROR_CARD_CMD_FAILED;
+	}
 
 	if (0x01 == data[2])
-		g_smtype = KEY_TYPE_AES;
+		exdata->smtype = KEY_TYPE_AES;
 	else
-		g_smtype = KEY_TYPE_DES;
+		exdata->smtype = KEY_TYPE_DES;
 
 	/* mutual authentication */
 	card->max_recv_size = 0xD8;
@@ -996,7 +1070,7 @@ epass2003_init(struct sc_card *card)
 	card->sm_ctx.ops.get_sm_apdu = epass2003_sm_get_wrapped_apdu;
 	card->sm_ctx.ops.free_sm_apdu = epass2003_sm_free_wrapped_apdu;
 
-	/* FIXME (VT): rather then set/unset 'g_sm', better to implement filter for APDUs to be wrapped */
+	/* FIXME (VT): rather then set/unset 'exdata->sm', better to implement filter for APDUs to be wrapped */
 	epass2003_refresh(card);
 
 	card->sm_ctx.sm_mode = SM_MODE_TRANSMIT;
@@ -1014,6 +1088,22 @@ epass2003_init(struct sc_card *card)
 }
 
 
+
+static int
+epass2003_finish(struct sc_card *card)
+{
+	struct epass2003_exdata *exdata = EXDATA(card);
+
+	if (exdata) {
+		free_cipher_ctx(exdata);
+		sc_mem_clear(exdata, sizeof(struct epass2003_exdata));
+		free(exdata);
+		card->drv_data = NULL;
+	}
+	return SC_SUCCESS;
+}
+
+
 /* COS implement SFI as lower 5 bits of FID, and not allow same SFI at the
  * same DF, so use hook functions to increase/decrease FID by 0x20 */
 static int
@@ -2251,7 +2341,7 @@ external_key_auth(struct sc_card *card, unsigned char kid,
 	r = hash_data(data, datalen, hash);
 	LOG_TEST_RET(card->ctx, r, "hash data failed");
 
-	des3_encrypt_cbc(hash, HASH_LEN, iv, random, 8, tmp_data);
+	des3_encrypt_cbc(card, hash, HASH_LEN, iv, random, 8, tmp_data);
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0x82, 0x01, 0x80 | kid);
 	apdu.lc = apdu.datalen = 8;
 	apdu.data = tmp_data;
@@ -2362,6 +2452,7 @@ static struct sc_card_driver *sc_get_driver(void)
 
 	epass2003_ops.match_card = epass2003_match_card;
 	epass2003_ops.init = epass2003_init;
+	epass2003_ops.finish = epass2003_finish;
 	epass2003_ops.write_binary = NULL;
 	epass2003_ops.write_record = NULL;
 	epass2003_ops.select_file = epass2003_select_file;
@@ -2377,6 +2468,7 @@ static struct sc_card_driver *sc_get_driver(void)
 	epass2003_ops.process_fci = epass2003_process_fci;
 	epass2003_ops.construct_fci = epass2003_construct_fci;
 	epass2003_ops.pin_cmd = epass2003_pin_cmd;
+	epass2003_drv.builtin_atrs = epass2003_atrs;
 	return &epass2003_drv;
 }
 
@@ -1358,6 +1358,7 @@ struct sc_card_driver * sc_get_cryptoflex_driver(void)
 	cryptoflex_ops.decipher = flex_decipher;
 	cryptoflex_ops.pin_cmd = flex_pin_cmd;
 	cryptoflex_ops.logout = flex_logout;
+	cryptoflex_drv.builtin_atrs = flex_atrs;
 	return &cryptoflex_drv;
 }
 
@@ -1383,5 +1384,6 @@ struct sc_card_driver * sc_get_cyberflex_driver(void)
 	cyberflex_ops.decipher = flex_decipher;
 	cyberflex_ops.pin_cmd = flex_pin_cmd;
 	cyberflex_ops.logout = flex_logout;
+	cyberflex_drv.builtin_atrs = flex_atrs;
 	return &cyberflex_drv;
 }
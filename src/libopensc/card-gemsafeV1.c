@@ -673,6 +673,7 @@ static struct sc_card_driver *sc_get_driver(void)
 	gemsafe_ops.process_fci	= gemsafe_process_fci;
 	gemsafe_ops.pin_cmd		 = gemsafe_pin_cmd;
 
+	gemsafe_drv.builtin_atrs = gemsafe_atrs;
 	return &gemsafe_drv;
 }
 
@@ -1885,6 +1885,7 @@ sc_get_driver(void)
 	gpk_ops.decipher	= gpk_decipher;
 	gpk_ops.pin_cmd		= gpk_pin_cmd;
 
+	gpk_drv.builtin_atrs = gpk_atrs;
 	return &gpk_drv;
 }
 
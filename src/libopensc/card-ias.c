@@ -524,6 +524,7 @@ static struct sc_card_driver *sc_get_driver(void)
 	ias_ops.compute_signature = ias_compute_signature;
 	ias_ops.pin_cmd = ias_pin_cmd;
 
+	ias_drv.builtin_atrs = ias_atrs;
 	return &ias_drv;
 }
 
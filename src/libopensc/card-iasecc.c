@@ -3474,6 +3474,7 @@ sc_get_driver(void)
 
 	iasecc_ops.read_public_key = iasecc_read_public_key;
 
+	iasecc_drv.builtin_atrs = iasecc_known_atrs;
 	return &iasecc_drv;
 }
 
@@ -875,6 +875,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	incrypto34_ops.card_ctl = incrypto34_card_ctl;
 	incrypto34_ops.pin_cmd = incrypto34_pin_cmd;
 
+	incrypto34_drv.builtin_atrs = incrypto34_atrs;
 	return &incrypto34_drv;
 }
 
@@ -494,6 +494,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	itacns_ops.read_binary = itacns_read_binary;
 	itacns_ops.list_files = itacns_list_files;
 	itacns_ops.select_file = itacns_select_file;
+	itacns_drv.builtin_atrs = itacns_atrs;
 	return &itacns_drv;
 }
 
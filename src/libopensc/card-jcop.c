@@ -924,6 +924,7 @@ static struct sc_card_driver * sc_get_driver(void)
      jcop_ops.process_fci = jcop_process_fci;
      jcop_ops.card_ctl = jcop_card_ctl;
      
+     jcop_drv.builtin_atrs = jcop_atrs;
      return &jcop_drv;
 }
 
@@ -1396,6 +1396,7 @@ static struct sc_card_driver *sc_get_driver(void)
 	mcrd_ops.compute_signature = mcrd_compute_signature;
 	mcrd_ops.pin_cmd = mcrd_pin_cmd;
 
+	mcrd_drv.builtin_atrs = mcrd_atrs;
 	return &mcrd_drv;
 }
 
@@ -491,6 +491,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	miocos_ops.delete_file = miocos_delete_file;
 	miocos_ops.card_ctl = miocos_card_ctl;
 	
+        miocos_drv.builtin_atrs = miocos_atrs;
         return &miocos_drv;
 }
 
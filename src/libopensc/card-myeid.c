@@ -66,6 +66,7 @@ static const char *myeid_atrs[] = {
 
 typedef struct myeid_private_data {
 	int card_state;
+	char card_name[100];	/* card->name with the applet version */
 } myeid_private_data_t;
 
 static int myeid_match_card(struct sc_card *card)
@@ -126,6 +127,8 @@ static int myeid_init(struct sc_card *card)
         
 	/* State that we have an RNG */
 	card->caps |= SC_CARD_CAP_RNG;
+	/* MSE stays in effect until another file is selected */
+	card->caps |= SC_CARD_CAP_REUSE_SEC_ENV;
 
 	card->max_recv_size = 255;
 	card->max_send_size = 255;
@@ -1123,9 +1126,9 @@ static int myeid_activate_card(struct sc_card *card)
 
 static int myeid_get_info(struct sc_card *card, u8 *rbuf, size_t buflen)
 {
+	myeid_private_data_t *priv = (myeid_private_data_t *) card->drv_data;
 	sc_apdu_t apdu;
 	int r;
-	char nameBuf[100];
 
 	LOG_FUNC_CALLED(card->ctx);
 
@@ -1149,9 +1152,12 @@ static int myeid_get_info(struct sc_card *card, u8 *rbuf, size_t buflen)
 	/* store the applet version */
 	card->version.fw_major = rbuf[5] * 10 + rbuf[6];
 	card->version.fw_minor = rbuf[7];
-	/* add version to name */
-	sprintf((char *) nameBuf, "%s %d.%d.%d", card->name, rbuf[5], rbuf[6], rbuf[7]);
-	card->name = nameBuf;
+	/* add version to name, once; the buffer lives as long as the card */
+	if (card->name != priv->card_name) {
+		snprintf(priv->card_name, sizeof(priv->card_name), "%s %d.%d.%d",
+				card->name, rbuf[5], rbuf[6], rbuf[7]);
+		card->name = priv->card_name;
+	}
 	//card->driver->name
 	LOG_FUNC_RETURN(card->ctx, r);
 }
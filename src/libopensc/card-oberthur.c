@@ -2313,6 +2313,7 @@ sc_get_driver(void)
 	auth_ops.pin_cmd = auth_pin_cmd;
 	auth_ops.logout = auth_logout;
 	auth_ops.check_sw = auth_check_sw;
+	auth_drv.builtin_atrs = oberthur_atrs;
 	return &auth_drv;
 }
 
@@ -122,6 +122,7 @@ struct blob {
 	unsigned char *	data;
 	unsigned int	len;
 	struct blob *	files;	/* pointer to 1st child */
+	int		stale;	/* data changed on the card, read again when used */
 };
 
 struct do_info {
@@ -146,6 +147,8 @@ static int		pgp_get_blob(sc_card_t *card, struct blob *blob,
 				 unsigned int id, struct blob **ret);
 static struct blob *	pgp_new_blob(sc_card_t *, struct blob *, unsigned int, sc_file_t *);
 static void		pgp_free_blob(struct blob *);
+static int		pgp_enumerate_blob(sc_card_t *card, struct blob *blob);
+static int		pgp_parse_blob(sc_card_t *card, struct blob *blob);
 static int		pgp_get_pubkey(sc_card_t *, unsigned int,
 				u8 *, size_t);
 static int		pgp_get_pubkey_pem(sc_card_t *, unsigned int,
@@ -264,6 +267,13 @@ static struct do_info		pgp2_objects[] = {	/* OpenPGP card spec 2.0 */
  * We should notice this when building fake file system later. */
 #define DO_CERT		0x7f21
 
+/* Largest DO read from the card: its length fits in 2 bytes */
+#define PGP_MAX_DO_SIZE	0xFFFF
+
+/* Constructed DOs holding copies of many other DOs: Application Related
+ * Data and Cardholder Related Data. Read once, they serve the others. */
+static const unsigned int pgp_related_data[] = { 0x006e, 0x0065 };
+
 #define DRVDATA(card)        ((struct pgp_priv_data *) ((card)->drv_data))
 struct pgp_priv_data {
 	struct blob *		mf;
@@ -523,6 +533,7 @@ pgp_set_blob(struct blob *blob, const u8 *data, size_t len)
 	blob->data = NULL;
 	blob->len    = 0;
 	blob->status = 0;
+	blob->stale  = 0;
 
 	if (len > 0) {
 		void *tmp = calloc(len, 1);
@@ -713,27 +724,94 @@ pgp_iterate_blobs(struct blob *blob, int level, void (*func)())
 }
 
 
+/* internal: find a blob by ID anywhere below a given root, without reading the card */
+static struct blob *
+pgp_search_blob(sc_card_t *card, struct blob *root, unsigned int id)
+{
+	struct blob	*child, *found;
+
+	for (child = root->files; child; child = child->next) {
+		if (child->id == id)
+			return child;
+		/* only look into constructed DOs whose contents are known */
+		if (child->info == NULL || child->info->type != CONSTRUCTED
+				|| child->id == DO_CERT || child->data == NULL)
+			continue;
+		if (pgp_enumerate_blob(card, child) < 0)
+			continue;
+		if ((found = pgp_search_blob(card, child, id)) != NULL)
+			return found;
+	}
+	return NULL;
+}
+
+
+/* internal: fill a top-level blob from its copy in the related data DOs */
+static int
+pgp_read_related_blob(sc_card_t *card, struct blob *blob)
+{
+	struct pgp_priv_data *priv = DRVDATA(card);
+	struct blob	*related, *found;
+	size_t		i;
+
+	for (i = 0; i < sizeof(pgp_related_data) / sizeof(pgp_related_data[0]); i++)
+		if (blob->id == pgp_related_data[i])
+			return SC_ERROR_FILE_NOT_FOUND;
+
+	for (i = 0; i < sizeof(pgp_related_data) / sizeof(pgp_related_data[0]); i++) {
+		for (related = priv->mf->files; related; related = related->next)
+			if (related->id == pgp_related_data[i])
+				break;
+		/* do not ask the card again for a DO it did not return */
+		if (related == NULL || related->status < 0
+				|| pgp_enumerate_blob(card, related) < 0)
+			continue;
+
+		found = pgp_search_blob(card, related, blob->id);
+		if (found != NULL) {
+			sc_log(card->ctx, "DO %04X taken from DO %04X", blob->id, related->id);
+			return pgp_set_blob(blob, found->data, found->len);
+		}
+	}
+	return SC_ERROR_FILE_NOT_FOUND;
+}
+
+
 /* internal: read a blob's contents from card */
 static int
 pgp_read_blob(sc_card_t *card, struct blob *blob)
 {
-	if (blob->data != NULL)
+	struct pgp_priv_data *priv = DRVDATA(card);
+
+	if (blob->data != NULL && !blob->stale)
 		return SC_SUCCESS;
 	if (blob->info == NULL)
 		return blob->status;
 
 	if (blob->info->get_fn) {	/* readable, top-level DO */
-		u8 	buffer[2048];
-		size_t	buf_len = (card->caps & SC_CARD_CAP_APDU_EXT)
-				  ? sizeof(buffer) : 256;
-		int	r = blob->info->get_fn(card, blob->id, buffer, buf_len);
+		u8	*buffer;
+		int	r;
+
+		if (blob->parent == priv->mf && !blob->stale
+				&& pgp_read_related_blob(card, blob) == SC_SUCCESS)
+			return SC_SUCCESS;
 
+		buffer = malloc(PGP_MAX_DO_SIZE);
+		if (buffer == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		r = blob->info->get_fn(card, blob->id, buffer, PGP_MAX_DO_SIZE);
 		if (r < 0) {	/* an error occurred */
+			free(buffer);
 			blob->status = r;
 			return r;
 		}
 
-		return pgp_set_blob(blob, buffer, r);
+		r = pgp_set_blob(blob, buffer, r);
+		free(buffer);
+		/* read again: children that exist already get the new contents */
+		if (r == SC_SUCCESS && blob->files != NULL)
+			r = pgp_parse_blob(card, blob);
+		return r;
 	}
 	else {		/* un-readable DO or part of a constructed DO */
 		return SC_SUCCESS;
@@ -742,28 +820,23 @@ pgp_read_blob(sc_card_t *card, struct blob *blob)
 
 
 /*
- * internal: Enumerate contents of a data blob.
+ * internal: Create or update the children of a blob from its contents.
  * The OpenPGP card has a TLV encoding according ASN.1 BER-encoding rules.
  */
 static int
-pgp_enumerate_blob(sc_card_t *card, struct blob *blob)
+pgp_parse_blob(sc_card_t *card, struct blob *blob)
 {
 	const u8	*in;
+	struct blob	*known = blob->files;
 	int		r;
 
-	if (blob->files != NULL)
-		return SC_SUCCESS;
-
-	if ((r = pgp_read_blob(card, blob)) < 0)
-		return r;
-
 	in = blob->data;
 
 	while ((int) blob->len > (in - blob->data)) {
 		unsigned int	cla, tag, tmptag;
 		size_t		len;
 		const u8	*data = in;
-		struct blob	*new;
+		struct blob	*new = NULL;
 
 		r = sc_asn1_read_tag(&data, blob->len - (in - blob->data),
 					&cla, &tag, &len);
@@ -779,11 +852,18 @@ pgp_enumerate_blob(sc_card_t *card, struct blob *blob)
 		}
 		tag |= cla;
 
+		/* blobs of a DO read again may be in use: keep them */
+		if (known != NULL)
+			for (new = blob->files; new != NULL && new->id != tag; new = new->next)
+				;
 		/* create fake file system hierarchy by
 		 * using constructed DOs as DF */
-		if ((new = pgp_new_blob(card, blob, tag, sc_file_new())) == NULL)
+		if (new == NULL && (new = pgp_new_blob(card, blob, tag, sc_file_new())) == NULL)
 			return SC_ERROR_OUT_OF_MEMORY;
 		pgp_set_blob(new, data, len);
+		if (known != NULL && new->files != NULL
+				&& (r = pgp_parse_blob(card, new)) < 0)
+			return r;
 		in = data + len;
 	}
 
@@ -791,6 +871,23 @@ pgp_enumerate_blob(sc_card_t *card, struct blob *blob)
 }
 
 
+/* internal: Enumerate contents of a data blob. */
+static int
+pgp_enumerate_blob(sc_card_t *card, struct blob *blob)
+{
+	int		r;
+
+	if (blob->files != NULL && !blob->stale)
+		return SC_SUCCESS;
+
+	/* reading a stale blob updates its children */
+	if ((r = pgp_read_blob(card, blob)) < 0 || blob->files != NULL)
+		return r;
+
+	return pgp_parse_blob(card, blob);
+}
+
+
 /* internal: find a blob by ID below a given parent, filling its contents when necessary */
 static int
 pgp_get_blob(sc_card_t *card, struct blob *blob, unsigned int id,
@@ -1066,7 +1163,8 @@ pgp_get_pubkey(sc_card_t *card, unsigned int tag, u8 *buf, size_t buf_len)
 	apdu.lc = 2;
 	apdu.data = ushort2bebytes(idbuf, tag);
 	apdu.datalen = 2;
-	apdu.le = ((buf_len >= 256) && !(card->caps & SC_CARD_CAP_APDU_EXT)) ? 256 : buf_len;
+	apdu.le = (card->caps & SC_CARD_CAP_APDU_EXT)
+		? MIN(buf_len, sc_get_max_recv_size(card)) : MIN(buf_len, 256);
 	apdu.resp = buf;
 	apdu.resplen = buf_len;
 
@@ -1130,7 +1228,8 @@ pgp_get_data(sc_card_t *card, unsigned int tag, u8 *buf, size_t buf_len)
 	LOG_FUNC_CALLED(card->ctx);
 
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_2, 0xCA, tag >> 8, tag);
-	apdu.le = ((buf_len >= 256) && !(card->caps & SC_CARD_CAP_APDU_EXT)) ? 256 : buf_len;
+	apdu.le = (card->caps & SC_CARD_CAP_APDU_EXT)
+		? MIN(buf_len, sc_get_max_recv_size(card)) : MIN(buf_len, 256);
 	apdu.resp = buf;
 	apdu.resplen = buf_len;
 
@@ -1149,8 +1248,9 @@ pgp_put_data(sc_card_t *card, unsigned int tag, const u8 *buf, size_t buf_len)
 {
 	sc_apdu_t apdu;
 	struct pgp_priv_data *priv = DRVDATA(card);
-	struct blob *affected_blob = NULL;
+	struct blob *affected_blob = NULL, *related;
 	struct do_info *dinfo = NULL;
+	size_t i;
 	u8 ins = 0xDA;
 	u8 p1 = tag >> 8;
 	u8 p2 = tag & 0xFF;
@@ -1230,6 +1330,14 @@ pgp_put_data(sc_card_t *card, unsigned int tag, const u8 *buf, size_t buf_len)
 		/* pgp_set_blob()'s failures do not impact pgp_put_data()'s result */
 	}
 
+	/* The related data DOs may hold the DO, or show it elsewhere
+	 * (e.g. a fingerprint in C5): read them again when next used */
+	for (related = priv->mf->files; related; related = related->next) {
+		for (i = 0; i < sizeof(pgp_related_data) / sizeof(pgp_related_data[0]); i++)
+			if (related->id == pgp_related_data[i] && related->data != NULL)
+				related->stale = 1;
+	}
+
 	LOG_FUNC_RETURN(card->ctx, buf_len);
 }
 
@@ -2279,6 +2387,7 @@ sc_get_driver(void)
 	pgp_ops.delete_file	= pgp_delete_file;
 	pgp_ops.update_binary	= pgp_update_binary;
 
+	pgp_drv.builtin_atrs = pgp_atrs;
 	return &pgp_drv;
 }
 
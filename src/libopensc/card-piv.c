@@ -122,6 +122,9 @@ enum {
 #define PIV_OBJ_CACHE_VALID			1
 #define PIV_OBJ_CACHE_NOT_PRESENT	8
 
+/* 53 82 xx xx and the largest body the length can tell */
+#define PIV_MAX_OBJECT_SIZE		(0xFFFF + 4)
+
 typedef struct piv_obj_cache {
 	u8* obj_data;
 	size_t obj_len;
@@ -885,33 +888,37 @@ static int piv_get_data(sc_card_t * card, int enumtag,
 	memcpy(p, piv_objects[enumtag].tag_value, tag_len);
 	p += tag_len;
 
-	if (*buf_len == 1 && *buf == NULL) { /* we need to get the length */
-		u8 rbufinitbuf[8]; /* tag of 53 with 82 xx xx  will fit in 4 */
+	if (*buf_len == 1 && *buf == NULL) {
+		/*
+		 * Read the whole object in one GET DATA, its size is not
+		 * known before. With chaining the card returns as much
+		 * as the buffer holds, and the largest object fits.
+		 */
 		u8 *rbuf;
-		size_t rbuflen;
-		size_t bodylen;
-		unsigned int cla_out, tag_out;
-		const u8 *body;
-
-		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"get len of #%d", enumtag);
-		rbuf = rbufinitbuf;
-		rbuflen = sizeof(rbufinitbuf);
+
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"get #%d", enumtag);
+		rbuf = malloc(PIV_MAX_OBJECT_SIZE);
+		if (rbuf == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto err;
+		}
+		*buf = rbuf;
+		*buf_len = PIV_MAX_OBJECT_SIZE;
 		r = piv_general_io(card, 0xCB, 0x3F, 0xFF, tagbuf,  p - tagbuf,
-				&rbuf, &rbuflen);
-		if (r > 0) {
-			body = rbuf;
-			if (sc_asn1_read_tag(&body, 0xffff, &cla_out, &tag_out, &bodylen) !=  SC_SUCCESS) {
-				sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "***** received buffer tag MISSING ");
+				buf, buf_len);
+		if (r <= 0) {
+			free(rbuf);
+			*buf = NULL;
+			*buf_len = 0;
+			if (r == 0)
 				r = SC_ERROR_FILE_NOT_FOUND;
-				goto err;
-			}
-		    *buf_len = r;
-		} else if ( r == 0) {
-			r = SC_ERROR_FILE_NOT_FOUND;
-			goto err;
-		} else {
 			goto err;
 		}
+		/* give back what the object did not use */
+		*buf = realloc(rbuf, r);
+		if (*buf == NULL)
+			*buf = rbuf;
+		goto err;
 	}
 sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"get buffer for #%d len %d", enumtag, *buf_len);
 	if (*buf == NULL && *buf_len > 0) {
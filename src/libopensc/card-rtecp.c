@@ -778,6 +778,7 @@ struct sc_card_driver * sc_get_rtecp_driver(void)
 	rtecp_ops.construct_fci = rtecp_construct_fci;
 	rtecp_ops.pin_cmd = NULL;
 
+	rtecp_drv.builtin_atrs = rtecp_atrs;
 	return &rtecp_drv;
 }
 
@@ -1282,6 +1282,7 @@ static struct sc_card_driver* get_rutoken_driver(void)
 	rutoken_ops.construct_fci = rutoken_construct_fci;
 	rutoken_ops.pin_cmd = NULL;
 
+	rutoken_drv.builtin_atrs = rutoken_atrs;
 	return &rutoken_drv;
 }
 
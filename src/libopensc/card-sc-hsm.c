@@ -1030,6 +1030,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	sc_hsm_ops.append_record     = NULL;
 	sc_hsm_ops.update_record     = NULL;
 
+	sc_hsm_drv.builtin_atrs = sc_hsm_atrs;
 	return &sc_hsm_drv;
 }
 
@@ -1138,6 +1138,7 @@ static struct sc_card_driver *sc_get_driver(void)
 	setcos_ops.construct_fci = setcos_construct_fci;
 	setcos_ops.card_ctl = setcos_card_ctl;
 
+	setcos_drv.builtin_atrs = setcos_atrs;
 	return &setcos_drv;
 }
 
@@ -1360,6 +1360,7 @@ static struct sc_card_driver * sc_get_driver(void)
 	starcos_ops.card_ctl    = starcos_card_ctl;
 	starcos_ops.logout      = starcos_logout;
   
+	starcos_drv.builtin_atrs = starcos_atrs;
 	return &starcos_drv;
 }
 
@@ -770,5 +770,6 @@ struct sc_card_driver * sc_get_tcos_driver(void)
 	tcos_ops.restore_security_env = tcos_restore_security_env;
 	tcos_ops.card_ctl             = tcos_card_ctl;
 	
+	tcos_drv.builtin_atrs = tcos_atrs;
 	return &tcos_drv;
 }
@@ -1282,6 +1282,7 @@ struct sc_card_driver *sc_get_westcos_driver(void)
 	westcos_ops.construct_fci = NULL;
 	westcos_ops.pin_cmd = westcos_pin_cmd;
 
+	westcos_drv.builtin_atrs = westcos_atrs;
 	return &westcos_drv;
 }
 
@@ -22,6 +22,8 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -34,6 +36,39 @@
 #define INVALIDATE_CARD_CACHE_IN_UNLOCK
 */
 
+/* ATR index and driver memo, see _sc_build_atr_index() */
+#define SC_ATR_MEMO_SIZE	16
+#define SC_ATR_MEMO_FILE	"atr-drivers"
+
+struct sc_atr_index_entry {
+	u8 atr[SC_MAX_ATR_SIZE];
+	u8 mask[SC_MAX_ATR_SIZE];
+	size_t len;
+	struct sc_card_driver *driver;
+	unsigned int idx;
+	int builtin;
+};
+
+struct sc_atr_memo {
+	u8 atr[SC_MAX_ATR_SIZE];
+	size_t len;
+	struct sc_card_driver *driver;
+};
+
+struct sc_atr_index {
+	struct sc_atr_index_entry *entries;
+	size_t count;
+
+	struct sc_atr_memo memo[SC_ATR_MEMO_SIZE];
+	unsigned int memo_next;
+};
+
+static struct sc_atr_index_entry *atr_index_find(sc_context_t *ctx, struct sc_atr *atr);
+static size_t atr_index_claims(sc_context_t *ctx, struct sc_atr *atr,
+		struct sc_card_driver **drivers, size_t max);
+static struct sc_card_driver *atr_memo_find(sc_context_t *ctx, struct sc_atr *atr);
+static void atr_memo_update(sc_context_t *ctx, struct sc_atr *atr, struct sc_card_driver *driver);
+
 #ifdef ENABLE_SM
 static int sc_card_sm_load(sc_card_t *card, const char *path, const char *module);
 static int sc_card_sm_unload(sc_card_t *card);
@@ -112,12 +147,48 @@ static void sc_card_free(sc_card_t *card)
 	free(card);
 }
 
+/* Returns 1 if the driver accepted and initialized the card, 0 if it does
+ * not handle the card and an error code if init() failed otherwise */
+static int match_card_driver(sc_card_t *card, struct sc_card_driver *drv)
+{
+	sc_context_t *ctx = card->ctx;
+	const struct sc_card_operations *ops = drv->ops;
+	int r;
+
+	sc_log(ctx, "trying driver '%s'", drv->short_name);
+	if (ops == NULL || ops->match_card == NULL)   {
+		return 0;
+	}
+	else if (!ctx->enable_default_driver && !strcmp("default", drv->short_name))   {
+		sc_log(ctx , "ignore 'default' card driver");
+		return 0;
+	}
+
+	/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
+	*card->ops = *ops;
+	if (ops->match_card(card) != 1)
+		return 0;
+	sc_log(ctx, "matched: %s", drv->name);
+	memcpy(card->ops, ops, sizeof(struct sc_card_operations));
+	card->driver = drv;
+	r = ops->init(card);
+	if (r) {
+		sc_log(ctx, "driver '%s' init() failed: %s", drv->name, sc_strerror(r));
+		card->driver = NULL;
+		if (r == SC_ERROR_INVALID_CARD)
+			return 0;
+		return r;
+	}
+	return 1;
+}
+
 int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 {
 	sc_card_t *card;
 	sc_context_t *ctx;
 	struct sc_card_driver *driver;
-	int i, r = 0, idx, connected = 0;
+	scconf_block *atrblock;
+	int i, r = 0, connected = 0;
 
 	if (card_out == NULL || reader == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
@@ -143,28 +214,19 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 
 	/* See if the ATR matches any ATR specified in the config file */
 	if ((driver = ctx->forced_driver) == NULL) {
-		sc_log(ctx, "matching configured ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
-			driver = ctx->card_drivers[i];
+		struct sc_atr_index_entry *entry;
 
-			if (driver->atr_map == NULL ||
-			    !strcmp(driver->short_name, "default")) {
-				driver = NULL;
-				continue;
-			}
-			sc_log(ctx, "trying driver '%s'", driver->short_name);
-			idx = _sc_match_atr(card, driver->atr_map, NULL);
-			if (idx >= 0) {
-				struct sc_atr_table *src = &driver->atr_map[idx];
-
-				sc_log(ctx, "matched driver '%s'", driver->name);
-				/* It's up to card driver to notice these correctly */
-				card->name = src->name;
-				card->type = src->type;
-				card->flags = src->flags;
-				break;
-			}
-			driver = NULL;
+		sc_log(ctx, "matching configured ATRs");
+		entry = atr_index_find(ctx, &card->atr);
+		if (entry != NULL) {
+			struct sc_atr_table *src = &entry->driver->atr_map[entry->idx];
+
+			driver = entry->driver;
+			sc_log(ctx, "matched driver '%s'", driver->name);
+			/* It's up to card driver to notice these correctly */
+			card->name = src->name;
+			card->type = src->type;
+			card->flags = src->flags;
 		}
 	}
 
@@ -182,38 +244,50 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 		}
 	}
 	else {
-		sc_log(ctx, "matching built-in ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
-			struct sc_card_driver *drv = ctx->card_drivers[i];
-			const struct sc_card_operations *ops = drv->ops;
-
-			sc_log(ctx, "trying driver '%s'", drv->short_name);
-			if (ops == NULL || ops->match_card == NULL)   {
-				continue;
-			}
-			else if (!ctx->enable_default_driver && !strcmp("default", drv->short_name))   {
-				sc_log(ctx , "ignore 'default' card driver");
-				continue;
+		struct sc_card_driver *memo = atr_memo_find(ctx, &card->atr);
+		struct sc_card_driver *claims[SC_MAX_CARD_DRIVERS];
+		size_t nclaims, j;
+
+		if (memo != NULL) {
+			sc_log(ctx, "trying the driver last used with this ATR");
+			r = match_card_driver(card, memo);
+			if (r < 0)
+				goto err;
+		}
+		/* Drivers listing the ATR in their own table come first, so that
+		 * the probing drivers only see cards with an unknown ATR */
+		nclaims = atr_index_claims(ctx, &card->atr, claims, SC_MAX_CARD_DRIVERS);
+		if (card->driver == NULL && nclaims > 0) {
+			sc_log(ctx, "matching built-in ATRs");
+			for (j = 0; j < nclaims; j++) {
+				if (claims[j] == memo)
+					continue;
+				r = match_card_driver(card, claims[j]);
+				if (r < 0)
+					goto err;
+				if (r == 1)
+					break;
 			}
-
-			/* Needed if match_card() needs to talk with the card (e.g. card-muscle) */
-			*card->ops = *ops;
-			if (ops->match_card(card) != 1)
-				continue;
-			sc_log(ctx, "matched: %s", drv->name);
-			memcpy(card->ops, ops, sizeof(struct sc_card_operations));
-			card->driver = drv;
-			r = ops->init(card);
-			if (r) {
-				sc_log(ctx, "driver '%s' init() failed: %s", drv->name, sc_strerror(r));
-				if (r == SC_ERROR_INVALID_CARD) {
-					card->driver = NULL;
+		}
+		if (card->driver == NULL) {
+			sc_log(ctx, "matching all card drivers");
+			for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+				if (ctx->card_drivers[i] == memo)
 					continue;
-				}
-				goto err;
+				for (j = 0; j < nclaims; j++)
+					if (claims[j] == ctx->card_drivers[i])
+						break;
+				if (j < nclaims)
+					continue;
+				r = match_card_driver(card, ctx->card_drivers[i]);
+				if (r < 0)
+					goto err;
+				if (r == 1)
+					break;
 			}
-			break;
 		}
+		if (card->driver != NULL && card->driver != memo)
+			atr_memo_update(ctx, &card->atr, card->driver);
 	}
 	if (card->driver == NULL) {
 		sc_log(ctx, "unable to find driver for inserted card");
@@ -224,6 +298,12 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 		card->name = card->driver->name;
 	*card_out = card;
 
+	/* Configured GET CHALLENGE length, see sc_get_random() */
+	atrblock = _sc_match_atr_block(ctx, NULL, &card->atr);
+	if (atrblock != NULL)
+		card->max_challenge_size = scconf_get_int(atrblock, "max_challenge_size",
+				card->max_challenge_size);
+
         /*  Override card limitations with reader limitations.
          *  Note that zero means no limitations at all.
 	 */
@@ -288,6 +368,17 @@ int sc_disconnect_card(sc_card_t *card)
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
+/* Forget everything known about the card state, e.g. after a reset */
+static void sc_invalidate_cache(struct sc_card *card)
+{
+	if (card->cache.current_ef)
+		sc_file_free(card->cache.current_ef);
+	if (card->cache.current_df)
+		sc_file_free(card->cache.current_df);
+	memset(&card->cache, 0, sizeof(card->cache));
+	card->cache.valid = 0;
+}
+
 int sc_reset(sc_card_t *card, int do_cold_reset)
 {
 	int r, r2;
@@ -302,9 +393,7 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 		return r;
 
 	r = card->reader->ops->reset(card->reader, do_cold_reset);
-	/* invalidate cache */
-	memset(&card->cache, 0, sizeof(card->cache));
-	card->cache.valid = 0;
+	sc_invalidate_cache(card);
 
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
@@ -318,11 +407,13 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 int sc_lock(sc_card_t *card)
 {
 	int r = 0, r2 = 0;
+	unsigned long long start;
 
 	LOG_FUNC_CALLED(card->ctx);
 
 	if (card == NULL)
 		return SC_ERROR_INVALID_ARGUMENTS;
+	start = sc_stats_clock();
 	r = sc_mutex_lock(card->ctx, card->mutex);
 	if (r != SC_SUCCESS)
 		return r;
@@ -330,9 +421,7 @@ int sc_lock(sc_card_t *card)
 		if (card->reader->ops->lock != NULL) {
 			r = card->reader->ops->lock(card->reader);
 			if (r == SC_ERROR_CARD_RESET || r == SC_ERROR_READER_REATTACHED) {
-				/* invalidate cache */
-				memset(&card->cache, 0, sizeof(card->cache));
-				card->cache.valid = 0;
+				sc_invalidate_cache(card);
 				r = card->reader->ops->lock(card->reader);
 			}
 		}
@@ -342,6 +431,8 @@ int sc_lock(sc_card_t *card)
 	if (r == 0)
 		card->lock_count++;
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
+	if (r == 0)
+		sc_stats_count(card->ctx, SC_STATS_LOCK_WAIT, sc_stats_clock() - start);
 	if (r2 != SC_SUCCESS) {
 		sc_log(card->ctx, "unable to release lock");
 		r = r != SC_SUCCESS ? r : r2;
@@ -365,10 +456,11 @@ int sc_unlock(sc_card_t *card)
 
 	assert(card->lock_count >= 1);
 	if (--card->lock_count == 0) {
+		card->cache.sec_env_valid = 0;
+		/* another application may select files between transactions */
+		card->cache.current_valid = 0;
 #ifdef INVALIDATE_CARD_CACHE_IN_UNLOCK
-		/* invalidate cache */
-		memset(&card->cache, 0, sizeof(card->cache));
-		card->cache.valid = 0;
+		sc_invalidate_cache(card);
 		sc_log(card->ctx, "cache invalidated");
 #endif
 		/* release reader lock */
@@ -442,10 +534,50 @@ int sc_delete_file(sc_card_t *card, const sc_path_t *path)
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+/* Extended length APDUs need both the card and the reader, and T=0
+ * carries only a short Le */
+static int sc_card_ext_apdu(const sc_card_t *card)
+{
+	return (card->caps & SC_CARD_CAP_APDU_EXT)
+		&& card->reader != NULL
+		&& (card->reader->capabilities & SC_READER_CAP_APDU_EXT)
+		&& card->reader->active_protocol != SC_PROTO_T0;
+}
+
+size_t sc_get_max_recv_size(const sc_card_t *card)
+{
+	if (card->max_recv_size > 0)
+		return card->max_recv_size;
+	return sc_card_ext_apdu(card) ? 65536 : 256;
+}
+
+size_t sc_get_max_send_size(const sc_card_t *card)
+{
+	if (card->max_send_size > 0)
+		return card->max_send_size;
+	return sc_card_ext_apdu(card) ? 65535 : 255;
+}
+
+size_t sc_get_max_challenge_size(const sc_card_t *card)
+{
+	size_t max = card->max_challenge_size > 0 ? card->max_challenge_size : 8;
+
+	if (max > SC_MAX_CHALLENGE_SIZE)
+		max = SC_MAX_CHALLENGE_SIZE;
+	if (max > sc_get_max_recv_size(card))
+		max = sc_get_max_recv_size(card);
+	return max;
+}
+
+/* Drivers with their own READ/UPDATE BINARY may not cope with more
+ * than a short APDU unless they set a limit themselves */
+#define SC_BINARY_OP_IS_ISO(card, op) \
+	((card)->ops->op == sc_get_iso7816_driver()->ops->op)
+
 int sc_read_binary(sc_card_t *card, unsigned int idx,
 		   unsigned char *buf, size_t count, unsigned long flags)
 {
-	size_t max_le = card->max_recv_size > 0 ? card->max_recv_size : 256;
+	size_t max_le = sc_get_max_recv_size(card);
 	int r;
 
 	assert(card != NULL && card->ops != NULL && buf != NULL);
@@ -462,6 +594,8 @@ int sc_read_binary(sc_card_t *card, unsigned int idx,
 #endif
 	if (card->ops->read_binary == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	if (max_le > 256 && card->max_recv_size == 0 && !SC_BINARY_OP_IS_ISO(card, read_binary))
+		max_le = 256;
 
 	if (count > max_le) {
 		int bytes_read = 0;
@@ -495,7 +629,7 @@ int sc_read_binary(sc_card_t *card, unsigned int idx,
 int sc_write_binary(sc_card_t *card, unsigned int idx,
 		    const u8 *buf, size_t count, unsigned long flags)
 {
-	size_t max_lc = card->max_send_size > 0 ? card->max_send_size : 255;
+	size_t max_lc = sc_get_max_send_size(card);
 	int r;
 
 	assert(card != NULL && card->ops != NULL && buf != NULL);
@@ -504,6 +638,8 @@ int sc_write_binary(sc_card_t *card, unsigned int idx,
 		LOG_FUNC_RETURN(card->ctx, 0);
 	if (card->ops->write_binary == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	if (max_lc > 255 && card->max_send_size == 0 && !SC_BINARY_OP_IS_ISO(card, write_binary))
+		max_lc = 255;
 
 	if (count > max_lc) {
 		int bytes_written = 0;
@@ -538,7 +674,7 @@ int sc_write_binary(sc_card_t *card, unsigned int idx,
 int sc_update_binary(sc_card_t *card, unsigned int idx,
 		     const u8 *buf, size_t count, unsigned long flags)
 {
-	size_t max_lc = card->max_send_size > 0 ? card->max_send_size : 255;
+	size_t max_lc = sc_get_max_send_size(card);
 	int r;
 
 	assert(card != NULL && card->ops != NULL && buf != NULL);
@@ -556,6 +692,8 @@ int sc_update_binary(sc_card_t *card, unsigned int idx,
 
 	if (card->ops->update_binary == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	if (max_lc > 255 && card->max_send_size == 0 && !SC_BINARY_OP_IS_ISO(card, update_binary))
+		max_lc = 255;
 
 	if (count > max_lc) {
 		int bytes_written = 0;
@@ -635,8 +773,11 @@ int sc_select_file(sc_card_t *card, const sc_path_t *in_path,  sc_file_t **file)
 	}
 	if (card->ops->select_file == NULL)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+	/* SELECT may reset the current security environment */
+	card->cache.sec_env_valid = 0;
 	r = card->ops->select_file(card, in_path, file);
 	LOG_TEST_RET(card->ctx, r, "'SELECT' error");
+	card->cache.sec_env_path = *in_path;
 
 	/* Remember file path */
 	if (file && *file)
@@ -685,6 +826,61 @@ int sc_get_challenge(sc_card_t *card, u8 *rnd, size_t len)
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+int sc_get_random(sc_card_t *card, u8 *rnd, size_t len)
+{
+	u8 buf[SC_MAX_CHALLENGE_SIZE];
+	size_t chunk, n;
+	int r;
+
+	assert(card != NULL);
+	LOG_FUNC_CALLED(card->ctx);
+
+	if (rnd == NULL && len)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_ARGUMENTS);
+	if (card->ops->get_challenge == NULL)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_NOT_SUPPORTED);
+
+	r = sc_lock(card);
+	LOG_TEST_RET(card->ctx, r, "sc_lock() failed");
+
+	/* bytes left over from the last call come first */
+	n = len < card->cache.random_len ? len : card->cache.random_len;
+	if (n > 0) {
+		card->cache.random_len -= n;
+		memcpy(rnd, card->cache.random + card->cache.random_len, n);
+		sc_mem_clear(card->cache.random + card->cache.random_len, n);
+		rnd += n;
+		len -= n;
+	}
+
+	/* whole commands go straight to the caller */
+	chunk = sc_get_max_challenge_size(card);
+	if (len >= chunk) {
+		n = len - len % chunk;
+		r = card->ops->get_challenge(card, rnd, n);
+		if (r < 0)
+			goto out;
+		rnd += n;
+		len -= n;
+	}
+
+	/* the rest of the last command is kept for the next call */
+	if (len > 0) {
+		r = card->ops->get_challenge(card, buf, chunk);
+		if (r < 0)
+			goto out;
+		memcpy(rnd, buf, len);
+		memcpy(card->cache.random, buf + len, chunk - len);
+		card->cache.random_len = chunk - len;
+	}
+	r = SC_SUCCESS;
+out:
+	/* also after an error, a driver may have filled part of it */
+	sc_mem_clear(buf, sizeof(buf));
+	sc_unlock(card);
+	LOG_FUNC_RETURN(card->ctx, r);
+}
+
 int sc_read_record(sc_card_t *card, unsigned int rec_nr, u8 *buf,
 		   size_t count, unsigned long flags)
 {
@@ -861,62 +1057,79 @@ sc_algorithm_info_t * sc_card_find_gostr3410_alg(sc_card_t *card,
 	return sc_card_find_alg(card, SC_ALGORITHM_GOSTR3410, key_length);
 }
 
+static int hex_nibble(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Compare the ATR with a table entry in "aa:bb:cc" notation, byte by byte,
+ * without converting either of them first. */
+static int match_atr_hex(const u8 *atr, size_t atr_len, const char *tatr, const char *matr)
+{
+	size_t i;
+
+	for (i = 0; i < atr_len; i++) {
+		const char *t = tatr + 3 * i, *m = matr ? matr + 3 * i : NULL;
+		int th = hex_nibble(t[0]), tl = hex_nibble(t[1]);
+		int mask = 0xFF;
+
+		if (th < 0 || tl < 0)
+			return 0;
+		if (m != NULL) {
+			int mh = hex_nibble(m[0]), ml = hex_nibble(m[1]);
+
+			if (mh < 0 || ml < 0)
+				return 0;
+			mask = (mh << 4) | ml;
+		}
+		if ((atr[i] & mask) != (((th << 4) | tl) & mask))
+			return 0;
+	}
+	return 1;
+}
+
 static int match_atr_table(sc_context_t *ctx, struct sc_atr_table *table, struct sc_atr *atr)
 {
 	u8 *card_atr_bin = atr->value;
 	size_t card_atr_bin_len = atr->len;
-	char card_atr_hex[3 * SC_MAX_ATR_SIZE];
-	size_t card_atr_hex_len;
+	size_t card_atr_hex_len = card_atr_bin_len ? card_atr_bin_len * 3 - 1 : 0;
 	unsigned int i = 0;
 
 	if (ctx == NULL || table == NULL || atr == NULL)
 		return -1;
-	sc_bin_to_hex(card_atr_bin, card_atr_bin_len, card_atr_hex, sizeof(card_atr_hex), ':');
-	card_atr_hex_len = strlen(card_atr_hex);
+	if (ctx->debug) {
+		char card_atr_hex[3 * SC_MAX_ATR_SIZE];
 
-	sc_log(ctx, "ATR     : %s", card_atr_hex);
+		sc_bin_to_hex(card_atr_bin, card_atr_bin_len, card_atr_hex, sizeof(card_atr_hex), ':');
+		sc_log(ctx, "ATR     : %s", card_atr_hex);
+	}
 
 	for (i = 0; table[i].atr != NULL; i++) {
 		const char *tatr = table[i].atr;
 		const char *matr = table[i].atrmask;
-		size_t tatr_len = strlen(tatr);
-		u8 mbin[SC_MAX_ATR_SIZE], tbin[SC_MAX_ATR_SIZE];
-		size_t mbin_len, tbin_len, s, matr_len;
-		size_t fix_hex_len = card_atr_hex_len;
-		size_t fix_bin_len = card_atr_bin_len;
 
 		sc_log(ctx, "ATR try : %s", tatr);
 
-		if (tatr_len != fix_hex_len) {
+		if (strlen(tatr) != card_atr_hex_len) {
 			sc_log(ctx, "ignored - wrong length");
 			continue;
 		}
 		if (matr != NULL) {
 			sc_log(ctx, "ATR mask: %s", matr);
 
-			matr_len = strlen(matr);
-			if (tatr_len != matr_len)
-				continue;
-			tbin_len = sizeof(tbin);
-			sc_hex_to_bin(tatr, tbin, &tbin_len);
-			mbin_len = sizeof(mbin);
-			sc_hex_to_bin(matr, mbin, &mbin_len);
-			if (mbin_len != fix_bin_len) {
+			if (strlen(matr) != card_atr_hex_len) {
 				sc_log(ctx, "length of atr and atr mask do not match - ignored: %s - %s", tatr, matr);
 				continue;
 			}
-			for (s = 0; s < tbin_len; s++) {
-				/* reduce tatr with mask */
-				tbin[s] = (tbin[s] & mbin[s]);
-				/* create copy of card_atr_bin masked) */
-				mbin[s] = (card_atr_bin[s] & mbin[s]);
-			}
-			if (memcmp(tbin, mbin, tbin_len) != 0)
-				continue;
-		} else {
-			if (strncasecmp(tatr, card_atr_hex, tatr_len) != 0)
-				continue;
 		}
+		if (!match_atr_hex(card_atr_bin, card_atr_bin_len, tatr, matr))
+			continue;
 		return i;
 	}
 	return -1;
@@ -1033,6 +1246,358 @@ int _sc_free_atr(sc_context_t *ctx, struct sc_card_driver *driver)
 	return SC_SUCCESS;
 }
 
+/*
+ * ATR index
+ *
+ * The card_atr entries of all card drivers, and the built-in ATR tables
+ * of the internal drivers, are converted to binary once, when the
+ * context is created. sc_connect_card() uses the configured entries to
+ * bind a card to a driver without calling match_card(), and the built-in
+ * ones to ask the drivers that list the ATR before any other driver:
+ * the match_card() functions of the remaining drivers, several of which
+ * send APDUs to probe the card, are then only called for unknown ATRs.
+ *
+ * The index also remembers which of these drivers last accepted a given
+ * ATR, so that it is asked first when the ATR is listed by several
+ * drivers. The memo is kept in the cache directory, so it survives the
+ * process.
+ */
+static struct sc_card_driver *find_card_driver(sc_context_t *ctx, const char *short_name)
+{
+	int i;
+
+	for (i = 0; ctx->card_drivers[i] != NULL; i++)
+		if (!strcmp(ctx->card_drivers[i]->short_name, short_name))
+			return ctx->card_drivers[i];
+	return NULL;
+}
+
+static int atr_memo_path(sc_context_t *ctx, char *buf, size_t bufsize)
+{
+	size_t len;
+	int r;
+
+	r = sc_get_cache_dir(ctx, buf, bufsize);
+	if (r != SC_SUCCESS)
+		return r;
+	len = strlen(buf);
+	if (len + 1 + strlen(SC_ATR_MEMO_FILE) + 1 > bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	snprintf(buf + len, bufsize - len, "/%s", SC_ATR_MEMO_FILE);
+	return SC_SUCCESS;
+}
+
+static void atr_memo_load(sc_context_t *ctx, struct sc_atr_index *index)
+{
+	char path[PATH_MAX], line[3 * SC_MAX_ATR_SIZE + 64];
+	unsigned int n = 0;
+	FILE *f;
+
+	if (atr_memo_path(ctx, path, sizeof(path)) != SC_SUCCESS)
+		return;
+	f = fopen(path, "r");
+	if (f == NULL)
+		return;
+	while (n < SC_ATR_MEMO_SIZE && fgets(line, sizeof(line), f) != NULL) {
+		struct sc_atr_memo *memo = &index->memo[n];
+		char *name = strchr(line, ' ');
+
+		if (name == NULL)
+			continue;
+		*name++ = '\0';
+		name[strcspn(name, "\r\n")] = '\0';
+		memo->len = sizeof(memo->atr);
+		if (sc_hex_to_bin(line, memo->atr, &memo->len) != SC_SUCCESS || memo->len == 0)
+			continue;
+		memo->driver = find_card_driver(ctx, name);
+		if (memo->driver != NULL)
+			n++;
+	}
+	fclose(f);
+	index->memo_next = n % SC_ATR_MEMO_SIZE;
+	sc_log(ctx, "loaded %u remembered card driver(s) from %s", n, path);
+}
+
+/* Called with ctx->mutex held. The list is written to a temporary file
+ * first, so that other processes never load a partially written list. */
+static void atr_memo_save(sc_context_t *ctx, struct sc_atr_index *index)
+{
+	char path[PATH_MAX], tmpname[PATH_MAX], hex[3 * SC_MAX_ATR_SIZE];
+	unsigned int i;
+	int r;
+	FILE *f;
+
+	if (atr_memo_path(ctx, path, sizeof(path)) != SC_SUCCESS)
+		return;
+#ifdef _WIN32
+	r = snprintf(tmpname, sizeof(tmpname), "%s.%lu.tmp", path, (unsigned long) GetCurrentProcessId());
+#else
+	r = snprintf(tmpname, sizeof(tmpname), "%s.%lu.tmp", path, (unsigned long) getpid());
+#endif
+	if (r < 0 || (size_t) r >= sizeof(tmpname))
+		return;
+	f = fopen(tmpname, "w");
+	if (f == NULL) {
+		if (sc_make_cache_dir(ctx) != SC_SUCCESS)
+			return;
+		f = fopen(tmpname, "w");
+		if (f == NULL)
+			return;
+	}
+	for (i = 0; i < SC_ATR_MEMO_SIZE; i++) {
+		struct sc_atr_memo *memo = &index->memo[i];
+
+		if (memo->driver == NULL)
+			continue;
+		sc_bin_to_hex(memo->atr, memo->len, hex, sizeof(hex), ':');
+		fprintf(f, "%s %s\n", hex, memo->driver->short_name);
+	}
+	if (ferror(f) | fclose(f)) {
+		unlink(tmpname);
+		return;
+	}
+#ifdef _WIN32
+	/* rename() does not replace existing files on Windows */
+	unlink(path);
+#endif
+	if (rename(tmpname, path) != 0)
+		unlink(tmpname);
+}
+
+static void atr_index_add(sc_context_t *ctx, struct sc_atr_index *index,
+		struct sc_card_driver *driver, struct sc_atr_table *src, unsigned int idx, int builtin)
+{
+	struct sc_atr_index_entry *dst = &index->entries[index->count];
+	size_t mask_len = sizeof(dst->mask);
+
+	dst->len = sizeof(dst->atr);
+	if (sc_hex_to_bin(src->atr, dst->atr, &dst->len) != SC_SUCCESS) {
+		sc_log(ctx, "invalid ATR ignored: %s", src->atr);
+		return;
+	}
+	if (src->atrmask == NULL) {
+		memset(dst->mask, 0xFF, dst->len);
+	}
+	else if (sc_hex_to_bin(src->atrmask, dst->mask, &mask_len) != SC_SUCCESS
+			|| mask_len != dst->len) {
+		sc_log(ctx, "length of atr and atr mask do not match - ignored: %s - %s",
+				src->atr, src->atrmask);
+		return;
+	}
+	dst->driver = driver;
+	dst->idx = idx;
+	dst->builtin = builtin;
+	index->count++;
+}
+
+static struct sc_atr_table *builtin_atrs(struct sc_card_driver *driver)
+{
+	/* older external drivers do not have the field */
+	if (driver->dll != NULL)
+		return NULL;
+	return driver->builtin_atrs;
+}
+
+int _sc_build_atr_index(sc_context_t *ctx)
+{
+	struct sc_atr_index *index = ctx->atr_index;
+	size_t count = 0, nbuiltin = 0;
+	int i;
+
+	if (index == NULL) {
+		index = calloc(1, sizeof(struct sc_atr_index));
+		if (index == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		if (ctx->use_atr_memo)
+			atr_memo_load(ctx, index);
+		ctx->atr_index = index;
+	}
+
+	if (index->entries != NULL)
+		free(index->entries);
+	index->entries = NULL;
+	index->count = 0;
+
+	for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		struct sc_atr_table *table = builtin_atrs(ctx->card_drivers[i]);
+
+		count += ctx->card_drivers[i]->natrs;
+		for (; table != NULL && table->atr != NULL; table++)
+			count++;
+	}
+	if (count == 0)
+		return SC_SUCCESS;
+	index->entries = calloc(count, sizeof(struct sc_atr_index_entry));
+	if (index->entries == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	/* configured entries first, they take precedence in atr_index_find() */
+	for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		struct sc_card_driver *driver = ctx->card_drivers[i];
+		unsigned int j;
+
+		for (j = 0; j < driver->natrs; j++)
+			atr_index_add(ctx, index, driver, &driver->atr_map[j], j, 0);
+	}
+	nbuiltin = index->count;
+	for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		struct sc_card_driver *driver = ctx->card_drivers[i];
+		struct sc_atr_table *table = builtin_atrs(driver);
+		unsigned int j;
+
+		for (j = 0; table != NULL && table[j].atr != NULL; j++)
+			atr_index_add(ctx, index, driver, &table[j], j, 1);
+	}
+	nbuiltin = index->count - nbuiltin;
+	sc_log(ctx, "ATR index: %lu configured and %lu built-in ATR(s)",
+			(unsigned long) (index->count - nbuiltin), (unsigned long) nbuiltin);
+	return SC_SUCCESS;
+}
+
+void _sc_free_atr_index(sc_context_t *ctx)
+{
+	if (ctx->atr_index == NULL)
+		return;
+	if (ctx->atr_index->entries != NULL)
+		free(ctx->atr_index->entries);
+	free(ctx->atr_index);
+	ctx->atr_index = NULL;
+}
+
+static int atr_index_match(struct sc_atr_index_entry *entry, struct sc_atr *atr)
+{
+	size_t j;
+
+	if (entry->len != atr->len)
+		return 0;
+	for (j = 0; j < entry->len; j++)
+		if ((atr->value[j] & entry->mask[j]) != (entry->atr[j] & entry->mask[j]))
+			return 0;
+	return 1;
+}
+
+/* Returns the first configured ATR entry matching the card, in card driver order */
+static struct sc_atr_index_entry *atr_index_find(sc_context_t *ctx, struct sc_atr *atr)
+{
+	struct sc_atr_index *index = ctx->atr_index;
+	size_t i;
+
+	if (index == NULL)
+		return NULL;
+	for (i = 0; i < index->count; i++) {
+		struct sc_atr_index_entry *entry = &index->entries[i];
+
+		if (entry->builtin || !strcmp(entry->driver->short_name, "default"))
+			continue;
+		if (atr_index_match(entry, atr))
+			return entry;
+	}
+	return NULL;
+}
+
+/* Stores the drivers listing the ATR in their built-in table, in card
+ * driver order, and returns their number */
+static size_t atr_index_claims(sc_context_t *ctx, struct sc_atr *atr,
+		struct sc_card_driver **drivers, size_t max)
+{
+	struct sc_atr_index *index = ctx->atr_index;
+	size_t i, n = 0;
+	int k;
+
+	if (index == NULL)
+		return 0;
+	for (k = 0; ctx->card_drivers[k] != NULL && n < max; k++) {
+		for (i = 0; i < index->count; i++) {
+			struct sc_atr_index_entry *entry = &index->entries[i];
+
+			if (entry->builtin && entry->driver == ctx->card_drivers[k]
+					&& atr_index_match(entry, atr)) {
+				drivers[n++] = entry->driver;
+				break;
+			}
+		}
+	}
+	return n;
+}
+
+/*
+ * Only a driver that lists the ATR in its own ATR table is remembered.
+ * Drivers that matched by probing the card (and the 'default' driver)
+ * are not: the card must go through the full matching to find out which
+ * applet it carries.
+ */
+static int atr_memo_allowed(sc_context_t *ctx, struct sc_atr *atr, struct sc_card_driver *driver)
+{
+	struct sc_atr_index *index = ctx->atr_index;
+	size_t i;
+
+	if (index == NULL || !strcmp(driver->short_name, "default"))
+		return 0;
+	for (i = 0; i < index->count; i++) {
+		struct sc_atr_index_entry *entry = &index->entries[i];
+
+		if (entry->driver == driver && atr_index_match(entry, atr))
+			return 1;
+	}
+	return 0;
+}
+
+static struct sc_card_driver *atr_memo_find(sc_context_t *ctx, struct sc_atr *atr)
+{
+	struct sc_atr_index *index = ctx->atr_index;
+	struct sc_card_driver *driver = NULL;
+	unsigned int i;
+
+	if (index == NULL || !ctx->use_atr_memo)
+		return NULL;
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (i = 0; i < SC_ATR_MEMO_SIZE; i++) {
+		struct sc_atr_memo *memo = &index->memo[i];
+
+		if (memo->driver != NULL && memo->len == atr->len
+				&& !memcmp(memo->atr, atr->value, atr->len)) {
+			driver = memo->driver;
+			break;
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+	/* the list may have been written by another version */
+	if (driver != NULL && !atr_memo_allowed(ctx, atr, driver))
+		driver = NULL;
+	return driver;
+}
+
+static void atr_memo_update(sc_context_t *ctx, struct sc_atr *atr, struct sc_card_driver *driver)
+{
+	struct sc_atr_index *index = ctx->atr_index;
+	struct sc_atr_memo *memo = NULL;
+	unsigned int i;
+
+	if (index == NULL || !ctx->use_atr_memo || atr->len == 0)
+		return;
+	if (!atr_memo_allowed(ctx, atr, driver)) {
+		sc_log(ctx, "driver '%s' not remembered for this ATR", driver->short_name);
+		return;
+	}
+	sc_mutex_lock(ctx, ctx->mutex);
+	for (i = 0; i < SC_ATR_MEMO_SIZE; i++) {
+		if (index->memo[i].driver != NULL && index->memo[i].len == atr->len
+				&& !memcmp(index->memo[i].atr, atr->value, atr->len)) {
+			memo = &index->memo[i];
+			break;
+		}
+	}
+	if (memo == NULL) {
+		memo = &index->memo[index->memo_next];
+		index->memo_next = (index->memo_next + 1) % SC_ATR_MEMO_SIZE;
+	}
+	memcpy(memo->atr, atr->value, atr->len);
+	memo->len = atr->len;
+	memo->driver = driver;
+	atr_memo_save(ctx, index);
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
 
 scconf_block *sc_get_conf_block(sc_context_t *ctx, const char *name1, const char *name2, int priority)
 {
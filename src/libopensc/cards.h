@@ -192,9 +192,13 @@ enum {
 
 	/* SmartCard-HSM */
 	SC_CARD_TYPE_SC_HSM = 26000,
+
+	/* Cards emulated by the virtual reader */
+	SC_CARD_TYPE_EMULATED = 27000,
 };
 
 extern sc_card_driver_t *sc_get_default_driver(void);
+extern sc_card_driver_t *sc_get_emulated_driver(void);
 extern sc_card_driver_t *sc_get_cardos_driver(void);
 extern sc_card_driver_t *sc_get_cryptoflex_driver(void);
 extern sc_card_driver_t *sc_get_cyberflex_driver(void);
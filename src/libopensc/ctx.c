@@ -35,6 +35,7 @@
 
 #include "common/libscdl.h"
 #include "internal.h"
+#include "asn1.h"
 
 int _sc_add_reader(sc_context_t *ctx, sc_reader_t *reader)
 {
@@ -62,6 +63,8 @@ struct _sc_driver_entry {
 };
 
 static const struct _sc_driver_entry internal_card_drivers[] = {
+	/* Cards of the virtual reader, matched by the reader, not the ATR */
+	{ "emulated",	(void *(*)(void)) sc_get_emulated_driver },
 	{ "cardos",	(void *(*)(void)) sc_get_cardos_driver },
 	{ "flex",	(void *(*)(void)) sc_get_cryptoflex_driver },
 	{ "cyberflex",	(void *(*)(void)) sc_get_cyberflex_driver },
@@ -117,6 +120,8 @@ struct _sc_ctx_options {
 	struct _sc_driver_entry cdrv[SC_MAX_CARD_DRIVERS];
 	int ccount;
 	char *forced_card_driver;
+	int debug_async;
+	long debug_file_max_size;
 };
 
 
@@ -183,6 +188,7 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	ctx->debug_file = stderr;
 	ctx->paranoid_memory = 0;
 	ctx->enable_default_driver = 0;
+	ctx->use_atr_memo = 0;
 
 #ifdef __APPLE__
 	/* Override the default debug log for OpenSC.tokend to be different from PKCS#11.
@@ -200,6 +206,8 @@ static void set_defaults(sc_context_t *ctx, struct _sc_ctx_options *opts)
  */
 int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename)
 {
+	sc_log_sink_stop(ctx);
+
 	/* Close any existing handles */
 	if (ctx->debug_file && (ctx->debug_file != stderr && ctx->debug_file != stdout))   {
 		fclose(ctx->debug_file);
@@ -253,12 +261,19 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 		sc_ctx_log_to_file(ctx, val);
 	}
 
+	opts->debug_async = scconf_get_bool(block, "debug_async", opts->debug_async);
+	opts->debug_file_max_size = scconf_get_int(block, "debug_file_max_size",
+			opts->debug_file_max_size / 1024) * 1024L;
+
 	ctx->paranoid_memory = scconf_get_bool (block, "paranoid-memory",
 		ctx->paranoid_memory);
 
 	ctx->enable_default_driver = scconf_get_bool (block, "enable_default_driver",
 			ctx->enable_default_driver);
 
+	ctx->use_atr_memo = scconf_get_bool (block, "use_atr_memo",
+			ctx->use_atr_memo);
+
 	val = scconf_get_str(block, "force_card_driver", NULL);
 	if (val) {
 		if (opts->forced_card_driver)
@@ -675,6 +690,7 @@ int sc_context_repair(sc_context_t **ctx_out)
 	 * card drivers - so rebuild the ATR's
 	 */
 	load_card_atrs(*ctx_out);
+	_sc_build_atr_index(*ctx_out);
 
 	/* TODO: May need to re-open any card driver DLL's */
 
@@ -685,6 +701,7 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 {
 	sc_context_t		*ctx;
 	struct _sc_ctx_options	opts;
+	scconf_block		*conf_block;
 	int			r;
 
 	if (ctx_out == NULL || parm == NULL)
@@ -716,8 +733,15 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 		sc_release_context(ctx);
 		return r;
 	}
+	r = sc_stats_init(ctx);
+	if (r != SC_SUCCESS) {
+		sc_release_context(ctx);
+		return r;
+	}
 
 	process_config_file(ctx, &opts);
+	if (ctx->debug && opts.debug_async)
+		sc_log_sink_start(ctx, opts.debug_file_max_size);
 	sc_log(ctx, "==================================="); /* first thing in the log */
 	sc_log(ctx, "opensc version: %s", sc_get_version());
 
@@ -733,6 +757,11 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 #elif defined(ENABLE_OPENCT)
 	ctx->reader_driver = sc_get_openct_driver();
 #endif
+	/* scripted cards replace the hardware readers when enabled */
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "virtual", 1);
+	if (ctx->reader_driver == NULL
+			|| (conf_block != NULL && scconf_get_bool(conf_block, "enable", 0)))
+		ctx->reader_driver = sc_get_virtual_driver();
 
 	load_reader_driver_options(ctx);
 	r = ctx->reader_driver->ops->init(ctx);
@@ -743,6 +772,7 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 
 	load_card_drivers(ctx, &opts);
 	load_card_atrs(ctx);
+	_sc_build_atr_index(ctx);
 	if (opts.forced_card_driver) {
 		/* FIXME: check return value? */
 		sc_set_card_driver(ctx, opts.forced_card_driver);
@@ -800,6 +830,7 @@ int sc_release_context(sc_context_t *ctx)
 	if (ctx->reader_driver->ops->finish != NULL)
 		ctx->reader_driver->ops->finish(ctx);
 
+	_sc_free_atr_index(ctx);
 	for (i = 0; ctx->card_drivers[i]; i++) {
 		struct sc_card_driver *drv = ctx->card_drivers[i];
 
@@ -810,6 +841,8 @@ int sc_release_context(sc_context_t *ctx)
 	}
 	if (ctx->preferred_language != NULL)
 		free(ctx->preferred_language);
+	sc_stats_release(ctx);
+	sc_asn1_free_programs(ctx);
 	if (ctx->mutex != NULL) {
 		int r = sc_mutex_destroy(ctx, ctx->mutex);
 		if (r != SC_SUCCESS) {
@@ -819,6 +852,7 @@ int sc_release_context(sc_context_t *ctx)
 	}
 	if (ctx->conf != NULL)
 		scconf_free(ctx->conf);
+	sc_log_sink_stop(ctx);
 	if (ctx->debug_file && (ctx->debug_file != stdout && ctx->debug_file != stderr))
 		fclose(ctx->debug_file);
 	if (ctx->debug_filename != NULL)
@@ -72,6 +72,27 @@ struct sc_atr_table {
 	scconf_block *card_atr;
 };
 
+/* Asynchronous debug output, see log.c. max_size > 0 enables rotation */
+int sc_log_sink_start(struct sc_context *ctx, long max_size);
+void sc_log_sink_stop(struct sc_context *ctx);
+
+/* APDU statistics, see stats.c */
+enum {
+	SC_STATS_GET_RESPONSE,
+	SC_STATS_RESEND_6C,
+	SC_STATS_CHAINED,
+	SC_STATS_SM_WRAP,
+	SC_STATS_SM_UNWRAP,
+	SC_STATS_LOCK_WAIT
+};
+int sc_stats_init(struct sc_context *ctx);
+void sc_stats_release(struct sc_context *ctx);
+unsigned long long sc_stats_clock(void);
+/* Counts one exchange with the reader; ins is that of the plain command */
+void sc_stats_transmit(struct sc_card *card, unsigned int ins,
+		size_t sent, size_t received, unsigned long long usec);
+void sc_stats_count(struct sc_context *ctx, int event, unsigned long long usec);
+
 /* Internal use only */
 int _sc_add_reader(struct sc_context *ctx, struct sc_reader *reader);
 int _sc_delete_reader(struct sc_context *ctx, struct sc_reader *reader);
@@ -81,6 +102,11 @@ int _sc_parse_atr(struct sc_reader *reader);
 int _sc_add_atr(struct sc_context *ctx, struct sc_card_driver *driver, struct sc_atr_table *src);
 int _sc_free_atr(struct sc_context *ctx, struct sc_card_driver *driver);
 
+/* (Re)compile the card drivers' ATR tables into the context's ATR index.
+ * Called after the card_atr blocks have been loaded. */
+int _sc_build_atr_index(struct sc_context *ctx);
+void _sc_free_atr_index(struct sc_context *ctx);
+
 /**
  * Convert an unsigned long into 4 bytes in big endian order
  * @param  buf   the byte array for the result, should be 4 bytes long
@@ -123,6 +149,12 @@ int _sc_card_add_rsa_alg(struct sc_card *card, unsigned int key_length,
 int _sc_card_add_ec_alg(struct sc_card *card, unsigned int key_length,
 			 unsigned long flags, unsigned long ext_flags);
 
+/* Returns 1 if the security environment 'env' is still set on the card
+ * after selecting 'path' (may be NULL), 0 otherwise. Only cards with
+ * SC_CARD_CAP_REUSE_SEC_ENV keep track of it. */
+int _sc_sec_env_is_current(struct sc_card *card, const struct sc_path *path,
+			 const struct sc_security_env *env);
+
 /********************************************************************/
 /*                 pkcs1 padding/encoding functions                 */
 /********************************************************************/
@@ -246,6 +278,7 @@ extern struct sc_reader_driver *sc_get_pcsc_driver(void);
 extern struct sc_reader_driver *sc_get_ctapi_driver(void);
 extern struct sc_reader_driver *sc_get_openct_driver(void);
 extern struct sc_reader_driver *sc_get_cardmod_driver(void);
+extern struct sc_reader_driver *sc_get_virtual_driver(void);
 
 #ifdef __cplusplus
 }
@@ -109,30 +109,95 @@ iso7816_check_sw(struct sc_card *card, unsigned int sw1, unsigned int sw2)
 }
 
 
+/* Offset data object of the odd instruction READ/UPDATE BINARY */
+static size_t
+iso7816_encode_offset(unsigned int idx, u8 *out)
+{
+	out[0] = 0x54;
+	if (idx > 0xFFFF) {
+		out[1] = 3;
+		out[2] = (idx >> 16) & 0xFF;
+		out[3] = (idx >> 8) & 0xFF;
+		out[4] = idx & 0xFF;
+		return 5;
+	}
+	out[1] = 2;
+	out[2] = (idx >> 8) & 0xFF;
+	out[3] = idx & 0xFF;
+	return 4;
+}
+
+
+/* READ BINARY with odd INS (B1) for offsets beyond 0x7FFF */
+static int
+iso7816_read_binary_odd(struct sc_card *card, unsigned int idx, u8 *buf, size_t count)
+{
+	struct sc_context *ctx = card->ctx;
+	struct sc_apdu apdu;
+	u8 sbuf[5], *rbuf;
+	const u8 *data;
+	size_t rbuflen, datalen;
+	int r;
+
+	/* Room for the discretionary data object header (53 82 xx xx) */
+	rbuflen = count + 4;
+	rbuf = malloc(rbuflen);
+	if (rbuf == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_4, 0xB1, 0x00, 0x00);
+	apdu.lc = apdu.datalen = iso7816_encode_offset(idx, sbuf);
+	apdu.data = sbuf;
+	apdu.le = rbuflen > sc_get_max_recv_size(card) ? sc_get_max_recv_size(card) : rbuflen;
+	apdu.resplen = rbuflen;
+	apdu.resp = rbuf;
+
+	r = sc_transmit_apdu(card, &apdu);
+	if (r < 0)
+		goto out;
+	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
+	if (r < 0 && r != SC_ERROR_FILE_END_REACHED)
+		goto out;
+
+	data = sc_asn1_find_tag(ctx, rbuf, apdu.resplen, 0x53, &datalen);
+	if (data == NULL) {
+		r = apdu.resplen ? SC_ERROR_INVALID_DATA : r;
+		goto out;
+	}
+	if (datalen > count)
+		datalen = count;
+	memcpy(buf, data, datalen);
+	r = datalen;
+out:
+	free(rbuf);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+
 static int
 iso7816_read_binary(struct sc_card *card, unsigned int idx, u8 *buf, size_t count, unsigned long flags)
 {
 	struct sc_context *ctx = card->ctx;
 	struct sc_apdu apdu;
-	u8 recvbuf[SC_MAX_APDU_BUFFER_SIZE];
 	int r;
 
+	assert(count <= sc_get_max_recv_size(card));
 	if (idx > 0x7fff) {
-		sc_log(ctx, "invalid EF offset: 0x%X > 0x7FFF", idx);
-		return SC_ERROR_OFFSET_TOO_LARGE;
+		sc_log(ctx, "EF offset 0x%X > 0x7FFF, using odd READ BINARY", idx);
+		r = iso7816_read_binary_odd(card, idx, buf, count);
+		LOG_FUNC_RETURN(ctx, r);
 	}
 
-	assert(count <= (card->max_recv_size > 0 ? card->max_recv_size : 256));
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_2_SHORT, 0xB0, (idx >> 8) & 0x7F, idx & 0xFF);
+	/* Becomes an extended APDU for Le > 256 */
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_2, 0xB0, (idx >> 8) & 0x7F, idx & 0xFF);
 	apdu.le = count;
 	apdu.resplen = count;
-	apdu.resp = recvbuf;
+	apdu.resp = buf;
 
 	r = sc_transmit_apdu(card, &apdu);
 	LOG_TEST_RET(ctx, r, "APDU transmit failed");
 	if (apdu.resplen == 0)
 		LOG_FUNC_RETURN(ctx, sc_check_sw(card, apdu.sw1, apdu.sw2));
-	memcpy(buf, recvbuf, apdu.resplen);
 
 	r =  sc_check_sw(card, apdu.sw1, apdu.sw2);
 	if (r == SC_ERROR_FILE_END_REACHED)
@@ -273,14 +338,14 @@ iso7816_write_binary(struct sc_card *card,
 	struct sc_apdu apdu;
 	int r;
 
-	assert(count <= (card->max_send_size > 0 ? card->max_send_size : 255));
+	assert(count <= sc_get_max_send_size(card));
 
 	if (idx > 0x7fff) {
 		sc_log(card->ctx, "invalid EF offset: 0x%X > 0x7FFF", idx);
 		return SC_ERROR_OFFSET_TOO_LARGE;
 	}
 
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0xD0,
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_3, 0xD0,
 		       (idx >> 8) & 0x7F, idx & 0xFF);
 	apdu.lc = count;
 	apdu.datalen = count;
@@ -295,6 +360,56 @@ iso7816_write_binary(struct sc_card *card,
 }
 
 
+/* UPDATE BINARY with odd INS (D7) for offsets beyond 0x7FFF */
+static int
+iso7816_update_binary_odd(struct sc_card *card,
+		unsigned int idx, const u8 *buf, size_t count)
+{
+	struct sc_apdu apdu;
+	u8 *sbuf, *p;
+	size_t len, max_data;
+	int r;
+
+	/* Offset and discretionary data object headers take up to 9 bytes */
+	max_data = sc_get_max_send_size(card) - 9;
+	if (count > max_data)
+		count = max_data;
+
+	/* Offset data object followed by the discretionary data object */
+	sbuf = malloc(count + 5 + 4);
+	if (sbuf == NULL)
+		LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+	len = iso7816_encode_offset(idx, sbuf);
+	p = sbuf + len;
+	*p++ = 0x53;
+	if (count < 0x80) {
+		*p++ = count;
+	} else if (count < 0x100) {
+		*p++ = 0x81;
+		*p++ = count;
+	} else {
+		*p++ = 0x82;
+		*p++ = (count >> 8) & 0xFF;
+		*p++ = count & 0xFF;
+	}
+	memcpy(p, buf, count);
+	len = p + count - sbuf;
+
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_3, 0xD7, 0x00, 0x00);
+	apdu.lc = len;
+	apdu.datalen = len;
+	apdu.data = sbuf;
+
+	r = sc_transmit_apdu(card, &apdu);
+	free(sbuf);
+	LOG_TEST_RET(card->ctx, r, "APDU transmit failed");
+	r = sc_check_sw(card, apdu.sw1, apdu.sw2);
+	LOG_TEST_RET(card->ctx, r, "Card returned error");
+
+	LOG_FUNC_RETURN(card->ctx, count);
+}
+
+
 static int
 iso7816_update_binary(struct sc_card *card,
 		unsigned int idx, const u8 *buf, size_t count, unsigned long flags)
@@ -302,14 +417,22 @@ iso7816_update_binary(struct sc_card *card,
 	struct sc_apdu apdu;
 	int r;
 
-	assert(count <= (card->max_send_size > 0 ? card->max_send_size : 255));
+	assert(count <= sc_get_max_send_size(card));
 
 	if (idx > 0x7fff) {
-		sc_log(card->ctx, "invalid EF offset: 0x%X > 0x7FFF", idx);
-		return SC_ERROR_OFFSET_TOO_LARGE;
+		size_t done = 0;
+
+		sc_log(card->ctx, "EF offset 0x%X > 0x7FFF, using odd UPDATE BINARY", idx);
+		while (done < count) {
+			r = iso7816_update_binary_odd(card, idx + done, buf + done, count - done);
+			LOG_TEST_RET(card->ctx, r, "Odd UPDATE BINARY failed");
+			done += r;
+		}
+		LOG_FUNC_RETURN(card->ctx, count);
 	}
 
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_3_SHORT, 0xD6, (idx >> 8) & 0x7F, idx & 0xFF);
+	/* Becomes an extended APDU for Lc > 255 */
+	sc_format_apdu(card, &apdu, SC_APDU_CASE_3, 0xD6, (idx >> 8) & 0x7F, idx & 0xFF);
 	apdu.lc = count;
 	apdu.datalen = count;
 	apdu.data = buf;
@@ -428,6 +551,133 @@ iso7816_process_fci(struct sc_card *card, struct sc_file *file,
 }
 
 
+/* Absolute path (starting with the MF) of the file 'in_path' refers to.
+ * Returns SC_ERROR_NOT_SUPPORTED if the path cannot be tracked. */
+static int
+iso7816_absolute_path(struct sc_card *card, const struct sc_path *in_path, struct sc_path *out)
+{
+	memset(out, 0, sizeof(*out));
+	out->type = SC_PATH_TYPE_PATH;
+	out->value[0] = 0x3F;
+	out->value[1] = 0x00;
+	out->len = 2;
+
+	switch (in_path->type) {
+	case SC_PATH_TYPE_PATH:
+		if (in_path->len < 2 || (in_path->len & 1))
+			return SC_ERROR_NOT_SUPPORTED;
+		if (memcmp(in_path->value, "\x3F\x00", 2) == 0)
+			out->len = 0;
+		if (out->len + in_path->len > SC_MAX_PATH_SIZE)
+			return SC_ERROR_NOT_SUPPORTED;
+		memcpy(out->value + out->len, in_path->value, in_path->len);
+		out->len += in_path->len;
+		return SC_SUCCESS;
+	case SC_PATH_TYPE_FILE_ID:
+		if (in_path->len != 2)
+			return SC_ERROR_NOT_SUPPORTED;
+		if (memcmp(in_path->value, "\x3F\x00", 2) == 0)
+			return SC_SUCCESS;
+		if (!card->cache.current_valid || card->cache.current_path.len < 2
+				|| card->cache.current_path.len + 2 > SC_MAX_PATH_SIZE)
+			return SC_ERROR_NOT_SUPPORTED;
+		*out = card->cache.current_path;
+		memcpy(out->value + out->len, in_path->value, 2);
+		out->len += 2;
+		return SC_SUCCESS;
+	default:
+		return SC_ERROR_NOT_SUPPORTED;
+	}
+}
+
+
+/* Returns SC_SUCCESS if the file 'path' is already selected, and a copy of
+ * its FCI in 'file_out' if requested and known */
+static int
+iso7816_select_cached(struct sc_card *card, const struct sc_path *path, struct sc_file **file_out)
+{
+	struct sc_card_cache *cache = &card->cache;
+
+	if (!cache->current_valid)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	if (sc_compare_path(&cache->current_path, path)) {
+		/* With an EF selected the DF has to be selected again,
+		 * or commands without a file reference would go to the EF */
+		if (cache->current_ef != NULL)
+			return SC_ERROR_FILE_NOT_FOUND;
+		if (file_out == NULL)
+			return SC_SUCCESS;
+		if (cache->current_df != NULL
+				&& sc_compare_path(&cache->current_df->path, path)) {
+			sc_file_dup(file_out, cache->current_df);
+			return *file_out ? SC_SUCCESS : SC_ERROR_OUT_OF_MEMORY;
+		}
+	}
+	else if (cache->current_ef != NULL && sc_compare_path(&cache->current_ef->path, path)) {
+		if (file_out == NULL)
+			return SC_SUCCESS;
+		sc_file_dup(file_out, cache->current_ef);
+		return *file_out ? SC_SUCCESS : SC_ERROR_OUT_OF_MEMORY;
+	}
+
+	return SC_ERROR_FILE_NOT_FOUND;
+}
+
+
+/* Record the file selected by 'path'; 'file' is its FCI or NULL if unknown */
+static void
+iso7816_select_update_cache(struct sc_card *card, const struct sc_path *path,
+		const struct sc_file *file, int by_fid)
+{
+	struct sc_card_cache *cache = &card->cache;
+	struct sc_path parent;
+
+	cache->current_valid = 0;
+	/* The DF/EF type is needed to know the current DF */
+	if (file == NULL || card->lock_count == 0)
+		return;
+	if (file->type != SC_FILE_TYPE_DF && file->type != SC_FILE_TYPE_WORKING_EF
+			&& file->type != SC_FILE_TYPE_INTERNAL_EF)
+		return;
+	/* A DF selected by FID could be the parent as well as a child */
+	if (by_fid && file->type == SC_FILE_TYPE_DF && path->len != 2)
+		return;
+
+	if (cache->current_ef) {
+		sc_file_free(cache->current_ef);
+		cache->current_ef = NULL;
+	}
+
+	if (file->type == SC_FILE_TYPE_DF) {
+		if (cache->current_df)
+			sc_file_free(cache->current_df);
+		sc_file_dup(&cache->current_df, file);
+		if (cache->current_df == NULL)
+			return;
+		cache->current_df->path = *path;
+		cache->current_path = *path;
+	}
+	else {
+		if (path->len < 4)
+			return;
+		parent = *path;
+		parent.len -= 2;
+		if (cache->current_df && !sc_compare_path(&cache->current_df->path, &parent)) {
+			sc_file_free(cache->current_df);
+			cache->current_df = NULL;
+		}
+		sc_file_dup(&cache->current_ef, file);
+		if (cache->current_ef == NULL)
+			return;
+		cache->current_ef->path = *path;
+		cache->current_path = parent;
+	}
+
+	cache->current_valid = 1;
+}
+
+
 static int
 iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct sc_file **file_out)
 {
@@ -435,17 +685,38 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 	struct sc_apdu apdu;
 	unsigned char buf[SC_MAX_APDU_BUFFER_SIZE];
 	unsigned char pathbuf[SC_MAX_PATH_SIZE], *path = pathbuf;
-	int r, pathlen;
+	int r, pathlen, tracked, by_fid;
 	struct sc_file *file = NULL;
+	struct sc_path abs_path;
 
 	assert(card != NULL && in_path != NULL);
 	ctx = card->ctx;
 	memcpy(path, in_path->value, in_path->len);
 	pathlen = in_path->len;
 
+	tracked = iso7816_absolute_path(card, in_path, &abs_path) == SC_SUCCESS;
+	if (tracked) {
+		r = iso7816_select_cached(card, &abs_path, file_out);
+		if (r != SC_ERROR_FILE_NOT_FOUND) {
+			sc_log(ctx, "%s is already selected", sc_print_path(&abs_path));
+			LOG_FUNC_RETURN(ctx, r);
+		}
+	}
+	by_fid = in_path->type == SC_PATH_TYPE_FILE_ID;
+
 	sc_format_apdu(card, &apdu, SC_APDU_CASE_4_SHORT, 0xA4, 0, 0);
 
-	switch (in_path->type) {
+	/* Select a child of the current DF by its file ID */
+	if (tracked && card->cache.current_valid && in_path->type == SC_PATH_TYPE_PATH
+			&& abs_path.len == card->cache.current_path.len + 2
+			&& sc_compare_path_prefix(&card->cache.current_path, &abs_path)) {
+		sc_log(ctx, "select %s relative to the current DF", sc_print_path(&abs_path));
+		memcpy(path, abs_path.value + abs_path.len - 2, 2);
+		pathlen = 2;
+		apdu.p1 = 0;
+		by_fid = 1;
+	}
+	else switch (in_path->type) {
 	case SC_PATH_TYPE_FILE_ID:
 		apdu.p1 = 0;
 		if (pathlen != 2)
@@ -502,7 +773,9 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 				r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 		}
 		if (apdu.sw1 == 0x61)
-			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+			r = SC_SUCCESS;
+		if (r == SC_SUCCESS && tracked)
+			iso7816_select_update_cache(card, &abs_path, NULL, by_fid);
 		LOG_FUNC_RETURN(ctx, r);
 	}
 
@@ -525,6 +798,8 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 		}
 		if ((size_t)apdu.resp[1] + 2 <= apdu.resplen)
 			card->ops->process_fci(card, file, apdu.resp+2, apdu.resp[1]);
+		if (tracked)
+			iso7816_select_update_cache(card, &abs_path, file, by_fid);
 		*file_out = file;
 		break;
 	case 0x00: /* proprietary coding */
@@ -542,27 +817,47 @@ iso7816_get_challenge(struct sc_card *card, u8 *rnd, size_t len)
 {
 	int r;
 	struct sc_apdu apdu;
-	u8 buf[10];
+	u8 buf[SC_MAX_CHALLENGE_SIZE];
+	size_t max = sc_get_max_challenge_size(card);
 
 	if (!rnd && len)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
-	sc_format_apdu(card, &apdu, SC_APDU_CASE_2_SHORT, 0x84, 0x00, 0x00);
-	apdu.le = 8;
-	apdu.resp = buf;
-	apdu.resplen = 8;	/* include SW's */
-
 	while (len > 0) {
-		size_t n = len > 8 ? 8 : len;
+		size_t n = len > max ? max : len;
+		size_t le = n < 8 ? 8 : n;
+
+		sc_format_apdu(card, &apdu, SC_APDU_CASE_2_SHORT, 0x84, 0x00, 0x00);
+		apdu.le = le;
+		apdu.resp = buf;
+		apdu.resplen = le;
 
 		r = sc_transmit_apdu(card, &apdu);
 		LOG_TEST_RET(card->ctx, r, "APDU transmit failed");
-		if (apdu.resplen != 8)
-			return sc_check_sw(card, apdu.sw1, apdu.sw2);
-		memcpy(rnd, apdu.resp, n);
+		r = sc_check_sw(card, apdu.sw1, apdu.sw2);
+		if (r != SC_SUCCESS && le > 8) {
+			/* the configured length is too long for this card */
+			sc_log(card->ctx, "GET CHALLENGE of %lu bytes failed, using 8 bytes", (unsigned long) le);
+			card->max_challenge_size = max = 8;
+			continue;
+		}
+		if (r == SC_SUCCESS && apdu.resplen == 0)
+			r = SC_ERROR_INVALID_DATA;
+		if (r != SC_SUCCESS)
+			sc_mem_clear(buf, sizeof(buf));
+		LOG_TEST_RET(card->ctx, r, "GET CHALLENGE failed");
+
+		if (apdu.resplen < le && le > 8) {
+			/* the card returned less, e.g. after 6Cxx: remember its limit */
+			card->max_challenge_size = max = apdu.resplen < 8 ? 8 : apdu.resplen;
+		}
+		if (n > apdu.resplen)
+			n = apdu.resplen;
+		memcpy(rnd, buf, n);
 		len -= n;
 		rnd += n;
 	}
+	sc_mem_clear(buf, sizeof(buf));
 	return 0;
 }
 
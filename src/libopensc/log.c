@@ -38,10 +38,15 @@
 #endif
 #ifdef HAVE_PTHREAD
 #include <pthread.h>
+#include <sched.h>
 #endif
 
 #include "internal.h"
 
+#if defined(HAVE_PTHREAD) && defined(__GNUC__) && !defined(_WIN32)
+#define ENABLE_LOG_SINK
+#endif
+
 static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, va_list args);
 
 void sc_do_log(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, ...)
@@ -58,6 +63,287 @@ void sc_do_log_noframe(sc_context_t *ctx, int level, const char *format, va_list
 	sc_do_log_va(ctx, level, NULL, 0, NULL, format, args);
 }
 
+#ifdef ENABLE_LOG_SINK
+/*
+ * Asynchronous log sink
+ *
+ * With 'debug_async' set, formatted lines are handed to a background
+ * writer thread through a bounded ring of small slots, so that logging
+ * threads never wait for the disk. A producer reserves as many
+ * consecutive slots as its line needs with a compare-and-swap on the
+ * tail, copies the line and publishes each slot through its sequence
+ * number; the writer consumes the slots in order. When the ring is full
+ * the line is dropped and counted, and the writer reports how many lines
+ * were lost.
+ *
+ * The writer sleeps on a condition variable while the ring is empty.
+ * It raises 'idle' under the mutex and looks at the ring once more
+ * before it waits; a producer that sees 'idle' after publishing its
+ * line takes the mutex to signal, so a wakeup can not get lost.
+ *
+ * Producers count themselves in ctx->log_sink_users before they load
+ * ctx->log_sink, and leave when they are done with the sink.
+ * sc_log_sink_stop() clears ctx->log_sink and waits for the count to
+ * drop to zero before it frees the sink: a producer that comes later
+ * finds the pointer cleared. There is no lock on the logging path.
+ */
+#define LOG_SINK_SLOTS		2048	/* power of two */
+#define LOG_SINK_SLOT_SIZE	496
+#define LOG_SINK_MAX_LINE	4096	/* size of the sc_do_log_va() buffer */
+
+struct sc_log_slot {
+	size_t seq;
+	size_t len;
+	int last;		/* last slot of a line */
+	char data[LOG_SINK_SLOT_SIZE];
+};
+
+struct sc_log_sink {
+	struct sc_log_slot *slots;
+	size_t tail;		/* next slot to reserve, shared by the producers */
+	size_t head;		/* next slot to write, writer thread only */
+	unsigned long dropped;
+	int idle;		/* writer is waiting for lines */
+	int stop;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+
+	FILE *file;
+	char *filename;		/* NULL if the output can not be rotated */
+	long max_size;
+	long size;
+
+	pid_t pid;
+	pthread_t thread;
+};
+
+/* Returns 0 if the line was queued or dropped, -1 if it has to be
+ * written directly */
+static int sc_log_sink_push(struct sc_log_sink *sink, const char *buf, size_t len)
+{
+	size_t count = (len + LOG_SINK_SLOT_SIZE - 1) / LOG_SINK_SLOT_SIZE;
+	size_t pos, seq, i;
+
+	if (sink->pid != getpid())
+		return -1;	/* forked: the writer thread is gone */
+	if (len == 0 || len > LOG_SINK_MAX_LINE)
+		return -1;
+
+	pos = __atomic_load_n(&sink->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		/* Slots are freed in order, so the range is free
+		 * when its last slot is */
+		struct sc_log_slot *slot = &sink->slots[(pos + count - 1) & (LOG_SINK_SLOTS - 1)];
+
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos + count - 1) {
+			if (__atomic_compare_exchange_n(&sink->tail, &pos, pos + count, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if ((long)(seq - (pos + count - 1)) < 0) {
+			__atomic_add_fetch(&sink->dropped, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+		else {
+			pos = __atomic_load_n(&sink->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		struct sc_log_slot *slot = &sink->slots[(pos + i) & (LOG_SINK_SLOTS - 1)];
+		size_t n = len > LOG_SINK_SLOT_SIZE ? LOG_SINK_SLOT_SIZE : len;
+
+		memcpy(slot->data, buf, n);
+		slot->len = n;
+		slot->last = (i == count - 1);
+		buf += n;
+		len -= n;
+		__atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+	}
+
+	/* Pairs with the store of 'idle' in sc_log_sink_wait(): either
+	 * the writer sees the line or we see the writer idle. The fence
+	 * keeps the load below from moving before the release stores. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sink->idle, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&sink->lock);
+		pthread_cond_signal(&sink->wakeup);
+		pthread_mutex_unlock(&sink->lock);
+	}
+	return 0;
+}
+
+static void sc_log_sink_write(struct sc_log_sink *sink, const char *buf, size_t len)
+{
+	if (sink->filename && sink->max_size > 0 && sink->size + (long)len > sink->max_size) {
+		size_t n = strlen(sink->filename) + 3;
+		char *old = malloc(n);
+		FILE *f = NULL;
+		int rotated = 0;
+
+		/* The new file is put under the descriptor of the current
+		 * stream, so that ctx->debug_file stays valid whatever
+		 * happens. If that fails, keep writing to the old file and
+		 * stop rotating. */
+		fflush(sink->file);
+		if (old != NULL) {
+			snprintf(old, n, "%s.1", sink->filename);
+			if (rename(sink->filename, old) == 0) {
+				f = fopen(sink->filename, "w");
+				if (f == NULL || dup2(fileno(f), fileno(sink->file)) < 0)
+					rename(old, sink->filename);
+				else
+					rotated = 1;
+				if (f != NULL)
+					fclose(f);
+			}
+			free(old);
+		}
+		if (rotated)
+			sink->size = 0;
+		else
+			sink->max_size = 0;
+	}
+	fwrite(buf, 1, len, sink->file);
+	sink->size += len;
+}
+
+static void sc_log_sink_wait(struct sc_log_sink *sink, struct sc_log_slot *slot)
+{
+	pthread_mutex_lock(&sink->lock);
+	__atomic_store_n(&sink->idle, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != sink->head + 1
+			&& !__atomic_load_n(&sink->stop, __ATOMIC_ACQUIRE))
+		pthread_cond_wait(&sink->wakeup, &sink->lock);
+	__atomic_store_n(&sink->idle, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&sink->lock);
+}
+
+static void *sc_log_sink_thread(void *arg)
+{
+	struct sc_log_sink *sink = (struct sc_log_sink *) arg;
+	size_t start = 0;	/* first slot of the line being collected */
+	char line[LOG_SINK_MAX_LINE];
+	size_t line_len = 0;
+
+	for (;;) {
+		struct sc_log_slot *slot = &sink->slots[sink->head & (LOG_SINK_SLOTS - 1)];
+		unsigned long dropped;
+
+		dropped = __atomic_exchange_n(&sink->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped) {
+			char msg[64];
+			int n = snprintf(msg, sizeof(msg), "*** %lu log messages dropped ***\n", dropped);
+
+			sc_log_sink_write(sink, msg, n);
+		}
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != sink->head + 1) {
+			/* ring empty */
+			fflush(sink->file);
+			if (__atomic_load_n(&sink->stop, __ATOMIC_ACQUIRE) && start == sink->head)
+				break;
+			sc_log_sink_wait(sink, slot);
+			continue;
+		}
+
+		memcpy(line + line_len, slot->data, slot->len);
+		line_len += slot->len;
+		sink->head++;
+		if (slot->last) {
+			sc_log_sink_write(sink, line, line_len);
+			line_len = 0;
+			/* release the slots of the line */
+			for (; start != sink->head; start++)
+				__atomic_store_n(&sink->slots[start & (LOG_SINK_SLOTS - 1)].seq,
+						start + LOG_SINK_SLOTS, __ATOMIC_RELEASE);
+		}
+	}
+	return NULL;
+}
+
+int sc_log_sink_start(sc_context_t *ctx, long max_size)
+{
+	struct sc_log_sink *sink;
+	size_t i;
+
+	if (ctx->log_sink != NULL)
+		return SC_SUCCESS;
+	if (ctx->debug_file == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	sink = calloc(1, sizeof(struct sc_log_sink));
+	if (sink == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	sink->slots = calloc(LOG_SINK_SLOTS, sizeof(struct sc_log_slot));
+	if (sink->slots == NULL) {
+		free(sink);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	for (i = 0; i < LOG_SINK_SLOTS; i++)
+		sink->slots[i].seq = i;
+
+	sink->file = ctx->debug_file;
+	if (ctx->debug_filename && ctx->debug_file != stdout && ctx->debug_file != stderr) {
+		sink->filename = strdup(ctx->debug_filename);
+		fseek(sink->file, 0, SEEK_END);
+		sink->size = ftell(sink->file);
+	}
+	sink->max_size = max_size;
+	sink->pid = getpid();
+	pthread_mutex_init(&sink->lock, NULL);
+	pthread_cond_init(&sink->wakeup, NULL);
+
+	if (pthread_create(&sink->thread, NULL, sc_log_sink_thread, sink) != 0) {
+		pthread_cond_destroy(&sink->wakeup);
+		pthread_mutex_destroy(&sink->lock);
+		free(sink->filename);
+		free(sink->slots);
+		free(sink);
+		return SC_ERROR_INTERNAL;
+	}
+	__atomic_store_n(&ctx->log_sink, sink, __ATOMIC_RELEASE);
+	return SC_SUCCESS;
+}
+
+void sc_log_sink_stop(sc_context_t *ctx)
+{
+	struct sc_log_sink *sink = ctx->log_sink;
+
+	if (sink == NULL)
+		return;
+	/* wait for the producers that are still pushing lines */
+	__atomic_store_n(&ctx->log_sink, NULL, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&ctx->log_sink_users, __ATOMIC_SEQ_CST) != 0)
+		sched_yield();
+
+	if (sink->pid == getpid()) {
+		/* the writer drains the ring before it exits */
+		pthread_mutex_lock(&sink->lock);
+		__atomic_store_n(&sink->stop, 1, __ATOMIC_RELEASE);
+		pthread_cond_signal(&sink->wakeup);
+		pthread_mutex_unlock(&sink->lock);
+		pthread_join(sink->thread, NULL);
+		pthread_cond_destroy(&sink->wakeup);
+		pthread_mutex_destroy(&sink->lock);
+	}
+	free(sink->filename);
+	free(sink->slots);
+	free(sink);
+}
+#else
+int sc_log_sink_start(sc_context_t *ctx, long max_size)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+void sc_log_sink_stop(sc_context_t *ctx)
+{
+}
+#endif
+
 static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int line, const char *func, const char *format, va_list args)
 {
 	char	buf[4096], *p;
@@ -66,12 +352,12 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 #ifdef _WIN32
 	SYSTEMTIME st;
 #else
-	struct tm *tm;
+	struct tm tm;
 	struct timeval tv;
 	char time_string[40];
 #endif
 	FILE		*outf = NULL;
-	int		n;
+	size_t		n;
 
 	assert(ctx != NULL);
 
@@ -79,7 +365,7 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 		return;
 
 	p = buf;
-	left = sizeof(buf);
+	left = sizeof(buf) - 1;	/* room for the terminating newline */
 
 #ifdef _WIN32
 	GetLocalTime(&st);
@@ -89,8 +375,8 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 			st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
 #else
 	gettimeofday (&tv, NULL);
-	tm = localtime (&tv.tv_sec);
-	strftime (time_string, sizeof(time_string), "%H:%M:%S", tm);
+	localtime_r (&tv.tv_sec, &tm);
+	strftime (time_string, sizeof(time_string), "%H:%M:%S", &tm);
 	r = snprintf(p, left, "0x%lx %s.%03ld ", (unsigned long)pthread_self(), time_string, tv.tv_usec / 1000);
 #endif
 	p += r;
@@ -99,7 +385,7 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 	if (file != NULL) {
 		r = snprintf(p, left, "[%s] %s:%d:%s: ",
 			ctx->app_name, file, line, func ? func : "");
-		if (r < 0 || (unsigned int)r > sizeof(buf))
+		if (r < 0 || (unsigned int)r >= left)
 			return;
 	}
 	else {
@@ -112,6 +398,10 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 	if (r < 0)
 		return;
 
+	n = strlen(buf);
+	if (n == 0 || buf[n-1] != '\n')
+		buf[n++] = '\n';
+
 #ifdef _WIN32
 	if (ctx->debug_filename)   {
 		r = sc_ctx_log_to_file(ctx, ctx->debug_filename);
@@ -120,14 +410,26 @@ static void sc_do_log_va(sc_context_t *ctx, int level, const char *file, int lin
 	}
 #endif
 
+#ifdef ENABLE_LOG_SINK
+	if (__atomic_load_n(&ctx->log_sink, __ATOMIC_RELAXED) != NULL) {
+		struct sc_log_sink *sink;
+
+		__atomic_add_fetch(&ctx->log_sink_users, 1, __ATOMIC_SEQ_CST);
+		sink = __atomic_load_n(&ctx->log_sink, __ATOMIC_SEQ_CST);
+		r = sink ? sc_log_sink_push(sink, buf, n) : -1;
+		__atomic_sub_fetch(&ctx->log_sink_users, 1, __ATOMIC_RELEASE);
+		if (r == 0)
+			return;
+	}
+#endif
+
 	outf = ctx->debug_file;
 	if (outf == NULL)
 		return;
 
-	fprintf(outf, "%s", buf);
-	n = strlen(buf);
-	if (n == 0 || buf[n-1] != '\n')
-		fprintf(outf, "\n");
+	/* one piece per line, flushed right away so that nothing is
+	 * lost when the application crashes */
+	fwrite(buf, 1, n, outf);
 	fflush(outf);
 
 #ifdef _WIN32
@@ -44,9 +44,19 @@ enum {
 #define __FUNCTION__ NULL
 #endif
 
+/* The level is checked before the call, so that the arguments of a
+ * disabled message (sc_strerror(), sc_dump_hex(), ...) are not evaluated */
+#define sc_log_enabled(ctx, level)	((ctx) != NULL && (ctx)->debug >= (level))
+
 #if defined(__GNUC__)
-#define sc_debug(ctx, level, format, args...)	sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, format , ## args)
-#define sc_log(ctx, format, args...)   sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, __FILE__, __LINE__, __FUNCTION__, format , ## args)
+#define sc_debug(ctx, level, format, args...) do { \
+	if (sc_log_enabled((ctx), (level))) \
+		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, format , ## args); \
+} while (0)
+#define sc_log(ctx, format, args...) do { \
+	if (sc_log_enabled((ctx), SC_LOG_DEBUG_NORMAL)) \
+		sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, __FILE__, __LINE__, __FUNCTION__, format , ## args); \
+} while (0)
 #else
 #define sc_debug _sc_debug
 #define sc_log _sc_log
@@ -62,13 +72,16 @@ void sc_hex_dump(struct sc_context *ctx, int level, const u8 * buf, size_t len,
 char * sc_dump_hex(const u8 * in, size_t count);
 
 #define SC_FUNC_CALLED(ctx, level) do { \
-	 sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, "called\n"); \
+	if (sc_log_enabled((ctx), (level))) \
+		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, "called\n"); \
 } while (0)
 #define LOG_FUNC_CALLED(ctx) SC_FUNC_CALLED((ctx), SC_LOG_DEBUG_NORMAL)
 
 #define SC_FUNC_RETURN(ctx, level, r) do { \
 	int _ret = r; \
-	if (_ret <= 0) { \
+	if (!sc_log_enabled((ctx), (level))) { \
+		/* not logged */ \
+	} else if (_ret <= 0) { \
 		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
 			"returning with: %d (%s)\n", _ret, sc_strerror(_ret)); \
 	} else { \
@@ -82,8 +95,9 @@ char * sc_dump_hex(const u8 * in, size_t count);
 #define SC_TEST_RET(ctx, level, r, text) do { \
 	int _ret = (r); \
 	if (_ret < 0) { \
-		sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
-			"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
+		if (sc_log_enabled((ctx), (level))) \
+			sc_do_log(ctx, level, __FILE__, __LINE__, __FUNCTION__, \
+				"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
 		return _ret; \
 	} \
 } while(0)
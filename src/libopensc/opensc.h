@@ -243,12 +243,27 @@ struct sc_ef_atr {
 };
 
 struct sc_card_cache {
+	/* Path of the current DF */
 	struct sc_path current_path;
 
         struct sc_file *current_ef;
         struct sc_file *current_df;
 
 	int valid;
+
+	/* Set by iso7816_select_file() while the card is locked and
+	 * current_path, current_df and current_ef match the card state */
+	int current_valid;
+
+	/* Security environment last set with sc_set_security_env() and
+	 * the path selected before it; see SC_CARD_CAP_REUSE_SEC_ENV */
+	struct sc_security_env sec_env;
+	struct sc_path sec_env_path;
+	int sec_env_valid;
+
+	/* Random bytes left over from GET CHALLENGE, see sc_get_random() */
+	u8 random[SC_MAX_CHALLENGE_SIZE];
+	size_t random_len;
 };
 
 #define SC_PROTO_T0		0x00000001
@@ -280,6 +295,8 @@ struct sc_reader_driver {
 #define SC_READER_CAP_PACE_ESIGN           0x00000008
 #define SC_READER_CAP_PACE_DESTROY_CHANNEL 0x00000010
 #define SC_READER_CAP_PACE_GENERIC         0x00000020
+#define SC_READER_CAP_APDU_EXT             0x00000040
+#define SC_READER_CAP_EMULATED             0x00000080
 
 typedef struct sc_reader {
 	struct sc_context *ctx;
@@ -495,6 +512,11 @@ struct sc_reader_operations {
 #define SC_CARD_CAP_ONLY_RAW_HASH		0x00000040
 #define SC_CARD_CAP_ONLY_RAW_HASH_STRIPPED	0x00000080
 
+/* The security environment stays set on the card until another file
+ * is selected, so a repeated SELECT/MSE for the same key can be
+ * skipped while the card remains locked. */
+#define SC_CARD_CAP_REUSE_SEC_ENV	0x00000100
+
 typedef struct sc_card {
 	struct sc_context *ctx;
 	struct sc_reader *reader;
@@ -506,6 +528,7 @@ typedef struct sc_card {
 	int cla;
 	size_t max_send_size; /* Max Lc supported by the card */
 	size_t max_recv_size; /* Max Le supported by the card */
+	size_t max_challenge_size; /* Max Le of GET CHALLENGE, 0 for 8 bytes */
 
 	struct sc_app_info *app[SC_MAX_CARD_APPS];
 	int app_count;
@@ -665,8 +688,18 @@ typedef struct sc_card_driver {
 	struct sc_atr_table *atr_map;
 	unsigned int natrs;
 	void *dll;
+	/* NULL terminated table of the ATRs the driver's match_card()
+	 * recognises; only read for the internal card drivers */
+	struct sc_atr_table *builtin_atrs;
 } sc_card_driver_t;
 
+/**
+ * @struct sc_stats_t
+ * APDU statistics of a context, see sc_ctx_get_stats(). The layout is
+ * private; read the counters with sc_stats_get() or sc_stats_format().
+ */
+typedef struct sc_stats sc_stats_t;
+
 /**
  * @struct sc_thread_context_t
  * Structure for the locking function to use when using libopensc
@@ -710,6 +743,20 @@ typedef struct sc_context {
 	sc_thread_context_t	*thread_ctx;
 	void *mutex;
 
+	/* compiled card_atr entries and last matched drivers, see card.c */
+	struct sc_atr_index *atr_index;
+	int use_atr_memo;
+
+	/* asynchronous debug output, see log.c */
+	struct sc_log_sink *log_sink;
+	unsigned int log_sink_users;
+
+	/* APDU statistics, see stats.c */
+	struct sc_stats_state *stats;
+
+	/* compiled PKCS#15 templates, see sc_asn1_get_program() */
+	struct sc_asn1_program *asn1_programs[SC_MAX_ASN1_PROGRAMS];
+
 	unsigned int magic;
 } sc_context_t;
 
@@ -859,6 +906,46 @@ unsigned int sc_ctx_get_reader_count(sc_context_t *ctx);
  */
 int sc_ctx_log_to_file(sc_context_t *ctx, const char* filename);
 
+/**
+ * Takes a copy of the APDU statistics collected since the context was
+ * created or the last sc_ctx_reset_stats()
+ * @param  ctx  OpenSC context
+ * @param  out  receives the copy, to be freed with sc_stats_free()
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_ctx_get_stats(sc_context_t *ctx, sc_stats_t **out);
+
+/**
+ * Frees statistics returned by sc_ctx_get_stats()
+ * @param  stats  statistics to free (can be NULL)
+ */
+void sc_stats_free(sc_stats_t *stats);
+
+/**
+ * Clears the APDU statistics of the context
+ * @param  ctx  OpenSC context
+ */
+void sc_ctx_reset_stats(sc_context_t *ctx);
+
+/**
+ * Returns one counter of the statistics
+ * @param  stats  statistics from sc_ctx_get_stats()
+ * @param  name   name of the counter as in sc_stats_format(),
+ *                e.g. "apdus" or "ins.A4.usec"
+ * @return the value, 0 for a counter that has not been touched
+ */
+unsigned long long sc_stats_get(const sc_stats_t *stats, const char *name);
+
+/**
+ * Formats APDU statistics as text, one "name value" pair per line
+ * @param  stats   statistics from sc_ctx_get_stats()
+ * @param  buf     output buffer (can be NULL to get the length)
+ * @param  buflen  size of buf
+ * @return the length of the text (without the terminating NUL),
+ *         which is truncated when it does not fit in buf
+ */
+size_t sc_stats_format(const sc_stats_t *stats, char *buf, size_t buflen);
+
 /**
  * Forces the use of a specified card driver
  * @param ctx OpenSC context
@@ -967,6 +1054,30 @@ int sc_select_file(struct sc_card *card, const sc_path_t *path,
  * @return number of files ids read or an error code
  */
 int sc_list_files(struct sc_card *card, u8 *buf, size_t buflen);
+/**
+ * Returns the maximum Le of a single APDU to the card. Without an
+ * explicit limit of the card or reader this is 65536 if both of them
+ * support extended length APDUs and 256 otherwise.
+ * @param  card  struct sc_card object
+ * @return maximum number of bytes one APDU can return
+ */
+size_t sc_get_max_recv_size(const struct sc_card *card);
+/**
+ * Returns the maximum Lc of a single APDU to the card, see
+ * sc_get_max_recv_size().
+ * @param  card  struct sc_card object
+ * @return maximum number of bytes one APDU can send
+ */
+size_t sc_get_max_send_size(const struct sc_card *card);
+/**
+ * Returns the number of random bytes one GET CHALLENGE may ask for.
+ * This is max_challenge_size of the card, set by the card driver or
+ * with max_challenge_size in the card_atr block of the configuration,
+ * or 8 bytes when it is not known.
+ * @param  card  struct sc_card object
+ * @return maximum Le of GET CHALLENGE
+ */
+size_t sc_get_max_challenge_size(const struct sc_card *card);
 /**
  * Read data from a binary EF
  * @param  card   struct sc_card object on which to issue the command
@@ -1078,6 +1189,18 @@ int sc_put_data(struct sc_card *, unsigned int, const u8 *, size_t);
  * @return SC_SUCCESS on success and an error code otherwise
  */
 int sc_get_challenge(struct sc_card *card, u8 * rndout, size_t len);
+/**
+ * Gets random data from the card. Unlike sc_get_challenge() the data
+ * may come from an earlier GET CHALLENGE: whole commands of
+ * sc_get_max_challenge_size() bytes are sent and what is left over is
+ * kept for the next call. Do not use it for challenges the card has to
+ * verify later.
+ * @param  card    struct sc_card object on which to issue the command
+ * @param  rndout  buffer for the random data
+ * @param  len     length of the random data
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_get_random(struct sc_card *card, u8 * rndout, size_t len);
 
 /********************************************************************/
 /*              ISO 7816-8 related functions                        */
@@ -30,7 +30,14 @@
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <utime.h>
+#include <sys/mman.h>
+#endif
 
+#include "common/compat_strlcpy.h"
 #include "internal.h"
 #include "pkcs15.h"
 
@@ -59,7 +66,10 @@ static int generate_cache_filename(struct sc_pkcs15_card *p15card,
 	for (i = 0; i < pathlen; i++)
 		sprintf(pathname + 2*i, "%02X", pathptr[i]);
 	if (p15card->tokeninfo->serial_number != NULL) {
-		char *last_update = sc_pkcs15_get_lastupdate(p15card);
+		char *last_update = p15card->cache_tag;
+
+		if (last_update == NULL)
+			last_update = sc_pkcs15_get_lastupdate(p15card);
 		if (last_update != NULL)
 			r = snprintf(buf, bufsize, "%s/%s_%s_%s", dir, p15card->tokeninfo->serial_number,
 					last_update, pathname);
@@ -126,40 +136,1098 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 	*bufsize = count;
 	if (data)
 		*buf = data;
+#ifndef _WIN32
+	/* Mark the file as recently used for the eviction */
+	utime(fname, NULL);
+#endif
 	return 0;
 }
 
-int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
-			 const sc_path_t *path,
-			 const u8 *buf, size_t bufsize)
+#ifndef _WIN32
+/*
+ * Keep the cache directory below the configured size by removing the
+ * least recently used files. Reads refresh the modification time of
+ * cache files, so the oldest ones are removed first.
+ */
+struct cache_entry {
+	char *name;
+	off_t size;
+	time_t mtime;
+};
+
+static int cache_entry_cmp(const void *a, const void *b)
 {
-	char fname[PATH_MAX];
+	const struct cache_entry *ea = a, *eb = b;
+
+	return ea->mtime < eb->mtime ? -1 : ea->mtime > eb->mtime;
+}
+
+static void cache_evict(struct sc_pkcs15_card *p15card, const char *keep)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	char dir[PATH_MAX], fname[PATH_MAX];
+	struct cache_entry *entries = NULL, *tmp;
+	size_t count = 0, alloc = 0, i;
+	struct dirent *ent;
+	struct stat stbuf;
+	unsigned long long total = 0;
+	DIR *d;
+
+	if (p15card->opts.file_cache_max_size == 0)
+		return;
+	if (sc_get_cache_dir(ctx, dir, sizeof(dir)) != SC_SUCCESS)
+		return;
+
+	d = opendir(dir);
+	if (d == NULL)
+		return;
+	while ((ent = readdir(d)) != NULL) {
+		/* Skip dot entries and files still being written */
+		if (ent->d_name[0] == '.' || strstr(ent->d_name, ".tmp") != NULL)
+			continue;
+		if ((size_t) snprintf(fname, sizeof(fname), "%s/%s", dir, ent->d_name) >= sizeof(fname))
+			continue;
+		if (stat(fname, &stbuf) != 0 || !S_ISREG(stbuf.st_mode))
+			continue;
+		total += stbuf.st_size;
+		if (strcmp(fname, keep) == 0)
+			continue;
+
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			tmp = realloc(entries, alloc * sizeof(*entries));
+			if (tmp == NULL)
+				break;
+			entries = tmp;
+		}
+		entries[count].name = strdup(fname);
+		if (entries[count].name == NULL)
+			break;
+		entries[count].size = stbuf.st_size;
+		entries[count].mtime = stbuf.st_mtime;
+		count++;
+	}
+	closedir(d);
+
+	if (total > p15card->opts.file_cache_max_size && count > 0) {
+		qsort(entries, count, sizeof(*entries), cache_entry_cmp);
+		for (i = 0; i < count && total > p15card->opts.file_cache_max_size; i++) {
+			sc_log(ctx, "File cache size %llu exceeds limit, removing %s", total, entries[i].name);
+			if (unlink(entries[i].name) != 0)
+				break;
+			total -= entries[i].size;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+		free(entries[i].name);
+	free(entries);
+}
+#endif
+
+/*
+ * Write a cache file through a temporary file, so that concurrent
+ * readers never see a partially written file
+ */
+static int cache_write_file(struct sc_pkcs15_card *p15card, const char *fname,
+			    const u8 *buf, size_t bufsize)
+{
+	char tmpname[PATH_MAX];
 	int r;
         FILE *f;
         size_t c;
 
-	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
-	if (r != 0)
-		return r;
+#ifdef _WIN32
+	r = snprintf(tmpname, sizeof(tmpname), "%s.%lu.tmp", fname, (unsigned long) GetCurrentProcessId());
+#else
+	r = snprintf(tmpname, sizeof(tmpname), "%s.%lu.tmp", fname, (unsigned long) getpid());
+#endif
+	if (r < 0 || (size_t) r >= sizeof(tmpname))
+		return SC_ERROR_BUFFER_TOO_SMALL;
 
-	f = fopen(fname, "wb");
+	f = fopen(tmpname, "wb");
 	/* If the open failed because the cache directory does
 	 * not exist, create it and a re-try the fopen() call.
 	 */
 	if (f == NULL && errno == ENOENT) {
 		if ((r = sc_make_cache_dir(p15card->card->ctx)) < 0)
 			return r;
-		f = fopen(fname, "wb");
+		f = fopen(tmpname, "wb");
 	}
 	if (f == NULL)
 		return 0;
 
 	c = fwrite(buf, 1, bufsize, f);
-        fclose(f);
-	if (c != bufsize) {
+	if (fclose(f) != 0 || c != bufsize) {
 		sc_debug(p15card->card->ctx, SC_LOG_DEBUG_NORMAL, "fwrite() wrote only %d bytes", c);
-		unlink(fname);
+		unlink(tmpname);
+		return SC_ERROR_INTERNAL;
+	}
+#ifdef _WIN32
+	/* rename() does not replace existing files on Windows */
+	unlink(fname);
+#endif
+	if (rename(tmpname, fname) != 0) {
+		unlink(tmpname);
 		return SC_ERROR_INTERNAL;
 	}
+
+#ifndef _WIN32
+	cache_evict(p15card, fname);
+#endif
         return 0;
 }
+
+int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
+			 const sc_path_t *path,
+			 const u8 *buf, size_t bufsize)
+{
+	char fname[PATH_MAX];
+	int r;
+
+	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
+	if (r != 0)
+		return r;
+
+	return cache_write_file(p15card, fname, buf, bufsize);
+}
+
+/*
+ * Snapshots of the parsed PKCS #15 structure
+ *
+ * A snapshot holds the TokenInfo with the supported algorithms, the DFs,
+ * the objects read from them and the unused space entries. Every field
+ * is written on its own as a 32 bit big endian integer or as a length
+ * followed by the bytes, and no pointer or in-memory layout ends up in
+ * the file: on load, every length is checked against the size of the
+ * field it is read into.
+ *
+ * The key of a snapshot is the EF(TokenInfo) as read from the card,
+ * which holds the serial number and the lastUpdate: the file is named
+ * after its length, CRC and the application path, and the snapshot only
+ * applies if the stored copy is the same byte for byte. The TokenInfo
+ * does not need to be decoded then.
+ */
+#define SNAPSHOT_MAGIC		"OSCP15S"
+#define SNAPSHOT_VERSION	3
+
+struct snapshot_buf {
+	u8 *data;
+	size_t len, size;
+	int error;
+};
+
+struct snapshot_reader {
+	const u8 *p, *end;
+	int error;
+};
+
+static int generate_snapshot_filename(struct sc_pkcs15_card *p15card,
+				      const u8 *key, size_t key_len,
+				      char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX], app[SC_MAX_PATH_SIZE * 2 + 1];
+	int r;
+
+	if (p15card->file_app == NULL || key_len == 0)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
+	if (r)
+		return r;
+	r = sc_bin_to_hex(p15card->file_app->path.value, p15card->file_app->path.len,
+			app, sizeof(app), 0);
+	if (r)
+		return r;
+
+	r = snprintf(buf, bufsize, "%s/%s_%lu_%04x.snapshot", dir,
+			app, (unsigned long) key_len, sc_crc32((unsigned char *) key, key_len));
+	if (r < 0 || (size_t) r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/*
+ * Writer: errors are kept in sb->error, so that a record can be written
+ * with a sequence of calls and checked once.
+ */
+static void snapshot_put_raw(struct snapshot_buf *sb, const void *data, size_t len)
+{
+	if (sb->error)
+		return;
+	if (sb->len + len > sb->size) {
+		size_t size = sb->size * 2 + len + 4096;
+		u8 *p = realloc(sb->data, size);
+
+		if (p == NULL) {
+			sb->error = SC_ERROR_OUT_OF_MEMORY;
+			return;
+		}
+		sb->data = p;
+		sb->size = size;
+	}
+	if (len)
+		memcpy(sb->data + sb->len, data, len);
+	sb->len += len;
+}
+
+static void snapshot_put_uint(struct snapshot_buf *sb, unsigned long value)
+{
+	u8 buf[4];
+
+	if (value > 0xFFFFFFFFUL) {
+		sb->error = SC_ERROR_NOT_SUPPORTED;
+		return;
+	}
+	ulong2bebytes(buf, value);
+	snapshot_put_raw(sb, buf, sizeof(buf));
+}
+
+/* Signed values are stored as their 32 bit two's complement */
+static void snapshot_put_int(struct snapshot_buf *sb, int value)
+{
+	snapshot_put_uint(sb, (unsigned int) value & 0xFFFFFFFFU);
+}
+
+static void snapshot_put_bytes(struct snapshot_buf *sb, const u8 *data, size_t len)
+{
+	snapshot_put_uint(sb, data ? len : 0);
+	if (data)
+		snapshot_put_raw(sb, data, len);
+}
+
+/* NULL and "" are told apart: the length includes the terminating NUL */
+static void snapshot_put_string(struct snapshot_buf *sb, const char *str)
+{
+	snapshot_put_bytes(sb, (const u8 *) str, str ? strlen(str) + 1 : 0);
+}
+
+static void snapshot_put_oid(struct snapshot_buf *sb, const struct sc_object_id *oid)
+{
+	int i;
+
+	for (i = 0; i < SC_MAX_OBJECT_ID_OCTETS; i++)
+		snapshot_put_int(sb, oid->value[i]);
+}
+
+static void snapshot_put_id(struct snapshot_buf *sb, const struct sc_pkcs15_id *id)
+{
+	snapshot_put_bytes(sb, id->value, id->len);
+}
+
+static void snapshot_put_path(struct snapshot_buf *sb, const struct sc_path *path)
+{
+	snapshot_put_bytes(sb, path->value, path->len);
+	snapshot_put_int(sb, path->index);
+	snapshot_put_int(sb, path->count);
+	snapshot_put_int(sb, path->type);
+	snapshot_put_bytes(sb, path->aid.value, path->aid.len);
+}
+
+/* Reader: after the first error every getter returns zero */
+static const u8 *snapshot_get_raw(struct snapshot_reader *rd, size_t len)
+{
+	const u8 *ret = rd->p;
+
+	if (rd->error || (size_t) (rd->end - rd->p) < len) {
+		rd->error = SC_ERROR_CORRUPTED_DATA;
+		return NULL;
+	}
+	rd->p += len;
+	return ret;
+}
+
+static unsigned long snapshot_get_uint(struct snapshot_reader *rd)
+{
+	const u8 *p = snapshot_get_raw(rd, 4);
+
+	return p ? bebytes2ulong(p) : 0;
+}
+
+static int snapshot_get_int(struct snapshot_reader *rd)
+{
+	unsigned long value = snapshot_get_uint(rd);
+
+	if (value & 0x80000000UL)
+		return -(int) (0xFFFFFFFFUL - value) - 1;
+	return (int) value;
+}
+
+/* Reads a value no larger than max */
+static unsigned long snapshot_get_len(struct snapshot_reader *rd, size_t max)
+{
+	unsigned long len = snapshot_get_uint(rd);
+
+	if (len > max) {
+		rd->error = SC_ERROR_CORRUPTED_DATA;
+		return 0;
+	}
+	return len;
+}
+
+/* Into a fixed size field, returns the length */
+static size_t snapshot_get_bytes(struct snapshot_reader *rd, u8 *buf, size_t max)
+{
+	size_t len = snapshot_get_len(rd, max);
+	const u8 *p = snapshot_get_raw(rd, len);
+
+	if (p == NULL)
+		return 0;
+	memcpy(buf, p, len);
+	return len;
+}
+
+/* Into a newly allocated buffer */
+static void snapshot_get_blob(struct snapshot_reader *rd, u8 **out, size_t *out_len)
+{
+	size_t len = snapshot_get_uint(rd);
+	const u8 *p = snapshot_get_raw(rd, len);
+
+	*out = NULL;
+	if (out_len)
+		*out_len = 0;
+	if (p == NULL || len == 0)
+		return;
+	*out = malloc(len);
+	if (*out == NULL) {
+		rd->error = SC_ERROR_OUT_OF_MEMORY;
+		return;
+	}
+	memcpy(*out, p, len);
+	if (out_len)
+		*out_len = len;
+}
+
+static void snapshot_get_string(struct snapshot_reader *rd, char **out)
+{
+	size_t len;
+
+	snapshot_get_blob(rd, (u8 **) out, &len);
+	if (*out != NULL && (*out)[len - 1] != '\0') {
+		free(*out);
+		*out = NULL;
+		rd->error = SC_ERROR_CORRUPTED_DATA;
+	}
+}
+
+/* Into a fixed size char array */
+static void snapshot_get_label(struct snapshot_reader *rd, char *buf, size_t size)
+{
+	size_t len = snapshot_get_bytes(rd, (u8 *) buf, size);
+
+	if (len == 0)
+		buf[0] = '\0';
+	else if (buf[len - 1] != '\0')
+		rd->error = SC_ERROR_CORRUPTED_DATA;
+}
+
+static void snapshot_get_oid(struct snapshot_reader *rd, struct sc_object_id *oid)
+{
+	int i;
+
+	for (i = 0; i < SC_MAX_OBJECT_ID_OCTETS; i++)
+		oid->value[i] = snapshot_get_int(rd);
+}
+
+static void snapshot_get_id(struct snapshot_reader *rd, struct sc_pkcs15_id *id)
+{
+	id->len = snapshot_get_bytes(rd, id->value, sizeof(id->value));
+}
+
+static void snapshot_get_path(struct snapshot_reader *rd, struct sc_path *path)
+{
+	memset(path, 0, sizeof(*path));
+	path->len = snapshot_get_bytes(rd, path->value, sizeof(path->value));
+	path->index = snapshot_get_int(rd);
+	path->count = snapshot_get_int(rd);
+	path->type = snapshot_get_int(rd);
+	path->aid.len = snapshot_get_bytes(rd, path->aid.value, sizeof(path->aid.value));
+}
+
+/* Only GOST R 34.10 key parameters are set when parsing the DFs */
+static void snapshot_put_params(struct snapshot_buf *sb, const struct sc_pkcs15_key_params *params)
+{
+	const struct sc_pkcs15_keyinfo_gostparams *gost = params->data;
+
+	if (gost == NULL) {
+		snapshot_put_uint(sb, 0);
+		return;
+	}
+	if (params->len != sizeof(*gost) || params->free_params != NULL) {
+		sb->error = SC_ERROR_NOT_SUPPORTED;
+		return;
+	}
+	snapshot_put_uint(sb, 1);
+	snapshot_put_uint(sb, gost->gostr3410);
+	snapshot_put_uint(sb, gost->gostr3411);
+	snapshot_put_uint(sb, gost->gost28147);
+}
+
+static void snapshot_get_params(struct snapshot_reader *rd, struct sc_pkcs15_key_params *params)
+{
+	struct sc_pkcs15_keyinfo_gostparams *gost;
+
+	memset(params, 0, sizeof(*params));
+	if (snapshot_get_len(rd, 1) == 0)
+		return;
+	gost = calloc(1, sizeof(*gost));
+	if (gost == NULL) {
+		rd->error = SC_ERROR_OUT_OF_MEMORY;
+		return;
+	}
+	gost->gostr3410 = snapshot_get_uint(rd);
+	gost->gostr3411 = snapshot_get_uint(rd);
+	gost->gost28147 = snapshot_get_uint(rd);
+	params->data = gost;
+	params->len = sizeof(*gost);
+}
+
+static void snapshot_put_algo_refs(struct snapshot_buf *sb, const unsigned int *refs)
+{
+	int i;
+
+	for (i = 0; i < SC_MAX_SUPPORTED_ALGORITHMS; i++)
+		snapshot_put_uint(sb, refs[i]);
+}
+
+static void snapshot_get_algo_refs(struct snapshot_reader *rd, unsigned int *refs)
+{
+	int i;
+
+	for (i = 0; i < SC_MAX_SUPPORTED_ALGORITHMS; i++)
+		refs[i] = snapshot_get_uint(rd);
+}
+
+/* The private and public key infos have the same fields */
+#define SNAPSHOT_PUT_KEY_INFO(sb, info) do { \
+	snapshot_put_id(sb, &(info)->id); \
+	snapshot_put_uint(sb, (info)->usage); \
+	snapshot_put_uint(sb, (info)->access_flags); \
+	snapshot_put_int(sb, (info)->native); \
+	snapshot_put_int(sb, (info)->key_reference); \
+	snapshot_put_uint(sb, (info)->modulus_length); \
+	snapshot_put_uint(sb, (info)->field_length); \
+	snapshot_put_algo_refs(sb, (info)->algo_refs); \
+	snapshot_put_bytes(sb, (info)->subject.value, (info)->subject.len); \
+	snapshot_put_params(sb, &(info)->params); \
+	snapshot_put_path(sb, &(info)->path); \
+} while (0)
+
+#define SNAPSHOT_GET_KEY_INFO(rd, info) do { \
+	snapshot_get_id(rd, &(info)->id); \
+	(info)->usage = snapshot_get_uint(rd); \
+	(info)->access_flags = snapshot_get_uint(rd); \
+	(info)->native = snapshot_get_int(rd); \
+	(info)->key_reference = snapshot_get_int(rd); \
+	(info)->modulus_length = snapshot_get_uint(rd); \
+	(info)->field_length = snapshot_get_uint(rd); \
+	snapshot_get_algo_refs(rd, (info)->algo_refs); \
+	snapshot_get_blob(rd, &(info)->subject.value, &(info)->subject.len); \
+	snapshot_get_params(rd, &(info)->params); \
+	snapshot_get_path(rd, &(info)->path); \
+} while (0)
+
+static void snapshot_put_auth_info(struct snapshot_buf *sb, const struct sc_pkcs15_auth_info *info)
+{
+	snapshot_put_id(sb, &info->auth_id);
+	snapshot_put_path(sb, &info->path);
+	snapshot_put_uint(sb, info->auth_type);
+	switch (info->auth_type) {
+	case SC_PKCS15_PIN_AUTH_TYPE_PIN:
+		snapshot_put_uint(sb, info->attrs.pin.flags);
+		snapshot_put_uint(sb, info->attrs.pin.type);
+		snapshot_put_uint(sb, info->attrs.pin.min_length);
+		snapshot_put_uint(sb, info->attrs.pin.stored_length);
+		snapshot_put_uint(sb, info->attrs.pin.max_length);
+		snapshot_put_int(sb, info->attrs.pin.reference);
+		snapshot_put_uint(sb, info->attrs.pin.pad_char);
+		break;
+	case SC_PKCS15_PIN_AUTH_TYPE_BIOMETRIC:
+		snapshot_put_uint(sb, info->attrs.bio.flags);
+		snapshot_put_oid(sb, &info->attrs.bio.template_id);
+		break;
+	case SC_PKCS15_PIN_AUTH_TYPE_AUTH_KEY:
+		snapshot_put_int(sb, info->attrs.authkey.derived);
+		snapshot_put_id(sb, &info->attrs.authkey.skey_id);
+		break;
+	default:
+		sb->error = SC_ERROR_NOT_SUPPORTED;
+		return;
+	}
+	snapshot_put_uint(sb, info->auth_method);
+	snapshot_put_int(sb, info->tries_left);
+	snapshot_put_int(sb, info->max_tries);
+}
+
+static void snapshot_get_auth_info(struct snapshot_reader *rd, struct sc_pkcs15_auth_info *info)
+{
+	snapshot_get_id(rd, &info->auth_id);
+	snapshot_get_path(rd, &info->path);
+	info->auth_type = snapshot_get_uint(rd);
+	switch (info->auth_type) {
+	case SC_PKCS15_PIN_AUTH_TYPE_PIN:
+		info->attrs.pin.flags = snapshot_get_uint(rd);
+		info->attrs.pin.type = snapshot_get_uint(rd);
+		info->attrs.pin.min_length = snapshot_get_uint(rd);
+		info->attrs.pin.stored_length = snapshot_get_uint(rd);
+		info->attrs.pin.max_length = snapshot_get_uint(rd);
+		info->attrs.pin.reference = snapshot_get_int(rd);
+		info->attrs.pin.pad_char = (u8) snapshot_get_len(rd, 0xFF);
+		break;
+	case SC_PKCS15_PIN_AUTH_TYPE_BIOMETRIC:
+		info->attrs.bio.flags = snapshot_get_uint(rd);
+		snapshot_get_oid(rd, &info->attrs.bio.template_id);
+		break;
+	case SC_PKCS15_PIN_AUTH_TYPE_AUTH_KEY:
+		info->attrs.authkey.derived = snapshot_get_int(rd);
+		snapshot_get_id(rd, &info->attrs.authkey.skey_id);
+		break;
+	default:
+		rd->error = SC_ERROR_CORRUPTED_DATA;
+		return;
+	}
+	info->auth_method = snapshot_get_uint(rd);
+	info->tries_left = snapshot_get_int(rd);
+	info->max_tries = snapshot_get_int(rd);
+}
+
+static size_t snapshot_info_size(unsigned int type)
+{
+	switch (type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		return sizeof(struct sc_pkcs15_prkey_info);
+	case SC_PKCS15_TYPE_PUBKEY:
+		return sizeof(struct sc_pkcs15_pubkey_info);
+	case SC_PKCS15_TYPE_SKEY:
+		return sizeof(struct sc_pkcs15_skey_info);
+	case SC_PKCS15_TYPE_CERT:
+		return sizeof(struct sc_pkcs15_cert_info);
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		return sizeof(struct sc_pkcs15_data_info);
+	case SC_PKCS15_TYPE_AUTH:
+		return sizeof(struct sc_pkcs15_auth_info);
+	}
+	return 0;
+}
+
+static void snapshot_put_info(struct snapshot_buf *sb, unsigned int type, const void *data)
+{
+	const struct sc_pkcs15_skey_info *skey = data;
+	const struct sc_pkcs15_cert_info *cert = data;
+	const struct sc_pkcs15_data_info *dobj = data;
+	int i;
+
+	switch (type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		SNAPSHOT_PUT_KEY_INFO(sb, (const struct sc_pkcs15_prkey_info *) data);
+		break;
+	case SC_PKCS15_TYPE_PUBKEY:
+		SNAPSHOT_PUT_KEY_INFO(sb, (const struct sc_pkcs15_pubkey_info *) data);
+		break;
+	case SC_PKCS15_TYPE_SKEY:
+		snapshot_put_id(sb, &skey->id);
+		snapshot_put_uint(sb, skey->usage);
+		snapshot_put_uint(sb, skey->access_flags);
+		snapshot_put_int(sb, skey->native);
+		snapshot_put_int(sb, skey->key_reference);
+		snapshot_put_uint(sb, skey->value_len);
+		snapshot_put_uint(sb, skey->key_type);
+		for (i = 0; i < SC_MAX_SUPPORTED_ALGORITHMS; i++)
+			snapshot_put_int(sb, skey->algo_refs[i]);
+		snapshot_put_path(sb, &skey->path);
+		snapshot_put_bytes(sb, skey->data.value, skey->data.len);
+		break;
+	case SC_PKCS15_TYPE_CERT:
+		snapshot_put_id(sb, &cert->id);
+		snapshot_put_int(sb, cert->authority);
+		snapshot_put_path(sb, &cert->path);
+		snapshot_put_bytes(sb, cert->value.value, cert->value.len);
+		break;
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		snapshot_put_id(sb, &dobj->id);
+		snapshot_put_string(sb, dobj->app_label);
+		snapshot_put_oid(sb, &dobj->app_oid);
+		snapshot_put_path(sb, &dobj->path);
+		snapshot_put_bytes(sb, dobj->data.value, dobj->data.len);
+		break;
+	case SC_PKCS15_TYPE_AUTH:
+		snapshot_put_auth_info(sb, data);
+		break;
+	default:
+		sb->error = SC_ERROR_NOT_SUPPORTED;
+	}
+}
+
+static void snapshot_get_info(struct snapshot_reader *rd, unsigned int type, void *data)
+{
+	struct sc_pkcs15_skey_info *skey = data;
+	struct sc_pkcs15_cert_info *cert = data;
+	struct sc_pkcs15_data_info *dobj = data;
+	int i;
+
+	switch (type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		SNAPSHOT_GET_KEY_INFO(rd, (struct sc_pkcs15_prkey_info *) data);
+		break;
+	case SC_PKCS15_TYPE_PUBKEY:
+		SNAPSHOT_GET_KEY_INFO(rd, (struct sc_pkcs15_pubkey_info *) data);
+		break;
+	case SC_PKCS15_TYPE_SKEY:
+		snapshot_get_id(rd, &skey->id);
+		skey->usage = snapshot_get_uint(rd);
+		skey->access_flags = snapshot_get_uint(rd);
+		skey->native = snapshot_get_int(rd);
+		skey->key_reference = snapshot_get_int(rd);
+		skey->value_len = snapshot_get_uint(rd);
+		skey->key_type = snapshot_get_uint(rd);
+		for (i = 0; i < SC_MAX_SUPPORTED_ALGORITHMS; i++)
+			skey->algo_refs[i] = snapshot_get_int(rd);
+		snapshot_get_path(rd, &skey->path);
+		snapshot_get_blob(rd, &skey->data.value, &skey->data.len);
+		break;
+	case SC_PKCS15_TYPE_CERT:
+		snapshot_get_id(rd, &cert->id);
+		cert->authority = snapshot_get_int(rd);
+		snapshot_get_path(rd, &cert->path);
+		snapshot_get_blob(rd, &cert->value.value, &cert->value.len);
+		break;
+	case SC_PKCS15_TYPE_DATA_OBJECT:
+		snapshot_get_id(rd, &dobj->id);
+		snapshot_get_label(rd, dobj->app_label, sizeof(dobj->app_label));
+		snapshot_get_oid(rd, &dobj->app_oid);
+		snapshot_get_path(rd, &dobj->path);
+		snapshot_get_blob(rd, &dobj->data.value, &dobj->data.len);
+		break;
+	case SC_PKCS15_TYPE_AUTH:
+		snapshot_get_auth_info(rd, data);
+		break;
+	default:
+		rd->error = SC_ERROR_CORRUPTED_DATA;
+	}
+}
+
+static void snapshot_put_object(struct snapshot_buf *sb, const struct sc_pkcs15_object *obj,
+			       unsigned int df_index)
+{
+	int i;
+
+	if (obj->data == NULL) {
+		sb->error = SC_ERROR_NOT_SUPPORTED;
+		return;
+	}
+	snapshot_put_uint(sb, df_index);
+	snapshot_put_uint(sb, obj->type);
+	snapshot_put_string(sb, obj->label);
+	snapshot_put_uint(sb, obj->flags);
+	snapshot_put_id(sb, &obj->auth_id);
+	snapshot_put_int(sb, obj->usage_counter);
+	snapshot_put_int(sb, obj->user_consent);
+	for (i = 0; i < SC_PKCS15_MAX_ACCESS_RULES; i++) {
+		snapshot_put_uint(sb, obj->access_rules[i].access_mode);
+		snapshot_put_id(sb, &obj->access_rules[i].auth_id);
+	}
+	/* Content of private objects stays on the card */
+	if (obj->flags & SC_PKCS15_CO_FLAG_PRIVATE)
+		snapshot_put_bytes(sb, NULL, 0);
+	else
+		snapshot_put_bytes(sb, obj->content.value, obj->content.len);
+	snapshot_put_string(sb, obj->guid);
+	snapshot_put_info(sb, obj->type, obj->data);
+}
+
+static int snapshot_get_object(struct snapshot_reader *rd, struct sc_pkcs15_df **dfs,
+			       unsigned int num_dfs, struct sc_pkcs15_object **out)
+{
+	struct sc_pkcs15_object *obj;
+	unsigned int df_index;
+	size_t info_len;
+	int i;
+
+	df_index = snapshot_get_uint(rd);
+	if (rd->error || df_index >= num_dfs)
+		return SC_ERROR_CORRUPTED_DATA;
+
+	obj = calloc(1, sizeof(*obj));
+	if (obj == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	obj->df = dfs[df_index];
+	obj->type = snapshot_get_uint(rd);
+	info_len = snapshot_info_size(obj->type);
+	if (rd->error || info_len == 0) {
+		free(obj);
+		return SC_ERROR_CORRUPTED_DATA;
+	}
+	/* The object can be released by sc_pkcs15_free_object() from here on */
+	obj->data = calloc(1, info_len);
+	if (obj->data == NULL) {
+		free(obj);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+
+	snapshot_get_label(rd, obj->label, sizeof(obj->label));
+	obj->flags = snapshot_get_uint(rd);
+	snapshot_get_id(rd, &obj->auth_id);
+	obj->usage_counter = snapshot_get_int(rd);
+	obj->user_consent = snapshot_get_int(rd);
+	for (i = 0; i < SC_PKCS15_MAX_ACCESS_RULES; i++) {
+		obj->access_rules[i].access_mode = snapshot_get_uint(rd);
+		snapshot_get_id(rd, &obj->access_rules[i].auth_id);
+	}
+	snapshot_get_blob(rd, &obj->content.value, &obj->content.len);
+	snapshot_get_string(rd, &obj->guid);
+	snapshot_get_info(rd, obj->type, obj->data);
+	if (rd->error) {
+		sc_pkcs15_free_object(obj);
+		return rd->error;
+	}
+	*out = obj;
+	return SC_SUCCESS;
+}
+
+static void snapshot_put_tokeninfo(struct snapshot_buf *sb, const struct sc_pkcs15_tokeninfo *ti)
+{
+	size_t i, num_seInfo = ti->seInfo ? ti->num_seInfo : 0;
+
+	snapshot_put_uint(sb, ti->version);
+	snapshot_put_uint(sb, ti->flags);
+	snapshot_put_string(sb, ti->label);
+	snapshot_put_string(sb, ti->serial_number);
+	snapshot_put_string(sb, ti->manufacturer_id);
+	snapshot_put_string(sb, ti->last_update.gtime);
+	snapshot_put_path(sb, &ti->last_update.path);
+	snapshot_put_oid(sb, &ti->profile_indication.oid);
+	snapshot_put_string(sb, ti->profile_indication.name);
+	snapshot_put_string(sb, ti->preferred_language);
+	snapshot_put_uint(sb, num_seInfo);
+	for (i = 0; i < num_seInfo; i++) {
+		snapshot_put_int(sb, ti->seInfo[i]->se);
+		snapshot_put_oid(sb, &ti->seInfo[i]->owner);
+		snapshot_put_bytes(sb, ti->seInfo[i]->aid.value, ti->seInfo[i]->aid.len);
+	}
+	for (i = 0; i < SC_MAX_SUPPORTED_ALGORITHMS; i++) {
+		const struct sc_supported_algo_info *algo = &ti->supported_algos[i];
+
+		snapshot_put_uint(sb, algo->reference);
+		snapshot_put_uint(sb, algo->mechanism);
+		snapshot_put_uint(sb, algo->operations);
+		snapshot_put_oid(sb, &algo->algo_id);
+		snapshot_put_uint(sb, algo->algo_ref);
+	}
+}
+
+static void snapshot_clear_tokeninfo(struct sc_pkcs15_tokeninfo *ti)
+{
+	size_t i;
+
+	free(ti->label);
+	free(ti->serial_number);
+	free(ti->manufacturer_id);
+	free(ti->last_update.gtime);
+	free(ti->profile_indication.name);
+	free(ti->preferred_language);
+	if (ti->seInfo) {
+		for (i = 0; i < ti->num_seInfo; i++)
+			free(ti->seInfo[i]);
+		free(ti->seInfo);
+	}
+	memset(ti, 0, sizeof(*ti));
+}
+
+static int snapshot_get_tokeninfo(struct snapshot_reader *rd, struct sc_pkcs15_tokeninfo *ti)
+{
+	size_t i, num_seInfo;
+
+	memset(ti, 0, sizeof(*ti));
+	ti->version = snapshot_get_uint(rd);
+	ti->flags = snapshot_get_uint(rd);
+	snapshot_get_string(rd, &ti->label);
+	snapshot_get_string(rd, &ti->serial_number);
+	snapshot_get_string(rd, &ti->manufacturer_id);
+	snapshot_get_string(rd, &ti->last_update.gtime);
+	snapshot_get_path(rd, &ti->last_update.path);
+	snapshot_get_oid(rd, &ti->profile_indication.oid);
+	snapshot_get_string(rd, &ti->profile_indication.name);
+	snapshot_get_string(rd, &ti->preferred_language);
+	num_seInfo = snapshot_get_len(rd, SC_MAX_SE_NUM);
+	if (!rd->error && num_seInfo) {
+		ti->seInfo = calloc(num_seInfo, sizeof(*ti->seInfo));
+		if (ti->seInfo == NULL)
+			rd->error = SC_ERROR_OUT_OF_MEMORY;
+	}
+	for (i = 0; !rd->error && i < num_seInfo; i++) {
+		struct sc_pkcs15_sec_env_info *se = calloc(1, sizeof(*se));
+
+		if (se == NULL) {
+			rd->error = SC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+		ti->seInfo[ti->num_seInfo++] = se;
+		se->se = snapshot_get_int(rd);
+		snapshot_get_oid(rd, &se->owner);
+		se->aid.len = snapshot_get_bytes(rd, se->aid.value, sizeof(se->aid.value));
+	}
+	for (i = 0; i < SC_MAX_SUPPORTED_ALGORITHMS; i++) {
+		struct sc_supported_algo_info *algo = &ti->supported_algos[i];
+
+		algo->reference = snapshot_get_uint(rd);
+		algo->mechanism = snapshot_get_uint(rd);
+		algo->operations = snapshot_get_uint(rd);
+		snapshot_get_oid(rd, &algo->algo_id);
+		algo->algo_ref = snapshot_get_uint(rd);
+	}
+	if (rd->error) {
+		snapshot_clear_tokeninfo(ti);
+		return rd->error;
+	}
+	return SC_SUCCESS;
+}
+
+/*
+ * Called at unbind: the DFs are parsed as the application needs them,
+ * and the snapshot is only written if all of them were.
+ */
+int sc_pkcs15_save_snapshot(struct sc_pkcs15_card *p15card)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct snapshot_buf sb;
+	struct sc_pkcs15_df *df;
+	struct sc_pkcs15_unusedspace *us;
+	struct sc_pkcs15_object *obj;
+	char fname[PATH_MAX];
+	unsigned int idx, num_dfs = 0, num_objects = 0, num_unusedspace = 0;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+	/* Emulators have their own idea of the DFs */
+	if (p15card->ops.parse_df || p15card->snapshot_key == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
+
+	r = generate_snapshot_filename(p15card, p15card->snapshot_key, p15card->snapshot_key_len,
+			fname, sizeof(fname));
+	LOG_TEST_RET(ctx, r, "Cannot make snapshot file name");
+
+	for (df = p15card->df_list; df; df = df->next) {
+		if (!df->enumerated) {
+			sc_log(ctx, "DF %s not parsed, no snapshot", sc_print_path(&df->path));
+			LOG_FUNC_RETURN(ctx, SC_ERROR_OBJECT_NOT_VALID);
+		}
+		num_dfs++;
+	}
+	for (obj = p15card->obj_list; obj; obj = obj->next)
+		num_objects++;
+	if (p15card->unusedspace_read)
+		for (us = p15card->unusedspace_list; us; us = us->next)
+			num_unusedspace++;
+
+	memset(&sb, 0, sizeof(sb));
+	snapshot_put_raw(&sb, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	snapshot_put_uint(&sb, SNAPSHOT_VERSION);
+	snapshot_put_bytes(&sb, p15card->snapshot_key, p15card->snapshot_key_len);
+	snapshot_put_tokeninfo(&sb, p15card->tokeninfo);
+
+	snapshot_put_uint(&sb, num_dfs);
+	for (df = p15card->df_list; df; df = df->next) {
+		snapshot_put_uint(&sb, df->type);
+		snapshot_put_path(&sb, &df->path);
+		snapshot_put_int(&sb, df->record_length);
+	}
+
+	snapshot_put_uint(&sb, num_objects);
+	for (obj = p15card->obj_list; obj; obj = obj->next) {
+		for (df = p15card->df_list, idx = 0; df && df != obj->df; df = df->next)
+			idx++;
+		if (df == NULL || obj->emulated) {
+			/* Not read from a DF of this card */
+			sb.error = SC_ERROR_NOT_SUPPORTED;
+			break;
+		}
+		snapshot_put_object(&sb, obj, idx);
+	}
+
+	snapshot_put_int(&sb, p15card->unusedspace_read);
+	snapshot_put_uint(&sb, num_unusedspace);
+	if (p15card->unusedspace_read) {
+		for (us = p15card->unusedspace_list; us; us = us->next) {
+			snapshot_put_path(&sb, &us->path);
+			snapshot_put_id(&sb, &us->auth_id);
+		}
+	}
+
+	r = sb.error;
+	if (r == SC_SUCCESS) {
+		r = cache_write_file(p15card, fname, sb.data, sb.len);
+		sc_log(ctx, "Snapshot of %u DFs and %u objects written to %s", num_dfs, num_objects, fname);
+	}
+	free(sb.data);
+	LOG_FUNC_RETURN(ctx, r);
+}
+
+/*
+ * Restore TokenInfo, DFs, objects and unused space of the card from its
+ * snapshot, given the EF(TokenInfo) just read from the card. The DFs
+ * found in the ODF have to match the ones of the snapshot.
+ */
+int sc_pkcs15_load_snapshot(struct sc_pkcs15_card *p15card, const u8 *key, size_t key_len)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct snapshot_reader rd;
+	struct sc_pkcs15_df *df, *dfs[SC_PKCS15_DF_TYPE_COUNT * 8];
+	struct sc_pkcs15_object *obj = NULL, *head = NULL, *tail = NULL;
+	struct sc_pkcs15_unusedspace us[8], *unusedspace = us;
+	struct sc_pkcs15_tokeninfo tokeninfo;
+	struct sc_path path;
+	const u8 *magic, *rec_key;
+	size_t rec_key_len;
+	unsigned int i, num_dfs = 0, num_objects, num_unusedspace = 0;
+	int unusedspace_read;
+	u8 *map;
+	char fname[PATH_MAX];
+	struct stat stbuf;
+	int r;
+#ifndef _WIN32
+	int fd;
+#else
+	FILE *f;
+#endif
+
+	LOG_FUNC_CALLED(ctx);
+	if (p15card->ops.parse_df || p15card->obj_list)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
+
+	memset(&tokeninfo, 0, sizeof(tokeninfo));
+	r = generate_snapshot_filename(p15card, key, key_len, fname, sizeof(fname));
+	if (r < 0)
+		LOG_FUNC_RETURN(ctx, r);
+	if (stat(fname, &stbuf) != 0 || stbuf.st_size < (off_t) sizeof(SNAPSHOT_MAGIC))
+		LOG_FUNC_RETURN(ctx, SC_ERROR_FILE_NOT_FOUND);
+
+#ifndef _WIN32
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_FILE_NOT_FOUND);
+	map = mmap(NULL, stbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_FILE_NOT_FOUND);
+#else
+	map = malloc(stbuf.st_size);
+	if (map == NULL)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	f = fopen(fname, "rb");
+	if (f == NULL || fread(map, 1, stbuf.st_size, f) != (size_t) stbuf.st_size) {
+		if (f)
+			fclose(f);
+		free(map);
+		LOG_FUNC_RETURN(ctx, SC_ERROR_FILE_NOT_FOUND);
+	}
+	fclose(f);
+#endif
+	rd.p = map;
+	rd.end = map + stbuf.st_size;
+	rd.error = SC_SUCCESS;
+
+	r = SC_ERROR_CORRUPTED_DATA;
+	magic = snapshot_get_raw(&rd, sizeof(SNAPSHOT_MAGIC));
+	if (magic == NULL || memcmp(magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC))
+			|| snapshot_get_uint(&rd) != SNAPSHOT_VERSION) {
+		sc_log(ctx, "Snapshot %s was written by another version", fname);
+		goto out;
+	}
+	rec_key_len = snapshot_get_uint(&rd);
+	rec_key = snapshot_get_raw(&rd, rec_key_len);
+	if (rec_key == NULL || rec_key_len != key_len || memcmp(rec_key, key, key_len)) {
+		sc_log(ctx, "Snapshot %s is for another TokenInfo", fname);
+		goto out;
+	}
+	r = snapshot_get_tokeninfo(&rd, &tokeninfo);
+	if (r < 0)
+		goto out;
+	r = SC_ERROR_CORRUPTED_DATA;
+
+	/* Same DFs in the same order */
+	for (df = p15card->df_list; df; df = df->next) {
+		if (num_dfs == sizeof(dfs) / sizeof(dfs[0]))
+			goto out;
+		dfs[num_dfs++] = df;
+	}
+	if (snapshot_get_uint(&rd) != num_dfs)
+		goto out;
+	for (i = 0; i < num_dfs; i++) {
+		unsigned int type = snapshot_get_uint(&rd);
+		int record_length;
+
+		snapshot_get_path(&rd, &path);
+		record_length = snapshot_get_int(&rd);
+		if (rd.error || type != dfs[i]->type
+				|| !sc_compare_path(&path, &dfs[i]->path)
+				|| path.index != dfs[i]->path.index
+				|| path.count != dfs[i]->path.count
+				|| record_length != dfs[i]->record_length)
+			goto out;
+	}
+
+	num_objects = snapshot_get_uint(&rd);
+	for (i = 0; i < num_objects; i++) {
+		r = snapshot_get_object(&rd, dfs, num_dfs, &obj);
+		if (r < 0)
+			goto out;
+		if (tail)
+			tail->next = obj;
+		else
+			head = obj;
+		tail = obj;
+	}
+
+	r = SC_ERROR_CORRUPTED_DATA;
+	unusedspace_read = snapshot_get_int(&rd);
+	num_unusedspace = snapshot_get_uint(&rd);
+	if (rd.error)
+		goto out;
+	/* every entry takes at least 24 bytes */
+	if (num_unusedspace > (size_t) (rd.end - rd.p) / 24)
+		goto out;
+	if (num_unusedspace > sizeof(us) / sizeof(us[0])) {
+		unusedspace = calloc(num_unusedspace, sizeof(*unusedspace));
+		if (unusedspace == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			goto out;
+		}
+	}
+	for (i = 0; i < num_unusedspace; i++) {
+		snapshot_get_path(&rd, &unusedspace[i].path);
+		snapshot_get_id(&rd, &unusedspace[i].auth_id);
+	}
+	if (rd.error || rd.p != rd.end)
+		goto out;
+
+	*p15card->tokeninfo = tokeninfo;
+	memset(&tokeninfo, 0, sizeof(tokeninfo));
+	while ((obj = head) != NULL) {
+		head = obj->next;
+		obj->next = NULL;
+		sc_pkcs15_add_object(p15card, obj);
+	}
+	for (i = 0; i < num_dfs; i++)
+		dfs[i]->enumerated = 1;
+	if (unusedspace_read) {
+		for (i = 0; i < num_unusedspace; i++)
+			sc_pkcs15_add_unusedspace(p15card, &unusedspace[i].path, &unusedspace[i].auth_id);
+		p15card->unusedspace_read = 1;
+	}
+	sc_log(ctx, "Restored %u DFs and %u objects from snapshot", num_dfs, num_objects);
+	r = SC_SUCCESS;
+out:
+	while ((obj = head) != NULL) {
+		head = obj->next;
+		sc_pkcs15_free_object(obj);
+	}
+	if (unusedspace != us)
+		free(unusedspace);
+	snapshot_clear_tokeninfo(&tokeninfo);
+#ifndef _WIN32
+	munmap(map, stbuf.st_size);
+#else
+	free(map);
+#endif
+	LOG_FUNC_RETURN(ctx, r);
+}
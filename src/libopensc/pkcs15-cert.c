@@ -233,52 +233,103 @@ static const struct sc_asn1_entry c_asn1_cert[] = {
 };
 
 
+/* What a CDF entry decodes into, besides the object */
+struct cdf_entry {
+	struct sc_pkcs15_cert_info info;
+	u8 id_value[128];
+	int id_type;
+	size_t id_value_len;
+};
+
+struct cdf_templates {
+	struct sc_asn1_entry	asn1_cred_ident[3], asn1_com_cert_attr[4],
+				asn1_x509_cert_attr[2], asn1_type_cert_attr[2],
+				asn1_cert[2], asn1_x509_cert_value_choice[3];
+	struct sc_asn1_pkcs15_object cert_obj;
+};
+
+static void
+format_cdf_templates(struct cdf_templates *t, struct sc_pkcs15_object *obj,
+		struct cdf_entry *entry)
+{
+	struct sc_pkcs15_cert_info *info = &entry->info;
+	sc_pkcs15_der_t *der = &info->value;
+
+	sc_copy_asn1_entry(c_asn1_cred_ident, t->asn1_cred_ident);
+	sc_copy_asn1_entry(c_asn1_com_cert_attr, t->asn1_com_cert_attr);
+	sc_copy_asn1_entry(c_asn1_x509_cert_attr, t->asn1_x509_cert_attr);
+	sc_copy_asn1_entry(c_asn1_x509_cert_value_choice, t->asn1_x509_cert_value_choice);
+	sc_copy_asn1_entry(c_asn1_type_cert_attr, t->asn1_type_cert_attr);
+	sc_copy_asn1_entry(c_asn1_cert, t->asn1_cert);
+
+	t->cert_obj.p15_obj = obj;
+	t->cert_obj.asn1_class_attr = t->asn1_com_cert_attr;
+	t->cert_obj.asn1_subclass_attr = NULL;
+	t->cert_obj.asn1_type_attr = t->asn1_type_cert_attr;
+
+	sc_format_asn1_entry(t->asn1_cred_ident + 0, &entry->id_type, NULL, 0);
+	sc_format_asn1_entry(t->asn1_cred_ident + 1, &entry->id_value, &entry->id_value_len, 0);
+	sc_format_asn1_entry(t->asn1_com_cert_attr + 0, &info->id, NULL, 0);
+	sc_format_asn1_entry(t->asn1_com_cert_attr + 1, &info->authority, NULL, 0);
+	sc_format_asn1_entry(t->asn1_com_cert_attr + 2, t->asn1_cred_ident, NULL, 0);
+	sc_format_asn1_entry(t->asn1_x509_cert_attr + 0, t->asn1_x509_cert_value_choice, NULL, 0);
+	sc_format_asn1_entry(t->asn1_x509_cert_value_choice + 0, &info->path, NULL, 0);
+	sc_format_asn1_entry(t->asn1_x509_cert_value_choice + 1, &der->value, &der->len, 0);
+	sc_format_asn1_entry(t->asn1_type_cert_attr + 0, t->asn1_x509_cert_attr, NULL, 0);
+	sc_format_asn1_entry(t->asn1_cert + 0, &t->cert_obj, NULL, 0);
+}
+
+static int
+compile_cdf_templates(struct sc_context *ctx, struct sc_asn1_program **prog)
+{
+	struct sc_pkcs15_object obj;
+	struct cdf_entry entry;
+	struct cdf_templates t;
+	void *bases[2] = { &obj, &entry };
+	size_t sizes[2] = { sizeof(obj), sizeof(entry) };
+
+	format_cdf_templates(&t, &obj, &entry);
+	return sc_asn1_compile(ctx, t.asn1_cert, bases, sizes, 2, NULL, 0, prog);
+}
+
+
 int
 sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj,
 		const u8 ** buf, size_t *buflen)
 {
         sc_context_t *ctx = p15card->card->ctx;
+	const struct sc_asn1_program *prog = NULL;
+	struct cdf_entry entry;
 	struct sc_pkcs15_cert_info info;
-	struct sc_asn1_entry	asn1_cred_ident[3], asn1_com_cert_attr[4],
-				asn1_x509_cert_attr[2], asn1_type_cert_attr[2],
-				asn1_cert[2], asn1_x509_cert_value_choice[3];
-	struct sc_asn1_pkcs15_object cert_obj = { obj, asn1_com_cert_attr, NULL,
-					     asn1_type_cert_attr };
-	sc_pkcs15_der_t *der = &info.value;
-	u8 id_value[128];
-	int id_type;
-	size_t id_value_len = sizeof(id_value);
+	sc_pkcs15_der_t *der = &entry.info.value;
 	int r;
 
-	sc_copy_asn1_entry(c_asn1_cred_ident, asn1_cred_ident);
-	sc_copy_asn1_entry(c_asn1_com_cert_attr, asn1_com_cert_attr);
-	sc_copy_asn1_entry(c_asn1_x509_cert_attr, asn1_x509_cert_attr);
-	sc_copy_asn1_entry(c_asn1_x509_cert_value_choice, asn1_x509_cert_value_choice);
-	sc_copy_asn1_entry(c_asn1_type_cert_attr, asn1_type_cert_attr);
-	sc_copy_asn1_entry(c_asn1_cert, asn1_cert);
+        /* Fill in defaults */
+	memset(&entry, 0, sizeof(entry));
+	entry.id_value_len = sizeof(entry.id_value);
+	entry.info.authority = 0;
 
-	sc_format_asn1_entry(asn1_cred_ident + 0, &id_type, NULL, 0);
-	sc_format_asn1_entry(asn1_cred_ident + 1, &id_value, &id_value_len, 0);
-	sc_format_asn1_entry(asn1_com_cert_attr + 0, &info.id, NULL, 0);
-	sc_format_asn1_entry(asn1_com_cert_attr + 1, &info.authority, NULL, 0);
-	sc_format_asn1_entry(asn1_com_cert_attr + 2, asn1_cred_ident, NULL, 0);
-	sc_format_asn1_entry(asn1_x509_cert_attr + 0, asn1_x509_cert_value_choice, NULL, 0);
-	sc_format_asn1_entry(asn1_x509_cert_value_choice + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_x509_cert_value_choice + 1, &der->value, &der->len, 0);
-	sc_format_asn1_entry(asn1_type_cert_attr + 0, asn1_x509_cert_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_cert + 0, &cert_obj, NULL, 0);
+	if (p15card->opts.use_compiled_asn1
+			&& sc_asn1_get_program(ctx, SC_ASN1_PROGRAM_CDF, compile_cdf_templates, &prog) < 0)
+		prog = NULL;
+	if (prog != NULL) {
+		void *bases[2] = { obj, &entry };
 
-        /* Fill in defaults */
-        memset(&info, 0, sizeof(info));
-	info.authority = 0;
+		r = sc_asn1_run(ctx, prog, bases, *buf, *buflen, buf, buflen, 0, NULL);
+	}
+	else {
+		struct cdf_templates t;
 
-	r = sc_asn1_decode(ctx, asn1_cert, *buf, *buflen, buf, buflen);
+		format_cdf_templates(&t, obj, &entry);
+		r = sc_asn1_decode(ctx, t.asn1_cert, *buf, *buflen, buf, buflen);
+	}
 	/* In case of error, trash the cert value (direct coding) */
 	if (r < 0 && der->value)
 		free(der->value);
 	if (r == SC_ERROR_ASN1_END_OF_CONTENTS)
 		return r;
 	LOG_TEST_RET(ctx, r, "ASN.1 decoding failed");
+	info = entry.info;
 
 	if (!p15card->app || !p15card->app->ddo.aid.len)   {
 		r = sc_pkcs15_make_absolute_path(&p15card->file_app->path, &info.path);
@@ -30,6 +30,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "internal.h"
 #include "cardctl.h"
@@ -38,6 +40,9 @@
 
 #define MANU_ID		"piv_II "
 
+/* the number of cert, pubkey and prkey triplets */
+#define PIV_NUM_CERTS_AND_KEYS 24
+
 int sc_pkcs15emu_piv_init_ex(sc_pkcs15_card_t *, sc_pkcs15emu_opt_t *);
 
 typedef struct objdata_st {
@@ -224,6 +229,141 @@ static int piv_get_guid(struct sc_pkcs15_card *p15card, const struct sc_pkcs15_o
 }
 
 
+/*
+ * Reading every certificate of the card only to learn the algorithm
+ * and size of its keys takes seconds. With the file cache enabled the
+ * key information is kept in the cache directory, together with the
+ * certificates. The CRC of the CHUID and CCC of the card is the cache
+ * tag, part of the names of the keys file and of the cached certs, so
+ * a reissued card is read again.
+ */
+#define PIV_KEYS_MAGIC		"OSCPIVK1"
+#define PIV_KEYS_SIZE		(8 + PIV_NUM_CERTS_AND_KEYS * 12)
+
+static int piv_cache_tag(struct sc_pkcs15_card *p15card)
+{
+	static const char *ids[] = { "3000", "DB00" };
+	unsigned int crc[2] = { 0, 0 };
+	char tag[24];
+	sc_path_t path;
+	u8 *data;
+	size_t len, i;
+	int r, use_file_cache;
+
+	/* CHUID and, when the card has one, CCC, as found on the card */
+	use_file_cache = p15card->opts.use_file_cache;
+	p15card->opts.use_file_cache = 0;
+	for (i = 0; i < 2; i++) {
+		sc_format_path(ids[i], &path);
+		data = NULL;
+		len = 0;
+		r = sc_pkcs15_read_file(p15card, &path, &data, &len);
+		if (r == SC_SUCCESS)
+			crc[i] = sc_crc32(data, len);
+		free(data);
+		if (r && i == 0)
+			break;
+	}
+	p15card->opts.use_file_cache = use_file_cache;
+	if (r && i == 0)
+		return r;
+
+	snprintf(tag, sizeof(tag), "PIV_%08X%08X", crc[0], crc[1]);
+	free(p15card->cache_tag);
+	p15card->cache_tag = strdup(tag);
+	if (p15card->cache_tag == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	return SC_SUCCESS;
+}
+
+static int piv_keys_cache_filename(struct sc_pkcs15_card *p15card,
+		char *buf, size_t bufsize)
+{
+	char dir[PATH_MAX];
+	int r;
+
+	r = sc_get_cache_dir(p15card->card->ctx, dir, sizeof(dir));
+	if (r)
+		return r;
+	r = piv_cache_tag(p15card);
+	if (r)
+		return r;
+
+	r = snprintf(buf, bufsize, "%s/%s_%s.keys", dir,
+			p15card->tokeninfo->serial_number, p15card->cache_tag);
+	if (r < 0 || (size_t) r >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static unsigned long piv_keys_get(const u8 *p)
+{
+	return ((unsigned long) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void piv_keys_put(u8 *p, unsigned long v)
+{
+	p[0] = (v >> 24) & 0xFF;
+	p[1] = (v >> 16) & 0xFF;
+	p[2] = (v >> 8) & 0xFF;
+	p[3] = v & 0xFF;
+}
+
+static int piv_read_keys_cache(const char *fname, common_key_info *ckis)
+{
+	u8 buf[PIV_KEYS_SIZE + 1], *p;
+	size_t len;
+	FILE *f;
+	int i;
+
+	f = fopen(fname, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	len = fread(buf, 1, sizeof(buf), f);
+	fclose(f);
+	if (len != PIV_KEYS_SIZE || memcmp(buf, PIV_KEYS_MAGIC, 8) != 0)
+		return SC_ERROR_CORRUPTED_DATA;
+
+	memset(ckis, 0, PIV_NUM_CERTS_AND_KEYS * sizeof(*ckis));
+	for (i = 0, p = buf + 8; i < PIV_NUM_CERTS_AND_KEYS; i++, p += 12) {
+		ckis[i].cert_found = piv_keys_get(p) != 0;
+		ckis[i].key_alg = (int) piv_keys_get(p + 4) - 1;
+		ckis[i].pubkey_len = piv_keys_get(p + 8);
+	}
+	return SC_SUCCESS;
+}
+
+static int piv_write_keys_cache(struct sc_pkcs15_card *p15card,
+		const char *fname, const common_key_info *ckis)
+{
+	u8 buf[PIV_KEYS_SIZE], *p;
+	size_t len;
+	FILE *f;
+	int i;
+
+	memcpy(buf, PIV_KEYS_MAGIC, 8);
+	for (i = 0, p = buf + 8; i < PIV_NUM_CERTS_AND_KEYS; i++, p += 12) {
+		piv_keys_put(p, ckis[i].cert_found);
+		piv_keys_put(p + 4, (unsigned long) (ckis[i].key_alg + 1));
+		piv_keys_put(p + 8, ckis[i].pubkey_len);
+	}
+
+	f = fopen(fname, "wb");
+	if (f == NULL && errno == ENOENT) {
+		if (sc_make_cache_dir(p15card->card->ctx) < 0)
+			return SC_ERROR_INTERNAL;
+		f = fopen(fname, "wb");
+	}
+	if (f == NULL)
+		return SC_ERROR_INTERNAL;
+	len = fwrite(buf, 1, sizeof(buf), f);
+	if (fclose(f) != 0 || len != sizeof(buf)) {
+		remove(fname);
+		return SC_ERROR_INTERNAL;
+	}
+	return SC_SUCCESS;
+}
+
 static int piv_detect_card(sc_pkcs15_card_t *p15card)
 {
 	sc_card_t *card = p15card->card;
@@ -320,9 +460,6 @@ static int sc_pkcs15emu_piv_init(sc_pkcs15_card_t *p15card)
 	 * not require this.
 	 */
 	/* certs will be pulled out from the cert objects */
-	/* the number of cert, pubkey and prkey triplets */
-
-#define PIV_NUM_CERTS_AND_KEYS 24
 
 	static const cdata certs[PIV_NUM_CERTS_AND_KEYS] = {
 		{"1", "Certificate for PIV Authentication", 0, "0101cece", 0},
@@ -605,6 +742,8 @@ static int sc_pkcs15emu_piv_init(sc_pkcs15_card_t *p15card)
 	sc_serial_number_t serial;
 	char buf[SC_MAX_SERIALNR * 2 + 1];
 	common_key_info ckis[PIV_NUM_CERTS_AND_KEYS];
+	char keys_file[PATH_MAX];
+	int keys_cached = 0, certs_cached = 1, use_file_cache;
 
 
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_VERBOSE);
@@ -626,10 +765,18 @@ static int sc_pkcs15emu_piv_init(sc_pkcs15_card_t *p15card)
 	if (r < 0) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL,"sc_card_ctl rc=%d",r);
 		p15card->tokeninfo->serial_number = strdup("00000000");
+		keys_file[0] = '\0';
 	} else {
 		sc_bin_to_hex(serial.value, serial.len, buf, sizeof(buf), 0);
 		p15card->tokeninfo->serial_number = strdup(buf);
+		if (!p15card->opts.use_file_cache
+				|| piv_keys_cache_filename(p15card, keys_file, sizeof(keys_file)))
+			keys_file[0] = '\0';
 	}
+	/* Without the cache tag, cached certs of an earlier issue of the
+	 * card could not be told apart */
+	if (p15card->cache_tag == NULL)
+		p15card->opts.use_file_cache = 0;
 
 	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "PIV-II adding objects...");
 
@@ -692,17 +839,27 @@ static int sc_pkcs15emu_piv_init(sc_pkcs15_card_t *p15card)
 	 */
 	/* set certs */
 	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "PIV-II adding certs...");
+	if (keys_file[0] && piv_read_keys_cache(keys_file, ckis) == SC_SUCCESS) {
+		sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "Key information from %s", keys_file);
+		keys_cached = 1;
+	}
+	/* The cached certs may belong to an earlier issue of the card */
+	use_file_cache = p15card->opts.use_file_cache;
+	if (!keys_cached)
+		p15card->opts.use_file_cache = 0;
 	for (i = 0; i < PIV_NUM_CERTS_AND_KEYS; i++) {
 		struct sc_pkcs15_cert_info cert_info;
 		struct sc_pkcs15_object    cert_obj;
 		sc_pkcs15_der_t   cert_der;
 		sc_pkcs15_cert_t *cert_out;
 		
-		ckis[i].cert_found = 0;
-		ckis[i].key_alg = -1;
-		ckis[i].pubkey_found = 0;
-		ckis[i].pubkey_from_file = 0;
-		ckis[i].pubkey_len = 0;
+		if (!keys_cached) {
+			ckis[i].cert_found = 0;
+			ckis[i].key_alg = -1;
+			ckis[i].pubkey_found = 0;
+			ckis[i].pubkey_from_file = 0;
+			ckis[i].pubkey_len = 0;
+		}
 
 		memset(&cert_info, 0, sizeof(cert_info));
 		memset(&cert_obj,  0, sizeof(cert_obj));
@@ -714,6 +871,16 @@ static int sc_pkcs15emu_piv_init(sc_pkcs15_card_t *p15card)
 		strncpy(cert_obj.label, certs[i].label, SC_PKCS15_MAX_LABEL_SIZE - 1);
 		cert_obj.flags = certs[i].obj_flags;
 
+		/* The cert is read when first used, from the file cache or the card */
+		if (keys_cached) {
+			if (ckis[i].cert_found && ckis[i].key_alg != -1) {
+				r = sc_pkcs15emu_add_x509_cert(p15card, &cert_obj, &cert_info);
+				if (r < 0)
+					sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, " Failed to add cert obj r=%d",r);
+			}
+			continue;
+		}
+
 		/* See if the cert might be present or not. */
 		r = (card->ops->card_ctl)(card, SC_CARDCTL_PIV_OBJECT_PRESENT, &cert_info.path);
 		if (r == 1) {
@@ -729,6 +896,9 @@ static int sc_pkcs15emu_piv_init(sc_pkcs15_card_t *p15card)
 		}
 
 		ckis[i].cert_found = 1;
+		if (keys_file[0] && sc_pkcs15_cache_file(p15card, &cert_info.path,
+					cert_der.value, cert_der.len) != SC_SUCCESS)
+			certs_cached = 0;
 		/* cache it using the PKCS15 emulation objects */
 		/* as it does not change */
                	if (cert_der.value) {
@@ -763,6 +933,14 @@ static int sc_pkcs15emu_piv_init(sc_pkcs15_card_t *p15card)
 			continue;
 		}
 	}
+	p15card->opts.use_file_cache = use_file_cache;
+
+	/* Next time the certs only have to be read when used */
+	if (keys_file[0] && !keys_cached && certs_cached) {
+		r = piv_write_keys_cache(p15card, keys_file, ckis);
+		if (r < 0)
+			sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "Cannot write %s r=%d", keys_file, r);
+	}
 
 	/* set pins */
 	sc_debug(card->ctx, SC_LOG_DEBUG_NORMAL, "PIV-II adding pins...");
@@ -159,16 +159,14 @@ static const struct sc_asn1_entry c_asn1_prkey[C_ASN1_PRKEY_SIZE] = {
 };
 
 
-int sc_pkcs15_decode_prkdf_entry(struct sc_pkcs15_card *p15card,
-				 struct sc_pkcs15_object *obj,
-				 const u8 ** buf, size_t *buflen)
-{
-	sc_context_t *ctx = p15card->card->ctx;
+/* What a PrKDF entry decodes into, besides the object */
+struct prkdf_entry {
 	struct sc_pkcs15_prkey_info info;
-	int r, i, gostr3410_params[3];
-	struct sc_pkcs15_keyinfo_gostparams *keyinfo_gostparams;
-	size_t usage_len = sizeof(info.usage);
-	size_t af_len = sizeof(info.access_flags);
+	int gostr3410_params[3];
+	size_t usage_len, af_len;
+};
+
+struct prkdf_templates {
 	struct sc_asn1_entry asn1_com_key_attr[C_ASN1_COM_KEY_ATTR_SIZE];
 	struct sc_asn1_entry asn1_com_prkey_attr[C_ASN1_COM_PRKEY_ATTR_SIZE];
 	struct sc_asn1_entry asn1_rsakey_attr[C_ASN1_RSAKEY_ATTR_SIZE];
@@ -183,89 +181,147 @@ int sc_pkcs15_decode_prkdf_entry(struct sc_pkcs15_card *p15card,
 	struct sc_asn1_entry asn1_prk_ecc_attr[C_ASN1_PRK_ECC_ATTR];
 	struct sc_asn1_entry asn1_prkey[C_ASN1_PRKEY_SIZE];
 	struct sc_asn1_entry asn1_supported_algorithms[C_ASN1_SUPPORTED_ALGORITHMS_SIZE];
-	struct sc_asn1_pkcs15_object rsa_prkey_obj = {obj, asn1_com_key_attr, asn1_com_prkey_attr, asn1_prk_rsa_attr};
-	struct sc_asn1_pkcs15_object dsa_prkey_obj = {obj, asn1_com_key_attr, asn1_com_prkey_attr, asn1_prk_dsa_attr};
-	struct sc_asn1_pkcs15_object gostr3410_prkey_obj = {obj, asn1_com_key_attr, asn1_com_prkey_attr, asn1_prk_gostr3410_attr};
-	struct sc_asn1_pkcs15_object ecc_prkey_obj = { obj, asn1_com_key_attr, asn1_com_prkey_attr, asn1_prk_ecc_attr };
-
-	sc_copy_asn1_entry(c_asn1_prkey, asn1_prkey);
-	sc_copy_asn1_entry(c_asn1_supported_algorithms, asn1_supported_algorithms);
-
-	sc_copy_asn1_entry(c_asn1_prk_rsa_attr, asn1_prk_rsa_attr);
-	sc_copy_asn1_entry(c_asn1_rsakey_attr, asn1_rsakey_attr);
-	sc_copy_asn1_entry(c_asn1_prk_dsa_attr, asn1_prk_dsa_attr);
-	sc_copy_asn1_entry(c_asn1_dsakey_attr, asn1_dsakey_attr);
-	sc_copy_asn1_entry(c_asn1_dsakey_value_attr, asn1_dsakey_value_attr);
-	sc_copy_asn1_entry(c_asn1_dsakey_i_p_attr, asn1_dsakey_i_p_attr);
-	sc_copy_asn1_entry(c_asn1_prk_gostr3410_attr, asn1_prk_gostr3410_attr);
-	sc_copy_asn1_entry(c_asn1_gostr3410key_attr, asn1_gostr3410key_attr);
-	sc_copy_asn1_entry(c_asn1_prk_ecc_attr, asn1_prk_ecc_attr);
-	sc_copy_asn1_entry(c_asn1_ecckey_attr, asn1_ecckey_attr);
-
-	sc_copy_asn1_entry(c_asn1_com_prkey_attr, asn1_com_prkey_attr);
-	sc_copy_asn1_entry(c_asn1_com_key_attr, asn1_com_key_attr);
-
-	sc_format_asn1_entry(asn1_prkey + 0, &rsa_prkey_obj, NULL, 0);
-	sc_format_asn1_entry(asn1_prkey + 1, &ecc_prkey_obj, NULL, 0);
-	sc_format_asn1_entry(asn1_prkey + 2, &dsa_prkey_obj, NULL, 0);
-	sc_format_asn1_entry(asn1_prkey + 3, &gostr3410_prkey_obj, NULL, 0);
-
-	sc_format_asn1_entry(asn1_prk_rsa_attr + 0, asn1_rsakey_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_prk_dsa_attr + 0, asn1_dsakey_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_prk_gostr3410_attr + 0, asn1_gostr3410key_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_prk_ecc_attr + 0, asn1_ecckey_attr, NULL, 0);
-
-	sc_format_asn1_entry(asn1_rsakey_attr + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_rsakey_attr + 1, &info.modulus_length, NULL, 0);
-
-	sc_format_asn1_entry(asn1_dsakey_attr + 0, asn1_dsakey_value_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_dsakey_value_attr + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_dsakey_value_attr + 1, asn1_dsakey_i_p_attr, NULL, 0);
-	sc_format_asn1_entry(asn1_dsakey_i_p_attr + 0, &info.path, NULL, 0);
-
-	sc_format_asn1_entry(asn1_gostr3410key_attr + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_gostr3410key_attr + 1, &gostr3410_params[0], NULL, 0);
-	sc_format_asn1_entry(asn1_gostr3410key_attr + 2, &gostr3410_params[1], NULL, 0);
-	sc_format_asn1_entry(asn1_gostr3410key_attr + 3, &gostr3410_params[2], NULL, 0);
+	struct sc_asn1_pkcs15_object rsa_prkey_obj, dsa_prkey_obj, gostr3410_prkey_obj, ecc_prkey_obj;
+};
 
-	sc_format_asn1_entry(asn1_ecckey_attr + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_ecckey_attr + 1, &info.field_length, NULL, 0);
+static void
+format_prkdf_templates(struct prkdf_templates *t, struct sc_pkcs15_object *obj,
+		struct prkdf_entry *entry)
+{
+	struct sc_pkcs15_prkey_info *info = &entry->info;
+	struct sc_asn1_pkcs15_object rsa_prkey_obj = {obj, t->asn1_com_key_attr, t->asn1_com_prkey_attr, t->asn1_prk_rsa_attr};
+	struct sc_asn1_pkcs15_object dsa_prkey_obj = {obj, t->asn1_com_key_attr, t->asn1_com_prkey_attr, t->asn1_prk_dsa_attr};
+	struct sc_asn1_pkcs15_object gostr3410_prkey_obj = {obj, t->asn1_com_key_attr, t->asn1_com_prkey_attr, t->asn1_prk_gostr3410_attr};
+	struct sc_asn1_pkcs15_object ecc_prkey_obj = { obj, t->asn1_com_key_attr, t->asn1_com_prkey_attr, t->asn1_prk_ecc_attr };
+	int i;
+
+	t->rsa_prkey_obj = rsa_prkey_obj;
+	t->dsa_prkey_obj = dsa_prkey_obj;
+	t->gostr3410_prkey_obj = gostr3410_prkey_obj;
+	t->ecc_prkey_obj = ecc_prkey_obj;
+
+	sc_copy_asn1_entry(c_asn1_prkey, t->asn1_prkey);
+	sc_copy_asn1_entry(c_asn1_supported_algorithms, t->asn1_supported_algorithms);
+
+	sc_copy_asn1_entry(c_asn1_prk_rsa_attr, t->asn1_prk_rsa_attr);
+	sc_copy_asn1_entry(c_asn1_rsakey_attr, t->asn1_rsakey_attr);
+	sc_copy_asn1_entry(c_asn1_prk_dsa_attr, t->asn1_prk_dsa_attr);
+	sc_copy_asn1_entry(c_asn1_dsakey_attr, t->asn1_dsakey_attr);
+	sc_copy_asn1_entry(c_asn1_dsakey_value_attr, t->asn1_dsakey_value_attr);
+	sc_copy_asn1_entry(c_asn1_dsakey_i_p_attr, t->asn1_dsakey_i_p_attr);
+	sc_copy_asn1_entry(c_asn1_prk_gostr3410_attr, t->asn1_prk_gostr3410_attr);
+	sc_copy_asn1_entry(c_asn1_gostr3410key_attr, t->asn1_gostr3410key_attr);
+	sc_copy_asn1_entry(c_asn1_prk_ecc_attr, t->asn1_prk_ecc_attr);
+	sc_copy_asn1_entry(c_asn1_ecckey_attr, t->asn1_ecckey_attr);
+
+	sc_copy_asn1_entry(c_asn1_com_prkey_attr, t->asn1_com_prkey_attr);
+	sc_copy_asn1_entry(c_asn1_com_key_attr, t->asn1_com_key_attr);
+
+	sc_format_asn1_entry(t->asn1_prkey + 0, &t->rsa_prkey_obj, NULL, 0);
+	sc_format_asn1_entry(t->asn1_prkey + 1, &t->ecc_prkey_obj, NULL, 0);
+	sc_format_asn1_entry(t->asn1_prkey + 2, &t->dsa_prkey_obj, NULL, 0);
+	sc_format_asn1_entry(t->asn1_prkey + 3, &t->gostr3410_prkey_obj, NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_prk_rsa_attr + 0, t->asn1_rsakey_attr, NULL, 0);
+	sc_format_asn1_entry(t->asn1_prk_dsa_attr + 0, t->asn1_dsakey_attr, NULL, 0);
+	sc_format_asn1_entry(t->asn1_prk_gostr3410_attr + 0, t->asn1_gostr3410key_attr, NULL, 0);
+	sc_format_asn1_entry(t->asn1_prk_ecc_attr + 0, t->asn1_ecckey_attr, NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_rsakey_attr + 0, &info->path, NULL, 0);
+	sc_format_asn1_entry(t->asn1_rsakey_attr + 1, &info->modulus_length, NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_dsakey_attr + 0, t->asn1_dsakey_value_attr, NULL, 0);
+	sc_format_asn1_entry(t->asn1_dsakey_value_attr + 0, &info->path, NULL, 0);
+	sc_format_asn1_entry(t->asn1_dsakey_value_attr + 1, t->asn1_dsakey_i_p_attr, NULL, 0);
+	sc_format_asn1_entry(t->asn1_dsakey_i_p_attr + 0, &info->path, NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_gostr3410key_attr + 0, &info->path, NULL, 0);
+	sc_format_asn1_entry(t->asn1_gostr3410key_attr + 1, &entry->gostr3410_params[0], NULL, 0);
+	sc_format_asn1_entry(t->asn1_gostr3410key_attr + 2, &entry->gostr3410_params[1], NULL, 0);
+	sc_format_asn1_entry(t->asn1_gostr3410key_attr + 3, &entry->gostr3410_params[2], NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_ecckey_attr + 0, &info->path, NULL, 0);
+	sc_format_asn1_entry(t->asn1_ecckey_attr + 1, &info->field_length, NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_com_key_attr + 0, &info->id, NULL, 0);
+	sc_format_asn1_entry(t->asn1_com_key_attr + 1, &info->usage, &entry->usage_len, 0);
+	sc_format_asn1_entry(t->asn1_com_key_attr + 2, &info->native, NULL, 0);
+	sc_format_asn1_entry(t->asn1_com_key_attr + 3, &info->access_flags, &entry->af_len, 0);
+	sc_format_asn1_entry(t->asn1_com_key_attr + 4, &info->key_reference, NULL, 0);
+
+	for (i=0; i<SC_MAX_SUPPORTED_ALGORITHMS && (t->asn1_supported_algorithms + i)->name; i++)
+		sc_format_asn1_entry(t->asn1_supported_algorithms + i, &info->algo_refs[i], NULL, 0);
+	sc_format_asn1_entry(t->asn1_com_key_attr + 5, t->asn1_supported_algorithms, NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_com_prkey_attr + 0, &info->subject.value, &info->subject.len, 0);
+}
 
-	sc_format_asn1_entry(asn1_com_key_attr + 0, &info.id, NULL, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 1, &info.usage, &usage_len, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 2, &info.native, NULL, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 3, &info.access_flags, &af_len, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 4, &info.key_reference, NULL, 0);
+static int
+compile_prkdf_templates(struct sc_context *ctx, struct sc_asn1_program **prog)
+{
+	struct sc_pkcs15_object obj;
+	struct prkdf_entry entry;
+	struct prkdf_templates t;
+	void *bases[2] = { &obj, &entry };
+	size_t sizes[2] = { sizeof(obj), sizeof(entry) };
+	const struct sc_asn1_entry *marks[1] = { t.asn1_dsakey_i_p_attr + 0 };
+
+	format_prkdf_templates(&t, &obj, &entry);
+	return sc_asn1_compile(ctx, t.asn1_prkey, bases, sizes, 2, marks, 1, prog);
+}
 
-	for (i=0; i<SC_MAX_SUPPORTED_ALGORITHMS && (asn1_supported_algorithms + i)->name; i++)
-		sc_format_asn1_entry(asn1_supported_algorithms + i, &info.algo_refs[i], NULL, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 5, asn1_supported_algorithms, NULL, 0);
 
-	sc_format_asn1_entry(asn1_com_prkey_attr + 0, &info.subject.value, &info.subject.len, 0);
+int sc_pkcs15_decode_prkdf_entry(struct sc_pkcs15_card *p15card,
+				 struct sc_pkcs15_object *obj,
+				 const u8 ** buf, size_t *buflen)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	const struct sc_asn1_program *prog = NULL;
+	struct prkdf_entry entry;
+	struct sc_pkcs15_prkey_info info;
+	int r, i, *gostr3410_params = entry.gostr3410_params;
+	int path_protected = 0;
+	struct sc_pkcs15_keyinfo_gostparams *keyinfo_gostparams;
 
 	/* Fill in defaults */
-	memset(&info, 0, sizeof(info));
-	info.key_reference = -1;
-	info.native = 1;
-	memset(gostr3410_params, 0, sizeof(gostr3410_params));
+	memset(&entry, 0, sizeof(entry));
+	entry.usage_len = sizeof(entry.info.usage);
+	entry.af_len = sizeof(entry.info.access_flags);
+	entry.info.key_reference = -1;
+	entry.info.native = 1;
+
+	if (p15card->opts.use_compiled_asn1
+			&& sc_asn1_get_program(ctx, SC_ASN1_PROGRAM_PRKDF, compile_prkdf_templates, &prog) < 0)
+		prog = NULL;
+	if (prog != NULL) {
+		void *bases[2] = { obj, &entry };
+
+		r = sc_asn1_run(ctx, prog, bases, *buf, *buflen, buf, buflen, 1, &path_protected);
+	}
+	else {
+		struct prkdf_templates t;
 
-	r = sc_asn1_decode_choice(ctx, asn1_prkey, *buf, *buflen, buf, buflen);
+		format_prkdf_templates(&t, obj, &entry);
+		r = sc_asn1_decode_choice(ctx, t.asn1_prkey, *buf, *buflen, buf, buflen);
+		path_protected = (t.asn1_dsakey_i_p_attr[0].flags & SC_ASN1_PRESENT) != 0;
+	}
 	if (r == SC_ERROR_ASN1_END_OF_CONTENTS)
 		return r;
 	LOG_TEST_RET(ctx, r, "PrKey DF ASN.1 decoding failed");
-	if (asn1_prkey[0].flags & SC_ASN1_PRESENT) {
+	info = entry.info;
+	if (r == 0) {
 		obj->type = SC_PKCS15_TYPE_PRKEY_RSA;
 	}
-	else if (asn1_prkey[1].flags & SC_ASN1_PRESENT) {
+	else if (r == 1) {
 		obj->type = SC_PKCS15_TYPE_PRKEY_EC;
 	}
-	else if (asn1_prkey[2].flags & SC_ASN1_PRESENT) {
+	else if (r == 2) {
 		obj->type = SC_PKCS15_TYPE_PRKEY_DSA;
 		/* If the value was indirect-protected, mark the path */
-		if (asn1_dsakey_i_p_attr[0].flags & SC_ASN1_PRESENT)
+		if (path_protected)
 			info.path.type = SC_PATH_TYPE_PATH_PROT;
 	}
-	else if (asn1_prkey[3].flags & SC_ASN1_PRESENT) {
+	else if (r == 3) {
 		obj->type = SC_PKCS15_TYPE_PRKEY_GOSTR3410;
 		assert(info.modulus_length == 0);
 		info.modulus_length = SC_PKCS15_GOSTR3410_KEYSIZE;
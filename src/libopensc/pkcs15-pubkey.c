@@ -151,17 +151,14 @@ static const struct sc_asn1_entry c_asn1_pubkey[C_ASN1_PUBKEY_SIZE] = {
 	{ NULL, 0, 0, 0, NULL, NULL }
 };
 
-int sc_pkcs15_decode_pukdf_entry(struct sc_pkcs15_card *p15card,
-				 struct sc_pkcs15_object *obj,
-				 const u8 ** buf, size_t *buflen)
-{
-	sc_context_t *ctx = p15card->card->ctx;
+/* What a PuKDF entry decodes into, besides the object */
+struct pukdf_entry {
 	struct sc_pkcs15_pubkey_info info;
-	int r, gostr3410_params[3];
-	struct sc_pkcs15_keyinfo_gostparams *keyinfo_gostparams;
-	size_t usage_len = sizeof(info.usage);
-	size_t af_len = sizeof(info.access_flags);
-	struct sc_pkcs15_der *der = &obj->content;
+	int gostr3410_params[3];
+	size_t usage_len, af_len;
+};
+
+struct pukdf_templates {
 	struct sc_asn1_entry asn1_com_key_attr[C_ASN1_COM_KEY_ATTR_SIZE];
 	struct sc_asn1_entry asn1_com_pubkey_attr[C_ASN1_COM_PUBKEY_ATTR_SIZE];
 	struct sc_asn1_entry asn1_rsakey_value_choice[C_ASN1_RSAKEY_VALUE_CHOICE_SIZE];
@@ -176,85 +173,148 @@ int sc_pkcs15_decode_pukdf_entry(struct sc_pkcs15_card *p15card,
 	struct sc_asn1_entry asn1_gostr3410_type_attr[C_ASN1_GOST3410_TYPE_ATTR_SIZE];
 	struct sc_asn1_entry asn1_pubkey_choice[C_ASN1_PUBKEY_CHOICE_SIZE];
 	struct sc_asn1_entry asn1_pubkey[C_ASN1_PUBKEY_SIZE];
-	struct sc_asn1_pkcs15_object rsakey_obj = { obj, asn1_com_key_attr,
-						    asn1_com_pubkey_attr, asn1_rsa_type_attr };
-	struct sc_asn1_pkcs15_object eckey_obj = { obj, asn1_com_key_attr,
-						    asn1_com_pubkey_attr, asn1_ec_type_attr };
-	struct sc_asn1_pkcs15_object dsakey_obj = { obj, asn1_com_key_attr,
-						    asn1_com_pubkey_attr, asn1_dsa_type_attr };
-	struct sc_asn1_pkcs15_object gostr3410key_obj =  { obj, asn1_com_key_attr,
-						    asn1_com_pubkey_attr, asn1_gostr3410_type_attr };
-
-	sc_copy_asn1_entry(c_asn1_pubkey, asn1_pubkey);
-	sc_copy_asn1_entry(c_asn1_pubkey_choice, asn1_pubkey_choice);
-	sc_copy_asn1_entry(c_asn1_rsa_type_attr, asn1_rsa_type_attr);
-	sc_copy_asn1_entry(c_asn1_rsakey_value_choice, asn1_rsakey_value_choice);
-	sc_copy_asn1_entry(c_asn1_rsakey_attr, asn1_rsakey_attr);
-	sc_copy_asn1_entry(c_asn1_ec_type_attr, asn1_ec_type_attr);
-	sc_copy_asn1_entry(c_asn1_eckey_value_choice, asn1_eckey_value_choice);
-	sc_copy_asn1_entry(c_asn1_eckey_attr, asn1_eckey_attr);
-	sc_copy_asn1_entry(c_asn1_dsa_type_attr, asn1_dsa_type_attr);
-	sc_copy_asn1_entry(c_asn1_dsakey_attr, asn1_dsakey_attr);
-	sc_copy_asn1_entry(c_asn1_gostr3410_type_attr, asn1_gostr3410_type_attr);
-	sc_copy_asn1_entry(c_asn1_gostr3410key_attr, asn1_gostr3410key_attr);
-	sc_copy_asn1_entry(c_asn1_com_pubkey_attr, asn1_com_pubkey_attr);
-	sc_copy_asn1_entry(c_asn1_com_key_attr, asn1_com_key_attr);
-
-	sc_format_asn1_entry(asn1_com_pubkey_attr + 0, &info.subject.value, &info.subject.len, 0);
-
-	sc_format_asn1_entry(asn1_pubkey_choice + 0, &rsakey_obj, NULL, 0);
-	sc_format_asn1_entry(asn1_pubkey_choice + 1, &dsakey_obj, NULL, 0);
-	sc_format_asn1_entry(asn1_pubkey_choice + 2, &gostr3410key_obj, NULL, 0);
-	sc_format_asn1_entry(asn1_pubkey_choice + 3, &eckey_obj, NULL, 0);
-
-	sc_format_asn1_entry(asn1_rsa_type_attr + 0, asn1_rsakey_attr, NULL, 0);
-
-	sc_format_asn1_entry(asn1_rsakey_value_choice + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_rsakey_value_choice + 1, &der->value, &der->len, 0);
-
-	sc_format_asn1_entry(asn1_rsakey_attr + 0, asn1_rsakey_value_choice, NULL, 0);
-	sc_format_asn1_entry(asn1_rsakey_attr + 1, &info.modulus_length, NULL, 0);
-
-	sc_format_asn1_entry(asn1_ec_type_attr + 0, asn1_eckey_attr, NULL, 0);
-
-	sc_format_asn1_entry(asn1_eckey_value_choice + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_eckey_value_choice + 1, &der->value, &der->len, 0);
-
-	sc_format_asn1_entry(asn1_eckey_attr + 0, asn1_eckey_value_choice, NULL, 0);
-	sc_format_asn1_entry(asn1_eckey_attr + 1, &info.field_length, NULL, 0);
-
-	sc_format_asn1_entry(asn1_dsa_type_attr + 0, asn1_dsakey_attr, NULL, 0);
-
-	sc_format_asn1_entry(asn1_dsakey_attr + 0, &info.path, NULL, 0);
-
-	sc_format_asn1_entry(asn1_gostr3410_type_attr + 0, asn1_gostr3410key_attr, NULL, 0);
+	struct sc_asn1_pkcs15_object rsakey_obj, eckey_obj, dsakey_obj, gostr3410key_obj;
+};
 
-	sc_format_asn1_entry(asn1_gostr3410key_attr + 0, &info.path, NULL, 0);
-	sc_format_asn1_entry(asn1_gostr3410key_attr + 1, &gostr3410_params[0], NULL, 0);
-	sc_format_asn1_entry(asn1_gostr3410key_attr + 2, &gostr3410_params[1], NULL, 0);
-	sc_format_asn1_entry(asn1_gostr3410key_attr + 3, &gostr3410_params[2], NULL, 0);
+static void
+format_pukdf_templates(struct pukdf_templates *t, struct sc_pkcs15_object *obj,
+		struct pukdf_entry *entry)
+{
+	struct sc_pkcs15_pubkey_info *info = &entry->info;
+	struct sc_pkcs15_der *der = &obj->content;
+	struct sc_asn1_pkcs15_object rsakey_obj = { obj, t->asn1_com_key_attr,
+						    t->asn1_com_pubkey_attr, t->asn1_rsa_type_attr };
+	struct sc_asn1_pkcs15_object eckey_obj = { obj, t->asn1_com_key_attr,
+						    t->asn1_com_pubkey_attr, t->asn1_ec_type_attr };
+	struct sc_asn1_pkcs15_object dsakey_obj = { obj, t->asn1_com_key_attr,
+						    t->asn1_com_pubkey_attr, t->asn1_dsa_type_attr };
+	struct sc_asn1_pkcs15_object gostr3410key_obj =  { obj, t->asn1_com_key_attr,
+						    t->asn1_com_pubkey_attr, t->asn1_gostr3410_type_attr };
+
+	t->rsakey_obj = rsakey_obj;
+	t->eckey_obj = eckey_obj;
+	t->dsakey_obj = dsakey_obj;
+	t->gostr3410key_obj = gostr3410key_obj;
+
+	sc_copy_asn1_entry(c_asn1_pubkey, t->asn1_pubkey);
+	sc_copy_asn1_entry(c_asn1_pubkey_choice, t->asn1_pubkey_choice);
+	sc_copy_asn1_entry(c_asn1_rsa_type_attr, t->asn1_rsa_type_attr);
+	sc_copy_asn1_entry(c_asn1_rsakey_value_choice, t->asn1_rsakey_value_choice);
+	sc_copy_asn1_entry(c_asn1_rsakey_attr, t->asn1_rsakey_attr);
+	sc_copy_asn1_entry(c_asn1_ec_type_attr, t->asn1_ec_type_attr);
+	sc_copy_asn1_entry(c_asn1_eckey_value_choice, t->asn1_eckey_value_choice);
+	sc_copy_asn1_entry(c_asn1_eckey_attr, t->asn1_eckey_attr);
+	sc_copy_asn1_entry(c_asn1_dsa_type_attr, t->asn1_dsa_type_attr);
+	sc_copy_asn1_entry(c_asn1_dsakey_attr, t->asn1_dsakey_attr);
+	sc_copy_asn1_entry(c_asn1_gostr3410_type_attr, t->asn1_gostr3410_type_attr);
+	sc_copy_asn1_entry(c_asn1_gostr3410key_attr, t->asn1_gostr3410key_attr);
+	sc_copy_asn1_entry(c_asn1_com_pubkey_attr, t->asn1_com_pubkey_attr);
+	sc_copy_asn1_entry(c_asn1_com_key_attr, t->asn1_com_key_attr);
+
+	sc_format_asn1_entry(t->asn1_com_pubkey_attr + 0, &info->subject.value, &info->subject.len, 0);
+
+	sc_format_asn1_entry(t->asn1_pubkey_choice + 0, &t->rsakey_obj, NULL, 0);
+	sc_format_asn1_entry(t->asn1_pubkey_choice + 1, &t->dsakey_obj, NULL, 0);
+	sc_format_asn1_entry(t->asn1_pubkey_choice + 2, &t->gostr3410key_obj, NULL, 0);
+	sc_format_asn1_entry(t->asn1_pubkey_choice + 3, &t->eckey_obj, NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_rsa_type_attr + 0, t->asn1_rsakey_attr, NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_rsakey_value_choice + 0, &info->path, NULL, 0);
+	sc_format_asn1_entry(t->asn1_rsakey_value_choice + 1, &der->value, &der->len, 0);
+
+	sc_format_asn1_entry(t->asn1_rsakey_attr + 0, t->asn1_rsakey_value_choice, NULL, 0);
+	sc_format_asn1_entry(t->asn1_rsakey_attr + 1, &info->modulus_length, NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_ec_type_attr + 0, t->asn1_eckey_attr, NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_eckey_value_choice + 0, &info->path, NULL, 0);
+	sc_format_asn1_entry(t->asn1_eckey_value_choice + 1, &der->value, &der->len, 0);
+
+	sc_format_asn1_entry(t->asn1_eckey_attr + 0, t->asn1_eckey_value_choice, NULL, 0);
+	sc_format_asn1_entry(t->asn1_eckey_attr + 1, &info->field_length, NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_dsa_type_attr + 0, t->asn1_dsakey_attr, NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_dsakey_attr + 0, &info->path, NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_gostr3410_type_attr + 0, t->asn1_gostr3410key_attr, NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_gostr3410key_attr + 0, &info->path, NULL, 0);
+	sc_format_asn1_entry(t->asn1_gostr3410key_attr + 1, &entry->gostr3410_params[0], NULL, 0);
+	sc_format_asn1_entry(t->asn1_gostr3410key_attr + 2, &entry->gostr3410_params[1], NULL, 0);
+	sc_format_asn1_entry(t->asn1_gostr3410key_attr + 3, &entry->gostr3410_params[2], NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_com_key_attr + 0, &info->id, NULL, 0);
+	sc_format_asn1_entry(t->asn1_com_key_attr + 1, &info->usage, &entry->usage_len, 0);
+	sc_format_asn1_entry(t->asn1_com_key_attr + 2, &info->native, NULL, 0);
+	sc_format_asn1_entry(t->asn1_com_key_attr + 3, &info->access_flags, &entry->af_len, 0);
+	sc_format_asn1_entry(t->asn1_com_key_attr + 4, &info->key_reference, NULL, 0);
+
+	sc_format_asn1_entry(t->asn1_pubkey + 0, t->asn1_pubkey_choice, NULL, 0);
+}
 
-	sc_format_asn1_entry(asn1_com_key_attr + 0, &info.id, NULL, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 1, &info.usage, &usage_len, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 2, &info.native, NULL, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 3, &info.access_flags, &af_len, 0);
-	sc_format_asn1_entry(asn1_com_key_attr + 4, &info.key_reference, NULL, 0);
+static int
+compile_pukdf_templates(struct sc_context *ctx, struct sc_asn1_program **prog)
+{
+	struct sc_pkcs15_object obj;
+	struct pukdf_entry entry;
+	struct pukdf_templates t;
+	void *bases[2] = { &obj, &entry };
+	size_t sizes[2] = { sizeof(obj), sizeof(entry) };
+	const struct sc_asn1_entry *marks[C_ASN1_PUBKEY_CHOICE_SIZE - 1] = {
+		t.asn1_pubkey_choice + 0, t.asn1_pubkey_choice + 1,
+		t.asn1_pubkey_choice + 2, t.asn1_pubkey_choice + 3
+	};
+
+	format_pukdf_templates(&t, &obj, &entry);
+	return sc_asn1_compile(ctx, t.asn1_pubkey, bases, sizes, 2,
+			marks, C_ASN1_PUBKEY_CHOICE_SIZE - 1, prog);
+}
 
-	sc_format_asn1_entry(asn1_pubkey + 0, asn1_pubkey_choice, NULL, 0);
+int sc_pkcs15_decode_pukdf_entry(struct sc_pkcs15_card *p15card,
+				 struct sc_pkcs15_object *obj,
+				 const u8 ** buf, size_t *buflen)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	const struct sc_asn1_program *prog = NULL;
+	struct pukdf_entry entry;
+	struct sc_pkcs15_pubkey_info info;
+	int r, i, *gostr3410_params = entry.gostr3410_params;
+	int present[C_ASN1_PUBKEY_CHOICE_SIZE - 1];
+	struct sc_pkcs15_keyinfo_gostparams *keyinfo_gostparams;
 
 	/* Fill in defaults */
-	memset(&info, 0, sizeof(info));
-	info.key_reference = -1;
-	info.native = 1;
-	memset(gostr3410_params, 0, sizeof(gostr3410_params));
+	memset(&entry, 0, sizeof(entry));
+	entry.usage_len = sizeof(entry.info.usage);
+	entry.af_len = sizeof(entry.info.access_flags);
+	entry.info.key_reference = -1;
+	entry.info.native = 1;
+	memset(present, 0, sizeof(present));
+
+	if (p15card->opts.use_compiled_asn1
+			&& sc_asn1_get_program(ctx, SC_ASN1_PROGRAM_PUKDF, compile_pukdf_templates, &prog) < 0)
+		prog = NULL;
+	if (prog != NULL) {
+		void *bases[2] = { obj, &entry };
+
+		r = sc_asn1_run(ctx, prog, bases, *buf, *buflen, buf, buflen, 0, present);
+	}
+	else {
+		struct pukdf_templates t;
 
-	r = sc_asn1_decode(ctx, asn1_pubkey, *buf, *buflen, buf, buflen);
+		format_pukdf_templates(&t, obj, &entry);
+		r = sc_asn1_decode(ctx, t.asn1_pubkey, *buf, *buflen, buf, buflen);
+		for (i = 0; i < C_ASN1_PUBKEY_CHOICE_SIZE - 1; i++)
+			present[i] = (t.asn1_pubkey_choice[i].flags & SC_ASN1_PRESENT) != 0;
+	}
 	if (r == SC_ERROR_ASN1_END_OF_CONTENTS)
 		return r;
 	LOG_TEST_RET(ctx, r, "ASN.1 decoding failed");
-	if (asn1_pubkey_choice[0].flags & SC_ASN1_PRESENT) {
+	info = entry.info;
+	if (present[0]) {
 		obj->type = SC_PKCS15_TYPE_PUBKEY_RSA;
-	} else if (asn1_pubkey_choice[2].flags & SC_ASN1_PRESENT) {
+	} else if (present[2]) {
 		obj->type = SC_PKCS15_TYPE_PUBKEY_GOSTR3410;
 		assert(info.modulus_length == 0);
 		info.modulus_length = SC_PKCS15_GOSTR3410_KEYSIZE;
@@ -269,7 +329,7 @@ int sc_pkcs15_decode_pukdf_entry(struct sc_pkcs15_card *p15card,
 		keyinfo_gostparams->gostr3411 = (unsigned int)gostr3410_params[1];
 		keyinfo_gostparams->gost28147 = (unsigned int)gostr3410_params[2];
 	} 
-	else if (asn1_pubkey_choice[3].flags & SC_ASN1_PRESENT) {
+	else if (present[3]) {
 		obj->type = SC_PKCS15_TYPE_PUBKEY_EC;
 	}
 	else {
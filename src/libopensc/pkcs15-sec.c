@@ -72,6 +72,11 @@ static int select_key_file(struct sc_pkcs15_card *p15card,
 		LOG_TEST_RET(ctx, SC_ERROR_INVALID_ARGUMENTS, "invalid private key path");
 	}
 
+	if (_sc_sec_env_is_current(p15card->card, &path, senv)) {
+		sc_log(ctx, "key file already selected");
+		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+	}
+
 	r = sc_select_file(p15card->card, &path, NULL);
 	LOG_TEST_RET(ctx, r, "sc_select_file() failed");
 
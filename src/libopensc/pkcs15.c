@@ -786,6 +786,9 @@ void sc_pkcs15_card_free(struct sc_pkcs15_card *p15card)
 	if (p15card->file_unusedspace != NULL)
 		sc_file_free(p15card->file_unusedspace);
 
+	free(p15card->snapshot_key);
+	free(p15card->cache_tag);
+
 	p15card->magic = 0;
 	sc_pkcs15_free_tokeninfo(p15card);
 	sc_pkcs15_free_app(p15card);
@@ -824,6 +827,11 @@ void sc_pkcs15_card_clear(sc_pkcs15_card_t *p15card)
 		sc_file_free(p15card->file_unusedspace);
 		p15card->file_unusedspace = NULL;
 	}
+	free(p15card->snapshot_key);
+	p15card->snapshot_key = NULL;
+	p15card->snapshot_key_len = 0;
+	free(p15card->cache_tag);
+	p15card->cache_tag = NULL;
 	if (p15card->tokeninfo->label != NULL) {
 		free(p15card->tokeninfo->label);
 		p15card->tokeninfo->label = NULL;
@@ -1094,14 +1102,30 @@ static int sc_pkcs15_bind_internal(sc_pkcs15_card_t *p15card, struct sc_aid *aid
 		err = SC_ERROR_PKCS15_APP_NOT_FOUND;
 		goto end;
 	}
+	len = err;
+
+	/* A known card: TokenInfo, DFs and objects come from the snapshot */
+	if (p15card->opts.use_file_cache && sc_pkcs15_load_snapshot(p15card, buf, len) == SC_SUCCESS) {
+		ok = 1;
+		goto end;
+	}
 
 	memset(&tokeninfo, 0, sizeof(tokeninfo));
-	err = sc_pkcs15_parse_tokeninfo(ctx, &tokeninfo, buf, (size_t)err);
+	err = sc_pkcs15_parse_tokeninfo(ctx, &tokeninfo, buf, len);
 	if (err != SC_SUCCESS)
 		goto end;
 
 	*(p15card->tokeninfo) = tokeninfo;
 
+	/* Without serial number and lastUpdate in the TokenInfo, another
+	 * card or a change of this one would not change the key */
+	if (p15card->opts.use_file_cache && tokeninfo.serial_number
+			&& tokeninfo.last_update.gtime) {
+		p15card->snapshot_key = buf;
+		p15card->snapshot_key_len = len;
+		buf = NULL;
+	}
+
 	if (!p15card->tokeninfo->serial_number && card->serialnr.len)   {
 		char *serial = calloc(1, card->serialnr.len*2 + 1);
 		size_t ii;
@@ -1142,17 +1166,22 @@ int sc_pkcs15_bind(sc_card_t *card, struct sc_aid *aid, struct sc_pkcs15_card **
 
 	p15card->card = card;
 	p15card->opts.use_file_cache = 0;
+	p15card->opts.file_cache_max_size = 4096 * 1024;
 	p15card->opts.use_pin_cache = 1;
 	p15card->opts.pin_cache_counter = 10;
 	p15card->opts.pin_cache_ignore_user_consent = 0;
+	p15card->opts.use_compiled_asn1 = 1;
 
 	conf_block = sc_get_conf_block(ctx, "framework", "pkcs15", 1);
 
 	if (conf_block) {
 		p15card->opts.use_file_cache = scconf_get_bool(conf_block, "use_file_caching", p15card->opts.use_file_cache);
+		p15card->opts.file_cache_max_size = (size_t) scconf_get_int(conf_block, "file_cache_max_size",
+				(int) (p15card->opts.file_cache_max_size / 1024)) * 1024;
 		p15card->opts.use_pin_cache = scconf_get_bool(conf_block, "use_pin_caching", p15card->opts.use_pin_cache);
 		p15card->opts.pin_cache_counter = scconf_get_int(conf_block, "pin_cache_counter", p15card->opts.pin_cache_counter);
 		p15card->opts.pin_cache_ignore_user_consent =  scconf_get_bool(conf_block, "pin_cache_ignore_user_consent", p15card->opts.pin_cache_ignore_user_consent);
+		p15card->opts.use_compiled_asn1 = scconf_get_bool(conf_block, "use_compiled_asn1", p15card->opts.use_compiled_asn1);
 	}
 	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d",
 	         p15card->opts.use_file_cache, p15card->opts.use_pin_cache, p15card->opts.pin_cache_counter, p15card->opts.pin_cache_ignore_user_consent);
@@ -1203,6 +1232,8 @@ int sc_pkcs15_unbind(struct sc_pkcs15_card *p15card)
 {
 	assert(p15card != NULL && p15card->magic == SC_PKCS15_CARD_MAGIC);
 	LOG_FUNC_CALLED(p15card->card->ctx);
+	if (p15card->snapshot_key)
+		sc_pkcs15_save_snapshot(p15card);
 	if (p15card->dll_handle)
 		sc_dlclose(p15card->dll_handle);
 	sc_pkcs15_pincache_clear(p15card);
@@ -1837,6 +1868,8 @@ sc_pkcs15_remove_dfs(struct sc_pkcs15_card *p15card)
 
 	for (cur = p15card->df_list; cur; cur = next)   {
 		next = cur->next;
+		if (cur->image)
+			free(cur->image);
 		free(cur);
 	}
 
@@ -1908,7 +1941,7 @@ int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 	sc_context_t *ctx = p15card->card->ctx;
 	u8 *buf;
 	const u8 *p;
-	size_t bufsize;
+	size_t bufsize, bufsize_read;
 	int r;
 	struct sc_pkcs15_object *obj = NULL;
 	int (* func)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
@@ -1952,6 +1985,7 @@ int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 	}
 	r = sc_pkcs15_read_file(p15card, &df->path, &buf, &bufsize);
 	LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
+	bufsize_read = bufsize;
 
 	p = buf;
 	while (bufsize && *p != 0x00) {
@@ -1987,7 +2021,19 @@ int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 		r = 0;
 ret:
 	df->enumerated = 1;
-	free(buf);
+	if (df->image) {
+		free(df->image);
+		df->image = NULL;
+		df->image_len = 0;
+	}
+	/* keep what was read, unless it does not start at the beginning of the file */
+	if (r == 0 && df->path.index == 0) {
+		df->image = buf;
+		df->image_len = bufsize_read;
+	}
+	else {
+		free(buf);
+	}
 	LOG_FUNC_RETURN(ctx, r);
 }
 
@@ -2183,15 +2229,81 @@ int sc_pkcs15_parse_unusedspace(const u8 * buf, size_t buflen, struct sc_pkcs15_
 	return 0;
 }
 
+/* Tells whether the file holds the content of a private object */
+static int is_private_object_file(struct sc_pkcs15_card *p15card, const sc_path_t *path)
+{
+	struct sc_pkcs15_object *obj;
+	const sc_path_t *obj_path;
+
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
+		if (!(obj->flags & SC_PKCS15_CO_FLAG_PRIVATE) || obj->data == NULL)
+			continue;
+		switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+		case SC_PKCS15_TYPE_CERT:
+			obj_path = &((struct sc_pkcs15_cert_info *) obj->data)->path;
+			break;
+		case SC_PKCS15_TYPE_DATA_OBJECT:
+			obj_path = &((struct sc_pkcs15_data_info *) obj->data)->path;
+			break;
+		case SC_PKCS15_TYPE_PUBKEY:
+			obj_path = &((struct sc_pkcs15_pubkey_info *) obj->data)->path;
+			break;
+		default:
+			continue;
+		}
+		if (sc_compare_path(obj_path, path))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * A DF below the application DF that has a PIN of its own. Only the
+ * PINs of the AODFs parsed so far are known: until all of them are,
+ * every file but the PKCS#15 directory files counts as protected.
+ */
+static int is_pin_protected_file(struct sc_pkcs15_card *p15card, const sc_path_t *path)
+{
+	struct sc_pkcs15_object *obj;
+	struct sc_pkcs15_df *df;
+	size_t app_len = p15card->file_app ? p15card->file_app->path.len : 0;
+	int directory = 0, aodf_parsed = 1;
+
+	for (df = p15card->df_list; df != NULL; df = df->next) {
+		if (sc_compare_path(&df->path, path))
+			directory = 1;
+		if (df->type == SC_PKCS15_AODF && !df->enumerated)
+			aodf_parsed = 0;
+	}
+	if ((p15card->file_odf && sc_compare_path(&p15card->file_odf->path, path))
+			|| (p15card->file_tokeninfo && sc_compare_path(&p15card->file_tokeninfo->path, path)))
+		directory = 1;
+	if (!aodf_parsed)
+		return !directory;
+
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
+		const sc_path_t *pin_path;
+
+		if ((obj->type & SC_PKCS15_TYPE_CLASS_MASK) != SC_PKCS15_TYPE_AUTH || obj->data == NULL)
+			continue;
+		pin_path = &((struct sc_pkcs15_auth_info *) obj->data)->path;
+		if (pin_path->len > app_len && pin_path->len < path->len
+				&& !memcmp(pin_path->value, path->value, pin_path->len))
+			return 1;
+	}
+	return 0;
+}
+
 int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
 			const sc_path_t *in_path,
 			u8 **buf, size_t *buflen)
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	sc_file_t *file = NULL;
+	const sc_acl_entry_t *acl;
 	u8	*data = NULL;
 	size_t	len = 0, offset = 0;
-	int	r;
+	int	r, cache = 0;
 
 	assert(p15card != NULL && in_path != NULL && buf != NULL);
 
@@ -2209,6 +2321,23 @@ int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
 		if (r)
 			goto fail_unlock;
 
+		/* Fill the file cache with files the card lets anybody read,
+		 * but never with the content of private objects. Many cards
+		 * do not report the ACL of a file: such files are cached too,
+		 * unless they are in a DF with a PIN of its own. Without
+		 * lastUpdate or a cache tag a changed card could not be told
+		 * from the cached one. */
+		if (p15card->opts.use_file_cache && file->ef_structure != SC_FILE_EF_LINEAR_VARIABLE_TLV
+				&& (p15card->cache_tag != NULL || sc_pkcs15_get_lastupdate(p15card) != NULL)) {
+			acl = sc_file_get_acl_entry(file, SC_AC_OP_READ);
+			if (acl != NULL && acl->method == SC_AC_NONE)
+				cache = 1;
+			else if (acl == NULL || acl->method == SC_AC_UNKNOWN)
+				cache = !is_pin_protected_file(p15card, in_path);
+			if (cache && is_private_object_file(p15card, in_path))
+				cache = 0;
+		}
+
 		/* Handle the case where the ASN.1 Path object specified
 		 * index and length values */
 		if (in_path->count < 0) {
@@ -2223,6 +2352,11 @@ int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
 				r = SC_ERROR_INVALID_ASN1_OBJECT;
 				goto fail_unlock;
 			}
+			/* The cache holds complete files only */
+			if (cache) {
+				len = file->size;
+				offset = 0;
+			}
 		}
 		data = malloc(len);
 		if (data == NULL) {
@@ -2272,6 +2406,22 @@ int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
 		sc_unlock(p15card->card);
 
 		sc_file_free(file);
+
+		if (cache) {
+			r = sc_pkcs15_cache_file(p15card, in_path, data, len);
+			if (r != SC_SUCCESS)
+				sc_log(ctx, "Cannot cache file: %s", sc_strerror(r));
+
+			/* Return only the requested part, which like a
+			 * direct read may be shorter than requested */
+			if (in_path->count >= 0) {
+				offset = in_path->index < len ? in_path->index : len;
+				len -= offset;
+				if (len > (size_t) in_path->count)
+					len = in_path->count;
+				memmove(data, data + offset, len);
+			}
+		}
 	}
 	*buf = data;
 	*buflen = len;
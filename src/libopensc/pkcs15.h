@@ -529,6 +529,11 @@ struct sc_pkcs15_df {
 	unsigned int type;
 	int enumerated;
 
+	/* DF content as last read from or written to the card,
+	 * starting at offset 0; lets pkcs15init rewrite only what changed */
+	u8 *image;
+	size_t image_len;
+
 	struct sc_pkcs15_df *next, *prev;
 };
 typedef struct sc_pkcs15_df sc_pkcs15_df_t;
@@ -601,9 +606,11 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_card_opts {
 		int use_file_cache;
+		size_t file_cache_max_size;	/* bytes, 0 for no limit */
 		int use_pin_cache;
 		int pin_cache_counter;
 		int pin_cache_ignore_user_consent;
+		int use_compiled_asn1;
 	} opts;
 
 	unsigned int magic;
@@ -612,6 +619,14 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_operations ops;
 
+	/* EF(TokenInfo) as read at bind time, under which a snapshot
+	 * is written at unbind; NULL if there is none to write */
+	u8 *snapshot_key;
+	size_t snapshot_key_len;
+
+	/* Used instead of lastUpdate in the names of cached files, by
+	 * emulators that can tell card contents apart in another way */
+	char *cache_tag;
 } sc_pkcs15_card_t;
 
 /* flags suitable for sc_pkcs15_tokeninfo_t */
@@ -878,6 +893,9 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const struct sc_path *path,
 			 const u8 *buf, size_t bufsize);
+int sc_pkcs15_save_snapshot(struct sc_pkcs15_card *p15card);
+int sc_pkcs15_load_snapshot(struct sc_pkcs15_card *p15card,
+			    const u8 *key, size_t key_len);
 
 /* PKCS #15 ID handling functions */
 int sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1,
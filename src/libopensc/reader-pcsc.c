@@ -79,6 +79,8 @@ struct pcsc_global_private_data {
 struct pcsc_private_data {
 	struct pcsc_global_private_data *gpriv;
 	SCARDHANDLE pcsc_card;
+	SCARDCONTEXT card_ctx;		/* context of pcsc_card, see pcsc_connect() */
+	int card_ctx_valid;
 	SCARD_READERSTATE reader_state;
 	DWORD verify_ioctl;
 	DWORD verify_ioctl_start;
@@ -98,6 +100,7 @@ struct pcsc_private_data {
 };
 
 static int pcsc_detect_card_presence(sc_reader_t *reader);
+static int part10_find_property_by_tag(unsigned char buffer[], int length, int tag_searched);
 
 static DWORD pcsc_reset_action(const char *str)
 {
@@ -439,6 +442,18 @@ static int pcsc_reconnect(sc_reader_t * reader, DWORD action)
 	return pcsc_to_opensc_error(rv);
 }
 
+#define PCSC_CARD_CTX(priv) ((priv)->card_ctx_valid ? (priv)->card_ctx : (priv)->gpriv->pcsc_ctx)
+
+static void pcsc_release_card_ctx(sc_reader_t *reader)
+{
+	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
+
+	if (priv->card_ctx_valid) {
+		priv->gpriv->SCardReleaseContext(priv->card_ctx);
+		priv->card_ctx_valid = 0;
+	}
+}
+
 static int pcsc_connect(sc_reader_t *reader)
 {
 	DWORD active_proto, tmp, protocol = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
@@ -456,20 +471,31 @@ static int pcsc_connect(sc_reader_t *reader)
 	if (!(reader->flags & SC_READER_CARD_PRESENT))
 		SC_FUNC_RETURN(reader->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_CARD_NOT_PRESENT);
 
+	/* Each card gets a context of its own: PC/SC-lite serializes the
+	 * calls made through one context, which would also serialize the
+	 * cards the PKCS#11 module detects in parallel. A context left
+	 * from a connection that was lost is dropped first. */
+	pcsc_release_card_ctx(reader);
+	rv = priv->gpriv->SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &priv->card_ctx);
+	if (rv == SCARD_S_SUCCESS)
+		priv->card_ctx_valid = 1;
+	else
+		PCSC_TRACE(reader, "SCardEstablishContext failed, sharing the reader context", rv);
 
-	rv = priv->gpriv->SCardConnect(priv->gpriv->pcsc_ctx, reader->name,
+	rv = priv->gpriv->SCardConnect(PCSC_CARD_CTX(priv), reader->name,
 			  priv->gpriv->connect_exclusive ? SCARD_SHARE_EXCLUSIVE : SCARD_SHARE_SHARED,
 			  protocol, &card_handle, &active_proto);
 #ifdef __APPLE__
 	if (rv == (LONG)SCARD_E_SHARING_VIOLATION) {
 		sleep(1); /* Try again to compete with Tokend probes */
-		rv = priv->gpriv->SCardConnect(priv->gpriv->pcsc_ctx, reader->name,
+		rv = priv->gpriv->SCardConnect(PCSC_CARD_CTX(priv), reader->name,
 			  priv->gpriv->connect_exclusive ? SCARD_SHARE_EXCLUSIVE : SCARD_SHARE_SHARED,
 			  protocol, &card_handle, &active_proto);
 	}
 #endif
 	if (rv != SCARD_S_SUCCESS) {
 		PCSC_TRACE(reader, "SCardConnect failed", rv);
+		pcsc_release_card_ctx(reader);
 		return pcsc_to_opensc_error(rv);
 	}
 
@@ -504,6 +530,7 @@ static int pcsc_disconnect(sc_reader_t * reader)
 	SC_FUNC_CALLED(reader->ctx, SC_LOG_DEBUG_NORMAL);
 
 	priv->gpriv->SCardDisconnect(priv->pcsc_card, priv->gpriv->disconnect_action);
+	pcsc_release_card_ctx(reader);
 	reader->flags = 0;
 	return SC_SUCCESS;
 }
@@ -567,6 +594,7 @@ static int pcsc_release(sc_reader_t *reader)
 {
 	struct pcsc_private_data *priv = GET_PRIV_DATA(reader);
 
+	pcsc_release_card_ctx(reader);
 	free(priv);
 	return SC_SUCCESS;
 }
@@ -922,6 +950,20 @@ static void detect_reader_features(sc_reader_t *reader, SCARDHANDLE card_handle)
 		}
 	}
 
+	/* Detect extended APDU support */
+	if (priv->get_tlv_properties) {
+		rcount = sizeof(rbuf);
+		rv = gpriv->SCardControl(card_handle, priv->get_tlv_properties, NULL, 0, rbuf, sizeof(rbuf), &rcount);
+		if (rv == SCARD_S_SUCCESS) {
+			int max_apdu_data = part10_find_property_by_tag(rbuf, rcount,
+					PCSCv2_PART10_PROPERTY_dwMaxAPDUDataSize);
+			if (max_apdu_data > 256) {
+				sc_log(ctx, "Reader supports extended APDUs (max data size %d)", max_apdu_data);
+				reader->capabilities |= SC_READER_CAP_APDU_EXT;
+			}
+		}
+	}
+
 	if (priv->pace_ioctl) {
 		char *log_text = "Reader supports PACE";
 		if (priv->gpriv->enable_pace) {
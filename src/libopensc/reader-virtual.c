@@ -0,0 +1,1133 @@
+/*
+ * reader-virtual.c: virtual reader driver, replays APDU transcripts or
+ * emulates a simple ISO 7816-4 card
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#ifdef ENABLE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/rand.h>
+#include <openssl/pem.h>
+#ifndef OPENSSL_NO_EC
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#endif
+#endif
+
+#include "internal.h"
+
+#define VIRTUAL_MAX_PINS	8
+#define VIRTUAL_MAX_KEYS	8
+
+/* function declarations */
+static int virtual_reader_init(sc_context_t *ctx);
+static int virtual_reader_finish(sc_context_t *ctx);
+static int virtual_reader_release(sc_reader_t *reader);
+static int virtual_reader_detect_card_presence(sc_reader_t *reader);
+static int virtual_reader_connect(sc_reader_t *reader);
+static int virtual_reader_disconnect(sc_reader_t *reader);
+static int virtual_reader_transmit(sc_reader_t *reader, sc_apdu_t *apdu);
+static int virtual_reader_lock(sc_reader_t *reader);
+static int virtual_reader_unlock(sc_reader_t *reader);
+
+static struct sc_reader_operations virtual_ops;
+
+static struct sc_reader_driver virtual_reader_driver = {
+	"Virtual reader",
+	"virtual",
+	&virtual_ops,
+	0, 0, NULL
+};
+
+/* one recorded command and its response (including SW1 SW2) */
+struct virtual_exchange {
+	u8	*cmd;
+	size_t	cmdlen;
+	u8	*resp;
+	size_t	resplen;
+};
+
+struct virtual_file {
+	u8	path[SC_MAX_PATH_SIZE];
+	size_t	pathlen;
+	int	is_df;
+	u8	aid[SC_MAX_AID_SIZE];
+	size_t	aidlen;
+	u8	*data;
+	size_t	size;
+};
+
+struct virtual_pin {
+	unsigned int	ref;
+	u8		value[SC_MAX_PIN_SIZE];
+	size_t		len;
+	int		tries, max_tries;
+	int		verified;
+};
+
+struct virtual_key {
+	unsigned int	ref;
+	int		pin_ref;	/* -1 if the key is not protected */
+#ifdef ENABLE_OPENSSL
+	EVP_PKEY	*pkey;
+#endif
+};
+
+/* private data structures */
+struct driver_data {
+	char			*name;
+	u8			atr[SC_MAX_ATR_SIZE];
+	size_t			atr_len;
+	unsigned long		latency;	/* microseconds per APDU */
+
+	/* transcript replay */
+	struct virtual_exchange	*exchanges;
+	size_t			nexchanges;
+	size_t			next;
+
+	/* card emulation */
+	struct virtual_file	*files;
+	size_t			nfiles;
+	struct virtual_pin	pins[VIRTUAL_MAX_PINS];
+	size_t			npins;
+	struct virtual_key	keys[VIRTUAL_MAX_KEYS];
+	size_t			nkeys;
+	int			cur_df, cur_ef;
+	int			se_key;
+};
+
+/*
+ * Helpers for the text formats
+ */
+static int
+parse_hex(const char *in, u8 **out, size_t *outlen)
+{
+	char *hex;
+	size_t len = 0, binlen;
+	int r;
+
+	hex = malloc(strlen(in) + 1);
+	if (hex == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	for (; *in != '\0'; in++) {
+		if (*in == ' ' || *in == '\t' || *in == ':' || *in == '/')
+			continue;
+		hex[len++] = *in;
+	}
+	hex[len] = '\0';
+	if (len % 2) {
+		free(hex);
+		return SC_ERROR_INVALID_ARGUMENTS;
+	}
+
+	binlen = len / 2;
+	*out = malloc(binlen ? binlen : 1);
+	if (*out == NULL) {
+		free(hex);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	r = sc_hex_to_bin(hex, *out, &binlen);
+	free(hex);
+	if (r < 0) {
+		free(*out);
+		*out = NULL;
+		return r;
+	}
+	*outlen = binlen;
+	return SC_SUCCESS;
+}
+
+static int
+parse_hex_fixed(const char *in, u8 *out, size_t *outlen)
+{
+	u8 *bin;
+	size_t len;
+	int r;
+
+	r = parse_hex(in, &bin, &len);
+	if (r < 0)
+		return r;
+	if (len > *outlen) {
+		free(bin);
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	}
+	memcpy(out, bin, len);
+	*outlen = len;
+	free(bin);
+	return SC_SUCCESS;
+}
+
+static int
+read_file(const char *name, u8 **out, size_t *outlen)
+{
+	FILE *f;
+	u8 *buf = NULL, *p;
+	size_t len = 0, size = 0, n;
+
+	f = fopen(name, "rb");
+	if (f == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	do {
+		if (len == size) {
+			size = size ? size * 2 : 4096;
+			p = realloc(buf, size + 1);
+			if (p == NULL) {
+				free(buf);
+				fclose(f);
+				return SC_ERROR_OUT_OF_MEMORY;
+			}
+			buf = p;
+		}
+		n = fread(buf + len, 1, size - len, f);
+		len += n;
+	} while (n > 0);
+	fclose(f);
+
+	buf[len] = '\0';
+	*out = buf;
+	*outlen = len;
+	return SC_SUCCESS;
+}
+
+/* Names in the image file are relative to the directory of the image */
+static char *
+relative_name(const char *base, const char *name)
+{
+	const char *slash;
+	char *out;
+	size_t dirlen;
+
+	slash = strrchr(base, '/');
+	if (name[0] == '/' || slash == NULL)
+		return strdup(name);
+	dirlen = slash - base + 1;
+	out = malloc(dirlen + strlen(name) + 1);
+	if (out == NULL)
+		return NULL;
+	memcpy(out, base, dirlen);
+	strcpy(out + dirlen, name);
+	return out;
+}
+
+/* Split a text file into lines with comments and blank lines removed.
+ * Calls cb() for every remaining line, stops at the first error. */
+static int
+for_each_line(sc_context_t *ctx, const char *fname, struct driver_data *data,
+		int (*cb)(sc_context_t *, const char *, struct driver_data *, char *))
+{
+	u8 *text;
+	size_t len;
+	char *line, *next, *p;
+	int r, lineno = 0;
+
+	r = read_file(fname, &text, &len);
+	if (r < 0) {
+		sc_log(ctx, "cannot read '%s'", fname);
+		return r;
+	}
+
+	for (line = (char *) text; line != NULL; line = next) {
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+		lineno++;
+
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		p = line + strlen(line);
+		while (p > line && isspace((unsigned char) p[-1]))
+			*--p = '\0';
+		while (isspace((unsigned char) *line))
+			line++;
+		if (*line == '\0')
+			continue;
+
+		r = cb(ctx, fname, data, line);
+		if (r < 0) {
+			sc_log(ctx, "%s:%d: %s", fname, lineno, sc_strerror(r));
+			break;
+		}
+	}
+
+	free(text);
+	return r < 0 ? r : SC_SUCCESS;
+}
+
+/*
+ * Transcript format:
+ *	atr <hex>
+ *	> <command APDU>
+ *	< <response data and SW1 SW2>
+ */
+static int
+transcript_line(sc_context_t *ctx, const char *fname, struct driver_data *data, char *line)
+{
+	struct virtual_exchange *ex;
+	u8 *bin;
+	size_t len;
+	int r;
+
+	if (strncmp(line, "atr", 3) == 0) {
+		data->atr_len = sizeof(data->atr);
+		return parse_hex_fixed(line + 3, data->atr, &data->atr_len);
+	}
+	if (line[0] != '>' && line[0] != '<')
+		return SC_ERROR_SYNTAX_ERROR;
+
+	r = parse_hex(line + 1, &bin, &len);
+	if (r < 0)
+		return r;
+
+	if (line[0] == '>') {
+		if (data->nexchanges && data->exchanges[data->nexchanges - 1].resp == NULL) {
+			free(bin);
+			return SC_ERROR_SYNTAX_ERROR;
+		}
+		ex = realloc(data->exchanges, (data->nexchanges + 1) * sizeof(*ex));
+		if (ex == NULL) {
+			free(bin);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		data->exchanges = ex;
+		ex = &data->exchanges[data->nexchanges++];
+		memset(ex, 0, sizeof(*ex));
+		ex->cmd = bin;
+		ex->cmdlen = len;
+		return SC_SUCCESS;
+	}
+
+	if (data->nexchanges == 0 || len < 2
+			|| data->exchanges[data->nexchanges - 1].resp != NULL) {
+		free(bin);
+		return SC_ERROR_SYNTAX_ERROR;
+	}
+	ex = &data->exchanges[data->nexchanges - 1];
+	ex->resp = bin;
+	ex->resplen = len;
+	return SC_SUCCESS;
+}
+
+/*
+ * Card image format:
+ *	atr <hex>
+ *	df <path> [aid <hex>]
+ *	ef <path> <hex> | @<file> | size <n>
+ *	pin <ref> <value> [tries <n>]
+ *	key <ref> <PEM private key file> [pin <ref>]
+ */
+static int
+find_file(struct driver_data *data, const u8 *path, size_t pathlen)
+{
+	size_t i;
+
+	for (i = 0; i < data->nfiles; i++)
+		if (data->files[i].pathlen == pathlen
+				&& memcmp(data->files[i].path, path, pathlen) == 0)
+			return (int) i;
+	return -1;
+}
+
+static int
+add_file(struct driver_data *data, const u8 *path, size_t pathlen, int is_df)
+{
+	struct virtual_file *f;
+	size_t len;
+	int idx;
+
+	if (pathlen < 2 || pathlen % 2 || pathlen > SC_MAX_PATH_SIZE)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	idx = find_file(data, path, pathlen);
+	if (idx >= 0)
+		return data->files[idx].is_df == is_df ? idx : SC_ERROR_FILE_ALREADY_EXISTS;
+
+	/* Every file has its parent DFs, so SELECT always finds them */
+	for (len = 2; len < pathlen; len += 2) {
+		idx = add_file(data, path, len, 1);
+		if (idx < 0)
+			return idx;
+	}
+
+	f = realloc(data->files, (data->nfiles + 1) * sizeof(*f));
+	if (f == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	data->files = f;
+	f = &data->files[data->nfiles];
+	memset(f, 0, sizeof(*f));
+	memcpy(f->path, path, pathlen);
+	f->pathlen = pathlen;
+	f->is_df = is_df;
+	return (int) data->nfiles++;
+}
+
+static int
+image_line(sc_context_t *ctx, const char *fname, struct driver_data *data, char *line)
+{
+	char *argv[6], *name;
+	int argc = 0, idx, r;
+	u8 path[SC_MAX_PATH_SIZE];
+	size_t pathlen = sizeof(path);
+	unsigned long ref;
+
+	for (argc = 0; argc < 6; argc++) {
+		argv[argc] = strtok(argc ? NULL : line, " \t");
+		if (argv[argc] == NULL)
+			break;
+	}
+	if (argc < 2)
+		return SC_ERROR_SYNTAX_ERROR;
+
+	if (strcmp(argv[0], "atr") == 0) {
+		data->atr_len = sizeof(data->atr);
+		return parse_hex_fixed(argv[1], data->atr, &data->atr_len);
+	}
+
+	if (strcmp(argv[0], "df") == 0 || strcmp(argv[0], "ef") == 0) {
+		struct virtual_file *f;
+		int is_df = argv[0][0] == 'd';
+
+		r = parse_hex_fixed(argv[1], path, &pathlen);
+		if (r < 0)
+			return r;
+		idx = add_file(data, path, pathlen, is_df);
+		if (idx < 0)
+			return idx;
+		f = &data->files[idx];
+
+		if (is_df) {
+			if (argc >= 4 && strcmp(argv[2], "aid") == 0) {
+				f->aidlen = sizeof(f->aid);
+				return parse_hex_fixed(argv[3], f->aid, &f->aidlen);
+			}
+			return argc == 2 ? SC_SUCCESS : SC_ERROR_SYNTAX_ERROR;
+		}
+
+		if (argc < 3)
+			return SC_ERROR_SYNTAX_ERROR;
+		free(f->data);
+		f->data = NULL;
+		if (strcmp(argv[2], "size") == 0 && argc >= 4) {
+			f->size = strtoul(argv[3], NULL, 0);
+			f->data = calloc(1, f->size ? f->size : 1);
+			return f->data ? SC_SUCCESS : SC_ERROR_OUT_OF_MEMORY;
+		}
+		if (argv[2][0] == '@') {
+			name = relative_name(fname, argv[2] + 1);
+			if (name == NULL)
+				return SC_ERROR_OUT_OF_MEMORY;
+			r = read_file(name, &f->data, &f->size);
+			if (r < 0)
+				sc_log(ctx, "cannot read '%s'", name);
+			free(name);
+			return r;
+		}
+		return parse_hex(argv[2], &f->data, &f->size);
+	}
+
+	if (strcmp(argv[0], "pin") == 0) {
+		struct virtual_pin *pin;
+
+		if (argc < 3 || data->npins == VIRTUAL_MAX_PINS)
+			return SC_ERROR_SYNTAX_ERROR;
+		if (strlen(argv[2]) > SC_MAX_PIN_SIZE)
+			return SC_ERROR_INVALID_PIN_LENGTH;
+		pin = &data->pins[data->npins++];
+		pin->ref = strtoul(argv[1], NULL, 16);
+		pin->len = strlen(argv[2]);
+		memcpy(pin->value, argv[2], pin->len);
+		pin->max_tries = 3;
+		if (argc >= 5 && strcmp(argv[3], "tries") == 0)
+			pin->max_tries = atoi(argv[4]);
+		if (pin->max_tries < 1 || pin->max_tries > 15)
+			return SC_ERROR_INVALID_ARGUMENTS;
+		pin->tries = pin->max_tries;
+		return SC_SUCCESS;
+	}
+
+	if (strcmp(argv[0], "key") == 0) {
+		struct virtual_key *key;
+
+		if (argc < 3 || data->nkeys == VIRTUAL_MAX_KEYS)
+			return SC_ERROR_SYNTAX_ERROR;
+		ref = strtoul(argv[1], NULL, 16);
+		key = &data->keys[data->nkeys];
+		key->ref = ref;
+		key->pin_ref = -1;
+		if (argc >= 5 && strcmp(argv[3], "pin") == 0)
+			key->pin_ref = (int) strtoul(argv[4], NULL, 16);
+#ifdef ENABLE_OPENSSL
+		{
+			FILE *f;
+
+			name = relative_name(fname, argv[2]);
+			if (name == NULL)
+				return SC_ERROR_OUT_OF_MEMORY;
+			f = fopen(name, "r");
+			if (f == NULL) {
+				sc_log(ctx, "cannot read '%s'", name);
+				free(name);
+				return SC_ERROR_FILE_NOT_FOUND;
+			}
+			free(name);
+			key->pkey = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+			fclose(f);
+			if (key->pkey == NULL)
+				return SC_ERROR_INVALID_DATA;
+		}
+#else
+		sc_log(ctx, "key %02lX: no OpenSSL support, security operations will fail", ref);
+#endif
+		data->nkeys++;
+		return SC_SUCCESS;
+	}
+
+	return SC_ERROR_SYNTAX_ERROR;
+}
+
+/*
+ * Card emulation
+ */
+static size_t
+set_sw(u8 *rbuf, size_t len, unsigned int sw)
+{
+	rbuf[len++] = (sw >> 8) & 0xFF;
+	rbuf[len++] = sw & 0xFF;
+	return len;
+}
+
+static struct virtual_pin *
+find_pin(struct driver_data *data, unsigned int ref)
+{
+	size_t i;
+
+	for (i = 0; i < data->npins; i++)
+		if (data->pins[i].ref == ref)
+			return &data->pins[i];
+	return NULL;
+}
+
+#ifdef ENABLE_OPENSSL
+static struct virtual_key *
+find_key(struct driver_data *data, int ref)
+{
+	size_t i;
+
+	for (i = 0; i < data->nkeys; i++)
+		if ((int) data->keys[i].ref == ref)
+			return &data->keys[i];
+	return NULL;
+}
+#endif
+
+static size_t
+emu_select(struct driver_data *data, const sc_apdu_t *apdu, u8 *rbuf, size_t rmax)
+{
+	const struct virtual_file *df = &data->files[data->cur_df];
+	struct virtual_file *f;
+	u8 path[SC_MAX_PATH_SIZE];
+	size_t pathlen = 0, len = 0, i;
+	int idx = -1;
+
+	switch (apdu->p1) {
+	case 0x00:
+	case 0x01:
+	case 0x02:
+		if (apdu->datalen == 0 || (apdu->datalen == 2
+				&& apdu->data[0] == 0x3F && apdu->data[1] == 0x00)) {
+			idx = find_file(data, (const u8 *) "\x3F\x00", 2);
+			break;
+		}
+		if (apdu->datalen != 2)
+			return set_sw(rbuf, 0, 0x6A87);
+		/* child of the current DF, the current DF itself or a sibling */
+		if (df->pathlen + 2 <= sizeof(path)) {
+			memcpy(path, df->path, df->pathlen);
+			memcpy(path + df->pathlen, apdu->data, 2);
+			idx = find_file(data, path, df->pathlen + 2);
+		}
+		if (idx < 0 && memcmp(df->path + df->pathlen - 2, apdu->data, 2) == 0)
+			idx = data->cur_df;
+		if (idx < 0 && apdu->p1 == 0x00 && df->pathlen > 2) {
+			memcpy(path, df->path, df->pathlen - 2);
+			memcpy(path + df->pathlen - 2, apdu->data, 2);
+			idx = find_file(data, path, df->pathlen);
+		}
+		break;
+	case 0x03:
+		if (df->pathlen > 2)
+			idx = find_file(data, df->path, df->pathlen - 2);
+		break;
+	case 0x04:
+		for (i = 0; i < data->nfiles; i++) {
+			f = &data->files[i];
+			if (f->aidlen != 0 && apdu->datalen <= f->aidlen
+					&& memcmp(f->aid, apdu->data, apdu->datalen) == 0) {
+				idx = (int) i;
+				break;
+			}
+		}
+		break;
+	case 0x08:
+	case 0x09:
+		if (apdu->p1 == 0x08) {
+			path[0] = 0x3F;
+			path[1] = 0x00;
+			pathlen = 2;
+		} else {
+			memcpy(path, df->path, df->pathlen);
+			pathlen = df->pathlen;
+		}
+		if (apdu->datalen % 2 || pathlen + apdu->datalen > sizeof(path))
+			return set_sw(rbuf, 0, 0x6A87);
+		memcpy(path + pathlen, apdu->data, apdu->datalen);
+		idx = find_file(data, path, pathlen + apdu->datalen);
+		break;
+	default:
+		return set_sw(rbuf, 0, 0x6A86);
+	}
+	if (idx < 0)
+		return set_sw(rbuf, 0, 0x6A82);
+
+	f = &data->files[idx];
+	if (f->is_df) {
+		data->cur_df = idx;
+		data->cur_ef = -1;
+	} else {
+		/* the parent DF exists, add_file() creates it */
+		data->cur_df = find_file(data, f->path, f->pathlen - 2);
+		data->cur_ef = idx;
+	}
+
+	if ((apdu->p2 & 0x0C) == 0x0C || apdu->le == 0)
+		return set_sw(rbuf, 0, 0x9000);
+
+	/* FCI template: FID, descriptor, size or DF name */
+	if (rmax < 2 + 4 + 3 + 4 + 2 + f->aidlen)
+		return set_sw(rbuf, 0, 0x6700);
+	rbuf[len++] = 0x6F;
+	rbuf[len++] = 0;
+	rbuf[len++] = 0x83;
+	rbuf[len++] = 2;
+	rbuf[len++] = f->path[f->pathlen - 2];
+	rbuf[len++] = f->path[f->pathlen - 1];
+	rbuf[len++] = 0x82;
+	rbuf[len++] = 1;
+	rbuf[len++] = f->is_df ? 0x38 : 0x01;
+	if (f->is_df) {
+		if (f->aidlen) {
+			rbuf[len++] = 0x84;
+			rbuf[len++] = (u8) f->aidlen;
+			memcpy(rbuf + len, f->aid, f->aidlen);
+			len += f->aidlen;
+		}
+	} else {
+		rbuf[len++] = 0x80;
+		rbuf[len++] = 2;
+		rbuf[len++] = (f->size >> 8) & 0xFF;
+		rbuf[len++] = f->size & 0xFF;
+	}
+	rbuf[1] = (u8) (len - 2);
+	if (len > apdu->le)
+		len = apdu->le;
+	return set_sw(rbuf, len, 0x9000);
+}
+
+static size_t
+emu_binary(struct driver_data *data, const sc_apdu_t *apdu, u8 *rbuf, size_t rmax)
+{
+	struct virtual_file *f;
+	size_t offset, len;
+
+	if (apdu->p1 & 0x80)
+		return set_sw(rbuf, 0, 0x6A81);		/* no short EF identifiers */
+	if (data->cur_ef < 0)
+		return set_sw(rbuf, 0, 0x6986);
+	f = &data->files[data->cur_ef];
+	offset = (apdu->p1 << 8) | apdu->p2;
+	if (offset > f->size)
+		return set_sw(rbuf, 0, 0x6B00);
+
+	if (apdu->ins == 0xD6) {
+		if (offset + apdu->datalen > f->size)
+			return set_sw(rbuf, 0, 0x6700);
+		memcpy(f->data + offset, apdu->data, apdu->datalen);
+		return set_sw(rbuf, 0, 0x9000);
+	}
+
+	len = f->size - offset;
+	if (len > apdu->le)
+		len = apdu->le;
+	if (len > rmax)
+		len = rmax;
+	memcpy(rbuf, f->data + offset, len);
+	return set_sw(rbuf, len, len < apdu->le ? 0x6282 : 0x9000);
+}
+
+static size_t
+emu_verify(struct driver_data *data, const sc_apdu_t *apdu, u8 *rbuf)
+{
+	struct virtual_pin *pin = find_pin(data, apdu->p2);
+	size_t len = apdu->datalen;
+
+	if (pin == NULL)
+		return set_sw(rbuf, 0, 0x6A88);
+	if (len == 0)
+		return set_sw(rbuf, 0, pin->verified ? 0x9000 : 0x63C0 | pin->tries);
+	if (pin->tries == 0)
+		return set_sw(rbuf, 0, 0x6983);
+
+	/* ignore padding added by the host */
+	while (len > 0 && (apdu->data[len - 1] == 0xFF || apdu->data[len - 1] == 0x00))
+		len--;
+	if (len != pin->len || memcmp(apdu->data, pin->value, len) != 0) {
+		pin->verified = 0;
+		pin->tries--;
+		return set_sw(rbuf, 0, pin->tries ? 0x63C0 | pin->tries : 0x6983);
+	}
+	pin->tries = pin->max_tries;
+	pin->verified = 1;
+	return set_sw(rbuf, 0, 0x9000);
+}
+
+static size_t
+emu_mse(struct driver_data *data, const sc_apdu_t *apdu, u8 *rbuf)
+{
+	size_t i, taglen;
+
+	if (apdu->p1 == 0xF3)
+		return set_sw(rbuf, 0, 0x9000);
+
+	for (i = 0; i + 2 <= apdu->datalen; i += 2 + taglen) {
+		taglen = apdu->data[i + 1];
+		if (i + 2 + taglen > apdu->datalen)
+			return set_sw(rbuf, 0, 0x6A80);
+		if (apdu->data[i] == 0x84 && taglen > 0)
+			data->se_key = apdu->data[i + 1 + taglen];
+	}
+	return set_sw(rbuf, 0, 0x9000);
+}
+
+static size_t
+emu_pso(struct driver_data *data, const sc_apdu_t *apdu, u8 *rbuf, size_t rmax)
+{
+#ifdef ENABLE_OPENSSL
+	struct virtual_key *key = find_key(data, data->se_key);
+	struct virtual_pin *pin;
+	const u8 *in = apdu->data;
+	size_t inlen = apdu->datalen;
+	RSA *rsa;
+	int sign, len = -1;
+
+	if (apdu->p1 == 0x9E && apdu->p2 == 0x9A)
+		sign = 1;
+	else if (apdu->p1 == 0x80 && apdu->p2 == 0x86)
+		sign = 0;
+	else
+		return set_sw(rbuf, 0, 0x6A86);
+
+	if (key == NULL)
+		return set_sw(rbuf, 0, 0x6A88);
+	if (key->pin_ref >= 0) {
+		pin = find_pin(data, key->pin_ref);
+		if (pin == NULL || !pin->verified)
+			return set_sw(rbuf, 0, 0x6982);
+	}
+
+	rsa = EVP_PKEY_get1_RSA(key->pkey);
+	if (rsa != NULL) {
+		if ((size_t) RSA_size(rsa) > rmax) {
+			RSA_free(rsa);
+			return set_sw(rbuf, 0, 0x6700);
+		}
+		if (sign) {
+			len = RSA_private_encrypt(inlen, in, rbuf, rsa,
+				inlen == (size_t) RSA_size(rsa) ? RSA_NO_PADDING : RSA_PKCS1_PADDING);
+		} else if (inlen > 1 && in[0] == 0x00) {
+			/* skip the padding indicator byte */
+			len = RSA_private_decrypt(inlen - 1, in + 1, rbuf, rsa, RSA_PKCS1_PADDING);
+		}
+		RSA_free(rsa);
+	}
+#ifndef OPENSSL_NO_EC
+	else if (sign) {
+		EC_KEY *ec = EVP_PKEY_get1_EC_KEY(key->pkey);
+		ECDSA_SIG *sig = NULL;
+		const BIGNUM *r, *s;
+		int n;
+
+		if (ec != NULL)
+			sig = ECDSA_do_sign(in, inlen, ec);
+		if (sig != NULL) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+			ECDSA_SIG_get0(sig, &r, &s);
+#else
+			r = sig->r;
+			s = sig->s;
+#endif
+			/* plain r || s, as the cards return it */
+			n = (EC_GROUP_get_degree(EC_KEY_get0_group(ec)) + 7) / 8;
+			if ((size_t) n * 2 <= rmax) {
+				memset(rbuf, 0, n * 2);
+				BN_bn2bin(r, rbuf + n - BN_num_bytes(r));
+				BN_bn2bin(s, rbuf + 2 * n - BN_num_bytes(s));
+				len = n * 2;
+			}
+			ECDSA_SIG_free(sig);
+		}
+		if (ec != NULL)
+			EC_KEY_free(ec);
+	}
+#endif
+	if (len < 0)
+		return set_sw(rbuf, 0, 0x6A80);
+	return set_sw(rbuf, len, 0x9000);
+#else
+	/* no crypto without OpenSSL */
+	return set_sw(rbuf, 0, 0x6A81);
+#endif
+}
+
+static size_t
+emu_get_challenge(const sc_apdu_t *apdu, u8 *rbuf, size_t rmax)
+{
+	size_t len = apdu->le;
+#ifndef ENABLE_OPENSSL
+	size_t i;
+#endif
+
+	if (len > rmax)
+		len = rmax;
+#ifdef ENABLE_OPENSSL
+	if (RAND_bytes(rbuf, len) != 1)
+		return set_sw(rbuf, 0, 0x6F00);
+#else
+	for (i = 0; i < len; i++)
+		rbuf[i] = rand() & 0xFF;
+#endif
+	return set_sw(rbuf, len, 0x9000);
+}
+
+static size_t
+emulate(struct driver_data *data, const sc_apdu_t *apdu, u8 *rbuf, size_t rmax)
+{
+	switch (apdu->ins) {
+	case 0xA4:
+		return emu_select(data, apdu, rbuf, rmax);
+	case 0xB0:
+	case 0xD6:
+		return emu_binary(data, apdu, rbuf, rmax);
+	case 0x20:
+		return emu_verify(data, apdu, rbuf);
+	case 0x22:
+		return emu_mse(data, apdu, rbuf);
+	case 0x2A:
+		return emu_pso(data, apdu, rbuf, rmax);
+	case 0x84:
+		return emu_get_challenge(apdu, rbuf, rmax);
+	case 0xC0:
+		/* nothing pending; answers the CLA probe of the default driver */
+		return set_sw(rbuf, 0, 0x9000);
+	}
+	return set_sw(rbuf, 0, 0x6D00);
+}
+
+/* Find the command in the transcript, starting after the last match */
+static size_t
+replay(struct driver_data *data, const u8 *sbuf, size_t ssize, u8 *rbuf, size_t rmax)
+{
+	struct virtual_exchange *ex;
+	size_t i, n;
+
+	for (i = 0; i < data->nexchanges; i++) {
+		n = (data->next + i) % data->nexchanges;
+		ex = &data->exchanges[n];
+		if (ex->cmdlen != ssize || memcmp(ex->cmd, sbuf, ssize) != 0)
+			continue;
+		data->next = n + 1;
+		if (ex->resplen - 2 > rmax) {
+			memcpy(rbuf, ex->resp, rmax);
+			return set_sw(rbuf, rmax, 0x6282);
+		}
+		memcpy(rbuf, ex->resp, ex->resplen);
+		return ex->resplen;
+	}
+	return set_sw(rbuf, 0, 0x6F00);
+}
+
+/*
+ * Initialize readers
+ *
+ * Called during sc_establish_context(), when the driver
+ * is loaded
+ */
+static void
+virtual_free_data(struct driver_data *data)
+{
+	size_t i;
+
+	if (data == NULL)
+		return;
+	for (i = 0; i < data->nexchanges; i++) {
+		free(data->exchanges[i].cmd);
+		free(data->exchanges[i].resp);
+	}
+	free(data->exchanges);
+	for (i = 0; i < data->nfiles; i++)
+		free(data->files[i].data);
+	free(data->files);
+	sc_mem_clear(data->pins, sizeof(data->pins));
+#ifdef ENABLE_OPENSSL
+	for (i = 0; i < data->nkeys; i++)
+		EVP_PKEY_free(data->keys[i].pkey);
+#endif
+	free(data->name);
+	free(data);
+}
+
+static int
+virtual_add_reader(sc_context_t *ctx, scconf_block *blk)
+{
+	sc_reader_t *reader = NULL;
+	struct driver_data *data;
+	const char *transcript, *image, *atr;
+	char name[128];
+	int r;
+
+	data = calloc(1, sizeof(*data));
+	if (data == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	data->name = strdup(blk->name && blk->name->data ? blk->name->data : "card");
+	data->latency = scconf_get_int(blk, "latency", 0);
+	if (data->name == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+
+	transcript = scconf_get_str(blk, "transcript", NULL);
+	image = scconf_get_str(blk, "image", NULL);
+	if ((transcript == NULL) == (image == NULL)) {
+		sc_log(ctx, "virtual card '%s': exactly one of transcript or image is needed", data->name);
+		r = SC_ERROR_INVALID_ARGUMENTS;
+		goto err;
+	}
+	if (transcript != NULL) {
+		r = for_each_line(ctx, transcript, data, transcript_line);
+		if (r == SC_SUCCESS && (data->nexchanges == 0
+				|| data->exchanges[data->nexchanges - 1].resp == NULL))
+			r = SC_ERROR_SYNTAX_ERROR;
+	} else {
+		r = for_each_line(ctx, image, data, image_line);
+		if (r == SC_SUCCESS && find_file(data, (const u8 *) "\x3F\x00", 2) < 0)
+			r = add_file(data, (const u8 *) "\x3F\x00", 2, 1);
+	}
+	if (r < 0)
+		goto err;
+
+	atr = scconf_get_str(blk, "atr", NULL);
+	if (atr != NULL) {
+		data->atr_len = sizeof(data->atr);
+		r = parse_hex_fixed(atr, data->atr, &data->atr_len);
+		if (r < 0)
+			goto err;
+	}
+	if (data->atr_len == 0) {
+		sc_log(ctx, "virtual card '%s': no ATR", data->name);
+		r = SC_ERROR_INVALID_ARGUMENTS;
+		goto err;
+	}
+
+	reader = calloc(1, sizeof(*reader));
+	if (reader == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	snprintf(name, sizeof(name), "Virtual reader (%s)", data->name);
+	reader->driver = &virtual_reader_driver;
+	reader->ops = &virtual_ops;
+	reader->drv_data = data;
+	reader->name = strdup(name);
+	reader->flags = SC_READER_CARD_PRESENT | SC_READER_CARD_CHANGED;
+	reader->supported_protocols = SC_PROTO_T1;
+	if (image != NULL)
+		reader->capabilities |= SC_READER_CAP_EMULATED;
+
+	if ((r = _sc_add_reader(ctx, reader)) < 0) {
+		free(reader->name);
+		free(reader);
+		goto err;
+	}
+	sc_log(ctx, "virtual card '%s': %s, latency %lu us", data->name,
+			transcript ? "transcript" : "image", data->latency);
+	return SC_SUCCESS;
+
+err:
+	virtual_free_data(data);
+	return r;
+}
+
+static int
+virtual_reader_init(sc_context_t *ctx)
+{
+	scconf_block *conf_block, **blocks;
+	int i;
+
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+
+	conf_block = sc_get_conf_block(ctx, "reader_driver", "virtual", 1);
+	if (conf_block == NULL)
+		return SC_SUCCESS;
+
+	blocks = scconf_find_blocks(ctx->conf, conf_block, "card", NULL);
+	for (i = 0; blocks != NULL && blocks[i] != NULL; i++) {
+		/* a broken card definition should not hide the others */
+		if (virtual_add_reader(ctx, blocks[i]) < 0)
+			sc_log(ctx, "virtual card %d ignored", i);
+	}
+	free(blocks);
+
+	return SC_SUCCESS;
+}
+
+/*
+ * Called when the driver is being unloaded.  finish() has to
+ * deallocate the private data and any resources.
+ */
+static int virtual_reader_finish(sc_context_t *ctx)
+{
+	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_VERBOSE);
+	return SC_SUCCESS;
+}
+
+static int virtual_reader_release(sc_reader_t *reader)
+{
+	virtual_free_data((struct driver_data *) reader->drv_data);
+	reader->drv_data = NULL;
+	return SC_SUCCESS;
+}
+
+/* The card never leaves the reader; the first call reports it as new */
+static int virtual_reader_detect_card_presence(sc_reader_t *reader)
+{
+	int flags = reader->flags;
+
+	reader->flags &= ~SC_READER_CARD_CHANGED;
+	return flags;
+}
+
+static int virtual_reader_connect(sc_reader_t *reader)
+{
+	struct driver_data *data = (struct driver_data *) reader->drv_data;
+	size_t i;
+
+	/* power on: forget the card state of the previous session */
+	data->next = 0;
+	data->cur_df = find_file(data, (const u8 *) "\x3F\x00", 2);
+	data->cur_ef = -1;
+	data->se_key = -1;
+	for (i = 0; i < data->npins; i++)
+		data->pins[i].verified = 0;
+
+	memcpy(reader->atr.value, data->atr, data->atr_len);
+	reader->atr.len = data->atr_len;
+	reader->active_protocol = SC_PROTO_T1;
+	return _sc_parse_atr(reader);
+}
+
+static int virtual_reader_disconnect(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int virtual_reader_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	struct driver_data *data = (struct driver_data *) reader->drv_data;
+	size_t ssize = 0, rsize;
+	u8 *sbuf = NULL, rbuf[SC_MAX_EXT_APDU_BUFFER_SIZE];
+	int r;
+
+	/* encode and log the APDU */
+	r = sc_apdu_get_octets(reader->ctx, apdu, &sbuf, &ssize, SC_PROTO_RAW);
+	if (r != SC_SUCCESS)
+		goto out;
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, sbuf, ssize, 1);
+
+	if (data->latency) {
+#ifdef _WIN32
+		Sleep(data->latency / 1000);
+#else
+		usleep(data->latency);
+#endif
+	}
+
+	if (data->nexchanges)
+		rsize = replay(data, sbuf, ssize, rbuf, sizeof(rbuf) - 2);
+	else
+		rsize = emulate(data, apdu, rbuf, sizeof(rbuf) - 2);
+
+	sc_apdu_log(reader->ctx, SC_LOG_DEBUG_NORMAL, rbuf, rsize, 0);
+	/* set response */
+	r = sc_apdu_set_resp(reader->ctx, apdu, rbuf, rsize);
+out:
+	if (sbuf != NULL) {
+		sc_mem_clear(sbuf, ssize);
+		free(sbuf);
+	}
+	sc_mem_clear(rbuf, sizeof(rbuf));
+
+	return r;
+}
+
+static int virtual_reader_lock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+static int virtual_reader_unlock(sc_reader_t *reader)
+{
+	return SC_SUCCESS;
+}
+
+struct sc_reader_driver *sc_get_virtual_driver(void)
+{
+	virtual_ops.init = virtual_reader_init;
+	virtual_ops.finish = virtual_reader_finish;
+	virtual_ops.detect_readers = NULL;
+	virtual_ops.release = virtual_reader_release;
+	virtual_ops.detect_card_presence = virtual_reader_detect_card_presence;
+	virtual_ops.connect = virtual_reader_connect;
+	virtual_ops.disconnect = virtual_reader_disconnect;
+	virtual_ops.transmit = virtual_reader_transmit;
+	virtual_ops.perform_verify = NULL;
+	virtual_ops.perform_pace = NULL;
+	virtual_ops.lock = virtual_reader_lock;
+	virtual_ops.unlock = virtual_reader_unlock;
+	virtual_ops.use_reader = NULL;
+
+	return &virtual_reader_driver;
+}
@@ -39,6 +39,8 @@ int sc_decipher(sc_card_t *card,
 	if (card->ops->decipher == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
 	r = card->ops->decipher(card, crgram, crgram_len, out, outlen);
+	if (r < 0)
+		card->cache.sec_env_valid = 0;
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -53,6 +55,8 @@ int sc_compute_signature(sc_card_t *card,
 	if (card->ops->compute_signature == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
 	r = card->ops->compute_signature(card, data, datalen, out, outlen);
+	if (r < 0)
+		card->cache.sec_env_valid = 0;
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -66,7 +70,20 @@ int sc_set_security_env(sc_card_t *card,
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->set_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	if (se_num == 0 && _sc_sec_env_is_current(card, NULL, env)) {
+		sc_log(card->ctx, "security environment already set");
+		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_SUCCESS);
+	}
+
+	card->cache.sec_env_valid = 0;
 	r = card->ops->set_security_env(card, env, se_num);
+	/* Only remember it while locked: sc_unlock() forgets it, as another
+	 * application may change the card state between transactions */
+	if (r == SC_SUCCESS && se_num == 0 && card->lock_count > 0
+			&& (card->caps & SC_CARD_CAP_REUSE_SEC_ENV)) {
+		memcpy(&card->cache.sec_env, env, sizeof(card->cache.sec_env));
+		card->cache.sec_env_valid = 1;
+	}
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -78,10 +95,23 @@ int sc_restore_security_env(sc_card_t *card, int se_num)
 	SC_FUNC_CALLED(card->ctx, SC_LOG_DEBUG_NORMAL);
 	if (card->ops->restore_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	card->cache.sec_env_valid = 0;
 	r = card->ops->restore_security_env(card, se_num);
 	SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
+int _sc_sec_env_is_current(struct sc_card *card, const struct sc_path *path,
+			 const struct sc_security_env *env)
+{
+	if (!(card->caps & SC_CARD_CAP_REUSE_SEC_ENV))
+		return 0;
+	if (!card->cache.valid || !card->cache.sec_env_valid)
+		return 0;
+	if (path != NULL && !sc_compare_path(path, &card->cache.sec_env_path))
+		return 0;
+	return memcmp(env, &card->cache.sec_env, sizeof(card->cache.sec_env)) == 0;
+}
+
 int sc_verify(sc_card_t *card, unsigned int type, int ref, 
 	      const u8 *pin, size_t pinlen, int *tries_left)
 {
@@ -126,6 +126,7 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 {
 	struct sc_context *ctx  = card->ctx;
 	struct sc_apdu *sm_apdu = NULL;
+	unsigned long long start;
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
@@ -134,14 +135,20 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
 
 	/* get SM encoded APDU */
+	start = sc_stats_clock();
 	rv = card->sm_ctx.ops.get_sm_apdu(card, apdu, &sm_apdu);
 	if (rv == SC_ERROR_SM_NOT_APPLIED)   {
 		/* SM wrap of this APDU is ignored by card driver.
 		 * Send plain APDU to the reader driver */
+		start = sc_stats_clock();
 		rv = card->reader->ops->transmit(card->reader, apdu);
+		if (rv == SC_SUCCESS)
+			sc_stats_transmit(card, apdu->ins, apdu->datalen, apdu->resplen,
+					sc_stats_clock() - start);
 		LOG_FUNC_RETURN(ctx, rv);
 	}
 	LOG_TEST_RET(ctx, rv, "get SM APDU error");
+	sc_stats_count(ctx, SC_STATS_SM_WRAP, sc_stats_clock() - start);
 
 	/* check if SM APDU is still valid */
 	rv = sc_check_apdu(card, sm_apdu);
@@ -151,11 +158,16 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 	}
 
 	/* send APDU to the reader driver */
+	start = sc_stats_clock();
 	rv = card->reader->ops->transmit(card->reader, sm_apdu);
 	LOG_TEST_RET(ctx, rv, "unable to transmit APDU");
+	sc_stats_transmit(card, apdu->ins, sm_apdu->datalen, sm_apdu->resplen,
+			sc_stats_clock() - start);
 
 	/* decode SM answer and free temporary SM related data */
+	start = sc_stats_clock();
 	rv = card->sm_ctx.ops.free_sm_apdu(card, apdu, &sm_apdu);
+	sc_stats_count(ctx, SC_STATS_SM_UNWRAP, sc_stats_clock() - start);
 
 	LOG_FUNC_RETURN(ctx, rv);
 }
@@ -0,0 +1,389 @@
+/*
+ * stats.c: APDU statistics
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include "common/compat_strlcpy.h"
+#include "internal.h"
+
+#define SC_STATS_LATENCY_BUCKETS	24
+#define SC_STATS_MAX_DRIVERS		16
+
+/* Number of events and the total time spent in them */
+typedef struct sc_stats_counter {
+	unsigned long count;
+	unsigned long long usec;
+} sc_stats_counter_t;
+
+/* Bucket i of a latency histogram counts the exchanges that took less
+ * than 2^(i+1) microseconds; the last bucket counts the slower ones.
+ * Applications only see the names of sc_stats_format(), so the layout
+ * can change without breaking them. */
+struct sc_stats {
+	/* exchanges with the reader, GET RESPONSE and chained parts included */
+	unsigned long apdus;
+	/* command data sent and response data received, in bytes */
+	unsigned long long bytes_out, bytes_in;
+	/* GET RESPONSE commands sent after 61xx */
+	unsigned long get_response;
+	/* commands sent again with the Le of a 6Cxx status */
+	unsigned long resend_6c;
+	/* parts of chained commands */
+	unsigned long chained;
+	/* time spent in the reader driver */
+	sc_stats_counter_t transmit;
+	/* secure messaging wrap and unwrap of commands */
+	sc_stats_counter_t sm_wrap, sm_unwrap;
+	/* time spent waiting for the card lock in sc_lock() */
+	sc_stats_counter_t lock_wait;
+	unsigned long latency[SC_STATS_LATENCY_BUCKETS];
+	/* reader transmit time by instruction byte (of the plain command) */
+	sc_stats_counter_t ins[256];
+	/* reader transmit time by card driver */
+	struct {
+		char name[16];
+		sc_stats_counter_t transmit;
+		unsigned long latency[SC_STATS_LATENCY_BUCKETS];
+	} drivers[SC_STATS_MAX_DRIVERS];
+	unsigned int ndrivers;
+};
+
+/* The counters have their own mutex: they are updated from the APDU
+ * path, which may run while ctx->mutex is held */
+struct sc_stats_state {
+	void *mutex;
+	sc_stats_t stats;
+};
+
+int sc_stats_init(sc_context_t *ctx)
+{
+	struct sc_stats_state *state;
+	int r;
+
+	state = calloc(1, sizeof(*state));
+	if (state == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	r = sc_mutex_create(ctx, &state->mutex);
+	if (r != SC_SUCCESS) {
+		free(state);
+		return r;
+	}
+	ctx->stats = state;
+	return SC_SUCCESS;
+}
+
+void sc_stats_release(sc_context_t *ctx)
+{
+	struct sc_stats_state *state = ctx->stats;
+
+	if (state == NULL)
+		return;
+	if (state->mutex != NULL)
+		sc_mutex_destroy(ctx, state->mutex);
+	free(state);
+	ctx->stats = NULL;
+}
+
+unsigned long long sc_stats_clock(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+
+	if (!QueryPerformanceFrequency(&freq) || !QueryPerformanceCounter(&count))
+		return (unsigned long long) GetTickCount() * 1000;
+	return (unsigned long long) count.QuadPart * 1000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static unsigned int latency_bucket(unsigned long long usec)
+{
+	unsigned int i = 0;
+
+	while (usec > 1 && i < SC_STATS_LATENCY_BUCKETS - 1) {
+		usec >>= 1;
+		i++;
+	}
+	return i;
+}
+
+void sc_stats_transmit(sc_card_t *card, unsigned int ins,
+		size_t sent, size_t received, unsigned long long usec)
+{
+	sc_context_t *ctx = card->ctx;
+	struct sc_stats_state *state = ctx->stats;
+	sc_stats_t *stats;
+	const char *name;
+	unsigned int bucket, i;
+
+	if (state == NULL)
+		return;
+	stats = &state->stats;
+	name = card->driver != NULL ? card->driver->short_name : "none";
+	bucket = latency_bucket(usec);
+
+	sc_mutex_lock(ctx, state->mutex);
+	stats->apdus++;
+	stats->bytes_out += sent;
+	stats->bytes_in += received;
+	stats->transmit.count++;
+	stats->transmit.usec += usec;
+	stats->latency[bucket]++;
+	stats->ins[ins & 0xFF].count++;
+	stats->ins[ins & 0xFF].usec += usec;
+
+	for (i = 0; i < stats->ndrivers; i++)
+		if (!strcmp(stats->drivers[i].name, name))
+			break;
+	if (i == stats->ndrivers && i < SC_STATS_MAX_DRIVERS) {
+		strlcpy(stats->drivers[i].name, name, sizeof(stats->drivers[i].name));
+		stats->ndrivers++;
+	}
+	if (i < stats->ndrivers) {
+		stats->drivers[i].transmit.count++;
+		stats->drivers[i].transmit.usec += usec;
+		stats->drivers[i].latency[bucket]++;
+	}
+	sc_mutex_unlock(ctx, state->mutex);
+}
+
+void sc_stats_count(sc_context_t *ctx, int event, unsigned long long usec)
+{
+	struct sc_stats_state *state = ctx->stats;
+	sc_stats_t *stats;
+
+	if (state == NULL)
+		return;
+	stats = &state->stats;
+
+	sc_mutex_lock(ctx, state->mutex);
+	switch (event) {
+	case SC_STATS_GET_RESPONSE:
+		stats->get_response++;
+		break;
+	case SC_STATS_RESEND_6C:
+		stats->resend_6c++;
+		break;
+	case SC_STATS_CHAINED:
+		stats->chained++;
+		break;
+	case SC_STATS_SM_WRAP:
+		stats->sm_wrap.count++;
+		stats->sm_wrap.usec += usec;
+		break;
+	case SC_STATS_SM_UNWRAP:
+		stats->sm_unwrap.count++;
+		stats->sm_unwrap.usec += usec;
+		break;
+	case SC_STATS_LOCK_WAIT:
+		stats->lock_wait.count++;
+		stats->lock_wait.usec += usec;
+		break;
+	}
+	sc_mutex_unlock(ctx, state->mutex);
+}
+
+int sc_ctx_get_stats(sc_context_t *ctx, sc_stats_t **out)
+{
+	struct sc_stats_state *state;
+	sc_stats_t *stats;
+
+	if (ctx == NULL || out == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	state = ctx->stats;
+	if (state == NULL)
+		return SC_ERROR_NOT_SUPPORTED;
+	stats = malloc(sizeof(*stats));
+	if (stats == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	sc_mutex_lock(ctx, state->mutex);
+	memcpy(stats, &state->stats, sizeof(*stats));
+	sc_mutex_unlock(ctx, state->mutex);
+	*out = stats;
+	return SC_SUCCESS;
+}
+
+void sc_stats_free(sc_stats_t *stats)
+{
+	free(stats);
+}
+
+void sc_ctx_reset_stats(sc_context_t *ctx)
+{
+	struct sc_stats_state *state;
+
+	if (ctx == NULL || ctx->stats == NULL)
+		return;
+	state = ctx->stats;
+
+	sc_mutex_lock(ctx, state->mutex);
+	memset(&state->stats, 0, sizeof(state->stats));
+	sc_mutex_unlock(ctx, state->mutex);
+}
+
+/* Calls emit() for every counter, with its name in sc_stats_format() */
+typedef void (*stats_emit_t)(void *arg, const char *name, unsigned long long value);
+
+static void walk_counter(stats_emit_t emit, void *arg,
+		const char *name, const sc_stats_counter_t *counter)
+{
+	char full[64];
+
+	snprintf(full, sizeof(full), "%s.count", name);
+	emit(arg, full, counter->count);
+	snprintf(full, sizeof(full), "%s.usec", name);
+	emit(arg, full, counter->usec);
+}
+
+static void walk_latency(stats_emit_t emit, void *arg,
+		const char *name, const unsigned long *latency)
+{
+	char full[64];
+	unsigned int i;
+
+	for (i = 0; i < SC_STATS_LATENCY_BUCKETS - 1; i++) {
+		if (latency[i] == 0)
+			continue;
+		snprintf(full, sizeof(full), "%s.lt_%lu", name, 2UL << i);
+		emit(arg, full, latency[i]);
+	}
+	if (latency[i] != 0) {
+		snprintf(full, sizeof(full), "%s.inf", name);
+		emit(arg, full, latency[i]);
+	}
+}
+
+static void walk_stats(const sc_stats_t *stats, stats_emit_t emit, void *arg)
+{
+	char name[48];
+	unsigned int i;
+
+	emit(arg, "apdus", stats->apdus);
+	emit(arg, "bytes.out", stats->bytes_out);
+	emit(arg, "bytes.in", stats->bytes_in);
+	emit(arg, "get_response", stats->get_response);
+	emit(arg, "resend_6c", stats->resend_6c);
+	emit(arg, "chained", stats->chained);
+	walk_counter(emit, arg, "transmit", &stats->transmit);
+	walk_counter(emit, arg, "sm_wrap", &stats->sm_wrap);
+	walk_counter(emit, arg, "sm_unwrap", &stats->sm_unwrap);
+	walk_counter(emit, arg, "lock_wait", &stats->lock_wait);
+	walk_latency(emit, arg, "latency", stats->latency);
+
+	for (i = 0; i < 256; i++) {
+		if (stats->ins[i].count == 0)
+			continue;
+		snprintf(name, sizeof(name), "ins.%02X", i);
+		walk_counter(emit, arg, name, &stats->ins[i]);
+	}
+	for (i = 0; i < stats->ndrivers && i < SC_STATS_MAX_DRIVERS; i++) {
+		snprintf(name, sizeof(name), "driver.%s", stats->drivers[i].name);
+		walk_counter(emit, arg, name, &stats->drivers[i].transmit);
+		snprintf(name, sizeof(name), "driver.%s.latency", stats->drivers[i].name);
+		walk_latency(emit, arg, name, stats->drivers[i].latency);
+	}
+}
+
+struct stats_lookup {
+	const char *name;
+	unsigned long long value;
+};
+
+static void lookup_emit(void *arg, const char *name, unsigned long long value)
+{
+	struct stats_lookup *lookup = arg;
+
+	if (!strcmp(lookup->name, name))
+		lookup->value = value;
+}
+
+unsigned long long sc_stats_get(const sc_stats_t *stats, const char *name)
+{
+	struct stats_lookup lookup;
+
+	if (stats == NULL || name == NULL)
+		return 0;
+	lookup.name = name;
+	lookup.value = 0;
+	walk_stats(stats, lookup_emit, &lookup);
+	return lookup.value;
+}
+
+struct stats_text {
+	char *buf;
+	size_t buflen, len;
+};
+
+/* Appends a line like snprintf() would: the text is cut at the end of
+ * the buffer, but the full length is counted */
+static void format_emit(void *arg, const char *name, unsigned long long value)
+{
+	struct stats_text *text = arg;
+	char line[128];
+	int r;
+
+	r = snprintf(line, sizeof(line), "%s %llu\n", name, value);
+	if (r < 0)
+		return;
+	if ((size_t) r >= sizeof(line))
+		r = sizeof(line) - 1;
+
+	if (text->buf != NULL && text->len + 1 < text->buflen) {
+		size_t n = text->buflen - text->len - 1;
+
+		if (n > (size_t) r)
+			n = r;
+		memcpy(text->buf + text->len, line, n);
+		text->buf[text->len + n] = '\0';
+	}
+	text->len += r;
+}
+
+size_t sc_stats_format(const sc_stats_t *stats, char *buf, size_t buflen)
+{
+	struct stats_text text;
+
+	if (buf != NULL && buflen > 0)
+		buf[0] = '\0';
+	if (stats == NULL)
+		return 0;
+
+	text.buf = buf;
+	text.buflen = buflen;
+	text.len = 0;
+	walk_stats(stats, format_emit, &text);
+	return text.len;
+}
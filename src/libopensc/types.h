@@ -34,6 +34,7 @@ typedef unsigned char u8;
 #define SC_MAX_APDU_BUFFER_SIZE		261 /* takes account of: CLA INS P1 P2 Lc [255 byte of data] Le */
 #define SC_MAX_EXT_APDU_BUFFER_SIZE	65538
 #define SC_MAX_PIN_SIZE			256 /* OpenPGP card has 254 max */
+#define SC_MAX_CHALLENGE_SIZE		256 /* Le of a short GET CHALLENGE */
 #define SC_MAX_ATR_SIZE			33
 #define SC_MAX_AID_SIZE			16
 #define SC_MAX_AID_STRING_SIZE		(SC_MAX_AID_SIZE * 2 + 3)
@@ -42,6 +43,7 @@ typedef unsigned char u8;
 #define SC_MAX_PATH_SIZE		16
 #define SC_MAX_PATH_STRING_SIZE		(SC_MAX_PATH_SIZE * 2 + 3)
 #define SC_MAX_SDO_ACLS			8
+#define SC_MAX_ASN1_PROGRAMS		4
 #define SC_MAX_CRTS_IN_SE		12
 #define SC_MAX_SE_NUM			8
 
@@ -7,7 +7,7 @@ OBJECTS			= pkcs11-global.obj pkcs11-session.obj pkcs11-object.obj misc.obj slot
 			  mechanism.obj openssl.obj framework-pkcs15.obj \
 			  framework-pkcs15init.obj debug.obj pkcs11-display.obj \
 				$(TOPDIR)\win32\versioninfo.res
-OBJECTS3		= pkcs11-spy.obj pkcs11-display.obj \
+OBJECTS3		= pkcs11-spy.obj pkcs11-spy-trace.obj pkcs11-display.obj \
 				$(TOPDIR)\win32\versioninfo.res
 
 all: $(TOPDIR)\win32\versioninfo.res $(TARGET1) $(TARGET3)
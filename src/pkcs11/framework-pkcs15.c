@@ -51,11 +51,12 @@ struct pkcs15_slot_data {
 	}                                       \
 	attr->ulValueLen = size;
 
-#define MAX_OBJECTS	64
 struct pkcs15_fw_data {
 	struct sc_pkcs15_card *		p15_card;
-	struct pkcs15_any_object *	objects[MAX_OBJECTS];
+	struct pkcs15_any_object **	objects;
 	unsigned int			num_objects;
+	unsigned int			max_objects;
+	struct pkcs15_fw_index *	index;
 	unsigned int			locked;
 	unsigned char user_puk[64];
 	unsigned int user_puk_len;
@@ -129,6 +130,27 @@ struct pkcs15_skey_object {
 #define skey_p15obj	base.p15_object
 #define is_skey(obj)	((__p15_type(obj) & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_SKEY_OBJECT)
 
+/*
+ * Binding keys and certificates to each other looks up objects by ID, and
+ * certificates by subject and issuer. The index keeps hash chains for these
+ * lookups so that binding stays linear in the number of objects. Objects are
+ * added to it as they are created, certificates once their data is read.
+ * Moving an object updates the indexes of both sides. Deleting an object
+ * drops the index; the next lookup rebuilds it.
+ */
+#define FW_INDEX_BUCKETS	256
+
+struct pkcs15_fw_index_entry {
+	struct pkcs15_any_object *	obj;
+	struct pkcs15_fw_index_entry *	next;
+};
+
+struct pkcs15_fw_index {
+	struct pkcs15_fw_index_entry *	by_id[FW_INDEX_BUCKETS];
+	struct pkcs15_fw_index_entry *	by_subject[FW_INDEX_BUCKETS];
+	struct pkcs15_fw_index_entry *	by_issuer[FW_INDEX_BUCKETS];
+};
+
 extern struct sc_pkcs11_object_ops pkcs15_cert_ops;
 extern struct sc_pkcs11_object_ops pkcs15_prkey_ops;
 extern struct sc_pkcs11_object_ops pkcs15_pubkey_ops;
@@ -149,6 +171,7 @@ static const struct {
 };
 
 static int	__pkcs15_release_object(struct pkcs15_any_object *);
+static void	__pkcs15_drop_index(struct pkcs15_fw_data *);
 static CK_RV	register_mechanisms(struct sc_pkcs11_card *p11card);
 static CK_RV	get_public_exponent(struct sc_pkcs15_pubkey *,
 					CK_ATTRIBUTE_PTR);
@@ -265,6 +288,9 @@ pkcs15_unbind(struct sc_pkcs11_card *p11card)
 			else
 				__pkcs15_release_object(obj);
 		}
+		__pkcs15_drop_index(fw_data);
+		if (fw_data->objects)
+			free(fw_data->objects);
 
 		unlock_card(fw_data);
 
@@ -351,6 +377,227 @@ set_cka_label(CK_ATTRIBUTE_PTR attr, char *label)
 }
 #endif
 
+static struct sc_pkcs15_id *
+__pkcs15_object_id(struct pkcs15_any_object *obj)
+{
+	struct sc_pkcs15_object *p15_object = obj->p15_object;
+
+	if (!p15_object || !p15_object->data)
+		return NULL;
+
+	switch (p15_object->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY:
+		return &((struct sc_pkcs15_prkey_info *) p15_object->data)->id;
+	case SC_PKCS15_TYPE_PUBKEY:
+		return &((struct sc_pkcs15_pubkey_info *) p15_object->data)->id;
+	case SC_PKCS15_TYPE_CERT:
+		return &((struct sc_pkcs15_cert_info *) p15_object->data)->id;
+	}
+	return NULL;
+}
+
+static unsigned int
+__pkcs15_index_hash(const u8 *value, size_t len)
+{
+	unsigned int hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ value[i]) * 16777619U;
+	return hash % FW_INDEX_BUCKETS;
+}
+
+static int
+__pkcs15_index_add(struct pkcs15_fw_index_entry **table, const u8 *key, size_t len,
+		struct pkcs15_any_object *obj)
+{
+	struct pkcs15_fw_index_entry *entry, **pp;
+
+	if (!(entry = calloc(1, sizeof(*entry))))
+		return SC_ERROR_OUT_OF_MEMORY;
+	entry->obj = obj;
+
+	/* Keep the chains in object order, the first match wins */
+	for (pp = &table[__pkcs15_index_hash(key, len)]; *pp; pp = &(*pp)->next)
+		;
+	*pp = entry;
+	return SC_SUCCESS;
+}
+
+static void
+__pkcs15_index_remove(struct pkcs15_fw_index_entry **table, const u8 *key, size_t len,
+		struct pkcs15_any_object *obj)
+{
+	struct pkcs15_fw_index_entry *entry, **pp;
+
+	for (pp = &table[__pkcs15_index_hash(key, len)]; (entry = *pp) != NULL; pp = &entry->next) {
+		if (entry->obj == obj) {
+			*pp = entry->next;
+			free(entry);
+			return;
+		}
+	}
+}
+
+static void
+__pkcs15_drop_index(struct pkcs15_fw_data *fw_data)
+{
+	struct pkcs15_fw_index *index = fw_data->index;
+	struct pkcs15_fw_index_entry *entry;
+	unsigned int i;
+
+	if (!index)
+		return;
+	for (i = 0; i < FW_INDEX_BUCKETS; i++) {
+		while ((entry = index->by_id[i]) != NULL) {
+			index->by_id[i] = entry->next;
+			free(entry);
+		}
+		while ((entry = index->by_subject[i]) != NULL) {
+			index->by_subject[i] = entry->next;
+			free(entry);
+		}
+		while ((entry = index->by_issuer[i]) != NULL) {
+			index->by_issuer[i] = entry->next;
+			free(entry);
+		}
+	}
+	free(index);
+	fw_data->index = NULL;
+}
+
+/* Add certificate data to the index, once it has been read */
+static int
+__pkcs15_index_add_cert(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *cert)
+{
+	struct pkcs15_fw_index *index = fw_data->index;
+	struct sc_pkcs15_cert *data = cert->cert_data;
+	int rv;
+
+	if (!index || !data)
+		return SC_SUCCESS;
+	if (data->subject_len) {
+		rv = __pkcs15_index_add(index->by_subject, data->subject, data->subject_len,
+				(struct pkcs15_any_object *) cert);
+		if (rv < 0)
+			return rv;
+	}
+	if (data->issuer_len) {
+		rv = __pkcs15_index_add(index->by_issuer, data->issuer, data->issuer_len,
+				(struct pkcs15_any_object *) cert);
+		if (rv < 0)
+			return rv;
+	}
+	return SC_SUCCESS;
+}
+
+static int
+__pkcs15_index_add_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object *obj)
+{
+	struct sc_pkcs15_id *id = __pkcs15_object_id(obj);
+	int rv;
+
+	if (!fw_data->index)
+		return SC_SUCCESS;
+	if (id) {
+		rv = __pkcs15_index_add(fw_data->index->by_id, id->value, id->len, obj);
+		if (rv < 0)
+			return rv;
+	}
+	if (is_cert(obj))
+		return __pkcs15_index_add_cert(fw_data, (struct pkcs15_cert_object *) obj);
+	return SC_SUCCESS;
+}
+
+static void
+__pkcs15_index_remove_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object *obj)
+{
+	struct pkcs15_fw_index *index = fw_data->index;
+	struct sc_pkcs15_id *id = __pkcs15_object_id(obj);
+	struct sc_pkcs15_cert *data;
+
+	if (!index)
+		return;
+	if (id)
+		__pkcs15_index_remove(index->by_id, id->value, id->len, obj);
+	if (is_cert(obj) && (data = ((struct pkcs15_cert_object *) obj)->cert_data) != NULL) {
+		if (data->subject_len)
+			__pkcs15_index_remove(index->by_subject, data->subject, data->subject_len, obj);
+		if (data->issuer_len)
+			__pkcs15_index_remove(index->by_issuer, data->issuer, data->issuer_len, obj);
+	}
+}
+
+static struct pkcs15_fw_index *
+__pkcs15_get_index(struct pkcs15_fw_data *fw_data)
+{
+	unsigned int i;
+
+	if (fw_data->index)
+		return fw_data->index;
+
+	if (!(fw_data->index = calloc(1, sizeof(struct pkcs15_fw_index))))
+		return NULL;
+	for (i = 0; i < fw_data->num_objects; i++) {
+		if (__pkcs15_index_add_object(fw_data, fw_data->objects[i]) < 0) {
+			__pkcs15_drop_index(fw_data);
+			return NULL;
+		}
+	}
+	return fw_data->index;
+}
+
+/* Returns the chain of objects that may have the given ID */
+static struct pkcs15_fw_index_entry *
+__pkcs15_index_by_id(struct pkcs15_fw_data *fw_data, const struct sc_pkcs15_id *id)
+{
+	struct pkcs15_fw_index *index = __pkcs15_get_index(fw_data);
+
+	if (!index)
+		return NULL;
+	return index->by_id[__pkcs15_index_hash(id->value, id->len)];
+}
+
+static int
+__pkcs15_append_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object *obj)
+{
+	if (fw_data->num_objects >= fw_data->max_objects) {
+		unsigned int max = fw_data->max_objects ? fw_data->max_objects * 2 : 64;
+		struct pkcs15_any_object **objects;
+
+		objects = realloc(fw_data->objects, max * sizeof(*objects));
+		if (!objects)
+			return SC_ERROR_OUT_OF_MEMORY;
+		fw_data->objects = objects;
+		fw_data->max_objects = max;
+	}
+	fw_data->objects[fw_data->num_objects++] = obj;
+	return SC_SUCCESS;
+}
+
+/* Move the object at position idx to another framework data */
+static int
+__pkcs15_move_object(struct pkcs15_fw_data *fw_data, unsigned int idx, struct pkcs15_fw_data *move_to_fw)
+{
+	struct pkcs15_any_object *obj = fw_data->objects[idx];
+	unsigned int tail = fw_data->num_objects - idx - 1;
+	int rv;
+
+	rv = __pkcs15_append_object(move_to_fw, obj);
+	if (rv < 0)
+		return rv;
+	if (tail)
+		memmove(&fw_data->objects[idx], &fw_data->objects[idx + 1], sizeof(fw_data->objects[0]) * tail);
+	fw_data->num_objects--;
+
+	/* The order of the other objects is kept, and obj is the last one
+	 * of move_to_fw, so both indexes stay in object order */
+	__pkcs15_index_remove_object(fw_data, obj);
+	if (__pkcs15_index_add_object(move_to_fw, obj) < 0)
+		__pkcs15_drop_index(move_to_fw);
+	return SC_SUCCESS;
+}
+
 static int
 __pkcs15_create_object(struct pkcs15_fw_data *fw_data,
 		       struct pkcs15_any_object **result,
@@ -360,19 +607,22 @@ __pkcs15_create_object(struct pkcs15_fw_data *fw_data,
 {
 	struct pkcs15_any_object *obj;
 
-	if (fw_data->num_objects >= MAX_OBJECTS)
-		return SC_ERROR_TOO_MANY_OBJECTS;
-
 	if (!(obj = calloc(1, size)))
 		return SC_ERROR_OUT_OF_MEMORY;
 
-	fw_data->objects[fw_data->num_objects++] = obj;
+	if (__pkcs15_append_object(fw_data, obj) < 0) {
+		free(obj);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
 
 	obj->base.ops = ops;
 	obj->p15_object = p15_object;
 	obj->refcount = 1;
 	obj->size = size;
 
+	if (__pkcs15_index_add_object(fw_data, obj) < 0)
+		__pkcs15_drop_index(fw_data);
+
 	*result = obj;
 	return 0;
 }
@@ -383,6 +633,9 @@ __pkcs15_release_object(struct pkcs15_any_object *obj)
 	if (--(obj->refcount) != 0)
 		return obj->refcount;
 
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_release_verify_key(&obj->base);
+#endif
 	sc_mem_clear(obj, obj->size);
 	free(obj);
 
@@ -401,6 +654,7 @@ __pkcs15_delete_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object
 	for (i = 0; i < fw_data->num_objects; ++i)   {
 		if (fw_data->objects[i] == obj) {
 			fw_data->objects[i] = fw_data->objects[--fw_data->num_objects];
+			__pkcs15_drop_index(fw_data);
 			if (__pkcs15_release_object(obj) > 0)
 				return SC_ERROR_INTERNAL;
 			return SC_SUCCESS;
@@ -413,6 +667,7 @@ __pkcs15_delete_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object
 CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 {
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card;
 	struct sc_pkcs15_object *auth;
 	struct sc_pkcs15_auth_info *pin_info;
 	struct sc_pin_cmd_data data;
@@ -429,8 +684,16 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 	sc_log(context, "C_GetTokenInfo(%lx)", slotID);
 
 	rv = slot_get_token(slotID, &slot);
+	if (rv != CKR_OK) {
+		sc_pkcs11_unlock();
+		return rv;
+	}
+
+	/* Release the global lock while talking to the card */
+	p11card = slot->card;
+	rv = sc_pkcs11_pin_card(p11card);
 	if (rv != CKR_OK)
-		goto out;
+		return rv;
 
 	/* User PIN flags are cleared before re-calculation */
 	slot->token_info.flags &= ~(CKF_USER_PIN_COUNT_LOW|CKF_USER_PIN_FINAL_TRY|CKF_USER_PIN_LOCKED);
@@ -468,7 +731,7 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 	}
 	memcpy(pInfo, &slot->token_info, sizeof(CK_TOKEN_INFO));
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unpin_card(p11card);
 	return rv;
 }
 
@@ -477,10 +740,10 @@ static int
 public_key_created(struct pkcs15_fw_data *fw_data, const struct sc_pkcs15_id *id,
 		struct pkcs15_any_object **obj2)
 {
-	size_t ii;
+	struct pkcs15_fw_index_entry *entry;
 
-	for(ii=0; ii<fw_data->num_objects; ii++) {
-		struct pkcs15_any_object *any_object = fw_data->objects[ii];
+	for (entry = __pkcs15_index_by_id(fw_data, id); entry; entry = entry->next) {
+		struct pkcs15_any_object *any_object = entry->obj;
 		struct sc_pkcs15_object *p15_object = any_object->p15_object;
 
 		if (!p15_object)
@@ -529,6 +792,8 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 
 	object->cert_info = p15_info;
 	object->cert_data = p15_cert;
+	if (__pkcs15_index_add_cert(fw_data, object) < 0)
+		__pkcs15_drop_index(fw_data);
 
 	/* Corresponding public key */
 	rv = public_key_created(fw_data, &p15_info->id, (struct pkcs15_any_object **) &obj2);
@@ -666,16 +931,23 @@ pkcs15_create_pkcs11_objects(struct pkcs15_fw_data *fw_data, int p15_type, const
 		int (*create)(struct pkcs15_fw_data *, struct sc_pkcs15_object *,
 			struct pkcs15_any_object **any_object))
 {
-	struct sc_pkcs15_object *p15_object[MAX_OBJECTS];
+	struct sc_pkcs15_object **p15_object;
 	int i, count, rv;
 
-	rv = count = sc_pkcs15_get_objects(fw_data->p15_card, p15_type, p15_object, MAX_OBJECTS);
+	count = sc_pkcs15_get_objects(fw_data->p15_card, p15_type, NULL, 0);
+	if (count <= 0)
+		return count;
+	if (!(p15_object = calloc(count, sizeof(*p15_object))))
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	rv = count = sc_pkcs15_get_objects(fw_data->p15_card, p15_type, p15_object, count);
 	if (rv >= 0)
 		sc_log(context, "Found %d %s%s", count, name, (count == 1)? "" : "s");
 
 	for (i = 0; rv >= 0 && i < count; i++)
 		rv = create(fw_data, p15_object[i], NULL);
 
+	free(p15_object);
 	return count;
 }
 
@@ -684,12 +956,12 @@ static void
 __pkcs15_prkey_bind_related(struct pkcs15_fw_data *fw_data, struct pkcs15_prkey_object *pk)
 {
 	struct sc_pkcs15_id *id = &pk->prv_info->id;
-	unsigned int i;
+	struct pkcs15_fw_index_entry *entry;
 
 	sc_log(context, "Object is a private key and has id %s", sc_pkcs15_print_id(id));
 
-	for (i = 0; i < fw_data->num_objects; i++) {
-		struct pkcs15_any_object *obj = fw_data->objects[i];
+	for (entry = __pkcs15_index_by_id(fw_data, id); entry; entry = entry->next) {
+		struct pkcs15_any_object *obj = entry->obj;
 
 		if (obj->base.flags & SC_PKCS11_OBJECT_HIDDEN)
 			continue;
@@ -711,7 +983,7 @@ __pkcs15_prkey_bind_related(struct pkcs15_fw_data *fw_data, struct pkcs15_prkey_
 
 			pubkey = (struct pkcs15_pubkey_object *) obj;
 			if (sc_pkcs15_compare_id(&pubkey->pub_info->id, id)) {
-				sc_log(context, "Associating object %d as public key", i);
+				sc_log(context, "Associating object %p as public key", obj);
 				pk->prv_pubkey = pubkey;
 				if (pk->prv_info->modulus_length == 0)
 					pk->prv_info->modulus_length = pubkey->pub_info->modulus_length;
@@ -726,42 +998,45 @@ __pkcs15_cert_bind_related(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_ob
 {
 	struct sc_pkcs15_cert *c1 = cert->cert_data;
 	struct sc_pkcs15_id *id = &cert->cert_info->id;
-	unsigned int i;
+	struct pkcs15_fw_index *index;
+	struct pkcs15_fw_index_entry *entry;
 
 	sc_log(context, "Object is a certificate and has id %s", sc_pkcs15_print_id(id));
 
-	/* Loop over all objects to see if we find the certificate of
-	 * the issuer and the associated private key */
-	for (i = 0; i < fw_data->num_objects; i++) {
-		struct pkcs15_any_object *obj = fw_data->objects[i];
-
-		if (is_cert(obj) && obj != (struct pkcs15_any_object *) cert) {
-			struct pkcs15_cert_object *cert2;
-			struct sc_pkcs15_cert *c2;
+	if (!(index = __pkcs15_get_index(fw_data)))
+		return;
 
-			cert2 = (struct pkcs15_cert_object *) obj;
-			c2 = cert2->cert_data;
+	/* Find the certificate of the issuer ... */
+	if (c1 && c1->issuer_len) {
+		entry = index->by_subject[__pkcs15_index_hash(c1->issuer, c1->issuer_len)];
+		for (; entry; entry = entry->next) {
+			struct pkcs15_cert_object *cert2 = (struct pkcs15_cert_object *) entry->obj;
+			struct sc_pkcs15_cert *c2 = cert2->cert_data;
 
-			if (!c1 || !c2 || !c1->issuer_len || !c2->subject_len)
+			if (cert2 == cert)
 				continue;
 			if (c1->issuer_len == c2->subject_len
 			 && !memcmp(c1->issuer, c2->subject, c1->issuer_len)) {
-				sc_log(context, "Associating object %d (id %s) as issuer",
-				         i, sc_pkcs15_print_id(&cert2->cert_info->id));
-				cert->cert_issuer = (struct pkcs15_cert_object *) obj;
-				return;
-			}
-		} else
-		if (is_privkey(obj) && !cert->cert_prvkey) {
-			struct pkcs15_prkey_object *pk;
-
-			pk = (struct pkcs15_prkey_object *) obj;
-			if (sc_pkcs15_compare_id(&pk->prv_info->id, id)) {
-				sc_log(context, "Associating object %d as private key", i);
-				cert->cert_prvkey = pk;
+				sc_log(context, "Associating object %p (id %s) as issuer",
+				         cert2, sc_pkcs15_print_id(&cert2->cert_info->id));
+				cert->cert_issuer = cert2;
+				break;
 			}
 		}
 	}
+
+	/* ... and the associated private key */
+	if (cert->cert_prvkey)
+		return;
+	for (entry = index->by_id[__pkcs15_index_hash(id->value, id->len)]; entry; entry = entry->next) {
+		struct pkcs15_prkey_object *pk = (struct pkcs15_prkey_object *) entry->obj;
+
+		if (is_privkey(entry->obj) && sc_pkcs15_compare_id(&pk->prv_info->id, id)) {
+			sc_log(context, "Associating object %p as private key", pk);
+			cert->cert_prvkey = pk;
+			break;
+		}
+	}
 }
 
 static void
@@ -769,6 +1044,11 @@ pkcs15_bind_related_objects(struct pkcs15_fw_data *fw_data)
 {
 	unsigned int i;
 
+	if (!__pkcs15_get_index(fw_data)) {
+		sc_log(context, "cannot index objects, related objects not bound");
+		return;
+	}
+
 	/* Loop over all private keys and attached related certificate
 	 * and/or public key
 	 */
@@ -793,6 +1073,9 @@ static int
 check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *cert)
 {
 	struct pkcs15_pubkey_object *obj2;
+	struct pkcs15_fw_index *index;
+	struct pkcs15_fw_index_entry *entry;
+	struct sc_pkcs15_cert *c1;
 	int rv;
 
 	if (!cert)
@@ -803,14 +1086,34 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *
 	rv = sc_pkcs15_read_certificate(fw_data->p15_card, cert->cert_info, &cert->cert_data);
 	if (rv < 0)
 		return rv;
+	c1 = cert->cert_data;
 
 	obj2 = cert->cert_pubkey;
 	/* make a copy of public key from the cert data */
 	if (!obj2->pub_data)
-		rv = sc_pkcs15_pubkey_from_cert(context, &cert->cert_data->data, &obj2->pub_data);
+		rv = sc_pkcs15_pubkey_from_cert(context, &c1->data, &obj2->pub_data);
 
-	/* now that we have the cert and pub key, lets see if we can bind anything else */
-	pkcs15_bind_related_objects(fw_data);
+	/* now that we have the cert and pub key, lets see if we can bind anything else:
+	 * its issuer, and the certificates it has issued */
+	if (__pkcs15_index_add_cert(fw_data, cert) < 0)
+		__pkcs15_drop_index(fw_data);
+	if (!(index = __pkcs15_get_index(fw_data)))
+		return 0;
+
+	__pkcs15_cert_bind_related(fw_data, cert);
+	if (!c1->subject_len)
+		return 0;
+	entry = index->by_issuer[__pkcs15_index_hash(c1->subject, c1->subject_len)];
+	for (; entry; entry = entry->next) {
+		struct pkcs15_cert_object *cert2 = (struct pkcs15_cert_object *) entry->obj;
+		struct sc_pkcs15_cert *c2 = cert2->cert_data;
+
+		if (cert2 == cert || (cert2->cert_flags & SC_PKCS11_OBJECT_HIDDEN))
+			continue;
+		if (c2->issuer_len == c1->subject_len
+		 && !memcmp(c2->issuer, c1->subject, c1->subject_len))
+			__pkcs15_cert_bind_related(fw_data, cert2);
+	}
 
 	return 0;
 }
@@ -820,8 +1123,8 @@ static void
 pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 		  CK_OBJECT_HANDLE_PTR pHandle)
 {
-	unsigned int i;
 	struct pkcs15_fw_data *card_fw_data;
+	struct pkcs15_fw_index_entry *entry;
 
 	if (obj == NULL || slot == NULL)
 		return;
@@ -835,6 +1138,7 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 		*pHandle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
 
 	list_append(&slot->objects, obj);
+	slot_index_invalidate(slot);
 	sc_log(context, "Slot:%X Setting object handle of 0x%lx to 0x%lx", slot->id, obj->base.handle, (CK_OBJECT_HANDLE)obj);
 	obj->base.handle = (CK_OBJECT_HANDLE)obj; /* cast pointer to long */
 	obj->base.flags |= SC_PKCS11_OBJECT_SEEN;
@@ -852,8 +1156,9 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 	case SC_PKCS15_TYPE_PRKEY_EC:
 		pkcs15_add_object(slot, (struct pkcs15_any_object *) obj->related_pubkey, NULL);
 		card_fw_data = (struct pkcs15_fw_data *) slot->card->fws_data[slot->fw_data_idx];
-		for (i = 0; i < card_fw_data->num_objects; i++) {
-			struct pkcs15_any_object *obj2 = card_fw_data->objects[i];
+		entry = __pkcs15_index_by_id(card_fw_data, &((struct pkcs15_prkey_object *) obj)->prv_info->id);
+		for (; entry; entry = entry->next) {
+			struct pkcs15_any_object *obj2 = entry->obj;
 			struct pkcs15_cert_object *cert;
 
 			if (!is_cert(obj2))
@@ -1137,15 +1442,9 @@ _add_pin_related_objects(struct sc_pkcs11_slot *slot, struct sc_pkcs15_object *p
 			continue;
 		}
 
-		if (move_to_fw && move_to_fw != fw_data && move_to_fw->num_objects < MAX_OBJECTS)   {
-			int tail = fw_data->num_objects - i - 1;
-
-			move_to_fw->objects[move_to_fw->num_objects++] = obj;
-			if (tail)
-				memcpy(&fw_data->objects[i], &fw_data->objects[i + 1], sizeof(fw_data->objects[0]) * tail);
+		if (move_to_fw && move_to_fw != fw_data
+				&& __pkcs15_move_object(fw_data, i, move_to_fw) == SC_SUCCESS)
 			i--;
-			fw_data->num_objects--;
-		}
 	}
 }
 
@@ -1177,15 +1476,10 @@ _add_public_objects(struct sc_pkcs11_slot *slot, struct pkcs15_fw_data *fw_data,
 		sc_log(context, "Add public object(%p,%s,%x)", obj, obj->p15_object->label, obj->p15_object->type);
 		pkcs15_add_object(slot, obj, NULL);
 
-		if (move_to_fw && move_to_fw != fw_data && move_to_fw->num_objects < MAX_OBJECTS)   {
-			int tail = fw_data->num_objects - i - 1;
-
+		if (move_to_fw && move_to_fw != fw_data)   {
 			sc_log(context, "Move public object(%p) from %p to %p", obj, fw_data, move_to_fw);
-			move_to_fw->objects[move_to_fw->num_objects++] = obj;
-			if (tail)
-				memcpy(&fw_data->objects[i], &fw_data->objects[i + 1], sizeof(fw_data->objects[0]) * tail);
-			i--;
-			fw_data->num_objects--;
+			if (__pkcs15_move_object(fw_data, i, move_to_fw) == SC_SUCCESS)
+				i--;
 		}
 	}
 }
@@ -1227,14 +1521,21 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 	 *  - configuration impose to create slot for all PINs.
 	 */
 	if (!auth_user_pin || sc_pkcs11_conf.create_slots_flags & SC_PKCS11_SLOT_CREATE_ALL)   {
-		struct sc_pkcs15_object *auths[MAX_OBJECTS];
+		struct sc_pkcs15_object **auths = NULL;
 		int auth_count;
 
-		memset(auths, 0, sizeof(auths));
 		/* Get authentication PKCS#15 objects present in the associated on-card application */
-		rv = sc_pkcs15_get_objects(fw_data->p15_card, SC_PKCS15_TYPE_AUTH_PIN, auths, SC_PKCS15_MAX_PINS);
-		if (rv < 0)
+		rv = sc_pkcs15_get_objects(fw_data->p15_card, SC_PKCS15_TYPE_AUTH_PIN, NULL, 0);
+		if (rv > 0) {
+			auths = calloc(rv, sizeof(*auths));
+			if (auths == NULL)
+				return CKR_HOST_MEMORY;
+			rv = sc_pkcs15_get_objects(fw_data->p15_card, SC_PKCS15_TYPE_AUTH_PIN, auths, rv);
+		}
+		if (rv < 0) {
+			free(auths);
 			return sc_to_cryptoki_error(rv, NULL);
+		}
 		auth_count = rv;
 		sc_log(context, "Found %d authentication objects", auth_count);
 
@@ -1248,8 +1549,10 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 			sc_log(context, "Found authentication object '%s'", auths[i]->label);
 
 			rv = pkcs15_create_slot(p11card, fw_data, auths[i], app_info, &islot);
-			if (rv != CKR_OK)
+			if (rv != CKR_OK) {
+				free(auths);
 				return CKR_OK; /* no more slots available for this card */
+			}
 			islot->fw_data_idx = idx;
 			_add_pin_related_objects(islot, auths[i], fw_data, NULL);
 
@@ -1259,6 +1562,7 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 			else if (!slot && auth_user_pin && auth_user_pin == auths[i])
 				slot = islot;
 		}
+		free(auths);
 	}
 	else   {
 		/* If there is no need to create slot for each PIN or for each application,
@@ -1664,14 +1968,7 @@ pkcs15_initialize(struct sc_pkcs11_card *p11card, void *ptr,
 	if (rv < 0)
 		return sc_to_cryptoki_error(rv, "C_InitToken");
 
-	rv = card_removed(p11card->reader);
-	if (rv != SC_SUCCESS)
-		return rv;
-
-	rv = card_detect_all();
-	if (rv != SC_SUCCESS)
-		return rv;
-
+	/* Tokens are re-bound by C_InitToken() once the card lock is released */
 	return CKR_OK;
 }
 
@@ -2742,6 +3039,7 @@ pkcs15_skey_destroy(struct sc_pkcs11_session *session, void *object)
 	/* Oppose to pkcs15_add_object */
 	--any_obj->refcount; /* correct refcont */
 	list_delete(&session->slot->objects, any_obj);
+	slot_index_invalidate(session->slot);
 	/* Delete object in pkcs15 */
 	rv = __pkcs15_delete_object(fw_data, any_obj);
 
@@ -2803,6 +3101,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 			 * and was created from certificate. */
 			--ao_pubkey->refcount;
 			list_delete(&session->slot->objects, ao_pubkey);
+			slot_index_invalidate(session->slot);
 			/* Delete public key object in pkcs15 */
 			if (pubkey->pub_data)   {
 				sc_pkcs15_free_pubkey(pubkey->pub_data);
@@ -2819,6 +3118,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 		/* Oppose to pkcs15_add_object */
 		--any_obj->refcount; /* correct refcont */
 		list_delete(&session->slot->objects, any_obj);
+		slot_index_invalidate(session->slot);
 		/* Delete object in pkcs15 */
 		rv = __pkcs15_delete_object(fw_data, any_obj);
 	}
@@ -2845,7 +3145,7 @@ pkcs15_get_random(struct sc_pkcs11_slot *slot, CK_BYTE_PTR p, CK_ULONG len)
 	if (!fw_data)
 		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_GenerateRandom");
 
-	rc = sc_get_challenge(fw_data->p15_card->card, p, (size_t)len);
+	rc = sc_get_random(fw_data->p15_card->card, p, (size_t)len);
 	return sc_to_cryptoki_error(rc, "C_GenerateRandom");
 }
 
@@ -3293,7 +3593,9 @@ pkcs15_prkey_get_attribute(struct sc_pkcs11_session *session,
 		check_attribute_buffer(attr, sizeof(CK_ULONG));
 		switch (prkey->prv_p15obj->type) {
 			case SC_PKCS15_TYPE_PRKEY_EC:
-				if (key)
+				if (prkey->prv_info->field_length)
+					*(CK_ULONG *) attr->pValue = prkey->prv_info->field_length;
+				else if (key)
 					*(CK_ULONG *) attr->pValue = key->u.ec.params.field_length;
 				else
 					*(CK_ULONG *) attr->pValue = 384; /* TODO -DEE needs work */
@@ -3397,7 +3699,6 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 	case CKM_ECDSA_SHA1:
 		flags = SC_ALGORITHM_ECDSA_HASH_SHA1;
 		break;
-#if 0
 	case CKM_ECDSA_SHA224:
 		flags = SC_ALGORITHM_ECDSA_HASH_SHA224;
 		break;
@@ -3410,7 +3711,6 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 	case CKM_ECDSA_SHA512:
 		flags = SC_ALGORITHM_ECDSA_HASH_SHA512;
 		break;
-#endif
 	default:
 		sc_log(context, "DEE - need EC for %d",pMechanism->mechanism);
 		return CKR_MECHANISM_INVALID;
@@ -4403,6 +4703,9 @@ static int register_ec_mechanisms(struct sc_pkcs11_card *p11card, int flags,
 		ec_flags |= CKF_EC_COMPRESS;
 
 	mech_info.flags = CKF_HW | CKF_SIGN; /* check for more */
+#ifdef ENABLE_OPENSSL
+	mech_info.flags |= CKF_VERIFY;
+#endif
 	mech_info.flags |= ec_flags;
 	mech_info.ulMinKeySize = min_key_size;
 	mech_info.ulMaxKeySize = max_key_size;
@@ -4414,19 +4717,26 @@ static int register_ec_mechanisms(struct sc_pkcs11_card *p11card, int flags,
 	if (rc != CKR_OK)
 		return rc;
 
-#if ENABLE_OPENSSL
-	mt = sc_pkcs11_new_fw_mechanism(CKM_ECDSA_SHA1,
-		&mech_info, CKK_EC, NULL);
-	if (!mt)
-		return CKR_HOST_MEMORY;
-	rc = sc_pkcs11_register_mechanism(p11card, mt);
+#ifdef ENABLE_OPENSSL
+	/* The data is hashed in software as it comes in, and only the hash
+	 * is signed with CKM_ECDSA, unless the token does the hash itself */
+	rc = sc_pkcs11_register_sign_and_hash_mechanism(p11card, CKM_ECDSA_SHA1, CKM_SHA_1, mt);
+	if (rc != CKR_OK)
+		return rc;
+	rc = sc_pkcs11_register_sign_and_hash_mechanism(p11card, CKM_ECDSA_SHA256, CKM_SHA256, mt);
+	if (rc != CKR_OK)
+		return rc;
+	rc = sc_pkcs11_register_sign_and_hash_mechanism(p11card, CKM_ECDSA_SHA384, CKM_SHA384, mt);
+	if (rc != CKR_OK)
+		return rc;
+	rc = sc_pkcs11_register_sign_and_hash_mechanism(p11card, CKM_ECDSA_SHA512, CKM_SHA512, mt);
 	if (rc != CKR_OK)
 		return rc;
 #endif
 
 	/* ADD ECDH mechanisms */
 	/* The PIV uses curves where CKM_ECDH1_DERIVE and CKM_ECDH1_COFACTOR_DERIVE produce the same results */
-	mech_info.flags &= ~CKF_SIGN;
+	mech_info.flags &= ~(CKF_SIGN | CKF_VERIFY);
 	mech_info.flags |= CKF_DERIVE;
 
 	mt = sc_pkcs11_new_fw_mechanism(CKM_ECDH1_COFACTOR_DERIVE, &mech_info, CKK_EC, NULL);
@@ -25,10 +25,42 @@ struct signature_data {
 	struct sc_pkcs11_object *key;
 	struct hash_signature_info *info;
 	sc_pkcs11_operation_t *	md;
-	CK_BYTE			buffer[4096/8];
-	unsigned int		buffer_len;
+	CK_BYTE *		buffer;		/* raw data, when not hashed in software */
+	CK_ULONG		buffer_len;
+	CK_ULONG		buffer_size;
 };
 
+/* Largest digest computed in software (SHA-512) */
+#define MAX_HASH_SIZE		64
+
+/*
+ * Append a part of the data for mechanisms working on the raw data,
+ * growing the buffer as needed
+ */
+static CK_RV
+signature_data_append(struct signature_data *data, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+{
+	if (ulPartLen > data->buffer_size - data->buffer_len) {
+		CK_ULONG size = data->buffer_size ? data->buffer_size : 512;
+		CK_BYTE *p;
+
+		while (size < data->buffer_len + ulPartLen) {
+			if (size * 2 < size)
+				return CKR_DATA_LEN_RANGE;
+			size *= 2;
+		}
+		p = realloc(data->buffer, size);
+		if (p == NULL)
+			return CKR_HOST_MEMORY;
+		data->buffer = p;
+		data->buffer_size = size;
+	}
+	if (ulPartLen)
+		memcpy(data->buffer + data->buffer_len, pPart, ulPartLen);
+	data->buffer_len += ulPartLen;
+	return CKR_OK;
+}
+
 /*
  * Register a mechanism
  */
@@ -398,22 +430,51 @@ sc_pkcs11_signature_update(sc_pkcs11_operation_t *operation,
 		CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
 {
 	struct signature_data *data;
+	CK_RV rv;
 
 	LOG_FUNC_CALLED(context);
 	sc_log(context, "data part length %li", ulPartLen);
 	data = (struct signature_data *) operation->priv_data;
 	if (data->md) {
-		CK_RV rv = data->md->type->md_update(data->md, pPart, ulPartLen);
+		rv = data->md->type->md_update(data->md, pPart, ulPartLen);
 		LOG_FUNC_RETURN(context, rv);
 	}
 
 	/* This signature mechanism operates on the raw data */
-	if (data->buffer_len + ulPartLen > sizeof(data->buffer))
-		LOG_FUNC_RETURN(context, CKR_DATA_LEN_RANGE);
-	memcpy(data->buffer + data->buffer_len, pPart, ulPartLen);
-	data->buffer_len += ulPartLen;
+	rv = signature_data_append(data, pPart, ulPartLen);
 	sc_log(context, "data length %li", data->buffer_len);
-	LOG_FUNC_RETURN(context, CKR_OK);
+	LOG_FUNC_RETURN(context, rv);
+}
+
+/*
+ * ECDSA only uses the leftmost bits of the hash, as many as the order of
+ * the curve has (X9.62); cards expect no more than that. A hash longer
+ * than the key, e.g. SHA-512 with a P-256 key, is cut down here.
+ */
+static CK_RV
+signature_truncate_ec_hash(struct sc_pkcs11_session *session, struct signature_data *data)
+{
+	CK_ULONG bits, len, i;
+	CK_ATTRIBUTE attr = { CKA_MODULUS_BITS, &bits, sizeof(bits) };
+	unsigned int shift;
+	CK_RV rv;
+
+	rv = data->key->ops->get_attribute(session, data->key, &attr);
+	if (rv != CKR_OK)
+		return rv;
+	len = (bits + 7) / 8;
+	if (bits == 0 || len >= data->buffer_len)
+		return CKR_OK;
+
+	sc_log(context, "hash truncated from %li to %li bytes", data->buffer_len, len);
+	data->buffer_len = len;
+	shift = 8 - bits % 8;
+	if (shift != 8) {
+		for (i = len - 1; i > 0; i--)
+			data->buffer[i] = (data->buffer[i] >> shift) | (data->buffer[i - 1] << (8 - shift));
+		data->buffer[0] >>= shift;
+	}
+	return CKR_OK;
 }
 
 static CK_RV
@@ -421,25 +482,42 @@ sc_pkcs11_signature_final(sc_pkcs11_operation_t *operation,
 		CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
 {
 	struct signature_data *data;
+	CK_MECHANISM mechanism;
+	CK_BYTE hash[MAX_HASH_SIZE];
+	CK_ULONG len;
 	CK_RV rv;
 
 	LOG_FUNC_CALLED(context);
 	data = (struct signature_data *) operation->priv_data;
+	mechanism = operation->mechanism;
 	sc_log(context, "data length %li", data->buffer_len);
 	if (data->md) {
 		sc_pkcs11_operation_t	*md = data->md;
-		CK_ULONG len = sizeof(data->buffer);
 
-		rv = md->type->md_final(md, data->buffer, &len);
-		if (rv == CKR_BUFFER_TOO_SMALL)
-			rv = CKR_FUNCTION_FAILED;
-		if (rv != CKR_OK)
-			LOG_FUNC_RETURN(context, rv);
-		data->buffer_len = len;
+		/* Keep the hash in the buffer: C_SignFinal is called
+		 * again after asking for the signature length */
+		if (data->buffer_len == 0) {
+			len = sizeof(hash);
+			rv = md->type->md_final(md, hash, &len);
+			if (rv == CKR_BUFFER_TOO_SMALL)
+				rv = CKR_FUNCTION_FAILED;
+			if (rv == CKR_OK)
+				rv = signature_data_append(data, hash, len);
+			if (rv != CKR_OK)
+				LOG_FUNC_RETURN(context, rv);
+		}
+
+		/* ECDSA signs the bare hash, there is no DigestInfo naming it */
+		if (data->info->sign_mech == CKM_ECDSA) {
+			mechanism.mechanism = CKM_ECDSA;
+			rv = signature_truncate_ec_hash(operation->session, data);
+			if (rv != CKR_OK)
+				LOG_FUNC_RETURN(context, rv);
+		}
 	}
 
 	sc_log(context, "%li bytes to sign", data->buffer_len);
-	rv = data->key->ops->sign(operation->session, data->key, &operation->mechanism,
+	rv = data->key->ops->sign(operation->session, data->key, &mechanism,
 			data->buffer, data->buffer_len, pSignature, pulSignatureLen);
 	LOG_FUNC_RETURN(context, rv);
 }
@@ -496,6 +574,8 @@ sc_pkcs11_signature_release(sc_pkcs11_operation_t *operation)
 	if (!data)
 	    return;
 	sc_pkcs11_release_operation(&data->md);
+	if (data->buffer)
+		free(data->buffer);
 	memset(data, 0, sizeof(*data));
 	free(data);
 }
@@ -643,11 +723,7 @@ sc_pkcs11_verify_update(sc_pkcs11_operation_t *operation,
 	}
 
 	/* This verification mechanism operates on the raw data */
-	if (data->buffer_len + ulPartLen > sizeof(data->buffer))
-		return CKR_DATA_LEN_RANGE;
-	memcpy(data->buffer + data->buffer_len, pPart, ulPartLen);
-	data->buffer_len += ulPartLen;
-	return CKR_OK;
+	return signature_data_append(data, pPart, ulPartLen);
 }
 
 static CK_RV
@@ -655,46 +731,15 @@ sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 			CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
 {
 	struct signature_data *data;
-	struct sc_pkcs11_object *key;
-	unsigned char *pubkey_value;
-	CK_KEY_TYPE key_type;
-	CK_BYTE params[9 /* GOST_PARAMS_OID_SIZE */] = { 0 };
-	CK_ATTRIBUTE attr = {CKA_VALUE, NULL, 0};
-	CK_ATTRIBUTE attr_key_type = {CKA_KEY_TYPE, &key_type, sizeof(key_type)};
-	CK_ATTRIBUTE attr_key_params = {CKA_GOSTR3410_PARAMS, &params, sizeof(params)};
-	int rv;
 
 	data = (struct signature_data *) operation->priv_data;
 
 	if (pSignature == NULL)
 		return CKR_ARGUMENTS_BAD;
 
-	key = data->key;
-	rv = key->ops->get_attribute(operation->session, key, &attr);
-	if (rv != CKR_OK)
-		return rv;
-	pubkey_value = calloc(1, attr.ulValueLen);
-	attr.pValue = pubkey_value;
-	rv = key->ops->get_attribute(operation->session, key, &attr);
-	if (rv != CKR_OK)
-		goto done;
-
-	rv = key->ops->get_attribute(operation->session, key, &attr_key_type);
-	if (rv == CKR_OK && key_type == CKK_GOSTR3410) {
-		rv = key->ops->get_attribute(operation->session, key, &attr_key_params);
-		if (rv != CKR_OK)
-			goto done;
-	}
-
-	rv = sc_pkcs11_verify_data(pubkey_value, attr.ulValueLen,
-		params, sizeof(params),
+	return sc_pkcs11_verify_data(operation->session, data->key,
 		operation->mechanism.mechanism, data->md,
 		data->buffer, data->buffer_len, pSignature, ulSignatureLen);
-
-done:
-	free(pubkey_value);
-
-	return rv;
 }
 #endif
 
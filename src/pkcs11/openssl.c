@@ -8,6 +8,7 @@
 #include "config.h"
 
 #ifdef ENABLE_OPENSSL		/* empty file without openssl */
+#include <stdlib.h>
 #include <string.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
@@ -18,6 +19,7 @@
 #include <openssl/opensslconf.h> /* for OPENSSL_NO_* */
 #ifndef OPENSSL_NO_EC
 #include <openssl/ec.h>
+#include <openssl/ecdsa.h>
 #endif /* OPENSSL_NO_EC */
 #ifndef OPENSSL_NO_ENGINE
 #include <openssl/engine.h>
@@ -151,10 +153,10 @@ static sc_pkcs11_mechanism_type_t openssl_ripemd160_mech = {
 	NULL			/* mech_data */
 };
 
-void
-sc_pkcs11_register_openssl_mechanisms(struct sc_pkcs11_card *card)
-{
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_ENGINE)
+static void
+openssl_load_gost_engine(void)
+{
 	void (*locking_cb)(int, int, const char *, int);
 	ENGINE *e;
 
@@ -189,6 +191,24 @@ sc_pkcs11_register_openssl_mechanisms(struct sc_pkcs11_card *card)
 
 	if (locking_cb)
 		CRYPTO_set_locking_callback(locking_cb);
+}
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+static pthread_once_t gost_engine_once = PTHREAD_ONCE_INIT;
+#endif
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_ENGINE) */
+
+void
+sc_pkcs11_register_openssl_mechanisms(struct sc_pkcs11_card *card)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_ENGINE)
+	/* Cards may be bound from several threads at once */
+#ifdef HAVE_PTHREAD
+	pthread_once(&gost_engine_once, openssl_load_gost_engine);
+#else
+	openssl_load_gost_engine();
+#endif
 #endif /* OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_ENGINE) */
 
 	openssl_sha1_mech.mech_data = EVP_sha1();
@@ -354,12 +374,225 @@ static CK_RV gostr3410_verify_data(const unsigned char *pubkey, int pubkey_len,
 }
 #endif /* OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC) */
 
+/* Reads an attribute of the key into a newly allocated buffer */
+static CK_RV get_key_attribute(struct sc_pkcs11_session *session,
+		struct sc_pkcs11_object *key, CK_ATTRIBUTE_TYPE type,
+		unsigned char **value, CK_ULONG *value_len)
+{
+	CK_ATTRIBUTE attr = { type, NULL, 0 };
+	CK_RV rv;
+
+	*value = NULL;
+	rv = key->ops->get_attribute(session, key, &attr);
+	if (rv != CKR_OK)
+		return rv;
+	if (attr.ulValueLen == 0 || attr.ulValueLen == (CK_ULONG) -1)
+		return CKR_KEY_TYPE_INCONSISTENT;
+	attr.pValue = malloc(attr.ulValueLen);
+	if (attr.pValue == NULL)
+		return CKR_HOST_MEMORY;
+	rv = key->ops->get_attribute(session, key, &attr);
+	if (rv != CKR_OK) {
+		free(attr.pValue);
+		return rv;
+	}
+	*value = attr.pValue;
+	*value_len = attr.ulValueLen;
+	return CKR_OK;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
+static CK_RV gostr3410_verify(struct sc_pkcs11_session *session,
+		struct sc_pkcs11_object *key,
+		unsigned char *data, int data_len,
+		unsigned char *signat, int signat_len)
+{
+	CK_BYTE params[9 /* GOST_PARAMS_OID_SIZE */] = { 0 };
+	CK_ATTRIBUTE attr_key_params = {CKA_GOSTR3410_PARAMS, &params, sizeof(params)};
+	unsigned char *value;
+	CK_ULONG value_len;
+	CK_RV rv;
+
+	rv = get_key_attribute(session, key, CKA_VALUE, &value, &value_len);
+	if (rv != CKR_OK)
+		return rv;
+	rv = key->ops->get_attribute(session, key, &attr_key_params);
+	if (rv == CKR_OK)
+		rv = gostr3410_verify_data(value, value_len, params, sizeof(params),
+				data, data_len, signat, signat_len);
+	free(value);
+	return rv;
+}
+
+static EVP_PKEY *decode_ec_public_key(const unsigned char *params, long params_len,
+		const unsigned char *point, long point_len)
+{
+	ASN1_OCTET_STRING *octet = NULL;
+	const unsigned char *p = params;
+	EVP_PKEY *pkey = NULL;
+	EC_KEY *ec;
+
+	ec = d2i_ECParameters(NULL, &p, params_len);
+	if (ec == NULL)
+		return NULL;
+
+	/* CKA_EC_POINT holds the point either as is or wrapped in an OCTET STRING */
+	p = point;
+	if (o2i_ECPublicKey(&ec, &p, point_len) == NULL) {
+		p = point;
+		octet = d2i_ASN1_OCTET_STRING(NULL, &p, point_len);
+		p = octet != NULL ? octet->data : NULL;
+		if (p == NULL || o2i_ECPublicKey(&ec, &p, octet->length) == NULL)
+			goto err;
+	}
+
+	pkey = EVP_PKEY_new();
+	if (pkey != NULL && EVP_PKEY_assign_EC_KEY(pkey, ec) == 1)
+		ec = NULL;
+	else {
+		EVP_PKEY_free(pkey);
+		pkey = NULL;
+	}
+err:
+	ASN1_OCTET_STRING_free(octet);
+	EC_KEY_free(ec);
+	return pkey;
+}
+
+/* The signature is r || s as defined by PKCS#11 */
+static CK_RV ecdsa_verify_data(EVP_PKEY *pkey,
+		const unsigned char *hash, int hash_len,
+		const unsigned char *signat, int signat_len)
+{
+	ECDSA_SIG *sig;
+	EC_KEY *ec;
+	int res = -1;
+
+	if (signat_len <= 0 || signat_len % 2 != 0)
+		return CKR_SIGNATURE_LEN_RANGE;
+
+	ec = EVP_PKEY_get1_EC_KEY(pkey);
+	if (ec == NULL)
+		return CKR_GENERAL_ERROR;
+	sig = ECDSA_SIG_new();
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	if (sig != NULL) {
+		BIGNUM *r = BN_bin2bn(signat, signat_len / 2, NULL);
+		BIGNUM *s = BN_bin2bn(signat + signat_len / 2, signat_len / 2, NULL);
+
+		if (r != NULL && s != NULL && ECDSA_SIG_set0(sig, r, s) == 1)
+			res = ECDSA_do_verify(hash, hash_len, sig, ec);
+		else {
+			BN_free(r);
+			BN_free(s);
+		}
+	}
+#else
+	if (sig != NULL
+			&& BN_bin2bn(signat, signat_len / 2, sig->r) != NULL
+			&& BN_bin2bn(signat + signat_len / 2, signat_len / 2, sig->s) != NULL)
+		res = ECDSA_do_verify(hash, hash_len, sig, ec);
+#endif
+	ECDSA_SIG_free(sig);
+	EC_KEY_free(ec);
+
+	if (res == 1)
+		return CKR_OK;
+	else if (res == 0)
+		return CKR_SIGNATURE_INVALID;
+	sc_log(context, "ECDSA_do_verify() returned %d\n", res);
+	return CKR_GENERAL_ERROR;
+}
+#endif /* OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC) */
+
+/* Returns the public key of the object, decoding it on first use.
+ * The key stays with the object until sc_pkcs11_release_verify_key().
+ */
+static CK_RV get_verify_key(struct sc_pkcs11_session *session,
+		struct sc_pkcs11_object *key, EVP_PKEY **out)
+{
+	CK_KEY_TYPE key_type;
+	CK_ATTRIBUTE attr_key_type = {CKA_KEY_TYPE, &key_type, sizeof(key_type)};
+	unsigned char *value = NULL, *point = NULL;
+	CK_ULONG value_len = 0, point_len = 0;
+	const unsigned char *p;
+	EVP_PKEY *pkey = NULL;
+	CK_RV rv;
+
+	if (key->verify_key != NULL) {
+		*out = (EVP_PKEY *) key->verify_key;
+		return CKR_OK;
+	}
+
+	rv = key->ops->get_attribute(session, key, &attr_key_type);
+	if (rv != CKR_OK)
+		return rv;
+
+	switch (key_type) {
+	case CKK_RSA:
+		rv = get_key_attribute(session, key, CKA_VALUE, &value, &value_len);
+		if (rv != CKR_OK)
+			break;
+		p = value;
+		pkey = d2i_PublicKey(EVP_PKEY_RSA, NULL, &p, (long) value_len);
+		break;
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
+	case CKK_EC:
+		rv = get_key_attribute(session, key, CKA_EC_PARAMS, &value, &value_len);
+		if (rv == CKR_OK)
+			rv = get_key_attribute(session, key, CKA_EC_POINT, &point, &point_len);
+		if (rv == CKR_OK)
+			pkey = decode_ec_public_key(value, (long) value_len,
+					point, (long) point_len);
+		break;
+#endif
+	default:
+		rv = CKR_KEY_TYPE_INCONSISTENT;
+		break;
+	}
+	free(value);
+	free(point);
+
+	if (rv != CKR_OK)
+		return rv;
+	if (pkey == NULL)
+		return CKR_GENERAL_ERROR;
+
+	key->verify_key = pkey;
+	*out = pkey;
+	return CKR_OK;
+}
+
+void sc_pkcs11_release_verify_key(struct sc_pkcs11_object *key)
+{
+	if (key == NULL || key->verify_key == NULL)
+		return;
+	EVP_PKEY_free((EVP_PKEY *) key->verify_key);
+	key->verify_key = NULL;
+}
+
+/* ECDSA mechanisms need an EC key, all others here an RSA key */
+static int is_ecdsa_mechanism(CK_MECHANISM_TYPE mech)
+{
+	switch (mech) {
+	case CKM_ECDSA:
+	case CKM_ECDSA_SHA1:
+	case CKM_ECDSA_SHA224:
+	case CKM_ECDSA_SHA256:
+	case CKM_ECDSA_SHA384:
+	case CKM_ECDSA_SHA512:
+		return 1;
+	}
+	return 0;
+}
+
 /* If no hash function was used, finish with RSA_public_decrypt().
  * If a hash function was used, we can make a big shortcut by
  *   finishing with EVP_VerifyFinal().
+ * ECDSA signatures are checked against the hash with ECDSA_do_verify().
  */
-CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
-			const unsigned char *pubkey_params, int pubkey_params_len,
+CK_RV sc_pkcs11_verify_data(struct sc_pkcs11_session *session,
+			struct sc_pkcs11_object *key,
 			CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
 			unsigned char *data, int data_len,
 			unsigned char *signat, int signat_len)
@@ -371,24 +604,44 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 	if (mech == CKM_GOSTR3410)
 	{
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
-		return gostr3410_verify_data(pubkey, pubkey_len,
-				pubkey_params, pubkey_params_len,
+		return gostr3410_verify(session, key,
 				data, data_len, signat, signat_len);
 #else
-		(void)pubkey_params, (void)pubkey_params_len; /* no warning */
 		return CKR_FUNCTION_NOT_SUPPORTED;
 #endif
 	}
 
-	pkey = d2i_PublicKey(EVP_PKEY_RSA, NULL, &pubkey, pubkey_len);
-	if (pkey == NULL)
-		return CKR_GENERAL_ERROR;
+	rv = get_verify_key(session, key, &pkey);
+	if (rv != CKR_OK)
+		return rv;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L && !defined(OPENSSL_NO_EC)
+	if (is_ecdsa_mechanism(mech) != (EVP_PKEY_base_id(pkey) == EVP_PKEY_EC))
+		return CKR_KEY_TYPE_INCONSISTENT;
+
+	if (EVP_PKEY_base_id(pkey) == EVP_PKEY_EC) {
+		unsigned char digest[EVP_MAX_MD_SIZE];
+		unsigned int digest_len = 0;
+
+		if (md == NULL)
+			return ecdsa_verify_data(pkey, data, data_len,
+					signat, signat_len);
+		if (!EVP_DigestFinal(DIGEST_CTX(md), digest, &digest_len)) {
+			sc_log(context, "EVP_DigestFinal() failed\n");
+			return CKR_GENERAL_ERROR;
+		}
+		return ecdsa_verify_data(pkey, digest, digest_len,
+				signat, signat_len);
+	}
+#else
+	if (is_ecdsa_mechanism(mech))
+		return CKR_KEY_TYPE_INCONSISTENT;
+#endif
 
 	if (md != NULL) {
 		EVP_MD_CTX *md_ctx = DIGEST_CTX(md);
 
 		res = EVP_VerifyFinal(md_ctx, signat, signat_len, pkey);
-		EVP_PKEY_free(pkey);
 		if (res == 1)
 			return CKR_OK;
 		else if (res == 0)
@@ -400,7 +653,7 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 	}
 	else {
 		RSA *rsa;
-		unsigned char *rsa_out = NULL, pad;
+		unsigned char rsa_out[OPENSSL_RSA_MAX_MODULUS_BITS / 8], pad;
 		int rsa_outlen = 0;
 
 		switch(mech) {
@@ -411,25 +664,20 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 		 	pad = RSA_NO_PADDING;
 		 	break;
 		 default:
-			EVP_PKEY_free(pkey);
 		 	return CKR_ARGUMENTS_BAD;
 		 }
 
 		rsa = EVP_PKEY_get1_RSA(pkey);
-		EVP_PKEY_free(pkey);
 		if (rsa == NULL)
 			return CKR_DEVICE_MEMORY;
-
-		rsa_out = calloc(1, RSA_size(rsa));
-		if (rsa_out == NULL) {
+		if (RSA_size(rsa) > (int) sizeof(rsa_out)) {
 			RSA_free(rsa);
-			return CKR_DEVICE_MEMORY;
+			return CKR_KEY_SIZE_RANGE;
 		}
 
 		rsa_outlen = RSA_public_decrypt(signat_len, signat, rsa_out, rsa, pad);
 		RSA_free(rsa);
 		if(rsa_outlen <= 0) {
-			free(rsa_out);
 			sc_log(context, "RSA_public_decrypt() returned %d\n", rsa_outlen);
 			return CKR_GENERAL_ERROR;
 		}
@@ -438,8 +686,6 @@ CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
 			rv = CKR_OK;
 		else
 			rv = CKR_SIGNATURE_INVALID;
-
-		free(rsa_out);
 	}
 
 	return rv;
@@ -36,15 +36,23 @@ list_t virtual_slots;
 pid_t initialized_pid = (pid_t)-1;
 #endif
 static int in_finalize = 0;
+static int can_create_threads = 1;
 extern CK_FUNCTION_LIST pkcs11_function_list;
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+static CK_RV slot_monitor_start(void);
+static CK_RV slot_monitor_wait(unsigned int *events);
+#endif
+static void slot_monitor_stop(void);
+
 #if defined(HAVE_PTHREAD) && defined(PKCS11_THREAD_LOCKING)
 #include <pthread.h>
 CK_RV mutex_create(void **mutex)
 {
-	pthread_mutex_t *m = calloc(1, sizeof(*mutex));
+	pthread_mutex_t *m = calloc(1, sizeof(*m));
 	if (m == NULL)
-		return CKR_GENERAL_ERROR;;
+		return CKR_GENERAL_ERROR;
 	pthread_mutex_init(m, NULL);
 	*mutex = m;
 	return CKR_OK;
@@ -215,6 +223,8 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 	rv = sc_pkcs11_init_lock((CK_C_INITIALIZE_ARGS_PTR) pInitArgs);
 	if (rv != CKR_OK)
 		goto out;
+	can_create_threads = !pInitArgs || !(((CK_C_INITIALIZE_ARGS_PTR) pInitArgs)->flags
+			& CKF_LIBRARY_CANT_CREATE_OS_THREADS);
 
 	/* set context options */
 	memset(&ctx_opts, 0, sizeof(sc_context_param_t));
@@ -230,6 +240,8 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 
 	/* Load configuration */
 	load_pkcs11_parameters(&sc_pkcs11_conf, context);
+	if (!can_create_threads)
+		sc_pkcs11_conf.detect_workers = 1;
 
 	/* List of sessions */
 	list_init(&sessions);
@@ -249,6 +261,7 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 		for (i=0; i<sc_ctx_get_reader_count(context); i++) {
 			initialize_reader(sc_ctx_get_reader(context, i));
 		}
+		card_detect_all();
 	}
 
 out:
@@ -280,15 +293,16 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	if (context == NULL)
 		return CKR_CRYPTOKI_NOT_INITIALIZED;
 
+	/* cancel pending calls */
+	in_finalize = 1;
+	slot_monitor_stop();
+
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_Finalize()");
 
-	/* cancel pending calls */
-	in_finalize = 1;
-	sc_cancel(context);
 	/* remove all cards from readers */
 	for (i=0; i < (int)sc_ctx_get_reader_count(context); i++)
 		card_removed(sc_ctx_get_reader(context, i));
@@ -298,6 +312,7 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	list_destroy(&sessions);
 
 	while ((slot = list_fetch(&virtual_slots))) {
+		slot_index_invalidate(slot);
 		list_destroy(&slot->objects);
 		free(slot);
 	}
@@ -345,6 +360,41 @@ CK_RV C_GetInfo(CK_INFO_PTR pInfo)
 	return rv;
 }
 
+/* OpenSC extension, see pkcs11-opensc.h */
+CK_RV C_OpenSC_GetStats(CK_UTF8CHAR_PTR pBuffer, CK_ULONG_PTR pulLen)
+{
+	sc_stats_t *stats = NULL;
+	size_t len;
+	CK_RV rv;
+
+	if (pulLen == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	if (sc_ctx_get_stats(context, &stats) != SC_SUCCESS) {
+		rv = CKR_FUNCTION_FAILED;
+		goto out;
+	}
+	len = sc_stats_format(stats, NULL, 0) + 1;
+	if (pBuffer == NULL_PTR) {
+		*pulLen = len;
+	} else if (*pulLen < len) {
+		*pulLen = len;
+		rv = CKR_BUFFER_TOO_SMALL;
+	} else {
+		sc_stats_format(stats, (char *) pBuffer, len);
+		*pulLen = len;
+	}
+
+out:
+	sc_stats_free(stats);
+	sc_pkcs11_unlock();
+	return rv;
+}
+
 CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList)
 {
 	if (ppFunctionList == NULL_PTR)
@@ -486,8 +536,10 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 		else {
 			now = get_current_time();
 			if (now >= slot->slot_state_expires || now == 0) {
-				/* Update slot status */
-				rv = card_detect(slot->reader);
+				/* Update slot status. Connecting to a new card
+				 * is left to the token functions, so that this
+				 * does no card I/O under the global lock */
+				rv = card_detect_presence(slot->reader);
 				/* Don't ask again within the next second */
 				slot->slot_state_expires = now + 1000;
 			}
@@ -496,8 +548,11 @@ CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
 	if (rv == CKR_TOKEN_NOT_PRESENT || rv == CKR_TOKEN_NOT_RECOGNIZED)
 		rv = CKR_OK;
 
-	if (rv == CKR_OK)
+	if (rv == CKR_OK) {
 		memcpy(pInfo, &slot->slot_info, sizeof(CK_SLOT_INFO));
+		if (slot_token_pending(slot))
+			pInfo->flags |= CKF_TOKEN_PRESENT;
+	}
 
 	sc_log(context, "C_GetSlotInfo(0x%lx) = %s", slotID, lookup_enum ( RV_T, rv ));
 	sc_pkcs11_unlock();
@@ -555,6 +610,8 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 {
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card;
+	sc_reader_t *reader;
 	CK_RV rv;
 	unsigned int i;
 
@@ -565,6 +622,7 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 	rv = slot_get_token(slotID, &slot);
 	if (rv != CKR_OK)
 		goto out;
+	p11card = slot->card;
 
 	/* Make sure there's no open session for this token */
 	for (i=0; i<list_size(&sessions); i++) {
@@ -575,17 +633,30 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 		}
 	}
 
-	if (slot->card->framework->init_token == NULL) {
+	if (p11card->framework->init_token == NULL) {
 		rv = CKR_FUNCTION_NOT_SUPPORTED;
 		goto out;
 	}
-	rv = slot->card->framework->init_token(slot->card,
+
+	/* Release the global lock while talking to the card */
+	rv = sc_pkcs11_pin_card(p11card);
+	if (rv != CKR_OK)
+		return rv;
+	reader = p11card->reader;
+	rv = p11card->framework->init_token(p11card,
 				 slot->fw_data, pPin, ulPinLen, pLabel);
+	sc_pkcs11_unpin_card(p11card);
+	if (rv != CKR_OK)
+		return rv;
 
-	if (rv == CKR_OK) {
-		/* Now we should re-bind all tokens so they get the
-		 * corresponding function vector and flags */
-	}
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+	/* Now re-bind all tokens so they get the
+	 * corresponding function vector and flags */
+	rv = card_removed(reader);
+	if (rv == CKR_OK)
+		rv = card_detect_all();
 
 out:	sc_pkcs11_unlock();
 	return rv;
@@ -595,21 +666,26 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 			 CK_SLOT_ID_PTR pSlot,  /* location that receives the slot ID */
 			 CK_VOID_PTR pReserved) /* reserved.  Should be NULL_PTR */
 {
-	sc_reader_t *found;
-	unsigned int mask, events;
-	void *reader_states = NULL;
-	CK_SLOT_ID slot_id;
+	unsigned int mask;
+	CK_SLOT_ID slot_id = 0;
 	CK_RV rv;
-	int r;
+#ifdef HAVE_PTHREAD
+	unsigned int events = 0;
+	CK_RV lock_rv;
+#endif
 
 	if (pReserved != NULL_PTR)
 		return  CKR_ARGUMENTS_BAD;
 
 	sc_log(context, "C_WaitForSlotEvent(block=%d)", !(flags & CKF_DONT_BLOCK));
-	/* Not all pcsc-lite versions implement consistently used functions as they are */
-	/* FIXME: add proper checking into build to check correct pcsc-lite version for SCardStatusChange/SCardCancel */
+#ifdef HAVE_PTHREAD
+	/* Blocking waits need the slot monitor thread */
+	if (!(flags & CKF_DONT_BLOCK) && !can_create_threads)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+#else
 	if (!(flags & CKF_DONT_BLOCK))
 		return CKR_FUNCTION_NOT_SUPPORTED;
+#endif
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
@@ -625,56 +701,241 @@ CK_RV C_WaitForSlotEvent(CK_FLAGS flags,   /* blocking/nonblocking flag */
 	if ((rv == CKR_OK) || (flags & CKF_DONT_BLOCK))
 		goto out;
 
-again:
-	sc_log(context, "C_WaitForSlotEvent() reader_states:%p", reader_states);
-	sc_pkcs11_unlock();
-	r = sc_wait_for_event(context, mask, &found, &events, -1, &reader_states);
-	if (sc_pkcs11_conf.plug_and_play && events & SC_EVENT_READER_ATTACHED) {
-		/* NSS/Firefox Triggers a C_GetSlotList(NULL) only if a slot ID is returned that it does not know yet
-		   Change the first hotplug slot id on every call to make this happen. */
-		sc_pkcs11_slot_t *hotplug_slot = list_get_at(&virtual_slots, 0);
-		*pSlot= hotplug_slot->id -1;
+#ifdef HAVE_PTHREAD
+	rv = slot_monitor_start();
+	if (rv != CKR_OK)
+		goto out;
 
-		rv = sc_pkcs11_lock();
-		if (rv != CKR_OK)
-			return rv;
+	for (;;) {
+		sc_pkcs11_unlock();
+		rv = slot_monitor_wait(&events);
+		/* Was C_Finalize called ? */
+		if (rv == CKR_CRYPTOKI_NOT_INITIALIZED || in_finalize == 1)
+			return CKR_CRYPTOKI_NOT_INITIALIZED;
 
-		goto out;
-	}
-	/* Was C_Finalize called ? */
-	if (in_finalize == 1)
-		return CKR_CRYPTOKI_NOT_INITIALIZED;
+		if ((lock_rv = sc_pkcs11_lock()) != CKR_OK)
+			return lock_rv;
+		if (rv != CKR_OK)
+			goto out;
 
-	if ((rv = sc_pkcs11_lock()) != CKR_OK)
-		return rv;
+		if (sc_pkcs11_conf.plug_and_play && (events & SC_EVENT_READER_ATTACHED)) {
+			/* NSS/Firefox Triggers a C_GetSlotList(NULL) only if a slot ID is returned that it does not know yet
+			   Change the first hotplug slot id on every call to make this happen. */
+			sc_pkcs11_slot_t *hotplug_slot = list_get_at(&virtual_slots, 0);
+			slot_id = hotplug_slot->id - 1;
+			goto out;
+		}
 
-	if (r != SC_SUCCESS) {
-		sc_log(context, "sc_wait_for_event() returned %d\n",  r);
-		rv = sc_to_cryptoki_error(r, "C_WaitForSlotEvent");
-		goto out;
+		/* If no changed slot was found (maybe an unsupported card
+		 * was inserted/removed) then go waiting again */
+		rv = slot_find_changed(&slot_id, mask);
+		if (rv == CKR_OK)
+			break;
 	}
-
-	/* If no changed slot was found (maybe an unsupported card
-	 * was inserted/removed) then go waiting again */
-	rv = slot_find_changed(&slot_id, mask);
-	if (rv != CKR_OK)
-		goto again;
+#endif
 
 out:
 	if (pSlot)
 		*pSlot = slot_id;
 
-	/* Free allocated readers states holder */
-	if (reader_states)   {
-		sc_log(context, "free reader states");
+	sc_log(context, "C_WaitForSlotEvent() = %s, event in 0x%lx", lookup_enum (RV_T, rv), slot_id);
+	sc_pkcs11_unlock();
+	return rv;
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * Slot event monitor
+ *
+ * Blocking C_WaitForSlotEvent() calls do not poll the readers themselves.
+ * A monitor thread, started by the first of them, keeps one
+ * sc_wait_for_event() call pending and queues the reader events it
+ * reports. Waiters sleep until an event is queued and then look for the
+ * slot that changed. C_Finalize() stops the thread with sc_cancel().
+ * A cancel that comes before the thread has started waiting is lost, so
+ * the wait also times out every SLOT_MONITOR_POLL_MSEC and the thread
+ * checks whether it has to stop.
+ */
+#define SLOT_EVENT_QUEUE_SIZE	32
+#define SLOT_MONITOR_POLL_MSEC	1000
+
+static pthread_mutex_t monitor_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t monitor_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t monitor_thread;
+static pid_t monitor_pid;
+static int monitor_running = 0;	/* thread created and not joined yet */
+static int monitor_exited = 0;	/* thread gave up, see monitor_error */
+static int monitor_stop = 0;
+static int monitor_error = SC_SUCCESS;
+static unsigned int event_queue[SLOT_EVENT_QUEUE_SIZE];
+static unsigned int event_head = 0, event_count = 0;
+
+static int
+slot_monitor_stopping(void)
+{
+	int stop;
+
+	pthread_mutex_lock(&monitor_lock);
+	stop = monitor_stop;
+	pthread_mutex_unlock(&monitor_lock);
+	return stop;
+}
+
+static void
+slot_monitor_push(unsigned int events)
+{
+	pthread_mutex_lock(&monitor_lock);
+	if (event_count < SLOT_EVENT_QUEUE_SIZE) {
+		event_queue[(event_head + event_count) % SLOT_EVENT_QUEUE_SIZE] = events;
+		event_count++;
+	}
+	else {
+		/* Queue is full: waiters rescan all slots anyway, so merge */
+		event_queue[(event_head + event_count - 1) % SLOT_EVENT_QUEUE_SIZE] |= events;
+	}
+	pthread_cond_broadcast(&monitor_cond);
+	pthread_mutex_unlock(&monitor_lock);
+}
+
+static void *
+slot_monitor(void *arg)
+{
+	void *reader_states = NULL;
+	sc_reader_t *found;
+	unsigned int mask, events;
+	int r = SC_SUCCESS;
+
+	mask = SC_EVENT_CARD_EVENTS;
+	if (sc_pkcs11_conf.plug_and_play)
+		mask |= SC_EVENT_READER_EVENTS;
+
+	while (!slot_monitor_stopping()) {
+		events = 0;
+		if (reader_states == NULL) {
+			/* Update the reader list; the next wait watches it */
+			if (sc_pkcs11_lock() != CKR_OK)
+				break;
+			sc_ctx_detect_readers(context);
+			sc_pkcs11_unlock();
+		}
+		r = sc_wait_for_event(context, mask, &found, &events,
+				SLOT_MONITOR_POLL_MSEC, &reader_states);
+
+		if (slot_monitor_stopping())
+			break;
+		if (r == SC_ERROR_EVENT_TIMEOUT)
+			continue;
+		if (r != SC_SUCCESS) {
+			sc_log(context, "slot monitor: sc_wait_for_event() returned %d", r);
+			break;
+		}
+
+		slot_monitor_push(events);
+		/* Watch the new set of readers */
+		if ((events & (SC_EVENT_READER_ATTACHED | SC_EVENT_READER_DETACHED)) && reader_states)
+			sc_wait_for_event(context, 0, NULL, NULL, -1, &reader_states);
+	}
+
+	if (reader_states)
 		sc_wait_for_event(context, 0, NULL, NULL, -1, &reader_states);
+
+	pthread_mutex_lock(&monitor_lock);
+	monitor_exited = 1;
+	monitor_error = r;
+	pthread_cond_broadcast(&monitor_cond);
+	pthread_mutex_unlock(&monitor_lock);
+	return NULL;
+}
+
+/* Called with the global lock held */
+static CK_RV
+slot_monitor_start(void)
+{
+	CK_RV rv = CKR_OK;
+	int join = 0;
+
+	pthread_mutex_lock(&monitor_lock);
+	if (monitor_running && monitor_exited) {
+		/* The previous thread failed, try again */
+		monitor_running = 0;
+		join = 1;
 	}
+	pthread_mutex_unlock(&monitor_lock);
+	if (join)
+		pthread_join(monitor_thread, NULL);
+
+	pthread_mutex_lock(&monitor_lock);
+	if (!monitor_running) {
+		monitor_stop = 0;
+		monitor_exited = 0;
+		monitor_error = SC_SUCCESS;
+		event_head = event_count = 0;
+		if (pthread_create(&monitor_thread, NULL, slot_monitor, NULL) == 0) {
+			monitor_running = 1;
+			monitor_pid = getpid();
+		}
+		else {
+			rv = CKR_FUNCTION_FAILED;
+		}
+	}
+	pthread_mutex_unlock(&monitor_lock);
+	return rv;
+}
 
-	sc_log(context, "C_WaitForSlotEvent() = %s, event in 0x%lx", lookup_enum (RV_T, rv), *pSlot);
-	sc_pkcs11_unlock();
+/* Called without the global lock: waits for the next queued event */
+static CK_RV
+slot_monitor_wait(unsigned int *events)
+{
+	CK_RV rv = CKR_OK;
+
+	pthread_mutex_lock(&monitor_lock);
+	while (event_count == 0 && !monitor_stop && !monitor_exited)
+		pthread_cond_wait(&monitor_cond, &monitor_lock);
+
+	if (monitor_stop) {
+		rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+	else if (event_count > 0) {
+		*events = event_queue[event_head];
+		event_head = (event_head + 1) % SLOT_EVENT_QUEUE_SIZE;
+		event_count--;
+	}
+	else {
+		rv = sc_to_cryptoki_error(monitor_error, "C_WaitForSlotEvent");
+	}
+	pthread_mutex_unlock(&monitor_lock);
 	return rv;
 }
 
+/* Called from C_Finalize() without the global lock */
+static void
+slot_monitor_stop(void)
+{
+	int running;
+
+	pthread_mutex_lock(&monitor_lock);
+	running = monitor_running;
+	monitor_running = 0;
+	monitor_stop = 1;
+	pthread_cond_broadcast(&monitor_cond);
+	pthread_mutex_unlock(&monitor_lock);
+
+	/* A forked child does not inherit the thread */
+	if (!running || monitor_pid != getpid())
+		return;
+
+	sc_cancel(context);
+	pthread_join(monitor_thread, NULL);
+}
+#else
+static void
+slot_monitor_stop(void)
+{
+	/* cancel pending calls */
+	sc_cancel(context);
+}
+#endif
+
 /*
  * Locking functions
  */
@@ -787,6 +1048,131 @@ void sc_pkcs11_free_lock(void)
 	global_locking = NULL;
 }
 
+/*
+ * Per-card locking
+ *
+ * The global lock only protects the slot and session tables. Every
+ * sc_pkcs11_card has its own lock, which is held across card I/O and
+ * protects the card's slots, objects and sessions. Nobody waits for a card
+ * lock while holding the global lock: the card is pinned and the global
+ * lock released first (sc_pkcs11_pin_card(), sc_pkcs11_lock_session()).
+ * A card lock holder may take the global lock for a short table update,
+ * such as opening or closing a session, but does no card I/O under it.
+ *
+ * A card or session that is used without the global lock held is pinned
+ * (reference counted) so that card removal or C_CloseSession only mark it
+ * as gone; the last user releases the memory.
+ */
+CK_RV sc_pkcs11_init_card_lock(struct sc_pkcs11_card *p11card)
+{
+	p11card->lock = NULL;
+	if (global_locking == NULL)
+		return CKR_OK;
+	return global_locking->CreateMutex(&p11card->lock);
+}
+
+void sc_pkcs11_lock_card(struct sc_pkcs11_card *p11card)
+{
+	if (!p11card->lock)
+		return;
+	if (global_locking)  {
+		while (global_locking->LockMutex(p11card->lock) != CKR_OK)
+			;
+	}
+}
+
+void sc_pkcs11_unlock_card(struct sc_pkcs11_card *p11card)
+{
+	__sc_pkcs11_unlock(p11card->lock);
+}
+
+void sc_pkcs11_free_card_lock(struct sc_pkcs11_card *p11card)
+{
+	if (p11card->lock && global_locking)
+		global_locking->DestroyMutex(p11card->lock);
+	p11card->lock = NULL;
+}
+
+/*
+ * Called with the global lock held. Pins the card, releases the global lock
+ * and waits for the card lock. On success the caller owns the card lock and
+ * must call sc_pkcs11_unpin_card().
+ */
+CK_RV sc_pkcs11_pin_card(struct sc_pkcs11_card *p11card)
+{
+	p11card->refs++;
+	sc_pkcs11_unlock();
+
+	sc_pkcs11_lock_card(p11card);
+	if (p11card->removed) {
+		sc_pkcs11_unpin_card(p11card);
+		return CKR_DEVICE_REMOVED;
+	}
+	return CKR_OK;
+}
+
+void sc_pkcs11_unpin_card(struct sc_pkcs11_card *p11card)
+{
+	sc_pkcs11_unlock_card(p11card);
+
+	/* C_Finalize() was called meanwhile, nothing left to release */
+	if (sc_pkcs11_lock() != CKR_OK)
+		return;
+	p11card->refs--;
+	card_release(p11card);
+	sc_pkcs11_unlock();
+}
+
+/*
+ * Locate session and lock the card it belongs to. The global lock is held
+ * only during the session table lookup.
+ */
+CK_RV sc_pkcs11_lock_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
+{
+	struct sc_pkcs11_session *sess;
+	CK_RV rv;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = get_session(hSession, &sess);
+	if (rv != CKR_OK) {
+		sc_pkcs11_unlock();
+		return rv;
+	}
+
+	sess->refs++;
+	sess->card->refs++;
+	sc_pkcs11_unlock();
+
+	sc_pkcs11_lock_card(sess->card);
+	if (sess->closed || sess->card->removed) {
+		/* Session was closed or token removed while waiting for the card */
+		sc_pkcs11_unlock_session(sess);
+		return CKR_SESSION_HANDLE_INVALID;
+	}
+
+	*session = sess;
+	return CKR_OK;
+}
+
+void sc_pkcs11_unlock_session(struct sc_pkcs11_session *session)
+{
+	struct sc_pkcs11_card *p11card = session->card;
+
+	sc_pkcs11_unlock_card(p11card);
+
+	if (sc_pkcs11_lock() != CKR_OK)
+		return;
+	session->refs--;
+	if (session->closed && session->refs == 0)
+		free(session);
+	p11card->refs--;
+	card_release(p11card);
+	sc_pkcs11_unlock();
+}
+
 CK_FUNCTION_LIST pkcs11_function_list = {
 	{ 2, 11 }, /* Note: NSS/Firefox ignores this version number and uses C_GetInfo() */
 	C_Initialize,
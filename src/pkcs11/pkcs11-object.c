@@ -64,55 +64,30 @@ sc_find_release(sc_pkcs11_operation_t *operation)
 
 
 static CK_RV
-get_object_from_session(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
-		struct sc_pkcs11_session **session, struct sc_pkcs11_object **object)
+get_object_from_session(struct sc_pkcs11_session *session, CK_OBJECT_HANDLE hObject,
+		struct sc_pkcs11_object **object)
 {
-	struct sc_pkcs11_session *sess;
-	CK_RV rv;
-
-	rv = get_session(hSession, &sess);
-	if (rv != CKR_OK)
-		return rv;
-
-	*object = list_seek(&sess->slot->objects, &hObject);
+	*object = list_seek(&session->slot->objects, &hObject);
 	if (!*object)
 		return CKR_OBJECT_HANDLE_INVALID;
-	*session = sess;
 	return CKR_OK;
 }
 
 /* C_CreateObject can be called from C_DeriveKey
- * which is holding the sc_pkcs11_lock
+ * which is holding the card lock of the session
  * So dont get the lock again. */
 static
-CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle */
+CK_RV sc_create_object_int(struct sc_pkcs11_session *session,	/* the locked session */
 		CK_ATTRIBUTE_PTR pTemplate,		/* the object's template */
 		CK_ULONG ulCount,			/* attributes in template */
-		CK_OBJECT_HANDLE_PTR phObject,		/* receives new object's handle. */
-		int use_lock)
+		CK_OBJECT_HANDLE_PTR phObject)		/* receives new object's handle. */
 {
 	CK_RV rv = CKR_OK;
-	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_card *card;
 
 	LOG_FUNC_CALLED(context);
-	if (pTemplate == NULL_PTR || ulCount == 0)
-		return CKR_ARGUMENTS_BAD;
-
-	if (use_lock) {
-	    rv = sc_pkcs11_lock();
-	    if (rv != CKR_OK)
-		return rv;
-	}
-
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_CreateObject()", pTemplate, ulCount);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 #if 0
 /* TODO DEE what should we check here */
 	if (!(session->flags & CKF_RW_SESSION)) {
@@ -126,9 +101,6 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 	else
 		rv = card->framework->create_object(session->slot, pTemplate, ulCount, phObject);
 
-out:
-	if (use_lock)
-		sc_pkcs11_unlock();
 	LOG_FUNC_RETURN(context, rv);
 }
 
@@ -139,7 +111,20 @@ C_CreateObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulCount,		/* attributes in template */
 		CK_OBJECT_HANDLE_PTR phObject)
 {
-	return sc_create_object_int(hSession, pTemplate, ulCount, phObject, 1);
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+
+	if (pTemplate == NULL_PTR || ulCount == 0)
+		return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = sc_create_object_int(session, pTemplate, ulCount, phObject);
+
+	sc_pkcs11_unlock_session(session);
+	return rv;
 }
 
 
@@ -164,12 +149,12 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_BBOOL is_token = FALSE;
 	CK_ATTRIBUTE token_attribure = {CKA_TOKEN, &is_token, sizeof(is_token)};
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_DestroyObject(hSession=0x%lx, hObject=0x%lx)", hSession, hObject);
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -185,7 +170,7 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = object->ops->destroy_object(session, object);
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -223,11 +208,11 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -263,7 +248,7 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:	sc_log(context, "C_GetAttributeValue(hSession=0x%lx, hObject=0x%lx) = %s",
 			hSession, hObject, lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -282,13 +267,13 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_SetAttributeValue", pTemplate, ulCount);
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(session, hObject, &object);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -305,40 +290,94 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			if (rv != CKR_OK)
 				break;
 		}
+		/* Indexed values may have changed */
+		slot_index_invalidate(session->slot);
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
 
+/* Add the object to the search results if it matches the template */
+static CK_RV
+find_match_object(struct sc_pkcs11_session *session, struct sc_pkcs11_find_operation *operation,
+		struct sc_pkcs11_object *object, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount,
+		int hide_private)
+{
+	CK_BBOOL is_private = TRUE;
+	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
+	struct sc_pkcs11_slot *slot = session->slot;
+	unsigned int j;
+
+	sc_log(context, "Object with handle 0x%lx", object->handle);
+
+	/* User not logged in and private object? */
+	if (hide_private) {
+		if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
+			return CKR_OK;
+		if (is_private) {
+			sc_log(context, "Object %d/%d: Private object and not logged in.",
+				 slot->id, object->handle);
+			return CKR_OK;
+		}
+	}
+
+	/* Try to match every attribute */
+	for (j = 0; j < ulCount; j++) {
+		if (object->ops->cmp_attribute(session, object, &pTemplate[j]) == 0) {
+			sc_log(context, "Object %d/%d: Attribute 0x%x does NOT match.",
+				 slot->id, object->handle, pTemplate[j].type);
+			return CKR_OK;
+		}
+
+		if (context->debug >= 4) {
+			sc_log(context, "Object %d/%d: Attribute 0x%x matches.",
+				 slot->id, object->handle, pTemplate[j].type);
+		}
+	}
+
+	sc_log(context, "Object %d/%d matches\n", slot->id, object->handle);
+	/* Realloc handles - remove restriction on only 32 matching objects -dee */
+	if (operation->num_handles >= operation->allocated_handles) {
+		CK_OBJECT_HANDLE *handles;
+
+		operation->allocated_handles += SC_PKCS11_FIND_INC_HANDLES;
+		sc_log(context, "realloc for %d handles", operation->allocated_handles);
+		handles = realloc(operation->handles,
+			sizeof(CK_OBJECT_HANDLE) * operation->allocated_handles);
+		if (handles == NULL)
+			return CKR_HOST_MEMORY;
+		operation->handles = handles;
+	}
+	operation->handles[operation->num_handles++] = object->handle;
+	return CKR_OK;
+}
+
+
 CK_RV
 C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ATTRIBUTE_PTR pTemplate,	/* attribute values to match */
 		CK_ULONG ulCount)		/* attributes in search template */
 {
 	CK_RV rv;
-	CK_BBOOL is_private = TRUE;
-	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
-	int match, hide_private;
-	unsigned int i, j;
+	CK_ATTRIBUTE_PTR key;
+	int hide_private;
+	unsigned int i;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_find_operation *operation;
+	struct sc_pkcs11_index_entry *entry;
 	struct sc_pkcs11_slot *slot;
 
 	if (pTemplate == NULL_PTR && ulCount > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	sc_log(context, "C_FindObjectsInit(slot = %d)\n", session->slot->id);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_FindObjectsInit()", pTemplate, ulCount);
 
@@ -358,61 +397,34 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (slot->login_user != CKU_USER && (slot->token_info.flags & CKF_LOGIN_REQUIRED))
 		hide_private = 1;
 
-	/* For each object in token do */
-	for (i=0; i<list_size(&slot->objects); i++) {
-		object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, i);
-		sc_log(context, "Object with handle 0x%lx", object->handle);
-
-		/* User not logged in and private object? */
-		if (hide_private) {
-			if (object->ops->get_attribute(session, object, &private_attribute) != CKR_OK)
-			        continue;
-			if (is_private) {
-				sc_log(context, "Object %d/%d: Private object and not logged in.",
-					 slot->id, object->handle);
-				continue;
-			}
-		}
-
-		/* Try to match every attribute */
-		match = 1;
-		for (j = 0; j < ulCount; j++) {
-			rv = object->ops->cmp_attribute(session, object, &pTemplate[j]);
-			if (rv == 0) {
-				sc_log(context, "Object %d/%d: Attribute 0x%x does NOT match.",
-					 slot->id, object->handle, pTemplate[j].type);
-				match = 0;
-				break;
-			}
+	/* Only the objects sharing an indexed value can match */
+	rv = slot_index_lookup(session, pTemplate, ulCount, &key, &entry);
+	if (rv != CKR_OK)
+		goto out;
 
-			if (context->debug >= 4) {
-				sc_log(context, "Object %d/%d: Attribute 0x%x matches.",
-					 slot->id, object->handle, pTemplate[j].type);
-			}
+	if (key != NULL) {
+		for (; entry != NULL && rv == CKR_OK; entry = entry->next) {
+			if (entry->len != key->ulValueLen
+					|| (entry->len && memcmp(entry->value, key->pValue, entry->len)))
+				continue;
+			rv = find_match_object(session, operation, entry->object,
+					pTemplate, ulCount, hide_private);
 		}
-
-		if (match) {
-			sc_log(context, "Object %d/%d matches\n", slot->id, object->handle);
-			/* Realloc handles - remove restriction on only 32 matching objects -dee */
-			if (operation->num_handles >= operation->allocated_handles) {
-				operation->allocated_handles += SC_PKCS11_FIND_INC_HANDLES;
-				sc_log(context, "realloc for %d handles", operation->allocated_handles);
-				operation->handles = realloc(operation->handles,
-					sizeof(CK_OBJECT_HANDLE) * operation->allocated_handles);
-				if (operation->handles == NULL) {
-					rv = CKR_HOST_MEMORY;
-					break;
-				}
-			}
-			operation->handles[operation->num_handles++] = object->handle;
+	} else {
+		/* For each object in token do */
+		for (i = 0; i < list_size(&slot->objects) && rv == CKR_OK; i++) {
+			object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, i);
+			rv = find_match_object(session, operation, object,
+					pTemplate, ulCount, hide_private);
 		}
 	}
-	rv = CKR_OK;
+	if (rv != CKR_OK)
+		goto out;
 
 	sc_log(context, "%d matching objects\n", operation->num_handles);
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -431,14 +443,10 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (phObject == NULL_PTR || ulMaxObjectCount == 0 || pulObjectCount == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = session_get_operation(session, SC_PKCS11_OPERATION_FIND, (sc_pkcs11_operation_t **) & operation);
 	if (rv != CKR_OK)
 		goto out;
@@ -453,7 +461,7 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	operation->current_handle += to_return;
 
-out:	sc_pkcs11_unlock();
+out:	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -464,19 +472,15 @@ C_FindObjectsFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = session_get_operation(session, SC_PKCS11_OPERATION_FIND, NULL);
 	if (rv == CKR_OK)
 		session_stop_operation(session, SC_PKCS11_OPERATION_FIND);
 
-out:	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -494,17 +498,15 @@ C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_DigestInit(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_init(session, pMechanism);
+	rv = sc_pkcs11_md_init(session, pMechanism);
 
 	sc_log(context, "C_DigestInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -519,21 +521,17 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	sc_log(context, "C_Digest(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = sc_pkcs11_md_update(session, pData, ulDataLen);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
-out:	sc_log(context, "C_Digest() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_log(context, "C_Digest() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -546,16 +544,14 @@ C_DigestUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
+	rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_DigestUpdate() == %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -576,16 +572,14 @@ C_DigestFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
+	rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
 	sc_log(context, "C_DigestFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -606,11 +600,11 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -637,7 +631,7 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_SignInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -653,14 +647,10 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	struct sc_pkcs11_session *session;
 	CK_ULONG length;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	/* According to the pkcs11 specs, we must not do any calls that
 	 * change our crypto state if the caller is just asking for the
 	 * signature buffer size, or if the result would be
@@ -681,7 +671,7 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_Sign() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -694,16 +684,14 @@ C_SignUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
+	rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_SignUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -717,14 +705,10 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	CK_ULONG length;
 	CK_RV rv;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	/* According to the pkcs11 specs, we must not do any calls that
 	 * change our crypto state if the caller is just asking for the
 	 * signature buffer size, or if the result would be
@@ -742,7 +726,7 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	sc_log(context, "C_SignFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -766,11 +750,11 @@ C_SignRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -801,7 +785,7 @@ C_SignRecoverInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	sc_log(context, "C_SignRecoverInit() = %sn", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -867,11 +851,11 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -901,7 +885,7 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_decr_init(session, pMechanism, object, key_type);
 
 out:	sc_log(context, "C_DecryptInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -914,17 +898,15 @@ CK_RV C_Decrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_decr(session, pEncryptedData, ulEncryptedDataLen,
-				pData, pulDataLen);
+	rv = sc_pkcs11_decr(session, pEncryptedData, ulEncryptedDataLen,
+			pData, pulDataLen);
 
 	sc_log(context, "C_Decrypt() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1007,17 +989,13 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			|| (pPrivateKeyTemplate == NULL_PTR && ulPrivateKeyAttributeCount > 0))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PrivKey attrs", pPrivateKeyTemplate, ulPrivateKeyAttributeCount);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PubKey attrs", pPublicKeyTemplate, ulPublicKeyAttributeCount);
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -1033,7 +1011,7 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 				phPublicKey, phPrivateKey);
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1081,11 +1059,11 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hBaseKey, &session, &object);
+	rv = get_object_from_session(session, hBaseKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1114,11 +1092,11 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	switch(key_type) {
 	    case CKK_EC:
 
-		rv = sc_create_object_int(hSession, pTemplate, ulAttributeCount, phKey, 0);
+		rv = sc_create_object_int(session, pTemplate, ulAttributeCount, phKey);
 		if (rv != CKR_OK)
 		    goto out;
 
-		rv = get_object_from_session(hSession, *phKey, &session, &key_object);
+		rv = get_object_from_session(session, *phKey, &key_object);
 		if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1135,7 +1113,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1154,20 +1132,17 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK) {
-		slot = session->slot;
-		if (slot->card->framework->get_random == NULL)
-			rv = CKR_RANDOM_NO_RNG;
-		else
-			rv = slot->card->framework->get_random(slot, RandomData, ulRandomLen);
-	}
+	slot = session->slot;
+	if (slot->card->framework->get_random == NULL)
+		rv = CKR_RANDOM_NO_RNG;
+	else
+		rv = slot->card->framework->get_random(slot, RandomData, ulRandomLen);
 
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -1201,12 +1176,12 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(session, hKey, &object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1228,7 +1203,7 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_verif_init(session, pMechanism, object, key_type);
 
 out:	sc_log(context, "C_VerifyInit() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1245,20 +1220,16 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv != CKR_OK)
-		goto out;
-
 	rv = sc_pkcs11_verif_update(session, pData, ulDataLen);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 
-out:	sc_log(context, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_log(context, "C_Verify() = %s", lookup_enum ( RV_T, rv ));
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1273,16 +1244,14 @@ CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
+	rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
 
 	sc_log(context, "C_VerifyUpdate() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
@@ -1297,16 +1266,14 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
-	if (rv == CKR_OK)
-		rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
+	rv = sc_pkcs11_verif_final(session, pSignature, ulSignatureLen);
 
 	sc_log(context, "C_VerifyFinal() = %s", lookup_enum ( RV_T, rv ));
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 #endif
 }
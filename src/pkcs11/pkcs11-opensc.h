@@ -9,4 +9,13 @@
  */
 #define CKA_OPENSC_NON_REPUDIATION      (CKA_VENDOR_DEFINED | 1UL)
 
+/*
+ * Exported by the module next to C_GetFunctionList(): returns the APDU
+ * statistics of the module as "name value" lines (see sc_stats_format()).
+ * When pBuffer is NULL_PTR only the needed length is returned in pulLen,
+ * which includes the terminating NUL.
+ */
+#define C_OPENSC_GET_STATS_NAME         "C_OpenSC_GetStats"
+typedef CK_RV (*CK_C_OpenSC_GetStats)(CK_UTF8CHAR_PTR pBuffer, CK_ULONG_PTR pulLen);
+
 #endif
@@ -29,7 +29,7 @@
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
 {
 	*session = list_seek(&sessions, &hSession);
-	if (!*session)
+	if (!*session || (*session)->closed)
 		return CKR_SESSION_HANDLE_INVALID;
 	return CKR_OK;
 }
@@ -43,6 +43,7 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 	CK_RV rv;
 	struct sc_pkcs11_slot *slot;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card;
 
 	if (!(flags & CKF_SERIAL_SESSION))
 		return CKR_SESSION_PARALLEL_NOT_SUPPORTED;
@@ -57,95 +58,131 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 	sc_log(context, "C_OpenSession(0x%lx)", slotID);
 
 	rv = slot_get_token(slotID, &slot);
+	if (rv != CKR_OK) {
+		sc_pkcs11_unlock();
+		goto out;
+	}
+
+	/* Release the global lock while waiting for the card */
+	p11card = slot->card;
+	rv = sc_pkcs11_pin_card(p11card);
 	if (rv != CKR_OK)
 		goto out;
 
 	/* Check that no conflictions sessions exist */
 	if (!(flags & CKF_RW_SESSION) && (slot->login_user == CKU_SO)) {
 		rv = CKR_SESSION_READ_WRITE_SO_EXISTS;
-		goto out;
+		goto out_unpin;
 	}
 
 	session = (struct sc_pkcs11_session *)calloc(1, sizeof(struct sc_pkcs11_session));
 	if (session == NULL) {
 		rv = CKR_HOST_MEMORY;
-		goto out;
+		goto out_unpin;
 	}
 
 	session->slot = slot;
+	session->card = p11card;
 	session->notify_callback = Notify;
 	session->notify_data = pApplication;
 	session->flags = flags;
-	slot->nsessions++;
 	session->handle = (CK_SESSION_HANDLE) session;	/* cast a pointer to long */
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK) {
+		free(session);
+		goto out_unpin;
+	}
+	slot->nsessions++;
 	list_append(&sessions, session);
+	sc_pkcs11_unlock();
+
 	*phSession = session->handle;
 	sc_log(context, "C_OpenSession handle: 0x%lx", session->handle);
 
+out_unpin:
+	sc_pkcs11_unpin_card(p11card);
 out:
 	sc_log(context, "C_OpenSession() = %s", lookup_enum(RV_T, rv));
-	sc_pkcs11_unlock();
 	return rv;
 }
 
-/* Internal version of C_CloseSession that gets called with
- * the global lock held */
-static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
+/* Logs out of the slot. Called with the card lock held */
+void sc_pkcs11_logout_slot(struct sc_pkcs11_slot *slot)
 {
-	struct sc_pkcs11_slot *slot;
-	struct sc_pkcs11_session *session;
-
-	sc_log(context, "real C_CloseSession(0x%lx)", hSession);
-
-	session = list_seek(&sessions, &hSession);
-	if (!session)
-		return CKR_SESSION_HANDLE_INVALID;
-
-	/* If we're the last session using this slot, make sure
-	 * we log out */
-	slot = session->slot;
-	slot->nsessions--;
-	if (slot->nsessions == 0 && slot->login_user >= 0) {
-		slot->login_user = -1;
-		slot->card->framework->logout(slot);
-	}
+	if (slot->login_user < 0)
+		return;
+	slot->login_user = -1;
+	slot->card->framework->logout(slot);
+	slot_index_invalidate(slot);
+}
 
+/* Removes the session from the session table. Called with the global
+ * lock held. A session still in use by another thread is released
+ * by sc_pkcs11_unlock_session() */
+static void sc_pkcs11_drop_session(struct sc_pkcs11_session *session)
+{
+	session->slot->nsessions--;
 	if (list_delete(&sessions, session) != 0)
 		sc_log(context, "Could not delete session from list!");
-	free(session);
-	return CKR_OK;
+	session->closed = 1;
+	if (session->refs == 0)
+		free(session);
 }
 
 /* Internal version of C_CloseAllSessions that gets called with
- * the global lock held */
+ * the global lock and the card lock held. Callers that do not want
+ * to talk to the card under the global lock log out of the slot
+ * first with sc_pkcs11_logout_slot() */
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 {
-	CK_RV rv = CKR_OK;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_slot *slot = NULL;
 	unsigned int i;
 	sc_log(context, "real C_CloseAllSessions(0x%lx) %d", slotID, list_size(&sessions));
-	for (i = 0; i < list_size(&sessions); i++) {
+	for (i = 0; i < list_size(&sessions); ) {
 		session = list_get_at(&sessions, i);
-		if (session->slot->id == slotID)
-			if ((rv = sc_pkcs11_close_session(session->handle)) != CKR_OK)
-				return rv;
+		if (session->slot->id == slotID) {
+			slot = session->slot;
+			sc_pkcs11_drop_session(session);
+			continue;
+		}
+		i++;
 	}
+
+	/* The last session of the slot is gone, make sure we log out */
+	if (slot != NULL)
+		sc_pkcs11_logout_slot(slot);
 	return CKR_OK;
 }
 
 CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
 	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	sc_log(context, "C_CloseSession(0x%lx)", hSession);
+
+	/* Wait for the card without holding the global lock */
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	sc_log(context, "C_CloseSession(0x%lx)", hSession);
+	/* If we're the last session using this slot, make sure
+	 * we log out. Sessions are only opened and closed with
+	 * the card lock held, so the count is stable here */
+	slot = session->slot;
+	if (slot->nsessions == 1)
+		sc_pkcs11_logout_slot(slot);
 
-	rv = sc_pkcs11_close_session(hSession);
+	rv = sc_pkcs11_lock();
+	if (rv == CKR_OK) {
+		sc_pkcs11_drop_session(session);
+		sc_pkcs11_unlock();
+	}
 
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -153,6 +190,7 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 {				/* the token's slot */
 	CK_RV rv;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
@@ -161,12 +199,26 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 	sc_log(context, "C_CloseAllSessions(0x%lx)", slotID);
 
 	rv = slot_get_token(slotID, &slot);
+	if (rv != CKR_OK) {
+		sc_pkcs11_unlock();
+		return rv;
+	}
+
+	/* Release the global lock while waiting for the card */
+	p11card = slot->card;
+	rv = sc_pkcs11_pin_card(p11card);
 	if (rv != CKR_OK)
-		goto out;
+		return rv;
 
-	rv = sc_pkcs11_close_all_sessions(slotID);
+	sc_pkcs11_logout_slot(slot);
 
-      out:sc_pkcs11_unlock();
+	rv = sc_pkcs11_lock();
+	if (rv == CKR_OK) {
+		rv = sc_pkcs11_close_all_sessions(slotID);
+		sc_pkcs11_unlock();
+	}
+
+	sc_pkcs11_unpin_card(p11card);
 	return rv;
 }
 
@@ -186,11 +238,9 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	sc_log(context, "C_GetSessionInfo(hSession:0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
 		goto out;
-	}
 
 	sc_log(context, "C_GetSessionInfo(slot:0x%lx)", session->slot->id);
 	pInfo->slotID = session->slot->id;
@@ -242,20 +292,13 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	if (userType != CKU_USER && userType != CKU_SO && userType != CKU_CONTEXT_SPECIFIC)
+		return CKR_USER_TYPE_INVALID;
+
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	if (userType != CKU_USER && userType != CKU_SO && userType != CKU_CONTEXT_SPECIFIC) {
-		rv = CKR_USER_TYPE_INVALID;
-		goto out;
-	}
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	sc_log(context, "C_Login(0x%lx, %d)", hSession, userType);
 
 	slot = session->slot;
@@ -282,11 +325,13 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		}
 
 		rv = slot->card->framework->login(slot, userType, pPin, ulPinLen);
-		if (rv == CKR_OK)
+		if (rv == CKR_OK) {
 			slot->login_user = userType;
+			slot_index_invalidate(slot);
+		}
 	}
 
-      out:sc_pkcs11_unlock();
+      out:sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -296,16 +341,10 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	sc_log(context, "C_Logout(hSession:0x%lx)", hSession);
 
 	slot = session->slot;
@@ -313,10 +352,11 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	if (slot->login_user >= 0) {
 		slot->login_user = -1;
 		rv = slot->card->framework->logout(slot);
+		slot_index_invalidate(slot);
 	} else
 		rv = CKR_USER_NOT_LOGGED_IN;
 
-      out:sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -329,16 +369,10 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	if (!(session->flags & CKF_RW_SESSION)) {
 		rv = CKR_SESSION_READ_ONLY;
 		goto out;
@@ -353,7 +387,7 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 		rv = slot->card->framework->init_pin(slot, pPin, ulPinLen);
 	}
 
-      out:sc_pkcs11_unlock();
+      out:sc_pkcs11_unlock_session(session);
 	return rv;
 }
 
@@ -367,16 +401,10 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	if ((pOldPin == NULL_PTR && ulOldLen > 0) || (pNewPin == NULL_PTR && ulNewLen > 0))
 		return CKR_ARGUMENTS_BAD;
 
-	rv = sc_pkcs11_lock();
+	rv = sc_pkcs11_lock_session(hSession, &session);
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	slot = session->slot;
 	sc_log(context, "Changing PIN (session 0x%lx; login user %d)", hSession, slot->login_user);
 
@@ -387,6 +415,6 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 
 	rv = slot->card->framework->change_pin(slot, pOldPin, ulOldLen, pNewPin, ulNewLen);
 out:
-	sc_pkcs11_unlock();
+	sc_pkcs11_unlock_session(session);
 	return rv;
 }
@@ -0,0 +1,586 @@
+/*
+ * pkcs11-spy-trace.c: binary trace mode of pkcs11-spy
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307,
+ * USA
+ */
+
+/*
+ * The text output of the spy formats and flushes every argument of every
+ * call. In trace mode the application gets a second function list, whose
+ * entries only time the call to the real module and append a fixed size
+ * record to a buffer; the buffer is written to a ring file when it is full
+ * and at C_Finalize(). The trace is read with pkcs11-spy-decode.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#endif
+
+#include "pkcs11.h"
+#include "pkcs11-spy-trace.h"
+
+/* records kept in memory before they are written */
+#define TRACE_BUFFER_RECORDS	256
+#define TRACE_DEFAULT_SIZE	(64UL * 1024 * 1024)
+
+#define FNV_BASIS		2166136261UL
+#define FNV_PRIME		16777619UL
+
+static CK_FUNCTION_LIST_PTR real = NULL;
+static CK_FUNCTION_LIST trace_list;
+
+static FILE *trace_file = NULL;
+static int trace_hashing = 0;
+static unsigned char trace_buffer[TRACE_BUFFER_RECORDS * SPY_TRACE_RECORD_SIZE];
+static unsigned int trace_buffered = 0;
+static unsigned long trace_seq = 0;
+static unsigned long long ring_size, ring_pos;
+static int ring_wrapped = 0;
+static unsigned char trace_header[SPY_TRACE_HEADER_SIZE];
+
+#ifdef _WIN32
+static CRITICAL_SECTION trace_lock;
+#define TRACE_LOCK()	EnterCriticalSection(&trace_lock)
+#define TRACE_UNLOCK()	LeaveCriticalSection(&trace_lock)
+#elif defined(HAVE_PTHREAD)
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+#define TRACE_LOCK()	pthread_mutex_lock(&trace_lock)
+#define TRACE_UNLOCK()	pthread_mutex_unlock(&trace_lock)
+#else
+#define TRACE_LOCK()
+#define TRACE_UNLOCK()
+#endif
+
+static void
+put_u16(unsigned char *p, unsigned int v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+}
+
+static void
+put_u32(unsigned char *p, unsigned long v)
+{
+	put_u16(p, v & 0xFFFF);
+	put_u16(p + 2, (v >> 16) & 0xFFFF);
+}
+
+static void
+put_u64(unsigned char *p, unsigned long long v)
+{
+	put_u32(p, (unsigned long) (v & 0xFFFFFFFFUL));
+	put_u32(p + 4, (unsigned long) (v >> 32));
+}
+
+static unsigned long long
+trace_clock(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+
+	if (!QueryPerformanceFrequency(&freq) || !QueryPerformanceCounter(&count))
+		return (unsigned long long) GetTickCount() * 1000;
+	return (unsigned long long) count.QuadPart * 1000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static unsigned long long
+wall_clock(void)
+{
+#ifdef _WIN32
+	FILETIME ft;
+	unsigned long long t;
+
+	GetSystemTimeAsFileTime(&ft);
+	t = ((unsigned long long) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	/* 100 ns intervals since 1601 */
+	return t / 10 - 11644473600000000ULL;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static unsigned long
+thread_id(void)
+{
+#ifdef _WIN32
+	return GetCurrentThreadId();
+#elif defined(HAVE_PTHREAD)
+	unsigned long id = (unsigned long) pthread_self();
+
+	return (id ^ (id >> 16 >> 16)) & 0xFFFFFFFFUL;
+#else
+	return 0;
+#endif
+}
+
+static unsigned long
+fnv(unsigned long h, const void *data, CK_ULONG len)
+{
+	const unsigned char *p = data;
+
+	if (p == NULL)
+		return h;
+	while (len--) {
+		h ^= *p++;
+		h = (h * FNV_PRIME) & 0xFFFFFFFFUL;
+	}
+	return h;
+}
+
+static unsigned long
+fnv_ulong(unsigned long h, CK_ULONG v)
+{
+	unsigned char buf[4];
+
+	put_u32(buf, v);
+	return fnv(h, buf, sizeof(buf));
+}
+
+static unsigned long
+hash_data(const void *data, CK_ULONG len)
+{
+	return fnv(FNV_BASIS, data, len);
+}
+
+/* Only the mechanism type: parameters may hold IVs and such */
+static unsigned long
+hash_mechanism(CK_MECHANISM_PTR mech)
+{
+	return mech != NULL ? fnv_ulong(FNV_BASIS, mech->mechanism) : FNV_BASIS;
+}
+
+/* Only the attribute types: values may be secret */
+static unsigned long
+hash_template(unsigned long h, CK_ATTRIBUTE_PTR attrs, CK_ULONG count)
+{
+	CK_ULONG i;
+
+	if (attrs == NULL)
+		return h;
+	for (i = 0; i < count; i++)
+		h = fnv_ulong(h, attrs[i].type);
+	return h;
+}
+
+/* Called with trace_lock held */
+static void
+write_at(unsigned long long offset, const unsigned char *data, size_t len)
+{
+	if (fseek(trace_file, (long) (SPY_TRACE_HEADER_SIZE + offset), SEEK_SET) == 0)
+		fwrite(data, 1, len, trace_file);
+}
+
+/* Called with trace_lock held */
+static void
+trace_flush_locked(void)
+{
+	const unsigned char *p = trace_buffer;
+	size_t len = trace_buffered * SPY_TRACE_RECORD_SIZE;
+
+	if (trace_file == NULL || trace_buffered == 0)
+		return;
+
+	while (len > 0) {
+		size_t n = len;
+
+		if (ring_size != 0 && ring_pos + n > ring_size)
+			n = (size_t) (ring_size - ring_pos);
+		write_at(ring_pos, p, n);
+		p += n;
+		len -= n;
+		ring_pos += n;
+		if (ring_size != 0 && ring_pos == ring_size) {
+			ring_pos = 0;
+			ring_wrapped = 1;
+		}
+	}
+	trace_buffered = 0;
+
+	put_u64(trace_header + 24, ring_pos);
+	put_u32(trace_header + 32, ring_wrapped);
+	if (fseek(trace_file, 0, SEEK_SET) == 0)
+		fwrite(trace_header, 1, sizeof(trace_header), trace_file);
+	fflush(trace_file);
+}
+
+static void
+trace_flush(void)
+{
+	TRACE_LOCK();
+	trace_flush_locked();
+	TRACE_UNLOCK();
+}
+
+static CK_RV
+trace_record(int function, unsigned long long start, CK_ULONG handle,
+		unsigned long hash, CK_RV rv)
+{
+	unsigned long long end = trace_clock();
+	unsigned long tid = thread_id();
+	unsigned char *rec;
+
+	TRACE_LOCK();
+	rec = trace_buffer + trace_buffered * SPY_TRACE_RECORD_SIZE;
+	memset(rec, 0, SPY_TRACE_RECORD_SIZE);
+	put_u64(rec, start);
+	put_u64(rec + 8, end - start);
+	put_u64(rec + 16, handle);
+	put_u32(rec + 24, tid);
+	put_u32(rec + 28, rv & 0xFFFFFFFFUL);
+	put_u32(rec + 32, trace_hashing ? hash : 0);
+	put_u16(rec + 36, function);
+	put_u16(rec + 38, trace_hashing ? SPY_TRACE_FLAG_HASH : 0);
+	put_u32(rec + 40, trace_seq++ & 0xFFFFFFFFUL);
+	if (++trace_buffered == TRACE_BUFFER_RECORDS)
+		trace_flush_locked();
+	TRACE_UNLOCK();
+	return rv;
+}
+
+/* Defines trace_<name>(), which calls the real module and records the
+ * call. The hash expression is only evaluated when hashing is on. */
+#define TRACE_CALL(name, params, args, handle, hash) \
+static CK_RV \
+trace_##name params \
+{ \
+	unsigned long long start = trace_clock(); \
+	CK_RV rv = real->name args; \
+	return trace_record(SPY_TRACE_##name, start, (handle), \
+			trace_hashing ? (hash) : 0, rv); \
+}
+
+static CK_RV
+trace_C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList)
+{
+	unsigned long long start = trace_clock();
+
+	if (ppFunctionList == NULL)
+		return trace_record(SPY_TRACE_C_GetFunctionList, start, 0, 0, CKR_ARGUMENTS_BAD);
+	*ppFunctionList = &trace_list;
+	return trace_record(SPY_TRACE_C_GetFunctionList, start, 0, 0, CKR_OK);
+}
+
+static CK_RV
+trace_C_Finalize(CK_VOID_PTR pReserved)
+{
+	unsigned long long start = trace_clock();
+	CK_RV rv = real->C_Finalize(pReserved);
+
+	trace_record(SPY_TRACE_C_Finalize, start, 0, 0, rv);
+	trace_flush();
+	return rv;
+}
+
+TRACE_CALL(C_Initialize, (CK_VOID_PTR pInitArgs),
+	(pInitArgs), 0, 0)
+TRACE_CALL(C_GetInfo, (CK_INFO_PTR pInfo),
+	(pInfo), 0, 0)
+TRACE_CALL(C_GetSlotList, (CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList, CK_ULONG_PTR pulCount),
+	(tokenPresent, pSlotList, pulCount), 0, 0)
+TRACE_CALL(C_GetSlotInfo, (CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo),
+	(slotID, pInfo), slotID, 0)
+TRACE_CALL(C_GetTokenInfo, (CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo),
+	(slotID, pInfo), slotID, 0)
+TRACE_CALL(C_GetMechanismList, (CK_SLOT_ID slotID, CK_MECHANISM_TYPE_PTR pMechanismList, CK_ULONG_PTR pulCount),
+	(slotID, pMechanismList, pulCount), slotID, 0)
+TRACE_CALL(C_GetMechanismInfo, (CK_SLOT_ID slotID, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_PTR pInfo),
+	(slotID, type, pInfo), slotID, fnv_ulong(FNV_BASIS, type))
+TRACE_CALL(C_InitToken, (CK_SLOT_ID slotID, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen, CK_UTF8CHAR_PTR pLabel),
+	(slotID, pPin, ulPinLen, pLabel), slotID, 0)
+TRACE_CALL(C_InitPIN, (CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen),
+	(hSession, pPin, ulPinLen), hSession, 0)
+TRACE_CALL(C_SetPIN, (CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pOldPin, CK_ULONG ulOldLen,
+		CK_UTF8CHAR_PTR pNewPin, CK_ULONG ulNewLen),
+	(hSession, pOldPin, ulOldLen, pNewPin, ulNewLen), hSession, 0)
+TRACE_CALL(C_OpenSession, (CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApplication,
+		CK_NOTIFY Notify, CK_SESSION_HANDLE_PTR phSession),
+	(slotID, flags, pApplication, Notify, phSession), slotID, fnv_ulong(FNV_BASIS, flags))
+TRACE_CALL(C_CloseSession, (CK_SESSION_HANDLE hSession),
+	(hSession), hSession, 0)
+TRACE_CALL(C_CloseAllSessions, (CK_SLOT_ID slotID),
+	(slotID), slotID, 0)
+TRACE_CALL(C_GetSessionInfo, (CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo),
+	(hSession, pInfo), hSession, 0)
+TRACE_CALL(C_GetOperationState, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState,
+		CK_ULONG_PTR pulOperationStateLen),
+	(hSession, pOperationState, pulOperationStateLen), hSession, 0)
+TRACE_CALL(C_SetOperationState, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState,
+		CK_ULONG ulOperationStateLen, CK_OBJECT_HANDLE hEncryptionKey,
+		CK_OBJECT_HANDLE hAuthenticationKey),
+	(hSession, pOperationState, ulOperationStateLen, hEncryptionKey, hAuthenticationKey),
+	hSession, 0)
+/* the PIN is never hashed */
+TRACE_CALL(C_Login, (CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin,
+		CK_ULONG ulPinLen),
+	(hSession, userType, pPin, ulPinLen), hSession, fnv_ulong(FNV_BASIS, userType))
+TRACE_CALL(C_Logout, (CK_SESSION_HANDLE hSession),
+	(hSession), hSession, 0)
+TRACE_CALL(C_CreateObject, (CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount,
+		CK_OBJECT_HANDLE_PTR phObject),
+	(hSession, pTemplate, ulCount, phObject), hSession,
+	hash_template(FNV_BASIS, pTemplate, ulCount))
+TRACE_CALL(C_CopyObject, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phNewObject),
+	(hSession, hObject, pTemplate, ulCount, phNewObject), hSession,
+	hash_template(FNV_BASIS, pTemplate, ulCount))
+TRACE_CALL(C_DestroyObject, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject),
+	(hSession, hObject), hSession, fnv_ulong(FNV_BASIS, hObject))
+TRACE_CALL(C_GetObjectSize, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ULONG_PTR pulSize),
+	(hSession, hObject, pulSize), hSession, fnv_ulong(FNV_BASIS, hObject))
+TRACE_CALL(C_GetAttributeValue, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount),
+	(hSession, hObject, pTemplate, ulCount), hSession,
+	hash_template(fnv_ulong(FNV_BASIS, hObject), pTemplate, ulCount))
+TRACE_CALL(C_SetAttributeValue, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount),
+	(hSession, hObject, pTemplate, ulCount), hSession,
+	hash_template(fnv_ulong(FNV_BASIS, hObject), pTemplate, ulCount))
+TRACE_CALL(C_FindObjectsInit, (CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount),
+	(hSession, pTemplate, ulCount), hSession,
+	hash_template(FNV_BASIS, pTemplate, ulCount))
+TRACE_CALL(C_FindObjects, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject,
+		CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount),
+	(hSession, phObject, ulMaxObjectCount, pulObjectCount), hSession, 0)
+TRACE_CALL(C_FindObjectsFinal, (CK_SESSION_HANDLE hSession),
+	(hSession), hSession, 0)
+TRACE_CALL(C_EncryptInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+	(hSession, pMechanism, hKey), hSession, hash_mechanism(pMechanism))
+TRACE_CALL(C_Encrypt, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen),
+	(hSession, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen), hSession,
+	hash_data(pData, ulDataLen))
+TRACE_CALL(C_EncryptUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen,
+		CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen),
+	(hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen), hSession,
+	hash_data(pPart, ulPartLen))
+TRACE_CALL(C_EncryptFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastEncryptedPart,
+		CK_ULONG_PTR pulLastEncryptedPartLen),
+	(hSession, pLastEncryptedPart, pulLastEncryptedPartLen), hSession, 0)
+TRACE_CALL(C_DecryptInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+	(hSession, pMechanism, hKey), hSession, hash_mechanism(pMechanism))
+TRACE_CALL(C_Decrypt, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen,
+		CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen),
+	(hSession, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen), hSession,
+	hash_data(pEncryptedData, ulEncryptedDataLen))
+TRACE_CALL(C_DecryptUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart,
+		CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen),
+	(hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen), hSession,
+	hash_data(pEncryptedPart, ulEncryptedPartLen))
+TRACE_CALL(C_DecryptFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastPart, CK_ULONG_PTR pulLastPartLen),
+	(hSession, pLastPart, pulLastPartLen), hSession, 0)
+TRACE_CALL(C_DigestInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism),
+	(hSession, pMechanism), hSession, hash_mechanism(pMechanism))
+TRACE_CALL(C_Digest, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen),
+	(hSession, pData, ulDataLen, pDigest, pulDigestLen), hSession,
+	hash_data(pData, ulDataLen))
+TRACE_CALL(C_DigestUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen),
+	(hSession, pPart, ulPartLen), hSession, hash_data(pPart, ulPartLen))
+TRACE_CALL(C_DigestKey, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey),
+	(hSession, hKey), hSession, fnv_ulong(FNV_BASIS, hKey))
+TRACE_CALL(C_DigestFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen),
+	(hSession, pDigest, pulDigestLen), hSession, 0)
+TRACE_CALL(C_SignInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+	(hSession, pMechanism, hKey), hSession, hash_mechanism(pMechanism))
+TRACE_CALL(C_Sign, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen),
+	(hSession, pData, ulDataLen, pSignature, pulSignatureLen), hSession,
+	hash_data(pData, ulDataLen))
+TRACE_CALL(C_SignUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen),
+	(hSession, pPart, ulPartLen), hSession, hash_data(pPart, ulPartLen))
+TRACE_CALL(C_SignFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen),
+	(hSession, pSignature, pulSignatureLen), hSession, 0)
+TRACE_CALL(C_SignRecoverInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey),
+	(hSession, pMechanism, hKey), hSession, hash_mechanism(pMechanism))
+TRACE_CALL(C_SignRecover, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen),
+	(hSession, pData, ulDataLen, pSignature, pulSignatureLen), hSession,
+	hash_data(pData, ulDataLen))
+TRACE_CALL(C_VerifyInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+	(hSession, pMechanism, hKey), hSession, hash_mechanism(pMechanism))
+TRACE_CALL(C_Verify, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen),
+	(hSession, pData, ulDataLen, pSignature, ulSignatureLen), hSession,
+	fnv(hash_data(pData, ulDataLen), pSignature, ulSignatureLen))
+TRACE_CALL(C_VerifyUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen),
+	(hSession, pPart, ulPartLen), hSession, hash_data(pPart, ulPartLen))
+TRACE_CALL(C_VerifyFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen),
+	(hSession, pSignature, ulSignatureLen), hSession, hash_data(pSignature, ulSignatureLen))
+TRACE_CALL(C_VerifyRecoverInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey),
+	(hSession, pMechanism, hKey), hSession, hash_mechanism(pMechanism))
+TRACE_CALL(C_VerifyRecover, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen,
+		CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen),
+	(hSession, pSignature, ulSignatureLen, pData, pulDataLen), hSession,
+	hash_data(pSignature, ulSignatureLen))
+TRACE_CALL(C_DigestEncryptUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen,
+		CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen),
+	(hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen), hSession,
+	hash_data(pPart, ulPartLen))
+TRACE_CALL(C_DecryptDigestUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart,
+		CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen),
+	(hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen), hSession,
+	hash_data(pEncryptedPart, ulEncryptedPartLen))
+TRACE_CALL(C_SignEncryptUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen,
+		CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen),
+	(hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen), hSession,
+	hash_data(pPart, ulPartLen))
+TRACE_CALL(C_DecryptVerifyUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart,
+		CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen),
+	(hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen), hSession,
+	hash_data(pEncryptedPart, ulEncryptedPartLen))
+TRACE_CALL(C_GenerateKey, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phKey),
+	(hSession, pMechanism, pTemplate, ulCount, phKey), hSession,
+	hash_template(hash_mechanism(pMechanism), pTemplate, ulCount))
+TRACE_CALL(C_GenerateKeyPair, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+		CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount,
+		CK_ATTRIBUTE_PTR pPrivateKeyTemplate, CK_ULONG ulPrivateKeyAttributeCount,
+		CK_OBJECT_HANDLE_PTR phPublicKey, CK_OBJECT_HANDLE_PTR phPrivateKey),
+	(hSession, pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount,
+		pPrivateKeyTemplate, ulPrivateKeyAttributeCount, phPublicKey, phPrivateKey),
+	hSession,
+	hash_template(hash_template(hash_mechanism(pMechanism),
+			pPublicKeyTemplate, ulPublicKeyAttributeCount),
+		pPrivateKeyTemplate, ulPrivateKeyAttributeCount))
+TRACE_CALL(C_WrapKey, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hWrappingKey, CK_OBJECT_HANDLE hKey, CK_BYTE_PTR pWrappedKey,
+		CK_ULONG_PTR pulWrappedKeyLen),
+	(hSession, pMechanism, hWrappingKey, hKey, pWrappedKey, pulWrappedKeyLen), hSession,
+	hash_mechanism(pMechanism))
+TRACE_CALL(C_UnwrapKey, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hUnwrappingKey, CK_BYTE_PTR pWrappedKey, CK_ULONG ulWrappedKeyLen,
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey),
+	(hSession, pMechanism, hUnwrappingKey, pWrappedKey, ulWrappedKeyLen,
+		pTemplate, ulAttributeCount, phKey), hSession,
+	hash_template(hash_mechanism(pMechanism), pTemplate, ulAttributeCount))
+TRACE_CALL(C_DeriveKey, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hBaseKey, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount,
+		CK_OBJECT_HANDLE_PTR phKey),
+	(hSession, pMechanism, hBaseKey, pTemplate, ulAttributeCount, phKey), hSession,
+	hash_template(hash_mechanism(pMechanism), pTemplate, ulAttributeCount))
+TRACE_CALL(C_SeedRandom, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSeed, CK_ULONG ulSeedLen),
+	(hSession, pSeed, ulSeedLen), hSession, 0)
+TRACE_CALL(C_GenerateRandom, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR RandomData, CK_ULONG ulRandomLen),
+	(hSession, RandomData, ulRandomLen), hSession, fnv_ulong(FNV_BASIS, ulRandomLen))
+TRACE_CALL(C_GetFunctionStatus, (CK_SESSION_HANDLE hSession),
+	(hSession), hSession, 0)
+TRACE_CALL(C_CancelFunction, (CK_SESSION_HANDLE hSession),
+	(hSession), hSession, 0)
+TRACE_CALL(C_WaitForSlotEvent, (CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, CK_VOID_PTR pReserved),
+	(flags, pSlot, pReserved), (rv == CKR_OK && pSlot != NULL) ? *pSlot : 0, 0)
+
+/* Writes what is left when the spy is unloaded or the process exits
+ * without calling C_Finalize() */
+#if defined(__GNUC__)
+__attribute__((destructor))
+static void
+trace_exit(void)
+{
+	trace_flush();
+}
+#endif
+
+/*
+ * Starts tracing the calls to the module in function list po to the file
+ * at path. On success list is set to the function list to hand out to
+ * the application.
+ */
+CK_RV
+spy_trace_init(const char *path, CK_FUNCTION_LIST_PTR po, CK_FUNCTION_LIST_PTR_PTR list)
+{
+	const char *env;
+	unsigned long long now;
+
+	if (trace_file != NULL) {
+		*list = &trace_list;
+		return CKR_OK;
+	}
+
+	trace_file = fopen(path, "w+b");
+	if (trace_file == NULL)
+		return CKR_GENERAL_ERROR;
+#ifdef _WIN32
+	InitializeCriticalSection(&trace_lock);
+#endif
+
+	ring_size = TRACE_DEFAULT_SIZE;
+	env = getenv("PKCS11SPY_TRACE_SIZE");
+	if (env != NULL)
+		ring_size = strtoul(env, NULL, 0);
+	/* a ring holds whole records and more than one buffer */
+	ring_size -= ring_size % SPY_TRACE_RECORD_SIZE;
+	if (ring_size != 0 && ring_size < sizeof(trace_buffer))
+		ring_size = sizeof(trace_buffer);
+	env = getenv("PKCS11SPY_TRACE_HASH");
+	trace_hashing = env != NULL && atoi(env) != 0;
+
+	memcpy(trace_header, SPY_TRACE_MAGIC, 8);
+	put_u32(trace_header + 8, SPY_TRACE_VERSION);
+	put_u32(trace_header + 12, SPY_TRACE_RECORD_SIZE);
+	put_u64(trace_header + 16, ring_size);
+#ifdef _WIN32
+	put_u32(trace_header + 36, GetCurrentProcessId());
+#else
+	put_u32(trace_header + 36, (unsigned long) getpid());
+#endif
+	now = trace_clock();
+	put_u64(trace_header + 40, wall_clock());
+	put_u64(trace_header + 48, now);
+	fwrite(trace_header, 1, sizeof(trace_header), trace_file);
+	fflush(trace_file);
+
+	real = po;
+	memset(&trace_list, 0, sizeof(trace_list));
+	trace_list.version.major = 2;
+	trace_list.version.minor = 11;
+#define SPY_TRACE_FUNCTION(name) trace_list.name = trace_##name;
+	SPY_TRACE_FUNCTIONS
+#undef SPY_TRACE_FUNCTION
+
+	*list = &trace_list;
+	return CKR_OK;
+}
@@ -0,0 +1,138 @@
+#ifndef PKCS11_SPY_TRACE_H
+#define PKCS11_SPY_TRACE_H
+
+/*
+ * Binary trace format of pkcs11-spy, read by pkcs11-spy-decode
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307,
+ * USA
+ */
+
+/*
+ * A trace file is a header followed by a ring of fixed size records.
+ * All numbers are stored little endian, so that a trace can be decoded
+ * on another machine.
+ *
+ * Header:
+ *    0  magic "P11SPYT1"
+ *    8  u32 format version (1)
+ *   12  u32 record size
+ *   16  u64 size of the ring in bytes (0 when the file just grows)
+ *   24  u64 offset of the next record in the ring
+ *   32  u32 1 when the ring has wrapped, the oldest record is at the offset
+ *   36  u32 process id
+ *   40  u64 wall clock time in microseconds since the epoch ...
+ *   48  u64 ... and the monotonic clock at the same moment
+ *
+ * Record:
+ *    0  u64 monotonic clock in microseconds when the call was made
+ *    8  u64 duration of the call in microseconds
+ *   16  u64 slot or session handle, 0 for the other functions
+ *   24  u32 thread id
+ *   28  u32 return value
+ *   32  u32 FNV-1a hash of the input data, see PKCS11SPY_TRACE_HASH
+ *   36  u16 function id, see below
+ *   38  u16 flags
+ *   40  u32 sequence number of the record
+ *   44  u32 reserved
+ */
+#define SPY_TRACE_MAGIC		"P11SPYT1"
+#define SPY_TRACE_VERSION	1
+#define SPY_TRACE_HEADER_SIZE	64
+#define SPY_TRACE_RECORD_SIZE	48
+
+/* the record has an argument hash */
+#define SPY_TRACE_FLAG_HASH	0x0001
+
+/* The function ids follow CK_FUNCTION_LIST, starting from 1 */
+#define SPY_TRACE_FUNCTIONS \
+	SPY_TRACE_FUNCTION(C_Initialize) \
+	SPY_TRACE_FUNCTION(C_Finalize) \
+	SPY_TRACE_FUNCTION(C_GetInfo) \
+	SPY_TRACE_FUNCTION(C_GetFunctionList) \
+	SPY_TRACE_FUNCTION(C_GetSlotList) \
+	SPY_TRACE_FUNCTION(C_GetSlotInfo) \
+	SPY_TRACE_FUNCTION(C_GetTokenInfo) \
+	SPY_TRACE_FUNCTION(C_GetMechanismList) \
+	SPY_TRACE_FUNCTION(C_GetMechanismInfo) \
+	SPY_TRACE_FUNCTION(C_InitToken) \
+	SPY_TRACE_FUNCTION(C_InitPIN) \
+	SPY_TRACE_FUNCTION(C_SetPIN) \
+	SPY_TRACE_FUNCTION(C_OpenSession) \
+	SPY_TRACE_FUNCTION(C_CloseSession) \
+	SPY_TRACE_FUNCTION(C_CloseAllSessions) \
+	SPY_TRACE_FUNCTION(C_GetSessionInfo) \
+	SPY_TRACE_FUNCTION(C_GetOperationState) \
+	SPY_TRACE_FUNCTION(C_SetOperationState) \
+	SPY_TRACE_FUNCTION(C_Login) \
+	SPY_TRACE_FUNCTION(C_Logout) \
+	SPY_TRACE_FUNCTION(C_CreateObject) \
+	SPY_TRACE_FUNCTION(C_CopyObject) \
+	SPY_TRACE_FUNCTION(C_DestroyObject) \
+	SPY_TRACE_FUNCTION(C_GetObjectSize) \
+	SPY_TRACE_FUNCTION(C_GetAttributeValue) \
+	SPY_TRACE_FUNCTION(C_SetAttributeValue) \
+	SPY_TRACE_FUNCTION(C_FindObjectsInit) \
+	SPY_TRACE_FUNCTION(C_FindObjects) \
+	SPY_TRACE_FUNCTION(C_FindObjectsFinal) \
+	SPY_TRACE_FUNCTION(C_EncryptInit) \
+	SPY_TRACE_FUNCTION(C_Encrypt) \
+	SPY_TRACE_FUNCTION(C_EncryptUpdate) \
+	SPY_TRACE_FUNCTION(C_EncryptFinal) \
+	SPY_TRACE_FUNCTION(C_DecryptInit) \
+	SPY_TRACE_FUNCTION(C_Decrypt) \
+	SPY_TRACE_FUNCTION(C_DecryptUpdate) \
+	SPY_TRACE_FUNCTION(C_DecryptFinal) \
+	SPY_TRACE_FUNCTION(C_DigestInit) \
+	SPY_TRACE_FUNCTION(C_Digest) \
+	SPY_TRACE_FUNCTION(C_DigestUpdate) \
+	SPY_TRACE_FUNCTION(C_DigestKey) \
+	SPY_TRACE_FUNCTION(C_DigestFinal) \
+	SPY_TRACE_FUNCTION(C_SignInit) \
+	SPY_TRACE_FUNCTION(C_Sign) \
+	SPY_TRACE_FUNCTION(C_SignUpdate) \
+	SPY_TRACE_FUNCTION(C_SignFinal) \
+	SPY_TRACE_FUNCTION(C_SignRecoverInit) \
+	SPY_TRACE_FUNCTION(C_SignRecover) \
+	SPY_TRACE_FUNCTION(C_VerifyInit) \
+	SPY_TRACE_FUNCTION(C_Verify) \
+	SPY_TRACE_FUNCTION(C_VerifyUpdate) \
+	SPY_TRACE_FUNCTION(C_VerifyFinal) \
+	SPY_TRACE_FUNCTION(C_VerifyRecoverInit) \
+	SPY_TRACE_FUNCTION(C_VerifyRecover) \
+	SPY_TRACE_FUNCTION(C_DigestEncryptUpdate) \
+	SPY_TRACE_FUNCTION(C_DecryptDigestUpdate) \
+	SPY_TRACE_FUNCTION(C_SignEncryptUpdate) \
+	SPY_TRACE_FUNCTION(C_DecryptVerifyUpdate) \
+	SPY_TRACE_FUNCTION(C_GenerateKey) \
+	SPY_TRACE_FUNCTION(C_GenerateKeyPair) \
+	SPY_TRACE_FUNCTION(C_WrapKey) \
+	SPY_TRACE_FUNCTION(C_UnwrapKey) \
+	SPY_TRACE_FUNCTION(C_DeriveKey) \
+	SPY_TRACE_FUNCTION(C_SeedRandom) \
+	SPY_TRACE_FUNCTION(C_GenerateRandom) \
+	SPY_TRACE_FUNCTION(C_GetFunctionStatus) \
+	SPY_TRACE_FUNCTION(C_CancelFunction) \
+	SPY_TRACE_FUNCTION(C_WaitForSlotEvent)
+
+enum {
+	SPY_TRACE_NONE = 0,
+#define SPY_TRACE_FUNCTION(name) SPY_TRACE_##name,
+	SPY_TRACE_FUNCTIONS
+#undef SPY_TRACE_FUNCTION
+	SPY_TRACE_FUNCTION_COUNT
+};
+
+#endif
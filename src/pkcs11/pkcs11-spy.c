@@ -38,6 +38,8 @@
 
 extern void *C_LoadModule(const char *name, CK_FUNCTION_LIST_PTR_PTR);
 extern CK_RV C_UnloadModule(void *module);
+extern CK_RV spy_trace_init(const char *path, CK_FUNCTION_LIST_PTR po,
+		CK_FUNCTION_LIST_PTR_PTR list);
 
 /* Declare all spy_* Cryptoki function */
 
@@ -49,12 +51,14 @@ static CK_FUNCTION_LIST_PTR po = NULL;
 static void *modhandle = NULL;
 /* Spy module output */
 static FILE *spy_output = NULL;
+/* Function list of the binary trace mode, see pkcs11-spy-trace.c */
+static CK_FUNCTION_LIST_PTR trace_list = NULL;
 
 /* Inits the spy. If successfull, po != NULL */
 static CK_RV
 init_spy(void)
 {
-	const char *output, *module;
+	const char *output, *module, *trace;
 	int rv = CKR_OK;
 #ifdef _WIN32
         char temp_path[PATH_MAX], expanded_path[PATH_MAX];
@@ -228,7 +232,18 @@ init_spy(void)
 	else {
 		po = NULL;
 		free(pkcs11_spy);
-		rv = CKR_GENERAL_ERROR;
+		return CKR_GENERAL_ERROR;
+	}
+
+	/* Binary trace instead of the text output, for the calls made
+	 * through the function list */
+	trace = getenv("PKCS11SPY_TRACE");
+	if (trace != NULL) {
+		if (spy_trace_init(trace, po, &trace_list) == CKR_OK)
+			fprintf(spy_output, "Binary trace: \"%s\"\n", trace);
+		else
+			fprintf(spy_output, "Error: cannot write the trace to \"%s\"\n", trace);
+		fflush(spy_output);
 	}
 
 	return rv;
@@ -347,6 +362,9 @@ CK_RV C_GetFunctionList
 			return rv;
 	}
 
+	if (trace_list != NULL)
+		return trace_list->C_GetFunctionList(ppFunctionList);
+
 	enter("C_GetFunctionList");
 	*ppFunctionList = pkcs11_spy;
 	return retne(CKR_OK);
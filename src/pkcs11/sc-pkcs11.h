@@ -82,6 +82,7 @@ struct sc_pkcs11_config {
 	unsigned int create_puk_slot;
 	unsigned int zero_ckaid_for_ca_certs;
 	unsigned int create_slots_flags;
+	unsigned int detect_workers;
 };
 
 /*
@@ -130,12 +131,33 @@ struct sc_pkcs11_object {
 	CK_OBJECT_HANDLE handle;
 	int flags;
 	struct sc_pkcs11_object_ops *ops;
+	/* public key decoded for software verification, see openssl.c */
+	void *verify_key;
 };
 
 #define SC_PKCS11_OBJECT_SEEN	0x0001
 #define SC_PKCS11_OBJECT_HIDDEN	0x0002
 #define SC_PKCS11_OBJECT_RECURS	0x8000
 
+/*
+ * Index of the slot objects by the value of one attribute.
+ * Chains keep the order of the objects in the slot list.
+ */
+#define SC_PKCS11_INDEX_BUCKETS	64
+
+struct sc_pkcs11_index_entry {
+	struct sc_pkcs11_object *object;
+	CK_ULONG len;
+	unsigned char *value;
+	struct sc_pkcs11_index_entry *next;
+};
+
+struct sc_pkcs11_index_table {
+	CK_ATTRIBUTE_TYPE type;
+	int valid;
+	struct sc_pkcs11_index_entry *buckets[SC_PKCS11_INDEX_BUCKETS];
+};
+
 
 /*
  * PKCS#11 smart card Framework abstraction
@@ -201,6 +223,10 @@ struct sc_pkcs11_card {
 	/* List of supported mechanisms */
 	struct sc_pkcs11_mechanism_type **mechanisms;
 	unsigned int nmechanisms;
+
+	void *lock;			/* Held across card I/O, see sc_pkcs11_lock_card() */
+	unsigned int refs;		/* Users waiting for or holding the card lock */
+	int removed;			/* Card is gone, release when no longer referenced */
 };
 
 struct sc_pkcs11_slot {
@@ -213,6 +239,7 @@ struct sc_pkcs11_slot {
 	unsigned int events;		/* Card events SC_EVENT_CARD_{INSERTED,REMOVED} */
 	void *fw_data;			/* Framework specific data */  /* TODO: get know how it used */
 	list_t objects;			/* Objects in this slot */
+	struct sc_pkcs11_index_table *object_index;	/* Lazily built attribute index of objects */
 	unsigned int nsessions;		/* Number of sessions using this slot */
 	sc_timestamp_t slot_state_expires;
 
@@ -312,6 +339,11 @@ struct sc_pkcs11_session {
 	CK_VOID_PTR notify_data;
 	/* Active operations - one per type */
 	struct sc_pkcs11_operation *operation[SC_PKCS11_OPERATION_MAX];
+	/* Card this session was opened on */
+	struct sc_pkcs11_card *card;
+	/* Users of this session not holding the global lock */
+	unsigned int refs;
+	int closed;
 };
 typedef struct sc_pkcs11_session sc_pkcs11_session_t;
 
@@ -336,15 +368,21 @@ void sc_pkcs11_print_attrs(int level, const char *file, unsigned int line, const
 
 /* Slot and card handling functions */
 CK_RV card_removed(sc_reader_t *reader);
+void card_release(struct sc_pkcs11_card *p11card);
 CK_RV card_detect_all(void);
 CK_RV create_slot(sc_reader_t *reader);
 CK_RV initialize_reader(sc_reader_t *reader);
 CK_RV card_detect(sc_reader_t *reader);
+CK_RV card_detect_presence(sc_reader_t *reader);
 CK_RV slot_get_slot(CK_SLOT_ID id, struct sc_pkcs11_slot **);
 CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot **);
+int slot_token_pending(struct sc_pkcs11_slot *slot);
 CK_RV slot_token_removed(CK_SLOT_ID id);
 CK_RV slot_allocate(struct sc_pkcs11_slot **, struct sc_pkcs11_card *);
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask);
+CK_RV slot_index_lookup(struct sc_pkcs11_session *, CK_ATTRIBUTE_PTR, CK_ULONG,
+		CK_ATTRIBUTE_PTR *, struct sc_pkcs11_index_entry **);
+void slot_index_invalidate(struct sc_pkcs11_slot *);
 
 /* Session manipulation */
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session ** session);
@@ -355,6 +393,7 @@ CK_RV session_get_operation(struct sc_pkcs11_session *, int,
 			struct sc_pkcs11_operation **);
 CK_RV session_stop_operation(struct sc_pkcs11_session *, int);
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID);
+void sc_pkcs11_logout_slot(struct sc_pkcs11_slot *);
 
 /* Generic secret key stuff */
 CK_RV sc_pkcs11_create_secret_key(struct sc_pkcs11_session *,
@@ -416,11 +455,12 @@ CK_RV sc_pkcs11_register_sign_and_hash_mechanism(struct sc_pkcs11_card *,
 				sc_pkcs11_mechanism_type_t *);
 
 #ifdef ENABLE_OPENSSL
-CK_RV sc_pkcs11_verify_data(const unsigned char *pubkey, int pubkey_len,
-	const unsigned char *pubkey_params, int pubkey_params_len,
+CK_RV sc_pkcs11_verify_data(struct sc_pkcs11_session *session,
+	struct sc_pkcs11_object *key,
 	CK_MECHANISM_TYPE mech, sc_pkcs11_operation_t *md,
 	unsigned char *inp, int inp_len,
 	unsigned char *signat, int signat_len);
+void sc_pkcs11_release_verify_key(struct sc_pkcs11_object *key);
 #endif
 
 /* Load configuration defaults */
@@ -431,6 +471,14 @@ CK_RV sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR);
 CK_RV sc_pkcs11_lock(void);
 void sc_pkcs11_unlock(void);
 void sc_pkcs11_free_lock(void);
+CK_RV sc_pkcs11_init_card_lock(struct sc_pkcs11_card *);
+void sc_pkcs11_lock_card(struct sc_pkcs11_card *);
+void sc_pkcs11_unlock_card(struct sc_pkcs11_card *);
+void sc_pkcs11_free_card_lock(struct sc_pkcs11_card *);
+CK_RV sc_pkcs11_pin_card(struct sc_pkcs11_card *);
+void sc_pkcs11_unpin_card(struct sc_pkcs11_card *);
+CK_RV sc_pkcs11_lock_session(CK_SESSION_HANDLE, struct sc_pkcs11_session **);
+void sc_pkcs11_unlock_session(struct sc_pkcs11_session *);
 
 #ifdef __cplusplus
 }
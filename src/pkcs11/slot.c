@@ -26,6 +26,10 @@
 
 #include "sc-pkcs11.h"
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 static struct sc_pkcs11_framework_ops *frameworks[] = {
 	&framework_pkcs15,
 #ifdef USE_PKCS15_INIT
@@ -101,7 +105,8 @@ CK_RV create_slot(sc_reader_t *reader)
 }
 
 
-/* create slots associated with a reader, called whenever a reader is seen. */
+/* create slots associated with a reader, called whenever a reader is seen.
+ * The card in it is left to card_detect_all(). */
 CK_RV initialize_reader(sc_reader_t *reader)
 {
 	unsigned int i;
@@ -128,62 +133,113 @@ CK_RV initialize_reader(sc_reader_t *reader)
 			return rv;
 	}
 
-	if (sc_detect_card_presence(reader)) {
-		card_detect(reader);
-	}
-
 	return CKR_OK;
 }
 
 
 CK_RV card_removed(sc_reader_t * reader)
 {
-	unsigned int i;
+	unsigned int i, nslots = 0;
 	struct sc_pkcs11_card *card = NULL;
+	struct sc_pkcs11_slot **slots = NULL;
+	CK_RV rv;
 	/* Mark all slots as "token not present" */
 	sc_log(context, "%s: card removed", reader->name);
 
+	/* Locate the "card" object */
+	for (i=0; i < list_size(&virtual_slots); i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+		if (slot->reader == reader && slot->card) {
+			card = slot->card;
+			break;
+		}
+	}
+
+	if (card) {
+		slots = calloc(list_size(&virtual_slots), sizeof(*slots));
+		if (slots == NULL)
+			return CKR_HOST_MEMORY;
+		for (i=0; i < list_size(&virtual_slots); i++) {
+			sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+			if (slot->card == card)
+				slots[nslots++] = slot;
+		}
+
+		/* Wait for the operations in progress on this card without
+		 * holding the global lock, and log out meanwhile */
+		card->refs++;
+		sc_pkcs11_unlock();
+		sc_pkcs11_lock_card(card);
+		if (!card->removed)
+			for (i=0; i < nslots; i++)
+				sc_pkcs11_logout_slot(slots[i]);
+		free(slots);
+
+		rv = sc_pkcs11_lock();
+		if (rv != CKR_OK) {
+			sc_pkcs11_unlock_card(card);
+			return rv;
+		}
+		card->refs--;
+		if (card->removed) {
+			/* Another thread released it while we were waiting */
+			sc_pkcs11_unlock_card(card);
+			card_release(card);
+			return CKR_OK;
+		}
+	}
 
 	for (i=0; i < list_size(&virtual_slots); i++) {
 		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
-		if (slot->reader == reader) {
-			/* Save the "card" object */
-			if (slot->card)
-				card = slot->card;
+		if (slot->reader == reader)
 			slot_token_removed(slot->id);
-		}
 	}
 
+	/* Disconnect before the global lock is released, so that nobody
+	 * connects to the reader meanwhile */
 	if (card) {
 		card->framework->unbind(card);
 		sc_disconnect_card(card->card);
-		/* FIXME: free mechanisms
-		 * spaces allocated by the
-		 * sc_pkcs11_register_sign_and_hash_mechanism
-		 * and sc_pkcs11_new_fw_mechanism.
-		 * but see sc_pkcs11_register_generic_mechanisms
-		for (i=0; i < card->nmechanisms; ++i) {
-			// if 'mech_data' is a pointer earlier returned by the ?alloc
-			free(card->mechanisms[i]->mech_data);
-			// if 'mechanisms[i]' is a pointer earlier returned by the ?alloc
-			free(card->mechanisms[i]);
-		}
-		*/
-		free(card->mechanisms);
-		free(card);
+		card->card = NULL;
+		card->removed = 1;
+		sc_pkcs11_unlock_card(card);
+		card_release(card);
 	}
 
 	return CKR_OK;
 }
 
 
-CK_RV card_detect(sc_reader_t *reader)
+/* Free a removed card once nobody is waiting for its lock any more.
+ * Called with the global lock held. */
+void card_release(struct sc_pkcs11_card *card)
 {
-	struct sc_pkcs11_card *p11card = NULL;
-	int rc, rv;
-	unsigned int i, j;
+	if (!card->removed || card->refs > 0)
+		return;
+
+	/* FIXME: free mechanisms
+	 * spaces allocated by the
+	 * sc_pkcs11_register_sign_and_hash_mechanism
+	 * and sc_pkcs11_new_fw_mechanism.
+	 * but see sc_pkcs11_register_generic_mechanisms
+	for (i=0; i < card->nmechanisms; ++i) {
+		// if 'mech_data' is a pointer earlier returned by the ?alloc
+		free(card->mechanisms[i]->mech_data);
+		// if 'mechanisms[i]' is a pointer earlier returned by the ?alloc
+		free(card->mechanisms[i]);
+	}
+	*/
+	free(card->mechanisms);
+	sc_pkcs11_free_card_lock(card);
+	free(card);
+}
 
-	rv = CKR_OK;
+
+/* Handles card insertion/removal in the reader. Returns CKR_OK if a card
+ * is present; touches the global slot and session lists. */
+CK_RV card_detect_presence(sc_reader_t *reader)
+{
+	int rc;
 
 	sc_log(context, "%s: Detecting smart card", reader->name);
 	/* Check if someone inserted a card */
@@ -211,6 +267,41 @@ again:
 		goto again;
 	}
 
+	return CKR_OK;
+}
+
+/* Frees a card that card_detect_token() created, if none of its tokens
+ * made it to a slot */
+static void card_drop_unused(struct sc_pkcs11_card *p11card, struct sc_pkcs11_framework_ops *framework)
+{
+	unsigned int i;
+
+	for (i=0; i<list_size(&virtual_slots); i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+		if (slot->card == p11card)
+			return;
+	}
+
+	sc_log(context, "%s: releasing the card", p11card->reader->name);
+	if (framework)
+		framework->unbind(p11card);
+	if (p11card->card)
+		sc_disconnect_card(p11card->card);
+	free(p11card->mechanisms);
+	sc_pkcs11_free_card_lock(p11card);
+	free(p11card);
+}
+
+/* Connects to the card in the reader and creates its tokens. Only touches
+ * the slots of this reader, so it may run for several readers at once. */
+static CK_RV card_detect_token(sc_reader_t *reader)
+{
+	struct sc_pkcs11_card *p11card = NULL;
+	int rc, rv, created = 0;
+	unsigned int i, j;
+
+	rv = CKR_OK;
+
 	/* Locate a slot related to the reader */
 	for (i=0; i<list_size(&virtual_slots); i++) {
 		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
@@ -227,13 +318,23 @@ again:
 		if (!p11card)
 			return CKR_HOST_MEMORY;
 		p11card->reader = reader;
+		rv = sc_pkcs11_init_card_lock(p11card);
+		if (rv != CKR_OK) {
+			free(p11card);
+			return rv;
+		}
+		created = 1;
 	}
 
 	if (p11card->card == NULL) {
 		sc_log(context, "%s: Connecting ... ", reader->name);
 		rc = sc_connect_card(reader, &p11card->card);
-		if (rc != SC_SUCCESS)
+		if (rc != SC_SUCCESS) {
+			p11card->card = NULL;
+			if (created)
+				card_drop_unused(p11card, NULL);
 			return sc_to_cryptoki_error(rc, NULL);
+		}
 	}
 
 	/* Detect the framework */
@@ -241,6 +342,15 @@ again:
 		struct sc_app_info *app_generic = sc_pkcs15_get_application_by_type(p11card->card, "generic");
 		struct sc_pkcs11_slot *first_slot = NULL;
 
+		/* Slots of a partially bound card may already be in use. Their
+		 * users may be waiting for the global lock held by our caller,
+		 * so leave the card alone until they are done */
+		if (p11card->refs > 0) {
+			sc_log(context, "%s: card busy, binding later", reader->name);
+			return CKR_OK;
+		}
+		sc_pkcs11_lock_card(p11card);
+
 		sc_log(context, "%s: Detecting Framework. %i on-card applications", reader->name, p11card->card->app_count);
 		sc_log(context, "%s: generic application %s", reader->name, app_generic ? app_generic->label : "<none>");
 
@@ -248,8 +358,10 @@ again:
 			if (frameworks[i]->bind != NULL)
 				break;
 		/*TODO: only first framework is used: pkcs15init framework is not reachable here */
-		if (frameworks[i] == NULL)
-			return CKR_GENERAL_ERROR;
+		if (frameworks[i] == NULL) {
+			rv = CKR_GENERAL_ERROR;
+			goto out_unlock;
+		}
 
 		/* Initialize framework */
 		sc_log(context, "%s: Detected framework %d. Creating tokens.", reader->name, i);
@@ -259,14 +371,14 @@ again:
 			rv = frameworks[i]->bind(p11card, app_generic);
 			if (rv != CKR_OK)   {
 				sc_log(context, "%s: cannot bind 'generic' token.", reader->name);
-				return rv;
+				goto out_unlock;
 			}
 
 			sc_log(context, "%s: Creating 'generic' token.", reader->name);
 			rv = frameworks[i]->create_tokens(p11card, app_generic, &first_slot);
 			if (rv != CKR_OK)   {
 				sc_log(context, "%s: cannot create 'generic' token.", reader->name);
-				return rv;
+				goto out_unlock;
 			}
 		}
 
@@ -289,27 +401,149 @@ again:
 			rv = frameworks[i]->create_tokens(p11card, app_info, &first_slot);
 			if (rv != CKR_OK)   {
 				sc_log(context, "%s: cannot create %s token.", reader->name, app_name);
-				return rv;
+				goto out_unlock;
 			}
 		}
 
 		p11card->framework = frameworks[i];
+		rv = CKR_OK;
+out_unlock:
+		sc_pkcs11_unlock_card(p11card);
+		/* e.g. none of its applications could be bound */
+		if (created)
+			card_drop_unused(p11card, frameworks[i]);
+		if (rv != CKR_OK)
+			return rv;
 	}
 	sc_log(context, "%s: Detection ended", reader->name);
 	return CKR_OK;
 }
 
+CK_RV card_detect(sc_reader_t *reader)
+{
+	CK_RV rv;
+
+	rv = card_detect_presence(reader);
+	if (rv != CKR_OK)
+		return rv;
+	return card_detect_token(reader);
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * Parallel detection
+ *
+ * Connecting to a card and binding its applications takes many APDUs.
+ * card_detect_all() handles insertion and removal for each reader first,
+ * then lets a small pool of threads connect and bind the cards, one reader
+ * per task. Each reader only fills its own slots, which initialize_reader()
+ * created beforehand in reader order, so the slot list comes out the same
+ * as with sequential detection.
+ */
+struct detect_pool {
+	pthread_mutex_t lock;
+	sc_reader_t **readers;
+	CK_RV *results;
+	unsigned int count, next;
+};
+
+static void *detect_worker(void *arg)
+{
+	struct detect_pool *pool = (struct detect_pool *) arg;
+	unsigned int i;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next < pool->count ? pool->next++ : pool->count;
+		pthread_mutex_unlock(&pool->lock);
+		if (i == pool->count)
+			break;
+		pool->results[i] = card_detect_token(pool->readers[i]);
+	}
+	return NULL;
+}
+
+/* Runs card_detect_token() for the readers, leaving the result for each
+ * in results[]; returns 0 if no threads were used */
+static unsigned int detect_tokens_parallel(sc_reader_t **readers, CK_RV *results, unsigned int count)
+{
+	struct detect_pool pool;
+	pthread_t *threads;
+	unsigned int i, nthreads = sc_pkcs11_conf.detect_workers;
+
+	if (nthreads > count)
+		nthreads = count;
+	if (nthreads < 2)
+		return 0;
+	/* The calling thread is one of the workers */
+	threads = calloc(nthreads - 1, sizeof(pthread_t));
+	if (threads == NULL)
+		return 0;
+
+	pool.readers = readers;
+	pool.results = results;
+	pool.count = count;
+	pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+
+	for (i = 0; i < nthreads - 1; i++)
+		if (pthread_create(&threads[i], NULL, detect_worker, &pool) != 0)
+			break;
+	nthreads = i;
+	sc_log(context, "Detecting cards in %u readers with %u threads", count, nthreads + 1);
+	detect_worker(&pool);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&pool.lock);
+	free(threads);
+	return nthreads + 1;
+}
+#endif
+
+/* A card that can not be used leaves its slot empty, it does not fail the
+ * detection of the others; only running out of memory is reported */
 CK_RV card_detect_all(void) {
-	 unsigned int i;
-
-	 /* Detect cards in all initialized readers */
-	 for (i=0; i< sc_ctx_get_reader_count(context); i++) {
-		 sc_reader_t *reader = sc_ctx_get_reader(context, i);
-		 if (!reader_get_slot(reader))
-			 initialize_reader(reader);
-		 card_detect(sc_ctx_get_reader(context, i));
-	 }
-	 return CKR_OK;
+	sc_reader_t **present;
+	CK_RV *results, rv = CKR_OK;
+	unsigned int i, count = 0, nreaders;
+
+	nreaders = sc_ctx_get_reader_count(context);
+	present = calloc(nreaders ? nreaders : 1, sizeof(sc_reader_t *));
+	results = calloc(nreaders ? nreaders : 1, sizeof(CK_RV));
+	if (present == NULL || results == NULL) {
+		free(present);
+		free(results);
+		return CKR_HOST_MEMORY;
+	}
+
+	/* Detect cards in all initialized readers */
+	for (i=0; i< nreaders; i++) {
+		sc_reader_t *reader = sc_ctx_get_reader(context, i);
+		if (!reader_get_slot(reader))
+			initialize_reader(reader);
+		if (card_detect_presence(reader) == CKR_OK)
+			present[count++] = reader;
+	}
+
+	/* Connect and bind the present cards */
+#ifdef HAVE_PTHREAD
+	if (count < 2 || !detect_tokens_parallel(present, results, count))
+#endif
+		for (i = 0; i < count; i++)
+			results[i] = card_detect_token(present[i]);
+
+	for (i = 0; i < count; i++) {
+		if (results[i] == CKR_OK)
+			continue;
+		sc_log(context, "%s: no token, CKR 0x%lX", present[i]->name, results[i]);
+		if (results[i] == CKR_HOST_MEMORY)
+			rv = CKR_HOST_MEMORY;
+	}
+
+	free(results);
+	free(present);
+	return rv;
 }
 
 /* Allocates an existing slot to a card */
@@ -368,6 +602,15 @@ CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot ** slot)
 	return CKR_OK;
 }
 
+/* Tells whether the slot gets a token once the card in its reader is
+ * connected and bound, which C_GetSlotInfo() leaves to slot_get_token() */
+int slot_token_pending(struct sc_pkcs11_slot *slot)
+{
+	return slot->card == NULL && slot->reader != NULL
+		&& (slot->reader->flags & SC_READER_CARD_PRESENT)
+		&& reader_get_slot(slot->reader) == slot;
+}
+
 CK_RV slot_token_removed(CK_SLOT_ID id)
 {
 	int rv, token_was_present;
@@ -384,6 +627,7 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	/* Terminate active sessions */
 	sc_pkcs11_close_all_sessions(id);
 
+	slot_index_invalidate(slot);
 	while ((object = list_fetch(&slot->objects))) {
 		if (object->ops->release)
 			object->ops->release(object);
@@ -432,3 +676,156 @@ CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 	}
 	LOG_FUNC_RETURN(context, CKR_NO_EVENT);
 }
+
+/*
+ * Object index
+ *
+ * Applications search the same few attributes over and over again. The
+ * first search on one of them builds a hash table over the slot objects
+ * so that following searches only look at the objects that share the
+ * value. Tables are dropped whenever objects are added or removed, or
+ * the login state changes what the objects report.
+ */
+
+/* Indexed attributes, in the order searches pick them. The serial
+ * number and the issuer come from the certificates, which are only read
+ * from the card when first asked for, so their tables are built by the
+ * first search that has neither an ID nor a label to go by. */
+static const CK_ATTRIBUTE_TYPE index_types[] = {
+	CKA_ID, CKA_LABEL, CKA_SERIAL_NUMBER, CKA_ISSUER, CKA_CLASS
+};
+#define INDEX_TYPES	(sizeof(index_types) / sizeof(index_types[0]))
+
+static unsigned int index_hash(const unsigned char *value, CK_ULONG len)
+{
+	unsigned int hash = 2166136261U;
+	CK_ULONG i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ value[i]) * 16777619U;
+	return hash % SC_PKCS11_INDEX_BUCKETS;
+}
+
+static void index_table_clear(struct sc_pkcs11_index_table *table)
+{
+	struct sc_pkcs11_index_entry *entry;
+	unsigned int i;
+
+	for (i = 0; i < SC_PKCS11_INDEX_BUCKETS; i++) {
+		while ((entry = table->buckets[i]) != NULL) {
+			table->buckets[i] = entry->next;
+			free(entry);
+		}
+	}
+	table->valid = 0;
+}
+
+static CK_RV index_table_build(struct sc_pkcs11_session *session, struct sc_pkcs11_index_table *table)
+{
+	struct sc_pkcs11_slot *slot = session->slot;
+	struct sc_pkcs11_index_entry *tail[SC_PKCS11_INDEX_BUCKETS];
+	struct sc_pkcs11_index_entry *entry;
+	struct sc_pkcs11_object *object;
+	CK_ATTRIBUTE attr;
+	unsigned int i, bucket;
+
+	memset(tail, 0, sizeof(tail));
+	for (i = 0; i < list_size(&slot->objects); i++) {
+		object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, i);
+
+		attr.type = table->type;
+		attr.pValue = NULL;
+		attr.ulValueLen = 0;
+		if (object->ops->get_attribute(session, object, &attr) != CKR_OK
+				|| attr.ulValueLen == (CK_ULONG) -1)
+			continue;
+
+		entry = calloc(1, sizeof(*entry) + attr.ulValueLen);
+		if (entry == NULL) {
+			index_table_clear(table);
+			return CKR_HOST_MEMORY;
+		}
+		entry->object = object;
+		entry->value = (unsigned char *)(entry + 1);
+		attr.pValue = entry->value;
+		if (object->ops->get_attribute(session, object, &attr) != CKR_OK) {
+			free(entry);
+			continue;
+		}
+		entry->len = attr.ulValueLen;
+
+		bucket = index_hash(entry->value, entry->len);
+		if (tail[bucket] != NULL)
+			tail[bucket]->next = entry;
+		else
+			table->buckets[bucket] = entry;
+		tail[bucket] = entry;
+	}
+
+	table->valid = 1;
+	sc_log(context, "Slot 0x%lx: built index of attribute 0x%lx over %d objects",
+			slot->id, table->type, list_size(&slot->objects));
+	return CKR_OK;
+}
+
+/*
+ * Find the index chain for a search template.
+ * On return *key points to the template attribute the chain was
+ * selected by, or is NULL if the template has no indexed attribute and
+ * the caller has to look at all objects. Entries of the chain still need
+ * to be compared with *key, as different values share a bucket.
+ */
+CK_RV slot_index_lookup(struct sc_pkcs11_session *session,
+		CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount,
+		CK_ATTRIBUTE_PTR *key, struct sc_pkcs11_index_entry **chain)
+{
+	struct sc_pkcs11_slot *slot = session->slot;
+	struct sc_pkcs11_index_table *table;
+	CK_ULONG i, t;
+	CK_RV rv;
+
+	*key = NULL;
+	*chain = NULL;
+
+	for (t = 0; t < INDEX_TYPES; t++) {
+		for (i = 0; i < ulCount; i++)
+			if (pTemplate[i].type == index_types[t]
+					&& (pTemplate[i].pValue != NULL || pTemplate[i].ulValueLen == 0))
+				break;
+		if (i < ulCount)
+			break;
+	}
+	if (t == INDEX_TYPES)
+		return CKR_OK;
+	*key = &pTemplate[i];
+
+	if (slot->object_index == NULL) {
+		slot->object_index = calloc(INDEX_TYPES, sizeof(struct sc_pkcs11_index_table));
+		if (slot->object_index == NULL)
+			return CKR_HOST_MEMORY;
+		for (i = 0; i < INDEX_TYPES; i++)
+			slot->object_index[i].type = index_types[i];
+	}
+
+	table = &slot->object_index[t];
+	if (!table->valid) {
+		rv = index_table_build(session, table);
+		if (rv != CKR_OK)
+			return rv;
+	}
+
+	*chain = table->buckets[index_hash((*key)->pValue, (*key)->ulValueLen)];
+	return CKR_OK;
+}
+
+void slot_index_invalidate(struct sc_pkcs11_slot *slot)
+{
+	unsigned int i;
+
+	if (slot->object_index == NULL)
+		return;
+	for (i = 0; i < INDEX_TYPES; i++)
+		index_table_clear(&slot->object_index[i]);
+	free(slot->object_index);
+	slot->object_index = NULL;
+}
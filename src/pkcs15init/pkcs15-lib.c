@@ -2564,6 +2564,11 @@ sc_pkcs15init_update_tokeninfo(struct sc_pkcs15_card *p15card, struct sc_profile
 	int		r;
 
 	LOG_FUNC_CALLED(p15card->card->ctx);
+	/* The TokenInfo read at bind time is not the key of this content */
+	free(p15card->snapshot_key);
+	p15card->snapshot_key = NULL;
+	p15card->snapshot_key_len = 0;
+
 	/* set lastUpdate field */
 	if (p15card->tokeninfo->last_update.gtime != NULL)
 		free(p15card->tokeninfo->last_update.gtime);
@@ -2651,6 +2656,125 @@ sc_pkcs15init_update_odf(struct sc_pkcs15_card *p15card, struct sc_profile *prof
 	LOG_FUNC_RETURN(ctx, r);
 }
 
+/*
+ * Rewrite a DF on the card, but only the byte ranges that differ from its
+ * current content. The image last read or written tells how much to look
+ * at; the card may have been changed since by another application, so
+ * the DF is read again under the card lock and the new content is diffed
+ * against that. If it can not be read, the whole DF is rewritten.
+ * Nearby ranges are merged, since an extra APDU costs more than a few
+ * unchanged bytes.
+ * The tail that held the old content is zeroed out if the DF shrank.
+ */
+#define DF_UPDATE_MERGE_GAP	16
+
+static int
+sc_pkcs15init_update_df_image(struct sc_profile *profile,
+		struct sc_pkcs15_card *p15card, struct sc_file *file,
+		struct sc_pkcs15_df *df, const unsigned char *data, size_t datalen)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_card	*card = p15card->card;
+	struct sc_file	*selected_file = NULL;
+	unsigned char	*image = NULL, *current = NULL;
+	size_t		image_len, current_len = 0, offs, end, next, written = 0;
+	int		r, authenticated = 0;
+
+	LOG_FUNC_CALLED(ctx);
+
+	r = sc_lock(card);
+	LOG_TEST_RET(ctx, r, "Failed to lock card");
+
+	r = sc_select_file(card, &file->path, &selected_file);
+	if (r < 0) {
+		sc_log(ctx, "Failed to select file");
+		goto err;
+	}
+
+	if (selected_file->size < datalen) {
+		sc_log(ctx, "File %s too small (require %u, have %u)",
+				sc_print_path(&file->path), (unsigned) datalen, selected_file->size);
+		sc_file_free(selected_file);
+		r = SC_ERROR_FILE_TOO_SMALL;
+		goto err;
+	}
+
+	image_len = datalen > df->image_len ? datalen : df->image_len;
+	if (image_len > selected_file->size)
+		image_len = selected_file->size;
+	sc_file_free(selected_file);
+
+	image = calloc(1, image_len ? image_len : 1);
+	current = malloc(image_len ? image_len : 1);
+	if (image == NULL || current == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	memcpy(image, data, datalen);
+
+	if (image_len) {
+		r = sc_read_binary(card, 0, current, image_len, 0);
+		if (r == (int) image_len)
+			current_len = image_len;
+		else
+			sc_log(ctx, "Cannot read back DF %s, rewriting it", sc_print_path(&file->path));
+		if (current_len && (df->image_len > image_len
+				|| memcmp(current, df->image, df->image_len)))
+			sc_log(ctx, "DF %s was changed on the card", sc_print_path(&file->path));
+	}
+
+	for (offs = 0; offs < image_len; offs = end) {
+		/* skip the bytes already on the card */
+		while (offs < current_len && image[offs] == current[offs])
+			offs++;
+		if (offs == image_len)
+			break;
+
+		/* extend the range up to the next run of unchanged bytes long enough */
+		for (end = offs + 1; end < image_len; end = next) {
+			if (end >= current_len || image[end] != current[end]) {
+				next = end + 1;
+				continue;
+			}
+			for (next = end; next < current_len && image[next] == current[next]; next++)
+				;
+			if (next - end >= DF_UPDATE_MERGE_GAP || next == image_len)
+				break;
+		}
+
+		if (!authenticated) {
+			r = sc_pkcs15init_authenticate(profile, p15card, file, SC_AC_OP_UPDATE);
+			if (r < 0)
+				goto err;
+			authenticated = 1;
+		}
+
+		r = sc_update_binary(card, offs, image + offs, end - offs, 0);
+		if (r < 0)
+			goto err;
+		written += end - offs;
+	}
+	sc_unlock(card);
+
+	sc_log(ctx, "DF %s: %u of %u bytes updated", sc_print_path(&file->path),
+			(unsigned) written, (unsigned) image_len);
+	free(current);
+	free(df->image);
+	df->image = image;
+	df->image_len = image_len;
+	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+
+err:
+	sc_unlock(card);
+	/* the content on the card is not known anymore */
+	free(current);
+	free(image);
+	free(df->image);
+	df->image = NULL;
+	df->image_len = 0;
+	LOG_FUNC_RETURN(ctx, r);
+}
+
 /*
  * Update any PKCS15 DF file (except ODF and DIR)
  */
@@ -2674,7 +2798,22 @@ sc_pkcs15init_update_any_df(struct sc_pkcs15_card *p15card,
 
 	r = sc_pkcs15_encode_df(card->ctx, p15card, df, &buf, &bufsize);
 	if (r >= 0) {
-		r = sc_pkcs15init_update_file(profile, p15card, file, buf, bufsize);
+		/* A cached image may not match the card */
+		if (df->image && !p15card->opts.use_file_cache && file)   {
+			r = sc_pkcs15init_update_df_image(profile, p15card, file, df, buf, bufsize);
+		}
+		else   {
+			r = sc_pkcs15init_update_file(profile, p15card, file, buf, bufsize);
+			if (df->image)
+				free(df->image);
+			df->image = NULL;
+			df->image_len = 0;
+			/* what is now on the card, the rest of the file is zeroed out */
+			if (r >= 0 && bufsize && (df->image = malloc(bufsize)) != NULL)   {
+				memcpy(df->image, buf, bufsize);
+				df->image_len = bufsize;
+			}
+		}
 
 		/* For better performance and robustness, we want
 		 * to note which portion of the file actually
@@ -0,0 +1,367 @@
+/*
+ * PKCS#15 directory entry decoding test
+ *
+ * Encodes a few CDF, PrKDF and PuKDF entries, mutates them and checks
+ * that the compiled templates decode them exactly like the interpreted
+ * ones, then compares the speed of both.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libopensc/opensc.h"
+#include "libopensc/pkcs15.h"
+
+#define MUTATIONS	3000
+#define ROUNDS		20000
+
+typedef int (*decode_func)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
+		const u8 **, size_t *);
+typedef int (*encode_func)(struct sc_context *, const struct sc_pkcs15_object *,
+		u8 **, size_t *);
+
+struct sample {
+	const char *name;
+	decode_func decode;
+	u8 *der;
+	size_t len;
+};
+
+static struct sc_context *ctx;
+static struct sc_pkcs15_card *p15card;
+static struct sample samples[16];
+static int nsamples;
+static unsigned long checked, failures;
+
+static int same_der(const struct sc_pkcs15_der *a, const struct sc_pkcs15_der *b)
+{
+	return a->len == b->len && (a->len == 0 || !memcmp(a->value, b->value, a->len));
+}
+
+static int same_id(const struct sc_pkcs15_id *a, const struct sc_pkcs15_id *b)
+{
+	return a->len == b->len && !memcmp(a->value, b->value, a->len);
+}
+
+static int same_path(const struct sc_path *a, const struct sc_path *b)
+{
+	return a->len == b->len && !memcmp(a->value, b->value, a->len)
+		&& a->index == b->index && a->count == b->count && a->type == b->type
+		&& a->aid.len == b->aid.len && !memcmp(a->aid.value, b->aid.value, a->aid.len);
+}
+
+static int same_key_info(const struct sc_pkcs15_prkey_info *a, const struct sc_pkcs15_prkey_info *b)
+{
+	return same_id(&a->id, &b->id) && a->usage == b->usage
+		&& a->access_flags == b->access_flags && a->native == b->native
+		&& a->key_reference == b->key_reference
+		&& a->modulus_length == b->modulus_length
+		&& a->field_length == b->field_length
+		&& !memcmp(a->algo_refs, b->algo_refs, sizeof(a->algo_refs))
+		&& same_der(&a->subject, &b->subject)
+		&& a->params.len == b->params.len
+		&& (a->params.len == 0 || !memcmp(a->params.data, b->params.data, a->params.len))
+		&& same_path(&a->path, &b->path);
+}
+
+static int same_object(const struct sc_pkcs15_object *a, const struct sc_pkcs15_object *b)
+{
+	int i;
+
+	if (a->type != b->type || strcmp(a->label, b->label) || a->flags != b->flags
+			|| !same_id(&a->auth_id, &b->auth_id)
+			|| a->user_consent != b->user_consent
+			|| !same_der(&a->content, &b->content))
+		return 0;
+	for (i = 0; i < SC_PKCS15_MAX_ACCESS_RULES; i++)
+		if (a->access_rules[i].access_mode != b->access_rules[i].access_mode
+				|| !same_id(&a->access_rules[i].auth_id, &b->access_rules[i].auth_id))
+			return 0;
+	if (a->data == NULL || b->data == NULL)
+		return a->data == b->data;
+
+	switch (a->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_CERT: {
+		const struct sc_pkcs15_cert_info *x = a->data, *y = b->data;
+
+		return same_id(&x->id, &y->id) && x->authority == y->authority
+			&& same_path(&x->path, &y->path) && same_der(&x->value, &y->value);
+	}
+	case SC_PKCS15_TYPE_PRKEY:
+		return same_key_info(a->data, b->data);
+	case SC_PKCS15_TYPE_PUBKEY:
+		/* the members of both infos are laid out alike */
+		return same_key_info(a->data, b->data);
+	}
+	return 0;
+}
+
+/* Decodes a buffer of entries the way sc_pkcs15_parse_df() does */
+static int decode_all(decode_func decode, int compiled, const u8 *in, size_t len,
+		struct sc_pkcs15_object **objs, int max, int *count)
+{
+	const u8 *p = in;
+	size_t left = len;
+	int r = 0;
+
+	p15card->opts.use_compiled_asn1 = compiled;
+	*count = 0;
+	while (left > 0 && *count < max) {
+		struct sc_pkcs15_object *obj = calloc(1, sizeof(*obj));
+
+		if (obj == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		r = decode(p15card, obj, &p, &left);
+		if (r < 0) {
+			sc_pkcs15_free_object(obj);
+			break;
+		}
+		objs[(*count)++] = obj;
+	}
+	return r < 0 ? r : (int) (len - left);
+}
+
+static void check(const struct sample *s, const u8 *in, size_t len)
+{
+	struct sc_pkcs15_object *a[8], *b[8];
+	int ra, rb, na, nb, i;
+
+	ra = decode_all(s->decode, 0, in, len, a, 8, &na);
+	rb = decode_all(s->decode, 1, in, len, b, 8, &nb);
+	checked++;
+	if (ra != rb || na != nb) {
+		fprintf(stderr, "%s: interpreted returned %d (%d entries), compiled %d (%d entries)\n",
+				s->name, ra, na, rb, nb);
+		failures++;
+	}
+	else {
+		for (i = 0; i < na; i++)
+			if (!same_object(a[i], b[i])) {
+				fprintf(stderr, "%s: entry %d decoded differently\n", s->name, i);
+				failures++;
+				break;
+			}
+	}
+	for (i = 0; i < na; i++)
+		sc_pkcs15_free_object(a[i]);
+	for (i = 0; i < nb; i++)
+		sc_pkcs15_free_object(b[i]);
+}
+
+static void mutate(u8 *buf, size_t *len)
+{
+	int n = 1 + rand() % 3;
+
+	while (n-- && *len > 0) {
+		size_t pos = rand() % *len;
+
+		switch (rand() % 4) {
+		case 0:
+			buf[pos] ^= 1 << (rand() % 8);
+			break;
+		case 1:
+			buf[pos] = rand() & 0xFF;
+			break;
+		case 2:
+			/* length bytes follow tags, make them lie more often */
+			buf[pos] = (buf[pos] & 0x80) | ((buf[pos] + rand() % 5 - 2) & 0x7F);
+			break;
+		case 3:
+			*len = pos;
+			break;
+		}
+	}
+}
+
+static void add_sample(const char *name, encode_func encode, decode_func decode,
+		struct sc_pkcs15_object *obj)
+{
+	struct sample *s = &samples[nsamples];
+	int r;
+
+	r = encode(ctx, obj, &s->der, &s->len);
+	if (r < 0) {
+		fprintf(stderr, "Cannot encode %s: %s\n", name, sc_strerror(r));
+		exit(1);
+	}
+	s->name = name;
+	s->decode = decode;
+	nsamples++;
+}
+
+static void init_object(struct sc_pkcs15_object *obj, unsigned int type, const char *label,
+		void *data)
+{
+	memset(obj, 0, sizeof(*obj));
+	obj->type = type;
+	strcpy(obj->label, label);
+	obj->flags = SC_PKCS15_CO_FLAG_PRIVATE | SC_PKCS15_CO_FLAG_MODIFIABLE;
+	sc_pkcs15_format_id("01", &obj->auth_id);
+	obj->data = data;
+}
+
+static void make_samples(void)
+{
+	static u8 cert_value[] = { 0x30, 0x06, 0x02, 0x01, 0x01, 0x04, 0x01, 0xAA };
+	static u8 subject[] = { 0x30, 0x0B, 0x31, 0x09, 0x30, 0x07, 0x06, 0x03,
+		0x55, 0x04, 0x03, 0x0C, 0x00 };
+	static struct sc_pkcs15_cert_info cert, cert_direct;
+	static struct sc_pkcs15_prkey_info rsa, ec, gost;
+	static struct sc_pkcs15_pubkey_info pub_rsa, pub_ec;
+	static struct sc_pkcs15_keyinfo_gostparams gost_params = { 1, 2, 3 };
+	struct sc_pkcs15_object obj;
+
+	sc_pkcs15_format_id("45", &cert.id);
+	cert.authority = 1;
+	sc_format_path("3F0050154331", &cert.path);
+	init_object(&obj, SC_PKCS15_TYPE_CERT_X509, "Certificate", &cert);
+	obj.flags = 0;
+	obj.auth_id.len = 0;
+	add_sample("cdf path", sc_pkcs15_encode_cdf_entry, sc_pkcs15_decode_cdf_entry, &obj);
+
+	sc_pkcs15_format_id("46", &cert_direct.id);
+	cert_direct.value.value = cert_value;
+	cert_direct.value.len = sizeof(cert_value);
+	init_object(&obj, SC_PKCS15_TYPE_CERT_X509, "Direct certificate", &cert_direct);
+	add_sample("cdf direct", sc_pkcs15_encode_cdf_entry, sc_pkcs15_decode_cdf_entry, &obj);
+
+	sc_pkcs15_format_id("45", &rsa.id);
+	rsa.usage = SC_PKCS15_PRKEY_USAGE_SIGN | SC_PKCS15_PRKEY_USAGE_DECRYPT;
+	rsa.access_flags = SC_PKCS15_PRKEY_ACCESS_SENSITIVE | SC_PKCS15_PRKEY_ACCESS_LOCAL;
+	rsa.native = 1;
+	rsa.key_reference = 0x10;
+	rsa.modulus_length = 2048;
+	rsa.algo_refs[0] = 1;
+	rsa.algo_refs[1] = 3;
+	rsa.subject.value = subject;
+	rsa.subject.len = sizeof(subject);
+	sc_format_path("3F0050154B01", &rsa.path);
+	init_object(&obj, SC_PKCS15_TYPE_PRKEY_RSA, "RSA key", &rsa);
+	obj.user_consent = 1;
+	obj.access_rules[0].access_mode = SC_PKCS15_ACCESS_RULE_MODE_PSO_CDS;
+	sc_pkcs15_format_id("02", &obj.access_rules[0].auth_id);
+	obj.access_rules[1].access_mode = SC_PKCS15_ACCESS_RULE_MODE_READ;
+	add_sample("prkdf rsa", sc_pkcs15_encode_prkdf_entry, sc_pkcs15_decode_prkdf_entry, &obj);
+
+	sc_pkcs15_format_id("47", &ec.id);
+	ec.usage = SC_PKCS15_PRKEY_USAGE_SIGN | SC_PKCS15_PRKEY_USAGE_DERIVE;
+	ec.native = 1;
+	ec.key_reference = -1;
+	ec.field_length = 256;
+	sc_format_path("3F0050154B02", &ec.path);
+	init_object(&obj, SC_PKCS15_TYPE_PRKEY_EC, "EC key", &ec);
+	add_sample("prkdf ec", sc_pkcs15_encode_prkdf_entry, sc_pkcs15_decode_prkdf_entry, &obj);
+
+	sc_pkcs15_format_id("48", &gost.id);
+	gost.usage = SC_PKCS15_PRKEY_USAGE_SIGN;
+	gost.native = 1;
+	gost.key_reference = 3;
+	gost.params.data = &gost_params;
+	gost.params.len = sizeof(gost_params);
+	sc_format_path("3F0050154B03", &gost.path);
+	init_object(&obj, SC_PKCS15_TYPE_PRKEY_GOSTR3410, "GOST key", &gost);
+	add_sample("prkdf gost", sc_pkcs15_encode_prkdf_entry, sc_pkcs15_decode_prkdf_entry, &obj);
+
+	sc_pkcs15_format_id("45", &pub_rsa.id);
+	pub_rsa.usage = SC_PKCS15_PRKEY_USAGE_VERIFY | SC_PKCS15_PRKEY_USAGE_ENCRYPT;
+	pub_rsa.native = 1;
+	pub_rsa.key_reference = -1;
+	pub_rsa.modulus_length = 1024;
+	sc_format_path("3F0050155501", &pub_rsa.path);
+	init_object(&obj, SC_PKCS15_TYPE_PUBKEY_RSA, "RSA public key", &pub_rsa);
+	obj.flags = 0;
+	obj.auth_id.len = 0;
+	add_sample("pukdf rsa", sc_pkcs15_encode_pukdf_entry, sc_pkcs15_decode_pukdf_entry, &obj);
+
+	sc_pkcs15_format_id("47", &pub_ec.id);
+	pub_ec.usage = SC_PKCS15_PRKEY_USAGE_VERIFY;
+	pub_ec.native = 1;
+	pub_ec.key_reference = -1;
+	pub_ec.field_length = 384;
+	init_object(&obj, SC_PKCS15_TYPE_PUBKEY_EC, "EC public key", &pub_ec);
+	obj.flags = 0;
+	obj.auth_id.len = 0;
+	obj.content.value = cert_value;
+	obj.content.len = sizeof(cert_value);
+	add_sample("pukdf ec direct", sc_pkcs15_encode_pukdf_entry, sc_pkcs15_decode_pukdf_entry, &obj);
+}
+
+static double time_decoding(int compiled)
+{
+	struct sc_pkcs15_object *objs[8];
+	clock_t start = clock();
+	int i, j, k, n;
+
+	for (i = 0; i < ROUNDS; i++)
+		for (j = 0; j < nsamples; j++) {
+			decode_all(samples[j].decode, compiled, samples[j].der, samples[j].len,
+					objs, 8, &n);
+			for (k = 0; k < n; k++)
+				sc_pkcs15_free_object(objs[k]);
+		}
+	return (double) (clock() - start) / CLOCKS_PER_SEC * 1e6 / ((double) ROUNDS * nsamples);
+}
+
+int main(int argc, char *argv[])
+{
+	sc_context_param_t ctx_param;
+	struct sc_card *card;
+	u8 buf[1024];
+	size_t len;
+	int i, j, r;
+
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.ver = 0;
+	ctx_param.app_name = "asn1test";
+	r = sc_context_create(&ctx, &ctx_param);
+	if (r) {
+		fprintf(stderr, "Failed to create initial context: %s\n", sc_strerror(r));
+		return 1;
+	}
+	card = calloc(1, sizeof(*card));
+	p15card = sc_pkcs15_card_new();
+	if (card == NULL || p15card == NULL)
+		return 1;
+	card->ctx = ctx;
+	p15card->card = card;
+	p15card->file_app = sc_file_new();
+	sc_format_path("3F005015", &p15card->file_app->path);
+
+	make_samples();
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+
+	for (i = 0; i < nsamples; i++) {
+		check(&samples[i], samples[i].der, samples[i].len);
+		for (j = 0; j < MUTATIONS; j++) {
+			len = samples[i].len;
+			memcpy(buf, samples[i].der, len);
+			mutate(buf, &len);
+			check(&samples[i], buf, len);
+		}
+	}
+	/* a whole directory file, padded like on a card */
+	for (len = 0, i = 0; i < nsamples; i++)
+		if (samples[i].decode == sc_pkcs15_decode_prkdf_entry) {
+			memcpy(buf + len, samples[i].der, samples[i].len);
+			len += samples[i].len;
+		}
+	memset(buf + len, 0, 16);
+	for (i = 0; i < nsamples && samples[i].decode != sc_pkcs15_decode_prkdf_entry; i++)
+		;
+	check(&samples[i], buf, len + 16);
+
+	printf("%lu decodings compared, %lu differences\n", checked, failures);
+	printf("interpreted: %.2f us per entry\n", time_decoding(0));
+	printf("compiled:    %.2f us per entry\n", time_decoding(1));
+
+	for (i = 0; i < nsamples; i++)
+		free(samples[i].der);
+	sc_pkcs15_card_free(p15card);
+	free(card);
+	sc_release_context(ctx);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# Lists the slots of four virtual readers with sequential and with
+# parallel token detection: three hold the sample card, one a blank card
+# that can not be bound. Both runs have to succeed and list the same
+# slots in the same order.
+#
+# Run by 'make check'; srcdir and top_builddir are set by the test driver.
+
+srcdir=${srcdir:-.}
+top_builddir=${top_builddir:-../..}
+abs_srcdir=`cd "$srcdir" && pwd`
+module=$top_builddir/src/pkcs11/.libs/opensc-pkcs11.so
+tool=$top_builddir/src/tools/pkcs11-tool
+
+if test ! -f "$module" || test ! -x "$tool"; then
+	echo "$module or $tool is not built"
+	exit 77
+fi
+
+echo "atr 3B:80:80:01:01" > detect-blank.img
+
+# The module is not installed yet, it finds libopensc in the build tree
+LD_LIBRARY_PATH=$top_builddir/src/libopensc/.libs${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}
+export LD_LIBRARY_PATH
+OPENSC_CONF=detect-parallel.conf
+export OPENSC_CONF
+
+list_slots() {
+	cat > $OPENSC_CONF <<EOT
+app default {
+	reader_driver virtual {
+		enable = true;
+		card a { image = $abs_srcdir/virtual-card.img; latency = 2000; }
+		card b { image = `pwd`/detect-blank.img; latency = 2000; }
+		card c { image = $abs_srcdir/virtual-card.img; latency = 2000; }
+		card d { image = $abs_srcdir/virtual-card.img; latency = 2000; }
+	}
+}
+app opensc-pkcs11 {
+	pkcs11 { detect_workers = $1; }
+}
+EOT
+	"$tool" --module "$module" --list-slots > detect-parallel-$1.out || exit 1
+}
+
+list_slots 1
+list_slots 4
+
+if ! diff detect-parallel-1.out detect-parallel-4.out; then
+	echo "parallel detection changed the slot list"
+	exit 1
+fi
+if test `grep -c "token label" detect-parallel-4.out` -ne 3; then
+	cat detect-parallel-4.out
+	echo "expected three tokens"
+	exit 1
+fi
+exit 0
@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Binds the sample card twice with the file cache enabled: the second
+# bind has to be served from the cache. The card reports no access
+# conditions for its files, like most ISO cards, and carries lastUpdate
+# in its TokenInfo.
+#
+# Run by 'make check'; srcdir is set by the test driver.
+
+srcdir=${srcdir:-.}
+abs_srcdir=`cd "$srcdir" && pwd`
+
+# The cache goes to $HOME/.eid/cache
+rm -rf file-cache.home
+mkdir file-cache.home
+HOME=`pwd`/file-cache.home
+export HOME
+
+# The sample card with lastUpdate 20261017000000Z in its TokenInfo
+sed -e 's|^ef 3F00/5015/5032 .*|ef 3F00/5015/5032 30370201000404123456780c075669727475616c800c53616d706c6520746f6b656e03020640a511180f32303236313031373030303030305a|' \
+	-e "s|virtual-card-key.pem|$abs_srcdir/virtual-card-key.pem|" \
+	-e "s|@virtual-card-cert.der|@$abs_srcdir/virtual-card-cert.der|" \
+	"$abs_srcdir/virtual-card.img" > file-cache.img
+
+OPENSC_CONF=file-cache.conf
+export OPENSC_CONF
+cat > $OPENSC_CONF <<EOT
+app default {
+	reader_driver virtual {
+		enable = true;
+		card sample { image = `pwd`/file-cache.img; }
+	}
+	framework pkcs15 { use_file_caching = true; }
+}
+EOT
+
+./filecachetest -r 0
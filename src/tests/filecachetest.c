@@ -0,0 +1,102 @@
+/*
+ * filecachetest.c: Bind the sample card of the virtual reader driver
+ * twice with the file cache enabled, and check that the second bind
+ * reads no file from the card but the ODF and the TokenInfo, which
+ * identify the card and so are always read.
+ *
+ * Run by file-cache.sh, which writes the configuration and the card
+ * image.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "libopensc/opensc.h"
+#include "libopensc/pkcs15.h"
+#include "sc-test.h"
+
+/* READ BINARY commands sent so far */
+static unsigned long long read_binary_count(void)
+{
+	sc_stats_t *stats;
+	unsigned long long count;
+
+	if (sc_ctx_get_stats(ctx, &stats) != SC_SUCCESS)
+		return 0;
+	count = sc_stats_get(stats, "ins.B0.count");
+	sc_stats_free(stats);
+	return count;
+}
+
+/* Binds the card and parses the AODF, returns the number of PINs. The
+ * PrKDF stays unparsed, so that no snapshot is written at unbind and
+ * the second bind has to go through the file cache. */
+static int bind_card(void)
+{
+	struct sc_pkcs15_card *p15card = NULL;
+	int r;
+
+	r = sc_pkcs15_bind(card, NULL, &p15card);
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "PKCS#15 binding failed: %s\n", sc_strerror(r));
+		return r;
+	}
+	if (!p15card->opts.use_file_cache) {
+		fprintf(stderr, "The file cache is not enabled\n");
+		r = SC_ERROR_INTERNAL;
+	}
+	else {
+		r = sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_AUTH_PIN, NULL, 0);
+	}
+	sc_pkcs15_unbind(p15card);
+	return r;
+}
+
+/* EF(ODF) and EF(TokenInfo) */
+#define UNCACHED_READS	2
+
+int main(int argc, char *argv[])
+{
+	unsigned long long first, second;
+	int pins1, pins2, r = 1;
+
+	if (sc_test_init(&argc, argv) != SC_SUCCESS)
+		return 1;
+
+	first = read_binary_count();
+	pins1 = bind_card();
+	first = read_binary_count() - first;
+	second = read_binary_count();
+	pins2 = bind_card();
+	second = read_binary_count() - second;
+
+	printf("First bind: %llu READ BINARY, %d PIN(s)\n", first, pins1);
+	printf("Second bind: %llu READ BINARY, %d PIN(s)\n", second, pins2);
+	if (pins1 <= 0 || pins2 != pins1)
+		fprintf(stderr, "The binds found different objects\n");
+	else if (first <= UNCACHED_READS)
+		fprintf(stderr, "The first bind read no DF from the card\n");
+	else if (second > UNCACHED_READS)
+		fprintf(stderr, "The second bind was not served from the cache\n");
+	else
+		r = 0;
+
+	sc_test_cleanup();
+	return r;
+}
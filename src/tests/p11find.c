@@ -0,0 +1,177 @@
+/*
+ * p11find.c: Search the certificate of the sample card of the virtual
+ * reader driver by each of the attributes the PKCS#11 module indexes
+ *
+ * Every search must find the certificate, or nothing when one of the
+ * values does not match. Run by p11find.sh, which also checks from the
+ * debug log in what order the module built its indexes.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pkcs11/pkcs11.h"
+
+extern void *C_LoadModule(const char *name, CK_FUNCTION_LIST_PTR_PTR);
+extern CK_RV C_UnloadModule(void *module);
+
+#define CERT_LABEL	"Sign cert"
+
+static CK_FUNCTION_LIST_PTR p11;
+static CK_SESSION_HANDLE session;
+static unsigned long failures;
+
+/* Runs one search, which has to find exactly 'expected', or nothing
+ * if 'expected' is CK_INVALID_HANDLE */
+static void search(const char *what, CK_ATTRIBUTE_PTR tmpl, CK_ULONG count,
+		CK_OBJECT_HANDLE expected)
+{
+	CK_OBJECT_HANDLE found[4];
+	CK_ULONG nfound = 0;
+	CK_RV rv;
+
+	rv = p11->C_FindObjectsInit(session, tmpl, count);
+	if (rv == CKR_OK) {
+		rv = p11->C_FindObjects(session, found, 4, &nfound);
+		p11->C_FindObjectsFinal(session);
+	}
+	if (rv != CKR_OK) {
+		fprintf(stderr, "%s: search failed: 0x%lx\n", what, rv);
+		failures++;
+	}
+	else if (expected == CK_INVALID_HANDLE ? nfound != 0
+			: nfound != 1 || found[0] != expected) {
+		fprintf(stderr, "%s: %lu object(s) found\n", what, nfound);
+		failures++;
+	}
+}
+
+/* Reads a variable length attribute into a new buffer */
+static CK_RV get_attribute(CK_OBJECT_HANDLE object, CK_ATTRIBUTE_PTR attr)
+{
+	CK_RV rv;
+
+	attr->pValue = NULL;
+	rv = p11->C_GetAttributeValue(session, object, attr, 1);
+	if (rv != CKR_OK)
+		return rv;
+	attr->pValue = malloc(attr->ulValueLen ? attr->ulValueLen : 1);
+	if (attr->pValue == NULL)
+		return CKR_HOST_MEMORY;
+	return p11->C_GetAttributeValue(session, object, attr, 1);
+}
+
+static int run_searches(void)
+{
+	CK_OBJECT_CLASS class = CKO_CERTIFICATE;
+	CK_BYTE id = 0x45, no_serial[] = { 0x02, 0x01, 0x00 };
+	CK_ATTRIBUTE issuer = { CKA_ISSUER, NULL, 0 };
+	CK_ATTRIBUTE serial = { CKA_SERIAL_NUMBER, NULL, 0 };
+	CK_ATTRIBUTE tmpl[3];
+	CK_OBJECT_HANDLE cert;
+	CK_ULONG count = 0;
+	CK_RV rv;
+
+	/* Goes by the label, the serial number index is not needed yet */
+	tmpl[0].type = CKA_LABEL;
+	tmpl[0].pValue = CERT_LABEL;
+	tmpl[0].ulValueLen = strlen(CERT_LABEL);
+	tmpl[1].type = CKA_SERIAL_NUMBER;
+	tmpl[1].pValue = no_serial;
+	tmpl[1].ulValueLen = sizeof(no_serial);
+	search("label and other serial number", tmpl, 2, CK_INVALID_HANDLE);
+
+	tmpl[0].type = CKA_CLASS;
+	tmpl[0].pValue = &class;
+	tmpl[0].ulValueLen = sizeof(class);
+	rv = p11->C_FindObjectsInit(session, tmpl, 1);
+	if (rv == CKR_OK) {
+		rv = p11->C_FindObjects(session, &cert, 1, &count);
+		p11->C_FindObjectsFinal(session);
+	}
+	if (rv != CKR_OK || count != 1) {
+		fprintf(stderr, "No certificate found (0x%lx)\n", rv);
+		return 1;
+	}
+	rv = get_attribute(cert, &issuer);
+	if (rv == CKR_OK)
+		rv = get_attribute(cert, &serial);
+	if (rv != CKR_OK) {
+		fprintf(stderr, "Cannot read the issuer and serial number (0x%lx)\n", rv);
+		failures++;
+		goto out;
+	}
+
+	tmpl[1] = issuer;
+	tmpl[2] = serial;
+	search("class, issuer and serial number", tmpl, 3, cert);
+	search("issuer", &issuer, 1, cert);
+	((CK_BYTE *) serial.pValue)[serial.ulValueLen - 1] ^= 0x01;
+	search("other serial number", &serial, 1, CK_INVALID_HANDLE);
+
+	tmpl[1].type = CKA_ID;
+	tmpl[1].pValue = &id;
+	tmpl[1].ulValueLen = sizeof(id);
+	search("class and ID", tmpl, 2, cert);
+
+out:
+	free(issuer.pValue);
+	free(serial.pValue);
+	return failures ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	CK_SLOT_ID slot;
+	CK_ULONG nslots = 1;
+	void *module;
+	CK_RV rv;
+	int r = 1;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s module\n", argv[0]);
+		return 1;
+	}
+	module = C_LoadModule(argv[1], &p11);
+	if (module == NULL) {
+		fprintf(stderr, "Failed to load PKCS#11 module %s\n", argv[1]);
+		return 1;
+	}
+	rv = p11->C_Initialize(NULL_PTR);
+	if (rv != CKR_OK) {
+		fprintf(stderr, "C_Initialize() failed: 0x%lx\n", rv);
+		goto out;
+	}
+
+	rv = p11->C_GetSlotList(CK_TRUE, &slot, &nslots);
+	if (rv == CKR_OK && nslots == 1)
+		rv = p11->C_OpenSession(slot, CKF_SERIAL_SESSION, NULL, NULL, &session);
+	else if (rv == CKR_OK)
+		rv = CKR_TOKEN_NOT_PRESENT;
+	if (rv != CKR_OK)
+		fprintf(stderr, "Cannot open a session on the token (0x%lx)\n", rv);
+	else
+		r = run_searches();
+
+	p11->C_Finalize(NULL_PTR);
+out:
+	C_UnloadModule(module);
+	return r;
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Runs p11find on the sample card of the virtual reader driver, then
+# checks from the debug log that the PKCS#11 module built the index of
+# the serial numbers, which reads the certificates, only for the first
+# search that had no ID or label to go by.
+#
+# Run by 'make check'; srcdir and top_builddir are set by the test driver.
+
+srcdir=${srcdir:-.}
+top_builddir=${top_builddir:-../..}
+abs_srcdir=`cd "$srcdir" && pwd`
+module=$top_builddir/src/pkcs11/.libs/opensc-pkcs11.so
+
+if test ! -f "$module"; then
+	echo "$module is not built"
+	exit 77
+fi
+
+rm -f p11find.log
+OPENSC_CONF=p11find.conf
+export OPENSC_CONF
+cat > $OPENSC_CONF <<EOT
+app default {
+	debug = 3;
+	debug_file = `pwd`/p11find.log;
+	reader_driver virtual {
+		enable = true;
+		card sample { image = $abs_srcdir/virtual-card.img; }
+	}
+}
+EOT
+
+# The module is not installed yet, it finds libopensc in the build tree
+LD_LIBRARY_PATH=$top_builddir/src/libopensc/.libs${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}
+export LD_LIBRARY_PATH
+
+./p11find "$module" || exit 1
+
+# CKA_LABEL, CKA_CLASS, CKA_SERIAL_NUMBER, CKA_ISSUER, CKA_ID
+built=`sed -n 's/.*built index of attribute \(0x[0-9a-f]*\) .*/\1/p' p11find.log | tr '\n' ' '`
+if test "$built" != "0x3 0x0 0x82 0x81 0x102 "; then
+	echo "indexes built in the wrong order: $built"
+	exit 1
+fi
+exit 0
@@ -0,0 +1,375 @@
+/*
+ * p11stress.c: Drive several PKCS#11 slots from concurrent threads
+ *
+ * Every slot with a token gets its own worker threads, each with a
+ * private session, running object searches, attribute reads and
+ * (with a PIN) signatures in a loop. One more thread keeps calling the
+ * slot and token information functions. Tokens should proceed
+ * independently of each other; the time per operation is printed
+ * for every slot.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include "common/compat_getopt.h"
+#include "pkcs11/pkcs11.h"
+
+extern void *C_LoadModule(const char *name, CK_FUNCTION_LIST_PTR_PTR);
+extern CK_RV C_UnloadModule(void *module);
+
+#define MAX_SLOTS	32
+
+static CK_FUNCTION_LIST_PTR p11;
+static const char *opt_module = NULL;
+static const char *opt_pin = NULL;
+static int opt_threads = 2;
+static int opt_iterations = 100;
+
+static volatile int workers_running;
+static pthread_mutex_t counter_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long errors;
+
+struct slot_stats {
+	CK_SLOT_ID id;
+	unsigned long ops;
+	unsigned long long usec;
+};
+
+struct worker {
+	pthread_t thread;
+	struct slot_stats *stats;
+};
+
+static const struct option options[] = {
+	{ "module",	1, NULL, 'm' },
+	{ "pin",	1, NULL, 'p' },
+	{ "threads",	1, NULL, 't' },
+	{ "iterations",	1, NULL, 'n' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/* Locking callbacks handed to the module */
+static CK_RV mutex_create(void **mutex)
+{
+	pthread_mutex_t *m = calloc(1, sizeof(*m));
+
+	if (m == NULL)
+		return CKR_HOST_MEMORY;
+	pthread_mutex_init(m, NULL);
+	*mutex = m;
+	return CKR_OK;
+}
+
+static CK_RV mutex_destroy(void *mutex)
+{
+	pthread_mutex_destroy((pthread_mutex_t *) mutex);
+	free(mutex);
+	return CKR_OK;
+}
+
+static CK_RV mutex_lock(void *mutex)
+{
+	return pthread_mutex_lock((pthread_mutex_t *) mutex) ? CKR_GENERAL_ERROR : CKR_OK;
+}
+
+static CK_RV mutex_unlock(void *mutex)
+{
+	return pthread_mutex_unlock((pthread_mutex_t *) mutex) ? CKR_GENERAL_ERROR : CKR_OK;
+}
+
+static unsigned long long now_usec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void count_error(const char *func, CK_SLOT_ID slot, CK_RV rv)
+{
+	fprintf(stderr, "slot 0x%lx: %s() failed: 0x%lx\n", slot, func, rv);
+	pthread_mutex_lock(&counter_lock);
+	errors++;
+	pthread_mutex_unlock(&counter_lock);
+}
+
+static CK_OBJECT_HANDLE find_sign_key(CK_SESSION_HANDLE session)
+{
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_KEY_TYPE type = CKK_RSA;
+	CK_BBOOL can_sign = CK_TRUE;
+	CK_ATTRIBUTE tmpl[] = {
+		{ CKA_CLASS, &class, sizeof(class) },
+		{ CKA_KEY_TYPE, &type, sizeof(type) },
+		{ CKA_SIGN, &can_sign, sizeof(can_sign) }
+	};
+	CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+	CK_ULONG count = 0;
+
+	if (p11->C_FindObjectsInit(session, tmpl, 3) != CKR_OK)
+		return CK_INVALID_HANDLE;
+	if (p11->C_FindObjects(session, &key, 1, &count) != CKR_OK || count == 0)
+		key = CK_INVALID_HANDLE;
+	p11->C_FindObjectsFinal(session);
+	return key;
+}
+
+static CK_RV find_and_read(CK_SESSION_HANDLE session)
+{
+	CK_OBJECT_CLASS class = CKO_CERTIFICATE;
+	CK_ATTRIBUTE tmpl = { CKA_CLASS, &class, sizeof(class) };
+	CK_OBJECT_HANDLE objects[16];
+	CK_ULONG count = 0, i;
+	CK_RV rv;
+	char label[128];
+
+	rv = p11->C_FindObjectsInit(session, &tmpl, 1);
+	if (rv != CKR_OK)
+		return rv;
+	rv = p11->C_FindObjects(session, objects, 16, &count);
+	p11->C_FindObjectsFinal(session);
+	if (rv != CKR_OK)
+		return rv;
+
+	for (i = 0; i < count; i++) {
+		CK_ATTRIBUTE attr = { CKA_LABEL, label, sizeof(label) };
+
+		rv = p11->C_GetAttributeValue(session, objects[i], &attr, 1);
+		if (rv != CKR_OK && rv != CKR_ATTRIBUTE_TYPE_INVALID)
+			return rv;
+	}
+	return CKR_OK;
+}
+
+static CK_RV sign(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key)
+{
+	CK_MECHANISM mech = { CKM_RSA_PKCS, NULL_PTR, 0 };
+	CK_BYTE data[20], sig[1024];
+	CK_ULONG sig_len = sizeof(sig);
+	CK_RV rv;
+
+	memset(data, 0x5A, sizeof(data));
+	rv = p11->C_SignInit(session, &mech, key);
+	if (rv != CKR_OK)
+		return rv;
+	return p11->C_Sign(session, data, sizeof(data), sig, &sig_len);
+}
+
+static void *slot_worker(void *arg)
+{
+	struct worker *w = (struct worker *) arg;
+	CK_SLOT_ID slot = w->stats->id;
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+	unsigned long long start;
+	CK_RV rv;
+	int i;
+
+	rv = p11->C_OpenSession(slot, CKF_SERIAL_SESSION, NULL, NULL, &session);
+	if (rv != CKR_OK) {
+		count_error("C_OpenSession", slot, rv);
+		return NULL;
+	}
+	if (opt_pin)
+		key = find_sign_key(session);
+
+	for (i = 0; i < opt_iterations; i++) {
+		start = now_usec();
+		rv = find_and_read(session);
+		if (rv != CKR_OK)
+			count_error("find_and_read", slot, rv);
+		if (key != CK_INVALID_HANDLE) {
+			rv = sign(session, key);
+			if (rv != CKR_OK)
+				count_error("C_Sign", slot, rv);
+		}
+
+		pthread_mutex_lock(&counter_lock);
+		w->stats->ops++;
+		w->stats->usec += now_usec() - start;
+		pthread_mutex_unlock(&counter_lock);
+	}
+
+	p11->C_CloseSession(session);
+	return NULL;
+}
+
+/* Metadata calls must not wait for card I/O of other tokens */
+static void *info_worker(void *arg)
+{
+	CK_SLOT_ID *slots = (CK_SLOT_ID *) arg;
+	CK_SLOT_INFO slot_info;
+	CK_TOKEN_INFO token_info;
+	unsigned long calls = 0;
+	unsigned long long start = now_usec();
+	CK_RV rv;
+	int i;
+
+	while (workers_running) {
+		for (i = 0; slots[i] != (CK_SLOT_ID) -1; i++) {
+			rv = p11->C_GetSlotInfo(slots[i], &slot_info);
+			if (rv != CKR_OK)
+				count_error("C_GetSlotInfo", slots[i], rv);
+			rv = p11->C_GetTokenInfo(slots[i], &token_info);
+			if (rv != CKR_OK)
+				count_error("C_GetTokenInfo", slots[i], rv);
+			calls += 2;
+		}
+	}
+	if (calls)
+		printf("info calls: %lu, %llu us per call\n", calls, (now_usec() - start) / calls);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	CK_C_INITIALIZE_ARGS init_args = {
+		mutex_create, mutex_destroy, mutex_lock, mutex_unlock,
+		CKF_OS_LOCKING_OK, NULL
+	};
+	CK_SLOT_ID slots[MAX_SLOTS + 1];
+	CK_ULONG nslots = MAX_SLOTS, i;
+	struct slot_stats stats[MAX_SLOTS];
+	struct worker *workers;
+	pthread_t info_thread;
+	unsigned long long start;
+	void *module;
+	CK_RV rv;
+	int c, t, nworkers;
+
+	while ((c = getopt_long(argc, argv, "m:p:t:n:", options, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			opt_module = optarg;
+			break;
+		case 'p':
+			opt_pin = optarg;
+			break;
+		case 't':
+			opt_threads = atoi(optarg);
+			break;
+		case 'n':
+			opt_iterations = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-m module] [-p pin] [-t threads-per-slot] [-n iterations]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (opt_module == NULL) {
+		fprintf(stderr, "No PKCS#11 module given\n");
+		return 1;
+	}
+	if (opt_threads < 1 || opt_iterations < 1) {
+		fprintf(stderr, "Invalid thread or iteration count\n");
+		return 1;
+	}
+
+	module = C_LoadModule(opt_module, &p11);
+	if (module == NULL) {
+		fprintf(stderr, "Failed to load PKCS#11 module %s\n", opt_module);
+		return 1;
+	}
+
+	rv = p11->C_Initialize(&init_args);
+	if (rv != CKR_OK) {
+		fprintf(stderr, "C_Initialize() failed: 0x%lx\n", rv);
+		C_UnloadModule(module);
+		return 1;
+	}
+
+	rv = p11->C_GetSlotList(CK_TRUE, slots, &nslots);
+	if (rv != CKR_OK || nslots == 0) {
+		fprintf(stderr, "No tokens found (0x%lx)\n", rv);
+		p11->C_Finalize(NULL_PTR);
+		C_UnloadModule(module);
+		return 1;
+	}
+	slots[nslots] = (CK_SLOT_ID) -1;
+	printf("%lu token(s), %d thread(s) per token, %d iteration(s)\n",
+		nslots, opt_threads, opt_iterations);
+
+	/* Login once per token, the login state is shared by all sessions */
+	if (opt_pin) {
+		for (i = 0; i < nslots; i++) {
+			CK_SESSION_HANDLE session;
+
+			rv = p11->C_OpenSession(slots[i], CKF_SERIAL_SESSION, NULL, NULL, &session);
+			if (rv == CKR_OK)
+				rv = p11->C_Login(session, CKU_USER,
+					(CK_UTF8CHAR_PTR) opt_pin, strlen(opt_pin));
+			if (rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN)
+				count_error("C_Login", slots[i], rv);
+			/* Keep the session open so that the token stays logged in */
+		}
+	}
+
+	nworkers = nslots * opt_threads;
+	workers = calloc(nworkers, sizeof(*workers));
+	if (workers == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	memset(stats, 0, sizeof(stats));
+	workers_running = 1;
+	if (pthread_create(&info_thread, NULL, info_worker, slots) != 0) {
+		fprintf(stderr, "Cannot create thread\n");
+		return 1;
+	}
+
+	start = now_usec();
+	for (i = 0; i < nslots; i++) {
+		stats[i].id = slots[i];
+		for (t = 0; t < opt_threads; t++) {
+			struct worker *w = &workers[i * opt_threads + t];
+
+			w->stats = &stats[i];
+			if (pthread_create(&w->thread, NULL, slot_worker, w) != 0) {
+				fprintf(stderr, "Cannot create thread\n");
+				return 1;
+			}
+		}
+	}
+
+	for (t = 0; t < nworkers; t++)
+		pthread_join(workers[t].thread, NULL);
+	workers_running = 0;
+	pthread_join(info_thread, NULL);
+
+	for (i = 0; i < nslots; i++) {
+		if (stats[i].ops)
+			printf("slot 0x%lx: %lu operations, %llu us per operation\n",
+				stats[i].id, stats[i].ops, stats[i].usec / stats[i].ops);
+	}
+	printf("total: %llu ms, %lu error(s)\n", (now_usec() - start) / 1000, errors);
+
+	free(workers);
+	p11->C_Finalize(NULL_PTR);
+	C_UnloadModule(module);
+	return errors ? 1 : 0;
+}
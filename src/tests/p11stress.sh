@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Runs p11stress on two sample cards of the virtual reader driver, so
+# that sessions, logins, searches and (with OpenSSL) signatures on two
+# tokens run from concurrent threads.
+#
+# Run by 'make check'; srcdir and top_builddir are set by the test driver.
+
+srcdir=${srcdir:-.}
+top_builddir=${top_builddir:-../..}
+abs_srcdir=`cd "$srcdir" && pwd`
+module=$top_builddir/src/pkcs11/.libs/opensc-pkcs11.so
+
+if test ! -f "$module"; then
+	echo "$module is not built"
+	exit 77
+fi
+
+OPENSC_CONF=p11stress.conf
+export OPENSC_CONF
+cat > $OPENSC_CONF <<EOT
+app default {
+	reader_driver virtual {
+		enable = true;
+		card a { image = $abs_srcdir/virtual-card.img; latency = 1000; }
+		card b { image = $abs_srcdir/virtual-card.img; latency = 1000; }
+	}
+}
+EOT
+
+# The module is not installed yet, it finds libopensc in the build tree
+LD_LIBRARY_PATH=$top_builddir/src/libopensc/.libs${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}
+export LD_LIBRARY_PATH
+
+./p11stress --module "$module" ${P11STRESS_PIN:+--pin $P11STRESS_PIN} --threads 2 --iterations 20
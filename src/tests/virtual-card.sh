@@ -0,0 +1,22 @@
+#!/bin/sh
+#
+# Binds the sample card of the virtual reader driver (virtual-card.img)
+# and signs with its key through PKCS#15.
+#
+# Run by 'make check'; srcdir is set by the test driver.
+
+srcdir=${srcdir:-.}
+abs_srcdir=`cd "$srcdir" && pwd`
+
+OPENSC_CONF=virtual-card.conf
+export OPENSC_CONF
+cat > $OPENSC_CONF <<EOT
+app default {
+	reader_driver virtual {
+		enable = true;
+		card sample { image = $abs_srcdir/virtual-card.img; }
+	}
+}
+EOT
+
+./virtualtest -r 0 "$abs_srcdir/virtual-card-key.pem"
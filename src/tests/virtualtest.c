@@ -0,0 +1,148 @@
+/*
+ * virtualtest.c: Sign through PKCS#15 with the sample card of the
+ * virtual reader driver and check the signature against the key file
+ * of the card image.
+ *
+ * Run by virtual-card.sh, which writes the configuration.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ENABLE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+#endif
+
+#include "libopensc/opensc.h"
+#include "libopensc/pkcs15.h"
+#include "sc-test.h"
+
+/* Exit status for automake's test driver */
+#define TEST_SKIPPED	77
+
+/* The user PIN of virtual-card.img */
+#define SAMPLE_PIN	"123456"
+
+#ifdef ENABLE_OPENSSL
+static int verify_signature(const char *keyfile, const u8 *digest,
+		const u8 *sig, size_t siglen)
+{
+	FILE *f;
+	EVP_PKEY *pkey;
+	RSA *rsa;
+	int r;
+
+	f = fopen(keyfile, "r");
+	if (f == NULL) {
+		perror(keyfile);
+		return -1;
+	}
+	pkey = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+	fclose(f);
+	if (pkey == NULL) {
+		fprintf(stderr, "%s: not a private key\n", keyfile);
+		return -1;
+	}
+	rsa = EVP_PKEY_get1_RSA(pkey);
+	r = rsa != NULL && RSA_verify(NID_sha256, digest, SHA256_DIGEST_LENGTH,
+			sig, siglen, rsa) == 1 ? 0 : -1;
+	if (rsa != NULL)
+		RSA_free(rsa);
+	EVP_PKEY_free(pkey);
+	return r;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sc_pkcs15_card *p15card = NULL;
+	struct sc_pkcs15_object *key, *pin;
+	static const char message[] = "Signed by the virtual reader test";
+	u8 digest[SHA256_DIGEST_LENGTH], sig[512];
+	int nargs = argc, r;
+
+	r = sc_test_init(&argc, argv);
+	if (r != SC_SUCCESS)
+		return 1;
+	if (argc >= nargs) {
+		fprintf(stderr, "usage: %s [-r reader] <key file of the image>\n", argv[0]);
+		sc_test_cleanup();
+		return 1;
+	}
+
+	r = sc_lock(card);
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "Locking the card failed: %s\n", sc_strerror(r));
+		sc_test_cleanup();
+		return 1;
+	}
+	r = sc_pkcs15_bind(card, NULL, &p15card);
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "PKCS#15 binding failed: %s\n", sc_strerror(r));
+		goto out;
+	}
+
+	r = sc_pkcs15_get_objects(p15card, SC_PKCS15_TYPE_PRKEY_RSA, &key, 1);
+	if (r != 1) {
+		fprintf(stderr, "No RSA private key found\n");
+		r = SC_ERROR_OBJECT_NOT_FOUND;
+		goto out;
+	}
+	r = sc_pkcs15_find_pin_by_auth_id(p15card, &key->auth_id, &pin);
+	if (r == SC_SUCCESS)
+		r = sc_pkcs15_verify_pin(p15card, pin, (const u8 *) SAMPLE_PIN, strlen(SAMPLE_PIN));
+	if (r != SC_SUCCESS) {
+		fprintf(stderr, "PIN verification failed: %s\n", sc_strerror(r));
+		goto out;
+	}
+
+	SHA256((const unsigned char *) message, strlen(message), digest);
+	r = sc_pkcs15_compute_signature(p15card, key,
+			SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_SHA256,
+			digest, sizeof(digest), sig, sizeof(sig));
+	if (r < 0) {
+		fprintf(stderr, "Signing failed: %s\n", sc_strerror(r));
+		goto out;
+	}
+	printf("Signed with '%s', %d bytes\n", key->label, r);
+
+	r = verify_signature(argv[argc], digest, sig, r);
+	if (r < 0)
+		fprintf(stderr, "Signature does not verify\n");
+	else
+		printf("Signature verified\n");
+
+out:
+	if (p15card != NULL)
+		sc_pkcs15_unbind(p15card);
+	sc_unlock(card);
+	sc_test_cleanup();
+	return r < 0 ? 1 : 0;
+}
+#else
+int main(int argc, char *argv[])
+{
+	/* The emulated card needs OpenSSL for the signature */
+	return TEST_SKIPPED;
+}
+#endif
@@ -46,11 +46,13 @@ static int	opt_wait = 0;
 static char **	opt_apdus;
 static char	*opt_reader;
 static int	opt_apdu_count = 0;
+static int	opt_stats = 0;
 static int	verbose = 0;
 
 enum {
 	OPT_SERIAL = 0x100,
-	OPT_LIST_ALG
+	OPT_LIST_ALG,
+	OPT_STATS
 };
 
 static const struct option options[] = {
@@ -68,6 +70,7 @@ static const struct option options[] = {
 	{ "card-driver",	1, NULL,		'c' },
 	{ "list-algorithms",    0, NULL,	OPT_LIST_ALG },
 	{ "wait",		0, NULL,		'w' },
+	{ "stats",		0, NULL,	OPT_STATS },
 	{ "verbose",		0, NULL,		'v' },
 	{ NULL, 0, NULL, 0 }
 };
@@ -87,6 +90,7 @@ static const char *option_help[] = {
 	"Forces the use of driver <arg> [auto-detect]",
 	"Lists algorithms supported by card",
 	"Wait for a card to be inserted",
+	"Prints APDU statistics at exit",
 	"Verbose operation. Use several times to enable debug output.",
 };
 
@@ -639,6 +643,24 @@ static int list_algorithms(void)
 	return 0;
 }
 
+static void print_stats(void)
+{
+	sc_stats_t *stats;
+	char *buf;
+	size_t len;
+
+	if (sc_ctx_get_stats(ctx, &stats) != SC_SUCCESS)
+		return;
+	len = sc_stats_format(stats, NULL, 0) + 1;
+	buf = malloc(len);
+	if (buf != NULL) {
+		sc_stats_format(stats, buf, len);
+		fputs(buf, stdout);
+		free(buf);
+	}
+	sc_stats_free(stats);
+}
+
 int main(int argc, char * const argv[])
 {
 	int err = 0, r, c, long_optind = 0;
@@ -731,6 +753,9 @@ int main(int argc, char * const argv[])
 			do_list_algorithms = 1;
 			action_count++;
 			break;
+		case OPT_STATS:
+			opt_stats = 1;
+			break;
 		}
 	}
 	if (action_count == 0)
@@ -839,6 +864,8 @@ end:
 		sc_unlock(card);
 		sc_disconnect_card(card);
 	}
+	if (ctx && opt_stats)
+		print_stats();
 	if (ctx)
 		sc_release_context(ctx);
 	return err;
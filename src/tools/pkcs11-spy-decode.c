@@ -0,0 +1,282 @@
+/*
+ * pkcs11-spy-decode.c: decodes the binary traces of pkcs11-spy
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pkcs11/pkcs11-spy-trace.h"
+#include "util.h"
+
+struct record {
+	unsigned long long start, duration, handle;
+	unsigned long thread, rv, hash, seq;
+	unsigned int function, flags;
+};
+
+struct function_stats {
+	unsigned long count, failed;
+	unsigned long long total;
+	unsigned long long *durations;
+	size_t size;
+};
+
+static const char *app_name = "pkcs11-spy-decode";
+
+static int opt_stats = 0;
+static const char *opt_function = NULL;
+
+static const struct option options[] = {
+	{ "stats",	0, NULL,	's' },
+	{ "function",	1, NULL,	'f' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static const char *option_help[] = {
+	"Prints per function latency statistics instead of the calls",
+	"Only shows the calls of function <arg>, e.g. C_Sign",
+};
+
+static const char *function_names[] = {
+	NULL,
+#define SPY_TRACE_FUNCTION(name) #name,
+	SPY_TRACE_FUNCTIONS
+#undef SPY_TRACE_FUNCTION
+};
+
+static struct function_stats stats[SPY_TRACE_FUNCTION_COUNT];
+
+/* wall clock and monotonic clock at the start of the trace */
+static unsigned long long wall_base, mono_base;
+
+static unsigned int
+get_u16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned long
+get_u32(const unsigned char *p)
+{
+	return get_u16(p) | ((unsigned long) get_u16(p + 2) << 16);
+}
+
+static unsigned long long
+get_u64(const unsigned char *p)
+{
+	return get_u32(p) | ((unsigned long long) get_u32(p + 4) << 32);
+}
+
+static const char *
+function_name(unsigned int function)
+{
+	static char unknown[16];
+
+	if (function > 0 && function < SPY_TRACE_FUNCTION_COUNT)
+		return function_names[function];
+	snprintf(unknown, sizeof(unknown), "function %u", function);
+	return unknown;
+}
+
+static void
+print_record(const struct record *r)
+{
+	unsigned long long t = wall_base + (r->start - mono_base);
+	time_t sec = (time_t) (t / 1000000);
+	struct tm *tm = localtime(&sec);
+	char when[32] = "";
+
+	if (tm != NULL)
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", tm);
+	printf("%8lu %s.%06lu %08lx %-22s 0x%08llx rv 0x%08lx %10.3f ms",
+			r->seq, when, (unsigned long) (t % 1000000), r->thread,
+			function_name(r->function), r->handle, r->rv,
+			r->duration / 1000.0);
+	if (r->flags & SPY_TRACE_FLAG_HASH)
+		printf(" hash %08lx", r->hash);
+	printf("\n");
+}
+
+static void
+count_record(const struct record *r)
+{
+	struct function_stats *s;
+
+	if (r->function == 0 || r->function >= SPY_TRACE_FUNCTION_COUNT)
+		return;
+	s = &stats[r->function];
+	if (s->count == s->size) {
+		size_t size = s->size ? 2 * s->size : 64;
+		unsigned long long *p = realloc(s->durations, size * sizeof(*p));
+
+		if (p == NULL)
+			util_fatal("Not enough memory");
+		s->durations = p;
+		s->size = size;
+	}
+	s->durations[s->count++] = r->duration;
+	s->total += r->duration;
+	if (r->rv != 0)
+		s->failed++;
+}
+
+static int
+compare_duration(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *) a;
+	unsigned long long y = *(const unsigned long long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+print_stats(void)
+{
+	unsigned int i;
+
+	printf("%-22s %8s %6s %10s %9s %9s %9s %9s %9s\n", "function", "calls", "failed",
+			"total ms", "mean ms", "p50 ms", "p95 ms", "p99 ms", "max ms");
+	for (i = 1; i < SPY_TRACE_FUNCTION_COUNT; i++) {
+		struct function_stats *s = &stats[i];
+		unsigned long n;
+
+		if (s->count == 0)
+			continue;
+		qsort(s->durations, s->count, sizeof(*s->durations), compare_duration);
+		n = s->count - 1;
+		printf("%-22s %8lu %6lu %10.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+				function_names[i], s->count, s->failed,
+				s->total / 1000.0, s->total / 1000.0 / s->count,
+				s->durations[n / 2] / 1000.0,
+				s->durations[(n * 95 + 50) / 100] / 1000.0,
+				s->durations[(n * 99 + 50) / 100] / 1000.0,
+				s->durations[n] / 1000.0);
+		free(s->durations);
+	}
+}
+
+/* Decodes the records between offsets from and to of the ring */
+static void
+read_records(FILE *f, size_t record_size, unsigned long long from, unsigned long long to)
+{
+	unsigned char buf[256];
+	struct record r;
+
+	if (from >= to)
+		return;
+	if (fseek(f, (long) (SPY_TRACE_HEADER_SIZE + from), SEEK_SET) != 0)
+		util_fatal("Cannot seek in the trace: %s", strerror(errno));
+	for (; from + record_size <= to; from += record_size) {
+		if (fread(buf, 1, record_size, f) != record_size)
+			break;
+		r.function = get_u16(buf + 36);
+		if (r.function == SPY_TRACE_NONE)
+			continue;
+		if (opt_function != NULL && strcmp(function_name(r.function), opt_function) != 0)
+			continue;
+		r.start = get_u64(buf);
+		r.duration = get_u64(buf + 8);
+		r.handle = get_u64(buf + 16);
+		r.thread = get_u32(buf + 24);
+		r.rv = get_u32(buf + 28);
+		r.hash = get_u32(buf + 32);
+		r.flags = get_u16(buf + 38);
+		r.seq = get_u32(buf + 40);
+		if (opt_stats)
+			count_record(&r);
+		else
+			print_record(&r);
+	}
+}
+
+static int
+decode(const char *path)
+{
+	unsigned char header[SPY_TRACE_HEADER_SIZE];
+	unsigned long long ring_size, pos;
+	size_t record_size;
+	FILE *f;
+	int wrapped;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		util_error("Cannot open %s: %s", path, strerror(errno));
+		return 1;
+	}
+	if (fread(header, 1, sizeof(header), f) != sizeof(header)
+			|| memcmp(header, SPY_TRACE_MAGIC, 8) != 0) {
+		util_error("%s is not a pkcs11-spy trace", path);
+		fclose(f);
+		return 1;
+	}
+	record_size = get_u32(header + 12);
+	if (get_u32(header + 8) != SPY_TRACE_VERSION
+			|| record_size < SPY_TRACE_RECORD_SIZE || record_size > 256) {
+		util_error("%s: unsupported trace version %lu", path, get_u32(header + 8));
+		fclose(f);
+		return 1;
+	}
+	ring_size = get_u64(header + 16);
+	pos = get_u64(header + 24);
+	wrapped = get_u32(header + 32) != 0;
+	wall_base = get_u64(header + 40);
+	mono_base = get_u64(header + 48);
+
+	if (!opt_stats)
+		printf("# process %lu, %s\n", get_u32(header + 36),
+				wrapped ? "ring has wrapped, oldest calls are lost" : "complete");
+
+	/* the oldest records follow the write offset once the ring wrapped */
+	if (wrapped)
+		read_records(f, record_size, pos, ring_size);
+	read_records(f, record_size, 0, pos);
+	fclose(f);
+
+	if (opt_stats)
+		print_stats();
+	return 0;
+}
+
+int
+main(int argc, char * const argv[])
+{
+	int c, long_optind = 0;
+
+	while (1) {
+		c = getopt_long(argc, argv, "sf:", options, &long_optind);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 's':
+			opt_stats = 1;
+			break;
+		case 'f':
+			opt_function = optarg;
+			break;
+		default:
+			util_print_usage_and_die(app_name, options, option_help, "trace-file");
+		}
+	}
+	if (optind != argc - 1)
+		util_print_usage_and_die(app_name, options, option_help, "trace-file");
+
+	return decode(argv[optind]);
+}
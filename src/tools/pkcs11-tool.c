@@ -24,6 +24,16 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <time.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#endif
 #ifdef ENABLE_OPENSSL
 #include <openssl/opensslv.h>
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L
@@ -51,6 +61,7 @@
 
 extern void *C_LoadModule(const char *name, CK_FUNCTION_LIST_PTR_PTR);
 extern CK_RV C_UnloadModule(void *module);
+extern void *C_GetModuleSymbol(void *module, const char *name);
 
 #define NEED_SESSION_RO	0x01
 #define NEED_SESSION_RW	0x02
@@ -102,7 +113,11 @@ enum {
 	OPT_NEW_PIN,
 	OPT_LOGIN_TYPE,
 	OPT_TEST_EC,
-	OPT_DERIVE
+	OPT_DERIVE,
+	OPT_BENCHMARK,
+	OPT_ITERATIONS,
+	OPT_THREADS,
+	OPT_SLOT_LIST
 };
 
 static const struct option options[] = {
@@ -158,6 +173,10 @@ static const struct option options[] = {
 	{ "verbose",		0, NULL,		'v' },
 	{ "private",		0, NULL,		OPT_PRIVATE },
 	{ "test-ec",		0, NULL,		OPT_TEST_EC },
+	{ "benchmark",		1, NULL,		OPT_BENCHMARK },
+	{ "iterations",		1, NULL,		OPT_ITERATIONS },
+	{ "threads",		1, NULL,		OPT_THREADS },
+	{ "slot-list",		1, NULL,		OPT_SLOT_LIST },
 
 	{ NULL, 0, NULL, 0 }
 };
@@ -214,7 +233,11 @@ static const char *option_help[] = {
 	"Test Mozilla-like keypair gen and cert req, <arg>=certfile",
 	"Verbose operation. (Set OPENSC_DEBUG to enable OpenSC specific debugging)",
 	"Set the CKA_PRIVATE attribute (object is only viewable after a login)",
-	"Test EC (best used with the --login or --pin option)"
+	"Test EC (best used with the --login or --pin option)",
+	"Measure an operation: sign, decrypt, digest, find-objects, get-attribute, login, random",
+	"Number of operations per benchmark thread (default: 100)",
+	"Number of benchmark threads (default: 1)",
+	"Comma separated IDs of the slots to benchmark, threads are spread over them"
 };
 
 static const char *	app_name = "pkcs11-tool"; /* for utils.c */
@@ -253,6 +276,11 @@ static int		opt_login_type = -1;
 static int		opt_key_usage_sign = 0;
 static int		opt_key_usage_decrypt = 0;
 static int		opt_key_usage_nonrepudiation = 0;
+static const char *	opt_benchmark = NULL;
+static unsigned long	opt_iterations = 100;
+static int		opt_threads = 1;
+static CK_SLOT_ID	opt_slot_list[32];
+static int		opt_slot_list_len = 0;
 
 static void *module = NULL;
 static CK_FUNCTION_LIST_PTR p11 = NULL;
@@ -352,6 +380,13 @@ static void		test_ec(CK_SLOT_ID slot, CK_SESSION_HANDLE session);
 static CK_RV		find_object_with_attributes(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE *out,
 				CK_ATTRIBUTE *attrs, CK_ULONG attrsLen, CK_ULONG obj_index);
 static CK_ULONG		get_private_key_length(CK_SESSION_HANDLE sess, CK_OBJECT_HANDLE prkey);
+static int		benchmark(const char *op);
+#ifdef HAVE_PTHREAD
+static CK_RV		bench_mutex_create(void **mutex);
+static CK_RV		bench_mutex_destroy(void *mutex);
+static CK_RV		bench_mutex_lock(void *mutex);
+static CK_RV		bench_mutex_unlock(void *mutex);
+#endif
 
 /* win32 needs this in open(2) */
 #ifndef O_BINARY
@@ -387,6 +422,12 @@ int main(int argc, char * argv[])
 	int do_unlock_pin = 0;
 	int action_count = 0;
 	CK_RV rv;
+#ifdef HAVE_PTHREAD
+	CK_C_INITIALIZE_ARGS init_args = {
+		bench_mutex_create, bench_mutex_destroy, bench_mutex_lock, bench_mutex_unlock,
+		CKF_OS_LOCKING_OK, NULL
+	};
+#endif
 
 #ifdef _WIN32
 	if(_setmode(_fileno(stdout), _O_BINARY ) == -1)
@@ -636,6 +677,30 @@ int main(int argc, char * argv[])
 			do_test_ec = 1;
 			action_count++;
 			break;
+		case OPT_BENCHMARK:
+			opt_benchmark = optarg;
+			action_count++;
+			break;
+		case OPT_ITERATIONS:
+			opt_iterations = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_THREADS:
+			opt_threads = atoi(optarg);
+			break;
+		case OPT_SLOT_LIST: {
+			char *p = optarg;
+
+			for (opt_slot_list_len = 0; *p != '\0'; p++) {
+				if (opt_slot_list_len == sizeof(opt_slot_list)/sizeof(opt_slot_list[0]))
+					util_fatal("Too many slots in --slot-list");
+				opt_slot_list[opt_slot_list_len++] = strtoul(p, &p, 0);
+				if (*p != ',' && *p != '\0')
+					util_fatal("Invalid --slot-list \"%s\"", optarg);
+				if (*p == '\0')
+					break;
+			}
+			break;
+		}
 		case OPT_DERIVE:
 			need_session |= NEED_SESSION_RW;
 			do_derive = 1;
@@ -656,6 +721,12 @@ int main(int argc, char * argv[])
 	if (module == NULL)
 		util_fatal("Failed to load pkcs11 module");
 
+#ifdef HAVE_PTHREAD
+	/* benchmark threads share the module */
+	if (opt_benchmark && opt_threads > 1)
+		rv = p11->C_Initialize(&init_args);
+	else
+#endif
 	rv = p11->C_Initialize(NULL);
 	if (rv == CKR_CRYPTOKI_ALREADY_INITIALIZED)
 		printf("\n*** Cryptoki library has already been initialized ***\n");
@@ -857,6 +928,9 @@ int main(int argc, char * argv[])
 
 	if (do_test_ec)
 		test_ec(opt_slot, session);
+
+	if (opt_benchmark)
+		err = benchmark(opt_benchmark);
 end:
 	if (session != CK_INVALID_HANDLE) {
 		rv = p11->C_CloseSession(session);
@@ -960,6 +1034,10 @@ static void show_token(CK_SLOT_ID slot)
 		printf("  (token not recognized)\n");
 		return;
 	}
+	if (rv != CKR_OK) {
+		printf("  (GetTokenInfo failed, %s)\n", CKR2Str(rv));
+		return;
+	}
 	if (!(info.flags & CKF_TOKEN_INITIALIZED) && (!verbose)) {
 		printf("  token state:   uninitialized\n");
 		return;
@@ -4130,6 +4208,469 @@ static int p11_test(CK_SESSION_HANDLE session)
 	return errors;
 }
 
+/*
+ * Benchmark: every thread opens its own session on one of the slots
+ * and times each operation separately. Throughput is measured over the
+ * wall clock time of all threads.
+ */
+enum {
+	BENCH_SIGN,
+	BENCH_DECRYPT,
+	BENCH_DIGEST,
+	BENCH_FIND_OBJECTS,
+	BENCH_GET_ATTRIBUTE,
+	BENCH_LOGIN,
+	BENCH_RANDOM
+};
+
+static const struct bench_op {
+	const char	*name;
+	int		op;
+} bench_ops[] = {
+	{ "sign",		BENCH_SIGN },
+	{ "decrypt",		BENCH_DECRYPT },
+	{ "digest",		BENCH_DIGEST },
+	{ "find-objects",	BENCH_FIND_OBJECTS },
+	{ "get-attribute",	BENCH_GET_ATTRIBUTE },
+	{ "login",		BENCH_LOGIN },
+	{ "random",		BENCH_RANDOM },
+	{ NULL, 0 }
+};
+
+struct bench_thread {
+#ifdef HAVE_PTHREAD
+	pthread_t		thread;
+#endif
+	int			op;
+	CK_SLOT_ID		slot;
+	CK_SESSION_HANDLE	session;
+	CK_OBJECT_HANDLE	object;
+	CK_MECHANISM		mech;
+	CK_BYTE			*input;
+	CK_ULONG		input_len;
+	double			*latency;	/* milliseconds, of the successful operations */
+	unsigned long		done, failed;
+	double			failed_time;	/* milliseconds spent in the failed ones */
+	CK_RV			rv;		/* first error */
+	const char		*func;
+};
+
+#ifdef HAVE_PTHREAD
+/* Locking callbacks handed to the module */
+static CK_RV bench_mutex_create(void **mutex)
+{
+	pthread_mutex_t *m = calloc(1, sizeof(*m));
+
+	if (m == NULL)
+		return CKR_HOST_MEMORY;
+	pthread_mutex_init(m, NULL);
+	*mutex = m;
+	return CKR_OK;
+}
+
+static CK_RV bench_mutex_destroy(void *mutex)
+{
+	pthread_mutex_destroy((pthread_mutex_t *) mutex);
+	free(mutex);
+	return CKR_OK;
+}
+
+static CK_RV bench_mutex_lock(void *mutex)
+{
+	return pthread_mutex_lock((pthread_mutex_t *) mutex) ? CKR_GENERAL_ERROR : CKR_OK;
+}
+
+static CK_RV bench_mutex_unlock(void *mutex)
+{
+	return pthread_mutex_unlock((pthread_mutex_t *) mutex) ? CKR_GENERAL_ERROR : CKR_OK;
+}
+#endif
+
+static double bench_now(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double) count.QuadPart * 1000.0 / (double) freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec * 1000.0 + (double) ts.tv_nsec / 1000000.0;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (double) tv.tv_sec * 1000.0 + (double) tv.tv_usec / 1000.0;
+#endif
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static CK_RV bench_fail(struct bench_thread *t, const char *func, CK_RV rv)
+{
+	if (t->rv == CKR_OK) {
+		t->rv = rv;
+		t->func = func;
+	}
+	return rv;
+}
+
+/* Open the session, log in and find the key or object to work on */
+static CK_RV bench_setup(struct bench_thread *t)
+{
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_ULONG count = 0;
+	CK_RV rv;
+
+	rv = p11->C_OpenSession(t->slot, CKF_SERIAL_SESSION, NULL, NULL, &t->session);
+	if (rv != CKR_OK)
+		return bench_fail(t, "C_OpenSession", rv);
+
+	if (opt_pin != NULL && t->op != BENCH_LOGIN) {
+		rv = p11->C_Login(t->session, CKU_USER, (CK_UTF8CHAR *) opt_pin, strlen(opt_pin));
+		if (rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN)
+			return bench_fail(t, "C_Login", rv);
+	}
+
+	switch (t->op) {
+	case BENCH_SIGN:
+	case BENCH_DECRYPT:
+		if (!find_object(t->session, class, &t->object,
+					opt_object_id_len ? opt_object_id : NULL, opt_object_id_len, 0))
+			return bench_fail(t, "find_object", CKR_KEY_HANDLE_INVALID);
+		if (opt_mechanism_used)
+			t->mech.mechanism = opt_mechanism;
+		else if (t->op == BENCH_DECRYPT)
+			t->mech.mechanism = CKM_RSA_PKCS;
+		else switch (getKEY_TYPE(t->session, t->object)) {
+		case CKK_EC:
+			t->mech.mechanism = CKM_ECDSA;
+			break;
+		case CKK_GOSTR3410:
+			t->mech.mechanism = CKM_GOSTR3410;
+			break;
+		default:
+			t->mech.mechanism = CKM_RSA_PKCS;
+			break;
+		}
+		break;
+	case BENCH_DIGEST:
+		t->mech.mechanism = opt_mechanism_used ? opt_mechanism : CKM_SHA_1;
+		break;
+	case BENCH_GET_ATTRIBUTE:
+		rv = p11->C_FindObjectsInit(t->session, NULL, 0);
+		if (rv != CKR_OK)
+			return bench_fail(t, "C_FindObjectsInit", rv);
+		rv = p11->C_FindObjects(t->session, &t->object, 1, &count);
+		p11->C_FindObjectsFinal(t->session);
+		if (rv != CKR_OK)
+			return bench_fail(t, "C_FindObjects", rv);
+		if (count == 0)
+			return bench_fail(t, "C_FindObjects", CKR_OBJECT_HANDLE_INVALID);
+		break;
+	}
+	return CKR_OK;
+}
+
+static CK_RV bench_one(struct bench_thread *t)
+{
+	CK_BYTE buf[1024];
+	CK_ULONG len = sizeof(buf);
+	CK_OBJECT_HANDLE objects[16];
+	CK_OBJECT_CLASS class;
+	CK_BYTE id[256];
+	char label[256];
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_CLASS, &class, sizeof(class) },
+		{ CKA_ID, id, sizeof(id) },
+		{ CKA_LABEL, label, sizeof(label) }
+	};
+	CK_RV rv;
+
+	switch (t->op) {
+	case BENCH_SIGN:
+		rv = p11->C_SignInit(t->session, &t->mech, t->object);
+		if (rv != CKR_OK)
+			return bench_fail(t, "C_SignInit", rv);
+		rv = p11->C_Sign(t->session, t->input, t->input_len, buf, &len);
+		return rv == CKR_OK ? rv : bench_fail(t, "C_Sign", rv);
+	case BENCH_DECRYPT:
+		rv = p11->C_DecryptInit(t->session, &t->mech, t->object);
+		if (rv != CKR_OK)
+			return bench_fail(t, "C_DecryptInit", rv);
+		rv = p11->C_Decrypt(t->session, t->input, t->input_len, buf, &len);
+		return rv == CKR_OK ? rv : bench_fail(t, "C_Decrypt", rv);
+	case BENCH_DIGEST:
+		rv = p11->C_DigestInit(t->session, &t->mech);
+		if (rv != CKR_OK)
+			return bench_fail(t, "C_DigestInit", rv);
+		rv = p11->C_Digest(t->session, t->input, t->input_len, buf, &len);
+		return rv == CKR_OK ? rv : bench_fail(t, "C_Digest", rv);
+	case BENCH_FIND_OBJECTS:
+		rv = p11->C_FindObjectsInit(t->session, NULL, 0);
+		if (rv != CKR_OK)
+			return bench_fail(t, "C_FindObjectsInit", rv);
+		do {
+			rv = p11->C_FindObjects(t->session, objects, 16, &len);
+		} while (rv == CKR_OK && len != 0);
+		p11->C_FindObjectsFinal(t->session);
+		return rv == CKR_OK ? rv : bench_fail(t, "C_FindObjects", rv);
+	case BENCH_GET_ATTRIBUTE:
+		rv = p11->C_GetAttributeValue(t->session, t->object, attrs, 3);
+		if (rv == CKR_ATTRIBUTE_TYPE_INVALID)
+			rv = CKR_OK;
+		return rv == CKR_OK ? rv : bench_fail(t, "C_GetAttributeValue", rv);
+	case BENCH_LOGIN:
+		rv = p11->C_Login(t->session, CKU_USER, (CK_UTF8CHAR *) opt_pin, strlen(opt_pin));
+		if (rv != CKR_OK)
+			return bench_fail(t, "C_Login", rv);
+		rv = p11->C_Logout(t->session);
+		return rv == CKR_OK ? rv : bench_fail(t, "C_Logout", rv);
+	case BENCH_RANDOM:
+		rv = p11->C_GenerateRandom(t->session, buf, 32);
+		return rv == CKR_OK ? rv : bench_fail(t, "C_GenerateRandom", rv);
+	}
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+static void *bench_worker(void *arg)
+{
+	struct bench_thread *t = (struct bench_thread *) arg;
+	double start, ms;
+	unsigned long i;
+	CK_RV rv;
+
+	for (i = 0; i < opt_iterations; i++) {
+		start = bench_now();
+		rv = bench_one(t);
+		ms = bench_now() - start;
+		if (rv == CKR_OK) {
+			t->latency[t->done++] = ms;
+		} else {
+			t->failed++;
+			t->failed_time += ms;
+		}
+	}
+	return NULL;
+}
+
+/* Input for sign, decrypt and digest: --input-file or a fixed buffer,
+ * for decrypt the buffer is encrypted with the public key. Each thread
+ * gets its own copy in t->input, freed by benchmark(). */
+#define BENCH_INPUT_SIZE	1024
+
+static int bench_input(struct bench_thread *t)
+{
+	CK_BYTE *buf;
+	ssize_t len;
+	int fd;
+
+	buf = malloc(BENCH_INPUT_SIZE);
+	if (buf == NULL)
+		util_fatal("Not enough memory for the benchmark input");
+	t->input = buf;
+
+	if (opt_input != NULL) {
+		fd = open(opt_input, O_RDONLY | O_BINARY);
+		if (fd < 0)
+			util_fatal("Cannot open %s: %m", opt_input);
+		len = read(fd, buf, BENCH_INPUT_SIZE);
+		close(fd);
+		if (len < 0)
+			util_fatal("Cannot read from %s: %m", opt_input);
+		t->input_len = len;
+		return 0;
+	}
+
+	memset(buf, 0x5A, BENCH_INPUT_SIZE);
+	switch (t->op) {
+	case BENCH_SIGN:
+		/* the size of a SHA-256 hash */
+		t->input_len = 32;
+		return 0;
+	case BENCH_DIGEST:
+		t->input_len = BENCH_INPUT_SIZE;
+		return 0;
+	case BENCH_DECRYPT:
+#ifdef ENABLE_OPENSSL
+		{
+			EVP_PKEY *pkey = get_public_key(t->session, t->object);
+			CK_BYTE *encrypted = NULL;
+			int n = -1;
+
+			if (pkey != NULL)
+				encrypted = malloc(EVP_PKEY_size(pkey));
+			if (encrypted != NULL)
+#if OPENSSL_VERSION_NUMBER >= 0x00909000L
+				n = EVP_PKEY_encrypt_old(encrypted, buf, 16, pkey);
+#else
+				n = EVP_PKEY_encrypt(encrypted, buf, 16, pkey);
+#endif
+			if (pkey != NULL)
+				EVP_PKEY_free(pkey);
+			if (n <= 0) {
+				free(encrypted);
+				fprintf(stderr, "Cannot encrypt the benchmark input with the public key\n");
+				return 1;
+			}
+			free(buf);
+			t->input = encrypted;
+			t->input_len = n;
+			return 0;
+		}
+#else
+		fprintf(stderr, "No OpenSSL support, use --input-file with a ciphertext\n");
+		return 1;
+#endif
+	}
+	t->input_len = 0;
+	return 0;
+}
+
+/* Number of APDUs sent so far by an OpenSC module, or -1 for
+ * other modules */
+static double bench_apdus(void)
+{
+	CK_C_OpenSC_GetStats get_stats;
+	CK_UTF8CHAR *buf;
+	CK_ULONG len = 0;
+	unsigned long apdus;
+	double r = -1;
+
+	get_stats = (CK_C_OpenSC_GetStats) C_GetModuleSymbol(module, C_OPENSC_GET_STATS_NAME);
+	if (get_stats == NULL || get_stats(NULL, &len) != CKR_OK)
+		return -1;
+	buf = malloc(len);
+	if (buf == NULL)
+		return -1;
+	if (get_stats(buf, &len) == CKR_OK && sscanf((char *) buf, "apdus %lu", &apdus) == 1)
+		r = apdus;
+	free(buf);
+	return r;
+}
+
+static int benchmark(const char *name)
+{
+	struct bench_thread *threads;
+	CK_SLOT_ID *slots = opt_slot_list_len ? opt_slot_list : &opt_slot;
+	int nslots = opt_slot_list_len ? opt_slot_list_len : 1;
+	unsigned long total = 0, failed = 0, n;
+	double *latency, start, elapsed, apdus, failed_time = 0;
+	int i, op = -1, err = 0;
+
+	for (i = 0; bench_ops[i].name != NULL; i++)
+		if (strcmp(bench_ops[i].name, name) == 0)
+			op = bench_ops[i].op;
+	if (op < 0)
+		util_fatal("Unknown benchmark operation \"%s\"", name);
+	if (opt_threads < 1 || opt_iterations < 1)
+		util_fatal("Invalid number of threads or iterations");
+#ifndef HAVE_PTHREAD
+	if (opt_threads > 1) {
+		fprintf(stderr, "No thread support, running one benchmark thread\n");
+		opt_threads = 1;
+	}
+#endif
+	if (op == BENCH_LOGIN) {
+		if (opt_pin == NULL)
+			util_fatal("The login benchmark needs --pin");
+		/* the login state is shared by the sessions of a token */
+		if (opt_threads > nslots)
+			util_fatal("The login benchmark runs at most one thread per slot");
+	}
+
+	threads = calloc(opt_threads, sizeof(*threads));
+	latency = calloc((size_t) opt_threads * opt_iterations, sizeof(*latency));
+	if (threads == NULL || latency == NULL)
+		util_fatal("Not enough memory for %d x %lu operations", opt_threads, opt_iterations);
+
+	for (i = 0; i < opt_threads; i++) {
+		struct bench_thread *t = &threads[i];
+
+		t->op = op;
+		t->slot = slots[i % nslots];
+		t->session = CK_INVALID_HANDLE;
+		t->latency = latency + (size_t) i * opt_iterations;
+		if (bench_setup(t) != CKR_OK) {
+			fprintf(stderr, "Benchmark setup on slot 0x%lx failed: %s: %s\n",
+					t->slot, t->func, CKR2Str(t->rv));
+			err = 1;
+			goto out;
+		}
+		if (bench_input(t)) {
+			err = 1;
+			goto out;
+		}
+	}
+
+	printf("Benchmark: %s", name);
+	if (op == BENCH_SIGN || op == BENCH_DECRYPT || op == BENCH_DIGEST)
+		printf(" (%s)", p11_mechanism_to_name(threads[0].mech.mechanism));
+	printf(", %d thread(s) x %lu iterations on %d slot(s)\n", opt_threads, opt_iterations, nslots);
+
+	apdus = bench_apdus();
+	start = bench_now();
+#ifdef HAVE_PTHREAD
+	for (i = 0; i < opt_threads; i++)
+		if (pthread_create(&threads[i].thread, NULL, bench_worker, &threads[i]) != 0)
+			util_fatal("Cannot create a benchmark thread");
+	for (i = 0; i < opt_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+#else
+	bench_worker(&threads[0]);
+#endif
+	elapsed = bench_now() - start;
+	if (apdus >= 0)
+		apdus = bench_apdus() - apdus;
+
+	/* only successful operations count for the latency and throughput,
+	 * move their latencies together */
+	for (i = 0; i < opt_threads; i++) {
+		memmove(latency + total, threads[i].latency, threads[i].done * sizeof(*latency));
+		total += threads[i].done;
+		failed += threads[i].failed;
+		failed_time += threads[i].failed_time;
+		if (threads[i].rv != CKR_OK)
+			fprintf(stderr, "slot 0x%lx: %s: %s\n", threads[i].slot,
+					threads[i].func, CKR2Str(threads[i].rv));
+	}
+	qsort(latency, total, sizeof(*latency), bench_compare);
+
+	printf("  Operations:  %lu\n", total);
+	printf("  Elapsed:     %.3f s\n", elapsed / 1000.0);
+	printf("  Throughput:  %.2f ops/s\n", elapsed > 0 ? total * 1000.0 / elapsed : 0.0);
+	if (total > 0) {
+		n = total - 1;
+		printf("  Latency:     p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+				latency[n / 2], latency[(n * 95 + 50) / 100],
+				latency[(n * 99 + 50) / 100], latency[n]);
+	}
+	if (failed)
+		printf("  Failed:      %lu, %.3f ms on average\n", failed, failed_time / failed);
+	if (apdus >= 0 && total + failed > 0)
+		printf("  APDUs:       %.1f per operation\n", apdus / (total + failed));
+	if (failed)
+		err = 1;
+
+out:
+	for (i = 0; i < opt_threads; i++) {
+		if (threads[i].session != CK_INVALID_HANDLE)
+			p11->C_CloseSession(threads[i].session);
+		free(threads[i].input);
+	}
+	free(latency);
+	free(threads);
+	return err;
+}
+
 /* Does about the same as Mozilla does when you go to an on-line CA
  * for obtaining a certificate: key pair generation, signing the
  * cert request + some other tests, writing certs and changing
@@ -4700,6 +5241,10 @@ static struct mech_info	p11_mechanisms[] = {
       { CKM_ECDSA_KEY_PAIR_GEN,	"ECDSA-KEY-PAIR-GEN", NULL },
       { CKM_ECDSA,		"ECDSA", NULL },
       { CKM_ECDSA_SHA1,		"ECDSA-SHA1", NULL },
+      { CKM_ECDSA_SHA224,	"ECDSA-SHA224", NULL },
+      { CKM_ECDSA_SHA256,	"ECDSA-SHA256", NULL },
+      { CKM_ECDSA_SHA384,	"ECDSA-SHA384", NULL },
+      { CKM_ECDSA_SHA512,	"ECDSA-SHA512", NULL },
       { CKM_ECDH1_DERIVE,	"ECDH1-DERIVE", NULL },
       { CKM_ECDH1_COFACTOR_DERIVE,"ECDH1-COFACTOR-DERIVE", NULL },
       { CKM_ECMQV_DERIVE,	"ECMQV-DERIVE", NULL },